@@ -19,7 +19,7 @@ extern cpu_data_t cpu_datas[MAX_CPUS];  // Defined in cpu.c
 // This function set data of each cpu_data from cpu_data array
 void set_tss_stack(size_t cpu_id){
     // Getting cpu_data pointer from cpu_id
-    cpu_data_t temp = cpu_datas[cpu_id];
+    cpu_data_t *temp = &cpu_datas[cpu_id];
 
     uint64_t stack_top = kmalloc_a(STACK_SIZE, true) + STACK_SIZE;
     if(stack_top <= STACK_SIZE) {
@@ -27,7 +27,14 @@ void set_tss_stack(size_t cpu_id){
         return;
     }
 
-    temp.tss_stack = stack_top;
+    uint64_t ist_top = kmalloc_a(IST_STACK_SIZE, true) + IST_STACK_SIZE;
+    if(ist_top <= IST_STACK_SIZE) {
+        printf("Failed to allocate interrupt stack for CPU %d.\n", cpu_id);
+        return;
+    }
+
+    temp->tss_stack = stack_top;
+    temp->ist_stack = ist_top;
 }
 
 
@@ -60,27 +67,29 @@ void init_gdt_tss_in_cpu(size_t cpu_id){
 
     set_tss_stack(cpu_id);
 
-    // Getting cpu_data pointer from cpu_id
-    cpu_data_t temp = cpu_datas[cpu_id];
+    // Getting cpu_data pointer from cpu_id. The GDT and TSS must stay where the core loads
+    // them from, so they are set up in cpu_datas, not in a copy on the stack.
+    cpu_data_t *temp = &cpu_datas[cpu_id];
 
     // Set GDT Entries for this cpu
-    gdt_setup(temp.gdt_entries, 0, 0, 0x0, 0x0, 0x0);      // Null
-    gdt_setup(temp.gdt_entries, 1, 0, 0xFFFF, 0x9A, 0xA0); // Kernel Code Selector 0x08
-    gdt_setup(temp.gdt_entries, 2, 0, 0xFFFF, 0x92, 0xA0); // Kernel Data Selector 0x10
-    gdt_setup(temp.gdt_entries, 3, 0, 0xFFFF, 0xFA, 0xA0); // User Code Selector   0x18
-    gdt_setup(temp.gdt_entries, 4, 0, 0xFFFF, 0xF2, 0xA0); // User Data Selector   0x20
+    gdt_setup(temp->gdt_entries, 0, 0, 0x0, 0x0, 0x0);      // Null
+    gdt_setup(temp->gdt_entries, 1, 0, 0xFFFF, 0x9A, 0xA0); // Kernel Code Selector 0x08
+    gdt_setup(temp->gdt_entries, 2, 0, 0xFFFF, 0x92, 0xA0); // Kernel Data Selector 0x10
+    gdt_setup(temp->gdt_entries, 3, 0, 0xFFFF, 0xFA, 0xA0); // User Code Selector   0x18
+    gdt_setup(temp->gdt_entries, 4, 0, 0xFFFF, 0xF2, 0xA0); // User Data Selector   0x20
 
     // Set TSS Entries for this cpu
-    memset((void *)&temp.tss, 0, sizeof(tss_t)); // Clear TSS
-    temp.tss.rsp0 = temp.tss_stack;
-    temp.tss.iopb_offset = sizeof(tss_t); // I/O Port Base Address
-    tss_setup(temp.gdt_entries, 5, (uint64_t)&temp.tss, sizeof(tss_t), 0x89, 0x0 );
+    memset((void *)&temp->tss, 0, sizeof(tss_t)); // Clear TSS
+    temp->tss.rsp0 = temp->tss_stack;
+    temp->tss.ist1 = temp->ist_stack;    // For the interrupts which switch threads, see scheduler.c
+    temp->tss.iopb_offset = sizeof(tss_t); // I/O Port Base Address
+    tss_setup(temp->gdt_entries, 5, (uint64_t)&temp->tss, sizeof(tss_t), 0x89, 0x0 );
 
     // Load The above GDT and TSS
-    temp.gdtr.limit = (uint16_t) (sizeof(gdt_entry_t) * 7 - 1); // 16 * 7 - 1 = 111 bytes
-    temp.gdtr.base = (uint64_t) &temp.gdt_entries;
+    temp->gdtr.limit = (uint16_t) (sizeof(gdt_entry_t) * 7 - 1); // 16 * 7 - 1 = 111 bytes
+    temp->gdtr.base = (uint64_t) &temp->gdt_entries;
 
-    gdt_flush((gdtr_t *)&temp.gdtr);    // Load GDT
+    gdt_flush((gdtr_t *)&temp->gdtr);    // Load GDT
     tss_flush(0x28);                    // Selector 0x28 (5th entry in GDT)
 
     printf(" [-] Initialize GDT & TSS for CPU %d.\n", cpu_id);
@@ -35,9 +35,15 @@ void tss_init(){
         printf("Stack Memory Creation Failed!\n");
         return;
     }
+    uint64_t ist_stack = (uint64_t) kmalloc_a(IST_STACK_SIZE, 1);
+    if(!ist_stack){
+        printf("Interrupt Stack Memory Creation Failed!\n");
+        return;
+    }
     memset(&tss, 0, sizeof(tss_t));
 
     tss.rsp0 = stack + STACK_SIZE;  // Set Stack Top
+    tss.ist1 = ist_stack + IST_STACK_SIZE;
     tss.iopb_offset = sizeof(tss_t);
 
     // TSS descriptor needs two entries (16 bytes)
@@ -4,6 +4,11 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+// The interrupts which may switch threads run on their own stack (IST1), never on the stack
+// of the interrupted thread, which another core may resume as soon as its registers are saved
+#define TSS_IST_SCHED       1
+#define IST_STACK_SIZE      0x4000      // 16 KB
+
 // Add TSS entry structure
 struct tss{ // 104 bytes is the minimum size of a TSS
     uint32_t reserved0;
@@ -13,6 +13,8 @@
 #include "ioapic.h"
 #include "apic.h"
 
+#include "../../gdt/tss.h"                  // TSS_IST_SCHED
+
 #include "../../../kshell/kshell.h"
 
 #include "apic_interrupt.h"
@@ -100,11 +102,22 @@ void set_bsp_apic_int_descriptor_table(){
     apic_int_set_gate(49, (uint64_t)&irq17, 0x08, 0x8E);   // HPET Timer, IRQ17
     
     apic_int_set_gate(50, (uint64_t)&irq18, 0x08, 0x8E);   // IPI, IRQ18
+    apic_int_set_gate(51, (uint64_t)&irq19, 0x08, 0x8E);   // Scheduler yield, IRQ19
+
+    // The interrupts which switch threads run on the interrupt stack, see scheduler.c
+    int_entries[48].ist = TSS_IST_SCHED;
+    int_entries[50].ist = TSS_IST_SCHED;
+    int_entries[51].ist = TSS_IST_SCHED;
 
     // System Calls
     apic_int_set_gate(172, (uint64_t)&irq140, 0x08, 0xEE); // Print System Call, IRQ140
     apic_int_set_gate(173, (uint64_t)&irq141, 0x08, 0xEE); // Read System Call, IRQ141
     apic_int_set_gate(174, (uint64_t)&irq142, 0x08, 0xEE); // Exit System Call, IRQ142
+    apic_int_set_gate(175, (uint64_t)&irq143, 0x08, 0xEE); // Fork System Call, IRQ143
+    apic_int_set_gate(176, (uint64_t)&irq144, 0x08, 0xEE); // Open System Call, IRQ144
+    apic_int_set_gate(177, (uint64_t)&irq145, 0x08, 0xEE); // Close System Call, IRQ145
+    apic_int_set_gate(178, (uint64_t)&irq146, 0x08, 0xEE); // Mmap System Call, IRQ146
+    apic_int_set_gate(179, (uint64_t)&irq147, 0x08, 0xEE); // Munmap System Call, IRQ147
 }
 
 
@@ -219,12 +232,24 @@ void set_ap_descriptor_table(uint64_t core_id){
 
     // Hardware Interrupts
     // Bootstrap Core has already set up the IOAPIC for hardware interrupts
-    ap_int_set_gate(core_id, 50, (uint64_t)&irq18, 0x08, 0xEE); // IPI, IRQ18
+    ap_int_set_gate(core_id, 48, (uint64_t)&irq16, 0x08, 0x8E); // APIC Timer, IRQ16
+    ap_int_set_gate(core_id, 50, (uint64_t)&irq18, 0x08, 0x8E); // IPI, IRQ18
+    ap_int_set_gate(core_id, 51, (uint64_t)&irq19, 0x08, 0x8E); // Scheduler yield, IRQ19
+
+    // The interrupts which switch threads run on the interrupt stack, see scheduler.c
+    core_int_entries[core_id][48].ist = TSS_IST_SCHED;
+    core_int_entries[core_id][50].ist = TSS_IST_SCHED;
+    core_int_entries[core_id][51].ist = TSS_IST_SCHED;
 
     // Software Interrupts for System Calls
     ap_int_set_gate(core_id, 172, (uint64_t)&irq140, 0x08, 0xEE); // Print System Call, IRQ140
     ap_int_set_gate(core_id, 173, (uint64_t)&irq141, 0x08, 0xEE); // Read System Call, IRQ141
     ap_int_set_gate(core_id, 174, (uint64_t)&irq142, 0x08, 0xEE); // Exit System Call, IRQ142
+    ap_int_set_gate(core_id, 175, (uint64_t)&irq143, 0x08, 0xEE); // Fork System Call, IRQ143
+    ap_int_set_gate(core_id, 176, (uint64_t)&irq144, 0x08, 0xEE); // Open System Call, IRQ144
+    ap_int_set_gate(core_id, 177, (uint64_t)&irq145, 0x08, 0xEE); // Close System Call, IRQ145
+    ap_int_set_gate(core_id, 178, (uint64_t)&irq146, 0x08, 0xEE); // Mmap System Call, IRQ146
+    ap_int_set_gate(core_id, 179, (uint64_t)&irq147, 0x08, 0xEE); // Munmap System Call, IRQ147
 }
 
 
@@ -1,13 +1,37 @@
 /*
 IPI (Inter-Processor Interrupt) handling for x86_64 architecture.
 This code is responsible for sending and handling IPIs between CPU cores in a multi-core system.
+
+TLB Shootdown
+
+invlpg and a CR3 reload only flush the TLB of the core which runs them. When a mapping is
+removed or changed, every other core which has the address space loaded may still have the
+old translation cached. The initiator posts the range to flush, marks the target cores and
+sends them an IPI. Each target flushes the range and acknowledges. The initiator waits for
+all acknowledgments before the old frames can be reused.
+
+Kernel (higher half) mappings are shared by all address spaces, so they go to every online
+core. Lower half mappings go only to the cores which have the same CR3 loaded.
+
+Reschedule
+
+The scheduler sends the same vector to a core which should pick up a thread now, e.g. an idle
+core which can steal from a busy one. The IPI runs on the interrupt stack like the timer, and
+irq_handler() calls schedule() after it. IPIs on one vector merge while one is pending, so the
+handler checks for both requests.
+
+https://wiki.osdev.org/TLB#TLB_Shootdown
+https://www.kernel.org/doc/html/latest/arch/x86/tlb.html
 */
 #include "../irq_manage.h"      // irq_install, irq_uninstall
 #include "apic.h"               // apic_send_eoi, get_lapic_id
 
 #include "../../../lib/stdio.h" // printf
 
-#include "../../../sys/timer/tsc.h"    // tsc_sleep
+#include "../../../memory/detect_memory.h"  // HIGHER_HALF_START_ADDR
+#include "../../../memory/paging.h"         // flush_tlb_range
+#include "../../../sys/cpu/cpu.h"           // cpu_datas, this_cpu_id
+#include "../../../memory/address_space.h"  // address_space_invalidate
 
 
 
@@ -16,11 +40,97 @@ This code is responsible for sending and handling IPIs between CPU cores in a mu
 uint64_t IPI_VECTOR = 50; // Interrupt vector for IPI (Inter-Processor Interrupt)
 uint64_t IPI_IRQ = 18;
 
+// The shootdown in flight. One at a time, the lock is held until every target acknowledged.
+static spinlock_t shootdown_lock;
+static volatile uint64_t shootdown_start;
+static volatile uint64_t shootdown_end;
+static volatile bool shootdown_pending[MAX_CPUS];   // Target cores which did not flush yet
+static volatile uint32_t shootdown_acks;            // Number of those cores
+
+
+// Flush the posted range if this core is a target of the shootdown in flight
+static bool tlb_shootdown_ack(uint32_t cpu) {
+    if (!__atomic_load_n(&shootdown_pending[cpu], __ATOMIC_ACQUIRE)) return false;
+
+    flush_tlb_range(shootdown_start, shootdown_end);
+
+    shootdown_pending[cpu] = false;
+    __atomic_fetch_sub(&shootdown_acks, 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+// Flush [start, end) of the address space cr3 on every other core which may cache it,
+// and return when all of them did. The caller flushes its own core.
+void tlb_shootdown(uint64_t cr3, uint64_t start, uint64_t end) {
+    if (end <= start) return;
+
+    uint32_t self = this_cpu_id();
+    bool kernel_range = start >= HIGHER_HALF_START_ADDR;
+
+    // Cores which do not have the address space loaded now flush its PCID when they load it
+    if (!kernel_range) address_space_invalidate(cr3);
+
+    uint64_t targets[MAX_CPUS / 64] = {0};
+    uint32_t count = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu == self || !cpu_datas[cpu].is_online) continue;
+        if (!kernel_range && cpu_datas[cpu].active_cr3 != cr3) continue;
+        targets[cpu / 64] |= 1ULL << (cpu % 64);
+        count++;
+    }
+    if (count == 0) return;     // Single core, or nobody else has the address space
+
+    // Interrupts stay off while we own the request. Waiting for the lock we answer the
+    // request of the current owner, otherwise two initiators would wait on each other.
+    uint64_t rflags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(rflags) :: "memory");
+    while (!try_acquire(&shootdown_lock)) {
+        tlb_shootdown_ack(self);
+        asm volatile("pause");
+    }
+
+    shootdown_start = start;
+    shootdown_end = end;
+    shootdown_acks = count;
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!(targets[cpu / 64] & (1ULL << (cpu % 64)))) continue;
+        __atomic_store_n(&shootdown_pending[cpu], true, __ATOMIC_RELEASE);
+        lapic_send_ipi(cpu, IPI_VECTOR);
+    }
+
+    while (__atomic_load_n(&shootdown_acks, __ATOMIC_ACQUIRE) != 0) {
+        asm volatile("pause");
+    }
+
+    release(&shootdown_lock);
+    if (rflags & 0x200) asm volatile("sti" ::: "memory");
+}
+
+
+// Make cpu run schedule() as soon as it has interrupts on
+void send_resched_ipi(uint32_t cpu) {
+    uint64_t rflags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(rflags) :: "memory");
+
+    __atomic_store_n(&cpu_datas[cpu].need_resched, true, __ATOMIC_RELEASE);
+    lapic_send_ipi(cpu, IPI_VECTOR);
+
+    if (rflags & 0x200) asm volatile("sti" ::: "memory");
+}
+
+
 void ipi_handler(registers_t *regs) {
-    // Handle the IPI interrupt here
-    // For example, you can print a message or perform some action
+    uint32_t cpu = this_cpu_id();
+    bool shootdown = tlb_shootdown_ack(cpu);
+
+    // schedule() runs after the handler and clears need_resched
+    if (shootdown || __atomic_load_n(&cpu_datas[cpu].need_resched, __ATOMIC_ACQUIRE)) return;
+
+    // Any other IPI, e.g. from switch_to_core()
     printf("Received IPI on CPU %d\n", get_lapic_id());
-    apic_send_eoi(); // Send EOI to LAPIC after handling the interrupt
+    // irq_handler() sends the EOI
 }
 
 void init_ipi() {
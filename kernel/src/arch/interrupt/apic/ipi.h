@@ -1,9 +1,15 @@
+
 #pragma once
 
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
 
+extern uint64_t IPI_VECTOR;
+
+void tlb_shootdown(uint64_t cr3, uint64_t start, uint64_t end);
+void send_resched_ipi(uint32_t cpu);
+
 void init_ipi();
 
 
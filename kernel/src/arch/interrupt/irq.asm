@@ -44,6 +44,7 @@
         mov rdi, rsp                    ; Pass the current stack pointer to `pic_irq_handler`
         cld
         call irq_handler
+        mov rsp, rax                    ; Registers to resume, of another thread after a switch
         
         ; Restore segment registers
         pop gs
@@ -96,7 +97,13 @@ IRQ  15,    47
 IRQ  16,    48      ; APIC Timer Interrupt
 IRQ  17,    49      ; HPET Timer Interrupt
 IRQ  18,    50      ; IPI
+IRQ  19,    51      ; Scheduler Yield
 
 IRQ  140,   172     ; Print System Call Interrupt
 IRQ  141,   173     ; Read System Call Interrupt
 IRQ  142,   174     ; Exit System Call Interrupt
+IRQ  143,   175     ; Fork System Call Interrupt
+IRQ  144,   176     ; Open System Call Interrupt
+IRQ  145,   177     ; Close System Call Interrupt
+IRQ  146,   178     ; Mmap System Call Interrupt
+IRQ  147,   179     ; Munmap System Call Interrupt
@@ -8,6 +8,8 @@ Interrupt Request(IRQ)
 #include "../../sys/cpu/cpuid.h"    //has_apic
 #include "apic/apic.h" // apic_send_eoi
 #include "../../lib/stdio.h"
+#include "../../process/scheduler.h"    // schedule, SCHED_TIMER_VECTOR, SCHED_YIELD_VECTOR
+#include "apic/ipi.h"                       // IPI_VECTOR
 
 #include "irq_manage.h"
 
@@ -21,7 +23,9 @@ Interrupt Request(IRQ)
 
 void (*irq_routines[TOTAL_IRQ])(registers_t *) = {0};   // This hold all irq routines
 
-void irq_handler(registers_t *regs)
+// Returns the registers which the stub in irq.asm restores: regs, or those of another thread
+// when the scheduler switches. Only the interrupts on the interrupt stack (IST) switch.
+registers_t *irq_handler(registers_t *regs)
 {
     void (*handler)(registers_t *r);    // This is a blank function pointer
     
@@ -51,6 +55,11 @@ void irq_handler(registers_t *regs)
         *  interrupt controller too */
         outb(PIC_COMMAND_MASTER, PIC_EOI); /* master */
     }
+
+    if (regs->int_no == SCHED_TIMER_VECTOR || regs->int_no == SCHED_YIELD_VECTOR || regs->int_no == IPI_VECTOR){
+        return schedule(regs);
+    }
+    return regs;
 }
 
 // Installing a custom handler function into irq_routines array
@@ -26,15 +26,21 @@ extern void irq15();    // Secondary ATA Hard Disk Controller, IRQ15
 
 extern void irq16();    // APIC Timer
 extern void irq17();    // HPET Timer
-extern void irq18();    
+extern void irq18();    // IPI
+extern void irq19();    // Scheduler yield
 
 
 extern void irq140();   // Print System Call
 extern void irq141();   // Read System Call
 extern void irq142();   // Exit System Call
+extern void irq143();   // Fork System Call
+extern void irq144();   // Open System Call
+extern void irq145();   // Close System Call
+extern void irq146();   // Mmap System Call
+extern void irq147();   // Munmap System Call
 
 
-void irq_handler(registers_t *regs);
+registers_t *irq_handler(registers_t *regs);
 void irq_install(int irq_no, void (*handler)(registers_t *r));
 void irq_uninstall(int irq_no);
 
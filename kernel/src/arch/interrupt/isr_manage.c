@@ -4,6 +4,9 @@ Interrupt Service Routine(ISR) Manage
 
 
 #include "../../lib/stdio.h"
+#include "../../memory/paging.h"
+#include "../../memory/vm_region.h"
+#include "../../memory/kheap.h"
 
 #include "isr_manage.h"
 
@@ -61,6 +64,12 @@ void page_fault_handler(registers_t *regs)
     uint64_t faulting_address;
     asm volatile("mov %%cr2, %0" : "=r"(faulting_address));
 
+    // Write to a page shared copy on write after fork: copy it and retry
+    if (handle_cow_fault(faulting_address, regs->err_code)) return;
+
+    // First touch of a reserved but not yet backed page: map a zeroed frame and retry
+    if (vm_region_handle_fault(faulting_address, regs->err_code)) return;
+
     // Decode the error code to determine the cause of the page fault.
     int present = !(regs->err_code & 0x1); // Page not present
     int rw = regs->err_code & 0x2;         // Write operation?
@@ -77,9 +86,9 @@ void page_fault_handler(registers_t *regs)
     if (id) printf("instruction fetch ");
     printf(") at address %x\n", faulting_address);
 
+    // Guard pages of the heap, and freed ranges of the heap debug mode
+    if (is_kheap_addr(faulting_address)) kheap_report_fault(faulting_address);
 
-    // Additional action to handle the page fault could be added here,
-    // such as invoking a page allocator or terminating a faulty process.
 
     // Halt the system to prevent further errors (for now).
     printf("Halting the system due to page fault.\n");
@@ -102,6 +102,11 @@ void set_pic_int_descriptor_table(){
     pic_int_set_gate(172, (uint64_t)&irq140, 0x08, 0xEE); // Print System Call, IRQ140
     pic_int_set_gate(173, (uint64_t)&irq141, 0x08, 0xEE); // Read System Call, IRQ141
     pic_int_set_gate(174, (uint64_t)&irq142, 0x08, 0xEE); // Exit System Call, IRQ142
+    pic_int_set_gate(175, (uint64_t)&irq143, 0x08, 0xEE); // Fork System Call, IRQ143
+    pic_int_set_gate(176, (uint64_t)&irq144, 0x08, 0xEE); // Open System Call, IRQ144
+    pic_int_set_gate(177, (uint64_t)&irq145, 0x08, 0xEE); // Close System Call, IRQ145
+    pic_int_set_gate(178, (uint64_t)&irq146, 0x08, 0xEE); // Mmap System Call, IRQ146
+    pic_int_set_gate(179, (uint64_t)&irq147, 0x08, 0xEE); // Munmap System Call, IRQ147
 }
 
 
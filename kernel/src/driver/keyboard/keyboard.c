@@ -15,6 +15,7 @@ https://github.com/dreamportdev/Osdev-Notes/blob/master/02_Architecture/09_Add_K
 #include "../../driver/speaker/speaker.h"
 #include "../../driver/io/ports.h"
 #include "../../driver/vga/vga_term.h"
+#include "../../process/scheduler.h"    // thread_wake
 
 #include "keyboard.h"
 
@@ -23,6 +24,7 @@ https://github.com/dreamportdev/Osdev-Notes/blob/master/02_Architecture/09_Add_K
 #define KEYBOARD_IRQ 1          // 33 - 32
 
 ring_buffer_t* keyboard_buffer;
+static thread_t* keyboard_reader;   // Blocked until a key arrives, see keyboard_set_reader()
 
 
 uint32_t scanCode;      // What key is pressed
@@ -227,10 +229,20 @@ void keyboardHandler(registers_t *regs){
     
     if(press && keyboard_buffer){
         ring_buffer_push(keyboard_buffer, scanCodeToChar(scanCode));    // Storing character into keyboard_buffer
+
+        thread_t* reader = __atomic_load_n(&keyboard_reader, __ATOMIC_ACQUIRE);
+        if(reader) thread_wake(reader);
     }
 }
 
 
+// thread, e.g. the shell, waits for keys in keyboard_buffer and is woken for every key.
+// NULL once it stops reading, so a deleted thread is never woken.
+void keyboard_set_reader(thread_t* thread){
+    __atomic_store_n(&keyboard_reader, thread, __ATOMIC_RELEASE);
+}
+
+
 void initKeyboard(){
     asm volatile("cli");
     
@@ -6,6 +6,7 @@
 
 
 #include "../../util/util.h"
+#include "../../process/types.h"
 
 
 #define KEYBOARD_COMMAND_PORT 0x64  // Keyboard Command Port
@@ -125,6 +126,7 @@ void keyboardHandler(registers_t *regs);
 void initKeyboard();
 void enableKeyboard();
 void disableKeyboard();
+void keyboard_set_reader(thread_t* thread);
 
 void handel_enter_key(bool keyPressed);
 void handel_shift_key(bool keyPressed);
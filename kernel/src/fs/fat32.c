@@ -13,8 +13,11 @@ https://wiki.osdev.org/FAT
 #include "../memory/kheap.h"
 #include "../memory/kmalloc.h"
 #include "../memory/vmm.h"
+#include "../memory/slab.h"
+#include "../memory/mmap.h"
 
 
+#include "page_cache.h"
 #include "fat32.h"
 
 
@@ -28,6 +31,14 @@ static HBA_PORT_T* fat32_port; // Save port globally
 
 uint32_t ROOT_DIR_CLUSTER;  // Root directory cluster number
 
+// Directory sectors are read into buffers of this cache instead of the stack. They are
+// identity mapped below 4 GB, so AHCI can DMA into them directly.
+static kmem_cache_t *fat32_dir_cache;
+
+// Files opened for mmap(), the index is the descriptor
+static fat32_file_t fat32_files[FAT32_MAX_OPEN_FILES];
+static spinlock_t fat32_files_lock;
+
 bool fat32_init(HBA_PORT_T* port) {
 
     if (!port) {
@@ -38,6 +49,10 @@ bool fat32_init(HBA_PORT_T* port) {
     uint8_t sector[512];
     fat32_port = port;
 
+    if (!fat32_dir_cache) {
+        fat32_dir_cache = kmem_cache_create("fat32_dir_sector", 512, 512);
+    }
+
     ahci_read(port, 0, 0, 1, (uint16_t*)sector);
 
     fat32_info.bytes_per_sector      = *(uint16_t*)&sector[11];
@@ -180,6 +195,9 @@ bool fat32_write_file(const char* filename, const uint8_t* data, uint32_t size)
 
             entries[i].fileSize = size;
             ahci_write(fat32_port, root_sector, 0, 1, (uint16_t*)sector);
+
+            // Later mappings read the new contents, present ones keep what they have
+            page_cache_evict((entries[i].fstClusHI << 16) | entries[i].fstClusLO);
             return true;
         }
     }
@@ -197,6 +215,7 @@ bool fat32_delete_file(const char* filename) {
         if (strncmp(entries[i].name, filename, 11) == 0) {
             entries[i].name[0] = 0xE5; // Mark as deleted
             ahci_write(fat32_port, root_sector, 0, 1, (uint16_t*)sector);
+            page_cache_evict((entries[i].fstClusHI << 16) | entries[i].fstClusLO);
             return true;
         }
     }
@@ -204,7 +223,9 @@ bool fat32_delete_file(const char* filename) {
 }
 
 bool fat32_read_root_dir() {
-    uint8_t sector[512];
+    uint8_t* sector = kmem_cache_alloc(fat32_dir_cache);
+    if (!sector) return false;
+
     uint32_t root_sector = fat32_cluster_to_sector(fat32_info.root_dir_first_cluster);
     ahci_read(fat32_port, root_sector, 0, 1, (uint16_t*)sector);
 
@@ -215,6 +236,8 @@ bool fat32_read_root_dir() {
         printf("  FAT32: File: %s Size: %d\n", entries[i].name, entries[i].fileSize);
         fat32_delete_file(entries[i].name); // Delete file for testing
     }
+
+    kmem_cache_free(fat32_dir_cache, sector);
     return true;
 }
 
@@ -342,40 +365,54 @@ bool fat32_create_directory(const char* name) {
 }
 
 bool fat32_find_free_entry(uint32_t cluster, DIR_ENTRY* entry) {
-    uint8_t buffer[512];
+    uint8_t* buffer = kmem_cache_alloc(fat32_dir_cache);
+    if (!buffer) return false;
+
     uint32_t sector = fat32_cluster_to_sector(cluster);
     ahci_read(fat32_port, sector, 0, 1, (uint16_t*)buffer);
 
+    bool found = false;
     DIR_ENTRY* entries = (DIR_ENTRY*)buffer;
     for (int i = 0; i < 512 / sizeof(DIR_ENTRY); i++) {
         if (entries[i].name[0] == 0x00 || entries[i].name[0] == 0xE5) {
             *entry = entries[i];
-            return true;
+            found = true;
+            break;
         }
     }
-    return false;
+
+    kmem_cache_free(fat32_dir_cache, buffer);
+    return found;
 }
 
 bool fat32_write_directory_entry(uint32_t cluster, DIR_ENTRY* entry) {
-    uint8_t buffer[512];
+    uint8_t* buffer = kmem_cache_alloc(fat32_dir_cache);
+    if (!buffer) return false;
+
     uint32_t sector = fat32_cluster_to_sector(cluster);
     ahci_read(fat32_port, sector, 0, 1, (uint16_t*)buffer);
 
+    bool written = false;
     DIR_ENTRY* entries = (DIR_ENTRY*)buffer;
     for (int i = 0; i < 512 / sizeof(DIR_ENTRY); i++) {
         if (entries[i].name[0] == 0x00 || entries[i].name[0] == 0xE5) {
             entries[i] = *entry;
             ahci_write(fat32_port, sector, 0, 1, (uint16_t*)buffer);
-            return true;
+            written = true;
+            break;
         }
     }
-    return false;
+
+    kmem_cache_free(fat32_dir_cache, buffer);
+    return written;
 }
 
 bool fat32_init_directory_cluster(uint32_t cluster, uint32_t parent_cluster) {
-    uint8_t buffer[512];
+    uint8_t* buffer = kmem_cache_alloc(fat32_dir_cache);
+    if (!buffer) return false;
+
     uint32_t sector = fat32_cluster_to_sector(cluster);
-    memset(buffer, 0, sizeof(buffer));
+    memset(buffer, 0, 512);
     ahci_write(fat32_port, sector, 0, 1, (uint16_t*)buffer);
 
     // Write "." and ".." entries
@@ -399,11 +436,14 @@ bool fat32_init_directory_cluster(uint32_t cluster, uint32_t parent_cluster) {
     
     ahci_write(fat32_port, sector, 0, 1, (uint16_t*)buffer);
 
+    kmem_cache_free(fat32_dir_cache, buffer);
     return true;
 }
 
 bool fat32_delete_directory(uint32_t cluster) {
-    uint8_t buffer[512];
+    uint8_t* buffer = kmem_cache_alloc(fat32_dir_cache);   // Not on the stack: this function recurses
+    if (!buffer) return false;
+
     uint32_t sector = fat32_cluster_to_sector(cluster);
     ahci_read(fat32_port, sector, 0, 1, (uint16_t*)buffer);
 
@@ -416,26 +456,33 @@ bool fat32_delete_directory(uint32_t cluster) {
     }
 
     // Mark the directory as deleted
-    memset(buffer, 0, sizeof(buffer));
+    memset(buffer, 0, 512);
     ahci_write(fat32_port, sector, 0, 1, (uint16_t*)buffer);
 
+    kmem_cache_free(fat32_dir_cache, buffer);
     return true;
 }
 
 bool fat32_delete_directory_entry(uint32_t cluster, const char* name) {
-    uint8_t buffer[512];
+    uint8_t* buffer = kmem_cache_alloc(fat32_dir_cache);
+    if (!buffer) return false;
+
     uint32_t sector = fat32_cluster_to_sector(cluster);
     ahci_read(fat32_port, sector, 0, 1, (uint16_t*)buffer);
 
+    bool deleted = false;
     DIR_ENTRY* entries = (DIR_ENTRY*)buffer;
     for (int i = 0; i < 512 / sizeof(DIR_ENTRY); i++) {
         if (strncmp(entries[i].name, name, 11) == 0) {
             entries[i].name[0] = 0xE5; // Mark as deleted
             ahci_write(fat32_port, sector, 0, 1, (uint16_t*)buffer);
-            return true;
+            deleted = true;
+            break;
         }
     }
-    return false;
+
+    kmem_cache_free(fat32_dir_cache, buffer);
+    return deleted;
 }
 
 void fat32_run_tests(HBA_PORT_T* global_port) {
@@ -475,7 +522,21 @@ void fat32_run_tests(HBA_PORT_T* global_port) {
     }
     printf(" [-] FAT32: File contents: %s\n", buffer);
 
-    // 4. Delete file
+    // 4. Map the file, its page is read on the first touch
+    printf(" [-] FAT32: Mapping file: %s\n", filename);
+    uint32_t length = strlen((char*)message);
+    int fd = fat32_open(filename);
+    const char* mapped = fd >= 0 ? mmap(fd, 0, length) : NULL;
+    if (!mapped || strncmp(mapped, message, length) != 0) {
+        printf(" [-] FAT32: Failed to map file!\n");
+        fat32_close(fd);
+        return;
+    }
+    munmap((void*)mapped, length);
+    fat32_close(fd);
+    printf(" [-] FAT32: Mapped file matches its contents.\n");
+
+    // 5. Delete file
     printf(" [-] FAT32: Deleting file: %s\n", filename);
     if (!fat32_delete_file(filename)) {
         printf(" [-] FAT32: Failed to delete file!\n");
@@ -489,12 +550,19 @@ void fat32_run_tests(HBA_PORT_T* global_port) {
 
 
 uint32_t fat32_read_cluster(uint32_t cluster, uint8_t* buffer, uint32_t size) {
+    return fat32_read_cluster_at(cluster, 0, buffer, size);
+}
+
+// Read size bytes from offset (a multiple of the sector size) into cluster. Whole sectors
+// are read, so buffer must have room up to the end of the last one.
+uint32_t fat32_read_cluster_at(uint32_t cluster, uint32_t offset, uint8_t* buffer, uint32_t size) {
     if (cluster < 2) return 0;
 
-    uint32_t first_sector = fat32_info.fat_start_sector + (cluster - 2) * fat32_info.sectors_per_cluster;
+    uint32_t first_sector = fat32_cluster_to_sector(cluster) + offset / fat32_info.bytes_per_sector;
     uint32_t total_bytes = fat32_info.sectors_per_cluster * fat32_info.bytes_per_sector;
 
-    if (size > total_bytes) size = total_bytes;
+    if (offset >= total_bytes) return 0;
+    if (size > total_bytes - offset) size = total_bytes - offset;
 
     uint32_t sectors_to_read = (size + fat32_info.bytes_per_sector - 1) / fat32_info.bytes_per_sector;
 
@@ -505,7 +573,7 @@ uint32_t fat32_read_cluster(uint32_t cluster, uint8_t* buffer, uint32_t size) {
 uint32_t fat32_write_cluster(uint32_t cluster, const uint8_t* buffer, uint32_t size) {
     if (cluster < 2) return 0;
 
-    uint32_t first_sector = fat32_info.fat_start_sector + (cluster - 2) * fat32_info.sectors_per_cluster;
+    uint32_t first_sector = fat32_cluster_to_sector(cluster);
     uint32_t total_bytes = fat32_info.sectors_per_cluster * fat32_info.bytes_per_sector;
 
     if (size > total_bytes) size = total_bytes;
@@ -532,6 +600,132 @@ uint32_t fat32_get_directory_cluster(const char* name) {
 }
 
 
+// Open a file of the root directory for mmap(). Returns its descriptor, -1 if it does not exist
+// or too many files are open.
+int fat32_open(const char* filename) {
+    uint8_t* sector = kmem_cache_alloc(fat32_dir_cache);
+    if (!sector) return -1;
 
+    uint32_t root_sector = fat32_cluster_to_sector(fat32_info.root_dir_first_cluster);
+    ahci_read(fat32_port, root_sector, 0, 1, (uint16_t*)sector);
 
+    int fd = -1;
+    DIR_ENTRY* entries = (DIR_ENTRY*)sector;
+    for (int i = 0; i < 512 / sizeof(DIR_ENTRY); i++) {
+        if (strncmp(entries[i].name, filename, 11) != 0) continue;
+
+        uint64_t rflags = acquire_irqsave(&fat32_files_lock);
+        for (int j = 0; j < FAT32_MAX_OPEN_FILES; j++) {
+            if (fat32_files[j].refs != 0) continue;
+
+            fat32_file_t* file = &fat32_files[j];
+            file->first_cluster = (entries[i].fstClusHI << 16) | entries[i].fstClusLO;
+            file->size = entries[i].fileSize;
+            file->refs = 1;
+            file->open = true;
+            file->cursor_index = 0;
+            file->cursor_cluster = file->first_cluster;
+            fd = j;
+            break;
+        }
+        release_irqrestore(&fat32_files_lock, rflags);
+        break;
+    }
+
+    kmem_cache_free(fat32_dir_cache, sector);
+    return fd;
+}
+
+// Drop the descriptor. Mappings of the file keep it open until they are unmapped. Closing
+// an fd twice drops its reference only once.
+void fat32_close(int fd) {
+    if (fd < 0 || fd >= FAT32_MAX_OPEN_FILES) return;
+
+    fat32_file_t* file = &fat32_files[fd];
+    uint64_t rflags = acquire_irqsave(&fat32_files_lock);
+    bool was_open = file->open;
+    file->open = false;
+    release_irqrestore(&fat32_files_lock, rflags);
+
+    if (was_open) fat32_file_put(file);
+}
+
+// The open file of fd with a new reference, NULL if fd is not open
+fat32_file_t* fat32_get_file(int fd) {
+    if (fd < 0 || fd >= FAT32_MAX_OPEN_FILES) return NULL;
+
+    fat32_file_t* file = NULL;
+    uint64_t rflags = acquire_irqsave(&fat32_files_lock);
+    if (fat32_files[fd].open) {
+        file = &fat32_files[fd];
+        file->refs++;
+    }
+    release_irqrestore(&fat32_files_lock, rflags);
+    return file;
+}
+
+uint32_t fat32_file_size(fat32_file_t* file) {
+    return file->size;
+}
+
+// Another reference to an open file
+void fat32_file_hold(fat32_file_t* file) {
+    uint64_t rflags = acquire_irqsave(&fat32_files_lock);
+    file->refs++;
+    release_irqrestore(&fat32_files_lock, rflags);
+}
 
+// Drop a reference. The last one frees the slot and the cached pages of the file.
+void fat32_file_put(fat32_file_t* file) {
+    uint64_t rflags = acquire_irqsave(&fat32_files_lock);
+    bool last = --file->refs == 0;
+    uint32_t first_cluster = file->first_cluster;
+    release_irqrestore(&fat32_files_lock, rflags);
+
+    if (last) page_cache_evict(first_cluster);
+}
+
+// Cluster index of the chain of file, 0 past its end
+static uint32_t fat32_file_cluster(fat32_file_t* file, uint32_t index) {
+    uint64_t rflags = acquire_irqsave(&file->lock);
+
+    if (index < file->cursor_index) {
+        file->cursor_index = 0;
+        file->cursor_cluster = file->first_cluster;
+    }
+    while (file->cursor_index < index && file->cursor_cluster >= 2 && file->cursor_cluster < 0x0FFFFFF8) {
+        file->cursor_cluster = fat32_next_cluster(file->cursor_cluster);
+        file->cursor_index++;
+    }
+
+    uint32_t cluster = file->cursor_index == index ? file->cursor_cluster : 0;
+    release_irqrestore(&file->lock, rflags);
+
+    return (cluster >= 2 && cluster < 0x0FFFFFF8) ? cluster : 0;
+}
+
+// Read page page_index of file into page (FAT32_PAGE_SIZE bytes), straight from the disk
+// without a bounce buffer. Past the end of the file the page is zero filled.
+bool fat32_read_page(fat32_file_t* file, uint64_t page_index, uint8_t* page) {
+    uint64_t offset = page_index * FAT32_PAGE_SIZE;
+    if (offset >= file->size) return false;
+
+    uint32_t cluster_bytes = fat32_info.sectors_per_cluster * fat32_info.bytes_per_sector;
+    uint32_t bytes = file->size - offset < FAT32_PAGE_SIZE ? file->size - offset : FAT32_PAGE_SIZE;
+
+    for (uint32_t done = 0; done < bytes; ) {
+        uint64_t pos = offset + done;
+        uint32_t cluster = fat32_file_cluster(file, pos / cluster_bytes);
+        if (cluster == 0) return false;
+
+        uint32_t in_cluster = pos % cluster_bytes;
+        uint32_t chunk = cluster_bytes - in_cluster < bytes - done ? cluster_bytes - in_cluster : bytes - done;
+        if (fat32_read_cluster_at(cluster, in_cluster, page + done, chunk) != chunk) return false;
+
+        done += chunk;
+    }
+
+    // The last sector may have filled bytes past the end of the file
+    memset(page + bytes, 0, FAT32_PAGE_SIZE - bytes);
+    return true;
+}
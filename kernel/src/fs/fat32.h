@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "../lib/stdio.h"     // spinlock_t
+
 #include "../sys/ahci/ahci.h" // contains ahci_read/ahci_write and HBA_PORT_T
 
 typedef struct {
@@ -76,6 +78,20 @@ typedef struct {
     uint32_t fileSize;
 } __attribute__((packed)) DIR_ENTRY;
 
+#define FAT32_MAX_OPEN_FILES 16
+#define FAT32_PAGE_SIZE      4096
+
+// A file opened for mmap(). Its pages are read into the page cache on first touch.
+typedef struct fat32_file {
+    uint32_t first_cluster;         // Identifies the file in the page cache
+    uint32_t size;
+    uint32_t refs;                  // The descriptor and every mapping, 0 for a free slot
+    bool open;                      // The descriptor still holds its reference
+    uint32_t cursor_index;          // Last cluster looked up in the chain ...
+    uint32_t cursor_cluster;        // ... and its number, so sequential pages walk one link
+    spinlock_t lock;                // Protects the cursor
+} fat32_file_t;
+
 extern fat32_info_t fat32_info;
 
 bool fat32_init(HBA_PORT_T* port);
@@ -96,6 +112,7 @@ uint32_t fat32_sector_to_cluster(uint32_t sector);
 
 uint32_t fat32_next_cluster(uint32_t cluster);
 uint32_t fat32_read_cluster(uint32_t cluster, uint8_t* buffer, uint32_t size);
+uint32_t fat32_read_cluster_at(uint32_t cluster, uint32_t offset, uint8_t* buffer, uint32_t size);
 uint32_t fat32_write_cluster(uint32_t cluster, const uint8_t* buffer, uint32_t size);
 uint32_t fat32_get_file_size(const char* filename);
 uint32_t fat32_get_file_cluster(const char* filename);
@@ -117,6 +134,14 @@ bool fat32_delete_directory(uint32_t cluster);
 bool fat32_delete_directory_entry(uint32_t cluster, const char* name);
 
 uint32_t fat32_get_directory_cluster(const char* name);
+
+int fat32_open(const char* filename);
+void fat32_close(int fd);
+fat32_file_t* fat32_get_file(int fd);
+uint32_t fat32_file_size(fat32_file_t* file);
+void fat32_file_hold(fat32_file_t* file);
+void fat32_file_put(fat32_file_t* file);
+bool fat32_read_page(fat32_file_t* file, uint64_t page_index, uint8_t* page);
 void     fat32_run_tests(HBA_PORT_T* global_port);
 
 
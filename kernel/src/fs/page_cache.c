@@ -0,0 +1,143 @@
+/*
+Page Cache
+
+Pages of files which are mapped with mmap() are read from the disk once, into a frame of
+their own, and every mapping of the page maps that frame read only. The cache keeps the frame
+as its owner, and each mapping adds a PMM reference, so unmapping never frees a cached page.
+A page is only read when it is touched for the first time, a large file which is mapped but
+read in a few places costs a few frames.
+
+Eviction drops the reference of the cache. A frame which is still mapped stays with its
+mappings and is freed with the last one of them.
+
+https://wiki.osdev.org/Page_Cache
+https://www.kernel.org/doc/html/latest/admin-guide/mm/concepts.html#page-cache
+*/
+
+#include "../lib/stdio.h"
+#include "../memory/pmm.h"
+#include "../memory/pmm_cache.h"
+#include "../memory/vmm.h"
+#include "../memory/slab.h"
+
+#include "fat32.h"
+#include "page_cache.h"
+
+
+static page_cache_entry_t *page_cache[PAGE_CACHE_BUCKETS];
+static kmem_cache_t *page_cache_entry_cache;
+static spinlock_t page_cache_lock;
+
+static uint64_t page_cache_pages;       // Pages in the cache
+static uint64_t page_cache_hits;        // Lookups served from the cache
+static uint64_t page_cache_misses;      // Lookups which read the page from the disk
+
+
+static inline uint64_t page_cache_bucket(uint32_t file, uint64_t index) {
+    return ((uint64_t) file * 0x9E3779B1 + index) & (PAGE_CACHE_BUCKETS - 1);
+}
+
+// Called with page_cache_lock held
+static page_cache_entry_t *page_cache_find(uint32_t file, uint64_t index) {
+    for (page_cache_entry_t *entry = page_cache[page_cache_bucket(file, index)]; entry; entry = entry->next) {
+        if (entry->file == file && entry->index == index) return entry;
+    }
+    return NULL;
+}
+
+
+// The frame of page index of file, with a PMM reference for the mapping of the caller.
+// Returns PMM_INVALID_FRAME if the page is past the end of the file or can not be read.
+uint64_t page_cache_get(fat32_file_t *file, uint64_t index) {
+    uint64_t rflags = acquire_irqsave(&page_cache_lock);
+    if (!page_cache_entry_cache) {
+        page_cache_entry_cache = kmem_cache_create("page_cache", sizeof(page_cache_entry_t), 0);
+    }
+
+    page_cache_entry_t *entry = page_cache_find(file->first_cluster, index);
+    if (entry) {
+        uint64_t frame = entry->frame;
+        pmm_frame_ref(frame);
+        page_cache_hits++;
+        release_irqrestore(&page_cache_lock, rflags);
+        return frame;
+    }
+    page_cache_misses++;
+    release_irqrestore(&page_cache_lock, rflags);
+
+    // Read without the lock, the disk is slow
+    uint64_t frame = pmm_cache_alloc_frame();
+    if (frame == PMM_INVALID_FRAME) return PMM_INVALID_FRAME;
+
+    entry = kmem_cache_alloc(page_cache_entry_cache);
+    if (!entry || !fat32_read_page(file, index, (uint8_t *) phys_to_vir(frame))) {
+        if (entry) kmem_cache_free(page_cache_entry_cache, entry);
+        pmm_cache_free_frame(frame);
+        return PMM_INVALID_FRAME;
+    }
+
+    entry->file = file->first_cluster;
+    entry->index = index;
+    entry->frame = frame;
+
+    rflags = acquire_irqsave(&page_cache_lock);
+
+    // Another core may have read the same page meanwhile, its copy wins
+    page_cache_entry_t *other = page_cache_find(file->first_cluster, index);
+    if (other) {
+        uint64_t other_frame = other->frame;
+        pmm_frame_ref(other_frame);
+        release_irqrestore(&page_cache_lock, rflags);
+
+        kmem_cache_free(page_cache_entry_cache, entry);
+        pmm_cache_free_frame(frame);
+        return other_frame;
+    }
+
+    uint64_t bucket = page_cache_bucket(entry->file, index);
+    entry->next = page_cache[bucket];
+    page_cache[bucket] = entry;
+    page_cache_pages++;
+    pmm_frame_ref(frame);
+
+    release_irqrestore(&page_cache_lock, rflags);
+    return frame;
+}
+
+
+// Drop every cached page of file, e.g. when it is written or its last descriptor is closed
+void page_cache_evict(uint32_t file) {
+    page_cache_entry_t *evicted = NULL;
+
+    uint64_t rflags = acquire_irqsave(&page_cache_lock);
+    for (int bucket = 0; bucket < PAGE_CACHE_BUCKETS; bucket++) {
+        page_cache_entry_t **link = &page_cache[bucket];
+        while (*link) {
+            page_cache_entry_t *entry = *link;
+            if (entry->file != file) {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            entry->next = evicted;
+            evicted = entry;
+            page_cache_pages--;
+        }
+    }
+    release_irqrestore(&page_cache_lock, rflags);
+
+    while (evicted) {
+        page_cache_entry_t *entry = evicted;
+        evicted = entry->next;
+
+        // A frame which is still mapped goes with its last mapping
+        if (pmm_frame_unref(entry->frame)) pmm_cache_free_frame(entry->frame);
+        kmem_cache_free(page_cache_entry_cache, entry);
+    }
+}
+
+
+void print_page_cache_stats() {
+    printf(" Page cache: %d pages (%d KB), %d hits, %d misses\n",
+        page_cache_pages, page_cache_pages * FRAME_SIZE / 1024, page_cache_hits, page_cache_misses);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define PAGE_CACHE_BUCKETS 256      // Hash buckets, a power of two
+
+struct fat32_file;
+
+// A 4 KB page of a file, read from the disk once and shared by every mapping of it
+typedef struct page_cache_entry {
+    uint32_t file;                  // First cluster of the file
+    uint64_t index;                 // Page of the file
+    uint64_t frame;                 // Owned by the cache, mappings hold PMM references
+    struct page_cache_entry *next;  // Next entry of the bucket
+} page_cache_entry_t;
+
+uint64_t page_cache_get(struct fat32_file *file, uint64_t index);
+void page_cache_evict(uint32_t file);
+
+void print_page_cache_stats();
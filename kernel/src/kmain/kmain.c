@@ -16,7 +16,9 @@ Reference   : https://wiki.osdev.org/Limine
 #include "../driver/vga/vga_gfx.h"
 #include "../driver/vga/framebuffer.h"
 #include "../process/process.h" 
+#include "../process/thread.h"          // init_thread_cache
 #include "../process/test_process.h"
+#include "../process/scheduler.h"       // init_scheduler, bench_context_switch
 #include "../sys/acpi/acpi.h"                   // init_acpi
 #include "../sys/acpi/descriptor_table/mcfg.h"
 #include "../sys/acpi/descriptor_table/madt.h"
@@ -48,15 +50,22 @@ Reference   : https://wiki.osdev.org/Limine
 #include "../driver/io/serial.h"
 #include "../arch/gdt/gdt.h"           // init_gdt
 #include "../arch/gdt/tss.h"
+#include "../memory/numa.h"              // init_numa
 #include "../memory/pmm.h"               // init_pmm, test_pmm
+#include "../memory/slab.h"              // test_slab
+#include "../memory/vmem.h"              // test_vmem
+#include "../memory/vm_region.h"         // test_vm_region
 #include "../memory/paging.h"            // init_paging, test_paging
-#include "../memory/kmalloc.h"           // test_kmalloc
-#include "../memory/vmm.h"               // test_vmm
+#include "../memory/kmalloc.h"           // test_kmalloc, bench_kmalloc
+#include "../memory/vmm.h"               // test_vmm, test_virt_to_phys
+#include "../memory/address_space.h"     // init_address_spaces, bench_pcid, test_cow
 #include "../memory/kheap.h"             // test_kheap
+#include "../memory/zero_pool.h"         // init_zero_pool, bench_zero_pool, zero_pool_idle
 #include "../sys/timer/tsc.h"         // time stamp counter
 #include "../sys/timer/rtc.h"         // RTC
 #include "../sys/timer/pit_timer.h"   // init_timer
 #include "../sys/timer/apic_timer.h"  // apic timer
+#include "../sys/timer/timer_wheel.h" // bench_timer_wheel
 #include "../sys/timer/hpet_timer.h"  // hpet timerzz
 #include "../kshell/kshell.h"
 #include "../kshell/ring_buffer.h"
@@ -110,9 +119,28 @@ void kmain(){
 
     // initially starts pic
     gdt_tss_init();         // Initialize GDT and TSS
+    init_cpu_id();          // Per CPU caches find their core with this_cpu_id()
+    init_numa();            // NUMA nodes from the ACPI SRAT and SLIT, before the PMM zones
     init_pmm();             // Initialize Physical Memory Manager
+    test_pmm();             // Check the PMM summary bitmap against a linear scan
+    test_slab();            // Check the slab allocator
+    test_vmem();            // Check the virtual address range allocator
     init_paging();          // Initialize paging
+    init_address_spaces();  // Kernel address space and PCIDs
+    init_zero_pool();       // Zero page and the pool of pre-zeroed frames
+    init_process_cache();   // Slab cache of process_t, before any core creates a process
+    init_thread_cache();    // Slab cache of thread_t, before any core creates a thread
+    init_ring_buffer_cache(); // Slab cache of ring_buffer_t, before the shell starts
     pic_int_init();         // Initialize PIC Interrupts
+    test_vm_region();       // Check demand paging through the page fault handler
+    test_vmm();             // Check the batched range map and unmap
+    test_virt_to_phys();    // Check the page walk and the per-CPU translation cache
+    bench_pcid();           // Compare address space switches with and without PCIDs
+    test_cow();             // Check the copy on write clone of fork()
+    bench_huge_pages();     // Compare TLB bound reads with 4 KB and 2 MB pages
+    bench_zero_pool();      // Compare pre-zeroed frames with clearing on allocation
+    test_kmalloc_cpu_cache(); // Check that the per core stacks keep kmalloc off the slab lock
+    bench_kmalloc();        // Cost of an allocation, with or without HEAP_DEBUG
     init_pit_timer(100);    // Initialize PIT Timer
     init_tsc();             // Initialize TSC for the bootstrap core
     printf("[Info] CPU %d with PIC initialized...\n\n", 0);
@@ -121,6 +149,12 @@ void kmain(){
     // Initialize APIC and IOAPIC
     if(has_apic()){
         init_all_cpu_cores();    // Starts all CPU cores
+        init_scheduler();        // kmain() goes on as the idle thread of the bootstrap core
+        bench_context_switch();  // Time a switch between two yielding threads
+        bench_sched_scaling();   // Throughput of CPU bound threads spread over the cores
+        bench_wakeup_latency();  // How soon a woken interactive thread preempts CPU hogs
+        bench_idle_wakeups();    // Timer interrupts on idle cores, none while tickless
+        bench_timer_wheel();     // Timer add and cancel cost, sleep() precision
     }else{
         printf("[Error] This System does not have APIC.\n");
     }
@@ -154,7 +188,7 @@ void kmain(){
 
     // start_kshell();
 
-    halt_kernel();
+    zero_pool_idle();       // Nothing left to do: keep pre-zeroed frames ready
 }
 
 
@@ -7,13 +7,12 @@
 #include "../../lib/stdlib.h" // atof
 #include "../../process/process.h"
 #include "../../process/thread.h"
+#include "../../process/scheduler.h"
 #include "../kshell.h"
 #include "../../util/util.h"
 
 #include "calculator.h"
 
-extern void restore_cpu_state(registers_t* registers);
-
 extern process_t* kshell_process;
 extern thread_t* kshell_thread;
 process_t* calculator_process;
@@ -35,7 +34,6 @@ void calculator_main(void* arg) {
 
         if (operator == 'q' || operator == 'Q') {
             printf("\nExiting calculator...\n");
-            destroy_calculator();
             break;
         }
 
@@ -74,8 +72,7 @@ void calculator_main(void* arg) {
         }
     }
 
-    // After calculator exits, go back to shell
-    run_kshell();
+    // Returning ends the thread, start_calculator() then takes the shell back
 }
 
 
@@ -91,21 +88,19 @@ void start_calculator() {
     thread_t* calculator_thread = create_thread(calculator_process, "Calculator Thread", &calculator_main, NULL);
     if (!calculator_thread) {
         printf("Failed to create calculator thread!\n");
+        delete_process(calculator_process);
         return;
     }
 
-    restore_cpu_state((registers_t *)(uintptr_t)&calculator_thread->registers);
-
     printf("Calculator started successfully.\n");
+
+    // The shell sleeps and leaves the keyboard to the calculator until it quits
+    thread_join(calculator_thread);
+    destroy_calculator();
 }
 
 void destroy_calculator() {
-    registers_t *regs = (registers_t *)&kshell_thread->registers;
-    if(!regs){
-        printf("Kshell is Null\n");
-    }
-
-    restore_cpu_state(regs);
     delete_process(calculator_process);
+    calculator_process = NULL;
     printf("Calculator process and thread destroyed.\n");
 }
\ No newline at end of file
@@ -20,8 +20,12 @@
 
 #include "../sys/acpi/descriptor_table/fadt.h" // for acpi_poweroff and acpi_reboot
 
+#include "../memory/memprof.h"
+
 #include "../process/process.h"
 #include "../process/thread.h"
+#include "../process/scheduler.h"
+#include "../driver/keyboard/keyboard.h"   // keyboard_set_reader
 
 #include "calculator/calculator.h"
 #include "steam_locomotive/sl.h" // For locomotive animation
@@ -33,8 +37,6 @@ process_t* kshell_process;
 thread_t* kshell_thread;
 
 
-extern void restore_cpu_state(registers_t* registers);
-
 // Global ring buffer to store keystrokes from the keyboard driver
 extern ring_buffer_t* keyboard_buffer;
 
@@ -44,11 +46,16 @@ void read_command(char *command, size_t bufsize) {
     size_t index = 0;
     uint8_t ch;
 
+    // The reader sleeps until the keyboard interrupt wakes it, boosted above CPU hogs
+    thread_t* self = get_current_thread();
+    if (self) thread_set_interactive(self, true);
+    keyboard_set_reader(self);
+
     // Loop until we either fill the command buffer or encounter Enter
     while (index < bufsize - 1) {
         // Wait for a character to be available
         while (is_ring_buffer_empty(keyboard_buffer)) {
-            // Optionally, you could yield the CPU or sleep here
+            thread_block();     // Returns at once if a key came after the check
         }
         // Pop a character from the ring buffer.
         if (ring_buffer_pop(keyboard_buffer, &ch) == 0) {
@@ -60,6 +67,8 @@ void read_command(char *command, size_t bufsize) {
         }
     }
     command[index] = '\0';
+
+    keyboard_set_reader(NULL);
 }
 
 
@@ -116,6 +125,12 @@ void execute_command(char* command) {
     }else if(strcmp(command, "meminfo") == 0){
         print_meminfo();
 
+    }else if(strcmp(command, "memprof") == 0){
+        print_memprof();
+
+    }else if(strcmp(command, "memprof serial") == 0){
+        memprof_dump_serial();
+
     }else if(strcmp(command, "ps") == 0) {
         print_process_list(); // Function to print the process list
 
@@ -253,8 +268,7 @@ void start_kshell() {
 
     // init_vfs();
 
-    restore_cpu_state((registers_t *)(uintptr_t)&kshell_thread->registers);
-
+    // The scheduler runs the shell thread from the next switch on
     printf("Shell started successfully.\n");
 }
 
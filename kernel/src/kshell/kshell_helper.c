@@ -12,6 +12,14 @@ Build Date: 2025-04-05
 #include "../process/thread.h"
 
 #include "../memory/detect_memory.h" // Memory management functions
+#include "../memory/pmm.h"           // Physical memory regions
+#include "../memory/buddy.h"         // Buddy zones of the regions
+#include "../memory/numa.h"          // NUMA nodes of the regions
+#include "../memory/pmm_cache.h"     // Per CPU frame caches
+#include "../memory/slab.h"          // Slab caches
+#include "../memory/paging.h"        // Page table frames
+#include "../memory/vmm.h"           // Translation caches
+#include "../fs/page_cache.h"        // Cached file pages
 
 #include "../bootloader/boot.h" // Bootloader information
 #include "../bootloader/firmware.h" // Firmware information
@@ -66,7 +74,26 @@ void print_current_timestamp(){
 void print_meminfo() {
     printf("Memory Information:\n");
     printf("Total Physical Memory: %d MB\n", TOTAL_PHYS_MEMORY / (1024 * 1024));
-    printf("Usable Physical Memory: %d MB\n", USABLE_LENGTH_PHYS_MEM / (1024 * 1024));
+    printf("Usable Physical Memory: %d MB\n", TOTAL_USABLE_PHYS_MEMORY / (1024 * 1024));
+    printf("Bootloader Reclaimable Memory: %d MB\n", BOOTLOADER_RECLAIMABLE_PHYS_MEMORY / (1024 * 1024));
+    printf("Free Physical Memory: %d MB\n", (pmm_free_frames() * FRAME_SIZE) / (1024 * 1024));
+
+    for(int i = 0; i < pmm_region_count; i++){
+        pmm_region_t *region = &pmm_regions[i];
+        printf(" Region %d: %x - %x, Node %d, %d KB, Free: %d KB (Bitmap: %d KB, Buddy: %d KB)\n",
+            i, region->base, region->end, region->node,
+            (region->nframes * FRAME_SIZE) / 1024,
+            (pmm_region_free_frames(region) * FRAME_SIZE) / 1024,
+            (region->free_frames * FRAME_SIZE) / 1024,
+            (region->zone ? region->zone->free_frames * FRAME_SIZE : 0) / 1024);
+    }
+    print_numa_info();
+    print_pmm_cache_stats();
+    print_page_table_stats();
+    print_virt_cache_stats();
+    print_page_cache_stats();
+    print_kmem_cache_stats();
+
     printf("Kernel Virtual Base Address: %x\n", KERNEL_VIR_BASE);
     printf("Kernel Physical Base Address: %x\n", KERNEL_PHYS_BASE);
     printf("HHDM Offset: %x\n", HHDM_OFFSET);
@@ -116,6 +143,7 @@ void help(){
     printf("20. rmdir <dirname> : Remove a directory.\n");
     printf("21. cd <dirname> : Change directory.\n");
     printf("22. tree : Print directory tree.\n");
+    printf("23. memprof [serial] : Print allocations per call site, or dump them to the serial port.\n");
 }
 
 
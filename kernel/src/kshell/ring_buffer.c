@@ -8,20 +8,29 @@ https://embedjournal.com/implementing-circular-buffer-embedded-c/
 */
 
 #include "../memory/kheap.h"
+#include "../memory/slab.h"
 #include "../lib/stdio.h"
 
 #include "ring_buffer.h"
 
 
+static kmem_cache_t *ring_buffer_cache;    // Slab cache of ring_buffer_t objects
+
+// Create the slab cache once at boot, before any core creates a ring buffer
+void init_ring_buffer_cache() {
+    ring_buffer_cache = kmem_cache_create("ring_buffer_t", sizeof(ring_buffer_t), 0);
+    if (!ring_buffer_cache) printf("[Error] Ring Buffer: No slab cache for ring_buffer_t\n");
+}
+
 // Initialize the ring buffer with given capacity.
 ring_buffer_t* ring_buffer_init(size_t capacity) {
 
-    ring_buffer_t* rb = kheap_alloc(sizeof(ring_buffer_t));
+    ring_buffer_t* rb = kmem_cache_alloc(ring_buffer_cache);
     if (!rb) return NULL;
 
     rb->buffer = kheap_alloc(capacity * sizeof(uint8_t));
     if (!rb->buffer) {
-        kheap_free((void *)rb,sizeof(ring_buffer_t));
+        kmem_cache_free(ring_buffer_cache, rb);
         return NULL;
     }
 
@@ -36,7 +45,7 @@ ring_buffer_t* ring_buffer_init(size_t capacity) {
 void ring_buffer_free(ring_buffer_t* rb, size_t capacity) {
     if (rb) {
         kheap_free(rb->buffer, capacity * sizeof(uint8_t));
-        kheap_free((void *)rb, sizeof(ring_buffer_t));
+        kmem_cache_free(ring_buffer_cache, rb);
     }
 }
 
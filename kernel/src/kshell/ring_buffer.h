@@ -15,6 +15,7 @@ typedef struct {
 } ring_buffer_t;
 
 
+void init_ring_buffer_cache();                               // Create the slab cache of ring buffers at boot.
 ring_buffer_t* ring_buffer_init(size_t capacity);           // Initialize the ring buffer with given capacity.
 void ring_buffer_free(ring_buffer_t* rb, size_t capacity);  // Free the allocated ring buffer.
 
@@ -158,16 +158,34 @@ void printf(const char* format, ...) {
 
 
 void acquire(spinlock_t* lock) {
-    while (true) {
-        if (lock->locked == false) {
-            lock->locked = true;
-            return;
+    // Test and set in one atomic step, so two cores can not both see the lock free
+    while (__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
+            asm volatile("pause");
         }
     }
 }
 
 void release(spinlock_t* lock) {
-    lock->locked = false;
+    __atomic_clear(&lock->locked, __ATOMIC_RELEASE);
+}
+
+// Take the lock only if it is free. Returns false instead of spinning.
+bool try_acquire(spinlock_t* lock) {
+    return !__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE);
+}
+
+// Disable interrupts on this core before taking the lock, so an interrupt handler
+// which takes the same lock can not deadlock against us. Returns the old RFLAGS.
+uint64_t acquire_irqsave(spinlock_t* lock) {
+    uint64_t rflags = irq_save();
+    acquire(lock);
+    return rflags;
+}
+
+void release_irqrestore(spinlock_t* lock, uint64_t rflags) {
+    release(lock);
+    irq_restore(rflags);    // IF was set before acquire_irqsave
 }
 
 
@@ -25,4 +25,19 @@ void printf(const char* format, ...);
 
 void acquire(spinlock_t* lock);
 void release(spinlock_t* lock);
+bool try_acquire(spinlock_t* lock);
+uint64_t acquire_irqsave(spinlock_t* lock);
+void release_irqrestore(spinlock_t* lock, uint64_t rflags);
+
+// Interrupts off on this core, e.g. around per core data an interrupt handler also touches.
+// irq_restore() turns them back on only if irq_save() found them on.
+static inline uint64_t irq_save(){
+    uint64_t rflags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(rflags) :: "memory");
+    return rflags;
+}
+
+static inline void irq_restore(uint64_t rflags){
+    if(rflags & 0x200) asm volatile("sti" ::: "memory");
+}
 
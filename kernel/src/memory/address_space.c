@@ -0,0 +1,365 @@
+/*
+Address Spaces and PCIDs
+
+Every process may get its own PML4. The kernel half and Limine's identity map of the first
+4 GB are shared with bsp_cr3, so kernel code runs unchanged in any address space.
+
+A plain CR3 load flushes the whole TLB. With CR4.PCIDE set the low 12 bits of CR3 tag each TLB
+entry with a process context identifier (PCID), and a load with bit 63 set keeps the entries
+of the other PCIDs. A core gives PCID_SLOTS PCIDs to the address spaces it ran last and
+recycles them round robin, so no PCID has to be freed across cores.
+
+An address space counts the removal of its lower half mappings in tlb_gen. Cores which have
+it loaded get a TLB shootdown, the others flush its PCID when they load it again with a newer
+generation than the one in their slot. Kernel mappings are shared by every PCID of a core and
+are flushed in all of them, with INVPCID where the CPU has it.
+
+https://wiki.osdev.org/TLB
+https://www.felixcloutier.com/x86/invpcid
+https://lwn.net/Articles/671299/
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/string.h"
+#include "../arch/interrupt/apic/ipi.h"
+#include "../sys/cpu/cpu.h"
+#include "../sys/cpu/cpuid.h"
+#include "../sys/timer/tsc.h"
+
+#include "detect_memory.h"
+#include "paging.h"
+#include "pmm.h"
+#include "slab.h"
+#include "vmm.h"
+
+#include "address_space.h"
+
+#define CR3_NOFLUSH         (1ULL << 63)    // Keep the TLB entries of the loaded PCID
+#define CR4_PCIDE           (1ULL << 17)
+
+#define INVPCID_ADDRESS      0              // One address in one PCID
+#define INVPCID_ALL_CONTEXTS 2              // Everything, global pages included
+
+address_space_t kernel_address_space;       // bsp_cr3, PCID 0 on every core
+bool pcid_enabled;
+static bool invpcid_supported;
+
+static kmem_cache_t *address_space_cache;
+
+
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t va) {
+    struct { uint64_t pcid; uint64_t va; } desc = { pcid, va };
+    asm volatile("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
+// The software TLB of virt_to_phys() caches one address space only, not one per PCID
+static inline void write_cr3(uint64_t cr3) {
+    asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    virt_cache_flush_all();
+}
+
+
+// Called by the bootstrap core once paging is up
+void init_address_spaces() {
+    kernel_address_space.pml4 = get_cr3_addr();
+    kernel_address_space.tlb_gen = 0;
+
+    address_space_cache = kmem_cache_create("address_space", sizeof(address_space_t), 0);
+
+    pcid_enabled = has_pcid();
+    invpcid_supported = pcid_enabled && has_invpcid();
+
+    init_pcid();
+
+    printf(" [-] Address spaces: PCID %s, INVPCID %s\n",
+        pcid_enabled ? "enabled" : "not supported", invpcid_supported ? "supported" : "not supported");
+}
+
+
+// Every core starts in the kernel address space with PCID 0
+void init_pcid() {
+    cpu_data_t *cpu = &cpu_datas[this_cpu_id()];
+
+    memset(cpu->pcid_slots, 0, sizeof(cpu->pcid_slots));
+    cpu->pcid_slots[0].as = &kernel_address_space;
+    cpu->pcid_slots[0].tlb_gen = kernel_address_space.tlb_gen;
+    cpu->pcid_current = 0;
+    cpu->pcid_next = 1;
+
+    cpu->active_as = &kernel_address_space;
+    cpu->active_cr3 = kernel_address_space.pml4;
+
+    if (!pcid_enabled) return;
+
+    // CR4.PCIDE can only be set while CR3 holds PCID 0
+    write_cr3(kernel_address_space.pml4);
+
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_PCIDE) : "memory");
+}
+
+
+address_space_t *address_space_create() {
+    address_space_t *as = kmem_cache_alloc(address_space_cache);
+    if (!as) return NULL;
+
+    as->pml4 = create_new_pml4();
+    as->tlb_gen = 0;
+
+    if (!as->pml4) {
+        kmem_cache_free(address_space_cache, as);
+        return NULL;
+    }
+    return as;
+}
+
+
+// A copy on write child of src for fork(). Returns NULL if the tables can not be copied.
+address_space_t *address_space_clone(address_space_t *src) {
+    if (!src || src == &kernel_address_space) return NULL;
+
+    address_space_t *as = address_space_create();
+    if (!as) return NULL;
+
+    if (!clone_user_mappings(as->pml4, src->pml4)) {
+        address_space_destroy(as);
+        return NULL;
+    }
+
+    // The writable pages of src are read only now, no core may keep writing through its TLB
+    if (cpu_datas[this_cpu_id()].active_as == src) {
+        flush_tlb_all();
+    } else {
+        __atomic_add_fetch(&src->tlb_gen, 1, __ATOMIC_SEQ_CST);
+    }
+    tlb_shootdown(src->pml4, 0, HIGHER_HALF_START_ADDR);
+
+    return as;
+}
+
+
+// Free the page tables of an address space and the frames of its lower half. It must not be
+// loaded on any core. Frames shared copy on write stay with the other address spaces.
+void address_space_destroy(address_space_t *as) {
+    if (!as || as == &kernel_address_space) return;
+
+    // Forget its PCIDs. A slot which goes to another address space later is flushed then.
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (int slot = 1; slot < PCID_SLOTS; slot++) {
+            address_space_t *expected = as;
+            __atomic_compare_exchange_n(&cpu_datas[cpu].pcid_slots[slot].as, &expected, NULL,
+                false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    destroy_pml4(as->pml4);
+    kmem_cache_free(address_space_cache, as);
+}
+
+
+// Load as on this core. With PCIDs its TLB entries from the last time survive, unless its
+// mappings were removed since then or its PCID went to another address space.
+void address_space_switch(address_space_t *as) {
+    uint64_t rflags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(rflags) :: "memory");
+
+    cpu_data_t *cpu = &cpu_datas[this_cpu_id()];
+    if (cpu->active_as == as) {
+        if (rflags & 0x200) asm volatile("sti" ::: "memory");
+        return;
+    }
+
+    cpu->active_as = as;
+    cpu->active_cr3 = as->pml4;
+
+    // A shootdown which bumps tlb_gen after this point sees this core as a target
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t gen = __atomic_load_n(&as->tlb_gen, __ATOMIC_SEQ_CST);
+
+    if (!pcid_enabled) {
+        write_cr3(as->pml4);
+        if (rflags & 0x200) asm volatile("sti" ::: "memory");
+        return;
+    }
+
+    uint8_t slot = 0;
+    while (slot < PCID_SLOTS && cpu->pcid_slots[slot].as != as) slot++;
+
+    if (slot == PCID_SLOTS) {
+        // Recycle the next PCID, whatever it still caches is flushed by the load below
+        slot = cpu->pcid_next;
+        cpu->pcid_next = (slot + 1 == PCID_SLOTS) ? 1 : slot + 1;
+        cpu->pcid_slots[slot].as = as;
+        cpu->pcid_slots[slot].tlb_gen = PCID_GEN_STALE;
+    }
+
+    uint64_t cr3 = as->pml4 | slot;
+    if (cpu->pcid_slots[slot].tlb_gen == gen) cr3 |= CR3_NOFLUSH;
+
+    cpu->pcid_slots[slot].tlb_gen = gen;
+    cpu->pcid_current = slot;
+    write_cr3(cr3);
+
+    if (rflags & 0x200) asm volatile("sti" ::: "memory");
+}
+
+
+// Lower half mappings of the address space cr3 were removed or changed, and this core has
+// already flushed them. Other cores flush its PCID when they load it next time.
+void address_space_invalidate(uint64_t cr3) {
+    cpu_data_t *cpu = &cpu_datas[this_cpu_id()];
+    address_space_t *as = cpu->active_as;
+    if (!as || as->pml4 != cr3) return;
+
+    uint64_t gen = __atomic_add_fetch(&as->tlb_gen, 1, __ATOMIC_SEQ_CST);
+    if (cpu->pcid_slots[cpu->pcid_current].as == as) cpu->pcid_slots[cpu->pcid_current].tlb_gen = gen;
+}
+
+
+// invlpg and a CR3 reload reach only the current PCID, but kernel mappings may be cached
+// under every PCID of this core
+void flush_tlb_other_pcids(uint64_t start, uint64_t end) {
+    if (!pcid_enabled) return;
+
+    cpu_data_t *cpu = &cpu_datas[this_cpu_id()];
+
+    if (invpcid_supported && (end - start) / PAGE_SIZE <= TLB_FLUSH_MAX_PAGES) {
+        for (uint64_t slot = 0; slot < PCID_SLOTS; slot++) {
+            if (slot == cpu->pcid_current || !cpu->pcid_slots[slot].as) continue;
+            for (uint64_t va = start & ~(uint64_t)(PAGE_SIZE - 1); va < end; va += PAGE_SIZE) {
+                invpcid(INVPCID_ADDRESS, slot, va);
+            }
+        }
+        return;
+    }
+
+    if (invpcid_supported) {
+        invpcid(INVPCID_ALL_CONTEXTS, 0, 0);
+        return;
+    }
+
+    // Without INVPCID the other PCIDs are flushed when they are loaded again
+    for (int slot = 0; slot < PCID_SLOTS; slot++) {
+        if (slot != cpu->pcid_current) cpu->pcid_slots[slot].tlb_gen = PCID_GEN_STALE;
+    }
+}
+
+
+#define BENCH_VA     0x0000700000000000ULL  // In the private lower half of both address spaces
+#define BENCH_PAGES  128
+#define BENCH_ROUNDS 64
+
+// Cycles of one switch plus one read of every page. A bumped generation makes the switch
+// flush the PCID like a plain CR3 load would.
+static uint64_t bench_switches(address_space_t **as, bool flush) {
+    uint64_t start = read_tsc();
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (int i = 0; i < 2; i++) {
+            if (flush) __atomic_add_fetch(&as[i]->tlb_gen, 1, __ATOMIC_SEQ_CST);
+            address_space_switch(as[i]);
+            for (uint64_t page = 0; page < BENCH_PAGES; page++) {
+                (void) *(volatile uint64_t *)(BENCH_VA + page * PAGE_SIZE);
+            }
+        }
+    }
+
+    return (read_tsc() - start) / (BENCH_ROUNDS * 2);
+}
+
+// Compare switches between two address spaces with and without keeping their TLB entries
+void bench_pcid() {
+    if (!pcid_enabled) {
+        printf(" [-] PCID: Not supported, every address space switch flushes the TLB\n");
+        return;
+    }
+
+    address_space_t *as[2] = { address_space_create(), address_space_create() };
+    bool ok = as[0] && as[1];
+
+    for (int i = 0; ok && i < 2; i++) {
+        address_space_switch(as[i]);
+        ok = vmm_map_range(BENCH_VA, BENCH_PAGES * PAGE_SIZE, PAGE_WRITE);
+    }
+
+    uint64_t kept = 0, flushed = 0;
+    if (ok) {
+        bench_switches(as, false);
+        kept = bench_switches(as, false);
+        flushed = bench_switches(as, true);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (!as[i]) continue;
+        address_space_switch(as[i]);
+        vmm_unmap_range(BENCH_VA, BENCH_PAGES * PAGE_SIZE);
+    }
+    address_space_switch(&kernel_address_space);
+    address_space_destroy(as[0]);
+    address_space_destroy(as[1]);
+
+    if (!ok) {
+        printf("[Error] PCID: Can not set up the benchmark address spaces\n");
+        return;
+    }
+
+    printf(" [-] PCID: Switch and read %d pages: %d cycles with PCID kept, %d cycles with TLB flushed\n",
+        BENCH_PAGES, kept, flushed);
+}
+
+
+#define COW_TEST_VA  0x0000710000000000ULL  // In the private lower half, next to BENCH_VA
+
+// fork() without a process: clone an address space, write in the child and check that the
+// parent keeps its data and its frame, and that the frame loses the mapping of the child again
+void test_cow() {
+    printf(" Test Copy on Write:\n");
+
+    address_space_t *parent = address_space_create();
+    if (!parent) return;
+    address_space_switch(parent);
+
+    volatile uint64_t *data = (volatile uint64_t *) COW_TEST_VA;
+    address_space_t *child = NULL;
+    uint64_t frame = 0, refs = 0, shared_refs = 0, child_frame = 0;
+
+    bool ok = vmm_map_range(COW_TEST_VA, PAGE_SIZE, PAGE_WRITE);
+    if (ok) {
+        *data = 0x1111;
+        frame = virt_to_phys(COW_TEST_VA);
+        refs = pmm_frame_refs(frame);
+        child = address_space_clone(parent);
+        ok = child != NULL;
+    }
+
+    if (ok) {
+        shared_refs = pmm_frame_refs(frame);
+
+        address_space_switch(child);
+        *data = 0x2222;                     // handle_cow_fault() gives the child a copy
+        child_frame = virt_to_phys(COW_TEST_VA);
+
+        address_space_switch(parent);
+        ok = *data == 0x1111 && virt_to_phys(COW_TEST_VA) == frame && child_frame != frame
+            && shared_refs == refs + 1 && pmm_frame_refs(frame) == refs;
+
+        *data = 0x3333;                     // The last mapping is made writable in place
+        ok = ok && virt_to_phys(COW_TEST_VA) == frame;
+
+        address_space_switch(child);
+        ok = ok && *data == 0x2222;
+    }
+
+    address_space_switch(&kernel_address_space);
+    address_space_destroy(child);
+    address_space_destroy(parent);
+
+    if (ok) {
+        printf(" [-] Copy on Write: The child got frame %x, the parent kept %x with %d mapping\n",
+            child_frame, frame, refs);
+    } else {
+        printf("[Error] Copy on Write: Test failed, frame %x had %d mappings, %d while shared\n",
+            frame, refs, shared_refs);
+    }
+}
@@ -0,0 +1,40 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// PCIDs a core hands out, one per slot. Slot 0 (PCID 0) always belongs to the kernel address space.
+#define PCID_SLOTS 8
+
+#define PCID_GEN_STALE ((uint64_t) -1)  // Slot generation which never matches, the PCID is flushed on use
+
+// A set of page tables. The kernel half and the identity mapped first 4 GB are shared by all.
+typedef struct address_space {
+    uint64_t pml4;                  // Physical address of the PML4
+    volatile uint64_t tlb_gen;      // Bumped whenever lower half mappings are removed or changed
+} address_space_t;
+
+// An address space which owns a PCID on a core, and the generation its TLB entries are from
+typedef struct pcid_slot {
+    address_space_t *as;
+    uint64_t tlb_gen;
+} pcid_slot_t;
+
+extern address_space_t kernel_address_space;
+extern bool pcid_enabled;
+
+void init_address_spaces();
+void init_pcid();
+
+address_space_t *address_space_create();
+address_space_t *address_space_clone(address_space_t *src);
+void address_space_destroy(address_space_t *as);
+void address_space_switch(address_space_t *as);
+void address_space_invalidate(uint64_t cr3);
+
+void flush_tlb_other_pcids(uint64_t start, uint64_t end);
+
+void bench_pcid();
+void test_cow();
@@ -0,0 +1,320 @@
+/*
+Buddy Allocator
+
+Hands out physically contiguous runs of 2^order frames (order 0 to 18, i.e. 4 KB to 1 GB).
+Every usable entry of the Limine memory map becomes a zone with its own free lists, split at
+NUMA node boundaries. A block of order n is always aligned to its own size, so its buddy is
+found by flipping bit n of the frame address and two free buddies merge into one block of
+order n + 1.
+
+The free lists are doubly linked through the free blocks themselves, accessed by HHDM.
+
+https://en.wikipedia.org/wiki/Buddy_memory_allocation
+https://wiki.osdev.org/Page_Frame_Allocation
+*/
+
+#include "../../../limine-8.6.0/limine.h"
+
+#include "../lib/stdio.h"
+#include "../lib/string.h"
+#include "../lib/assert.h"
+
+#include "detect_memory.h"
+#include "kmalloc.h"
+#include "vmm.h"
+#include "memprof.h"
+#include "numa.h"
+
+#include "buddy.h"
+
+
+// Node stored at the start of every free block
+typedef struct pmm_block {
+    uint64_t next;  // Physical address of the next free block of the same order
+    uint64_t prev;  // Physical address of the previous free block of the same order
+} pmm_block_t;
+
+pmm_zone_t pmm_zones[PMM_MAX_ZONES];
+int pmm_zone_count;
+
+// Found from detect_memory.c
+extern size_t mem_entry_count;
+extern struct limine_memmap_entry **mem_entries;
+
+extern volatile uint64_t phys_mem_head;
+
+extern spinlock_t pmm_lock;     // Defined in pmm.c, guards the zones and the frame bitmaps
+
+
+static inline pmm_block_t *block_at(uint64_t addr){
+    return (pmm_block_t *) phys_to_vir(addr);
+}
+
+static inline uint64_t frame_idx(pmm_zone_t *zone, uint64_t addr){
+    return (addr - zone->base) / FRAME_SIZE;
+}
+
+// Put a free block at the head of the free list of the given order
+static void zone_push(pmm_zone_t *zone, uint64_t addr, uint8_t order){
+    pmm_block_t *block = block_at(addr);
+
+    block->prev = PMM_NO_BLOCK;
+    block->next = zone->free_list[order];
+    if(block->next != PMM_NO_BLOCK){
+        block_at(block->next)->prev = addr;
+    }
+    zone->free_list[order] = addr;
+
+    zone->free_order[frame_idx(zone, addr)] = order + 1;
+    zone->free_frames += (1ULL << order);
+}
+
+// Unlink a free block from the free list of the given order
+static void zone_remove(pmm_zone_t *zone, uint64_t addr, uint8_t order){
+    pmm_block_t *block = block_at(addr);
+
+    if(block->prev != PMM_NO_BLOCK){
+        block_at(block->prev)->next = block->next;
+    }else{
+        zone->free_list[order] = block->next;
+    }
+    if(block->next != PMM_NO_BLOCK){
+        block_at(block->next)->prev = block->prev;
+    }
+
+    zone->free_order[frame_idx(zone, addr)] = 0;
+    zone->free_frames -= (1ULL << order);
+}
+
+// Add a frame range to the zone as the largest aligned blocks which fit in it
+static void zone_seed(pmm_zone_t *zone, uint64_t start, uint64_t end){
+    uint64_t addr = start;
+
+    while(addr < end){
+        uint8_t order = PMM_MAX_ORDER;
+        while(order > 0 && ((addr & (PMM_ORDER_SIZE(order) - 1)) || addr + PMM_ORDER_SIZE(order) > end)){
+            order--;
+        }
+        zone_push(zone, addr, order);
+        addr += PMM_ORDER_SIZE(order);
+    }
+}
+
+
+// Smallest order whose block can hold size bytes
+uint8_t pmm_size_to_order(uint64_t size){
+    uint8_t order = 0;
+    while(order < PMM_MAX_ORDER && PMM_ORDER_SIZE(order) < size){
+        order++;
+    }
+    return order;
+}
+
+
+// Find the zone which contains the physical address
+pmm_zone_t *pmm_find_zone(uint64_t addr){
+    for(int i = 0; i < pmm_zone_count; i++){
+        if(addr >= pmm_zones[i].base && addr < pmm_zones[i].end){
+            return &pmm_zones[i];
+        }
+    }
+    return NULL;
+}
+
+
+// Take a block of the given order from the zone, splitting a larger block if needed
+uint64_t pmm_zone_alloc(pmm_zone_t *zone, uint8_t order){
+    if(!zone || order > PMM_MAX_ORDER) return 0;
+
+    uint8_t current = order;
+    while(current <= PMM_MAX_ORDER && zone->free_list[current] == PMM_NO_BLOCK){
+        current++;
+    }
+    if(current > PMM_MAX_ORDER) return 0;   // No block large enough in this zone
+
+    uint64_t addr = zone->free_list[current];
+    zone_remove(zone, addr, current);
+
+    // Give the upper halves back until the block has the requested size
+    while(current > order){
+        current--;
+        zone_push(zone, addr + PMM_ORDER_SIZE(current), current);
+    }
+
+    return addr;
+}
+
+
+// Return a block to the zone and merge it with its free buddies
+void pmm_zone_free(pmm_zone_t *zone, uint64_t addr, uint8_t order){
+    if(!zone || order > PMM_MAX_ORDER) return;
+
+    assert((addr & (PMM_ORDER_SIZE(order) - 1)) == 0); // Blocks are aligned to their size
+
+    while(order < PMM_MAX_ORDER){
+        uint64_t buddy = addr ^ PMM_ORDER_SIZE(order);
+
+        if(buddy < zone->base || buddy + PMM_ORDER_SIZE(order) > zone->end) break;
+        if(zone->free_order[frame_idx(zone, buddy)] != order + 1) break;   // Buddy is used or split
+
+        zone_remove(zone, buddy, order);
+        if(buddy < addr) addr = buddy;
+        order++;
+    }
+
+    zone_push(zone, addr, order);
+}
+
+
+// Allocate 2^order contiguous frames which end below the physical limit, from the zones of
+// node first and then from the other nodes, nearest first
+uint64_t pmm_alloc_pages_node(uint8_t order, uint64_t limit, uint8_t node){
+    uint64_t addr = 0;
+    uint64_t rflags = acquire_irqsave(&pmm_lock);
+
+    for(int n = 0; n < numa_node_count && !addr; n++){
+        uint8_t current = numa_fallback(node, n);
+
+        for(int i = 0; i < pmm_zone_count; i++){
+            // Zones which cross the limit are skipped as a whole
+            if(pmm_zones[i].node != current || pmm_zones[i].end > limit) continue;
+
+            addr = pmm_zone_alloc(&pmm_zones[i], order);
+            if(addr) break;
+        }
+    }
+
+    release_irqrestore(&pmm_lock, rflags);
+    return addr;
+}
+
+
+// Allocate 2^order contiguous frames which end below the physical limit, local to the running core
+uint64_t pmm_alloc_pages_below(uint8_t order, uint64_t limit){
+    return pmm_alloc_pages_node(order, limit, this_numa_node());
+}
+
+
+// Allocate 2^order contiguous frames, aligned to their size. Returns the physical address or 0
+uint64_t pmm_alloc_pages(uint8_t order){
+    return pmm_alloc_pages_below(order, (uint64_t)-1);
+}
+
+
+// Free 2^order contiguous frames which were returned by pmm_alloc_pages
+void pmm_free_pages(uint64_t addr, uint8_t order){
+    pmm_zone_t *zone = pmm_find_zone(addr);
+    if(!zone){
+        printf("[Error] PMM: pmm_free_pages: %x is not inside any zone\n", addr);
+        return;
+    }
+
+    memprof_untag_frames(addr, (uint64_t) FRAME_SIZE << order);
+
+    uint64_t rflags = acquire_irqsave(&pmm_lock);
+    pmm_zone_free(zone, addr, order);
+    release_irqrestore(&pmm_lock, rflags);
+}
+
+
+uint64_t buddy_free_frames(){
+    uint64_t free = 0;
+    for(int i = 0; i < pmm_zone_count; i++){
+        free += pmm_zones[i].free_frames;
+    }
+    return free;
+}
+
+
+// Set up an empty zone for the frame aligned range [base, end)
+static pmm_zone_t *zone_create(uint64_t base, uint64_t end){
+    if(pmm_zone_count >= PMM_MAX_ZONES || end <= base) return NULL;
+
+    pmm_zone_t *zone = &pmm_zones[pmm_zone_count];
+    zone->base = base;
+    zone->end = end;
+    zone->nframes = (end - base) / FRAME_SIZE;
+    zone->free_frames = 0;
+    zone->node = numa_node_of_addr(base);
+    for(int order = 0; order <= PMM_MAX_ORDER; order++){
+        zone->free_list[order] = PMM_NO_BLOCK;
+    }
+
+    zone->free_order = (uint8_t *) kmalloc_a(zone->nframes, 1);
+    if(zone->free_order == NULL){
+        printf("[Error] PMM: Failed to allocate buddy zone metadata\n");
+        return NULL;
+    }
+    memset(zone->free_order, 0, zone->nframes);
+
+    pmm_zone_count++;
+    return zone;
+}
+
+
+// Create a zone for every usable memory map entry and fill the free lists.
+// Memory already given away by kmalloc stays out of the zones.
+void init_buddy(){
+    if(mem_entries == NULL){
+        printf("[Error] PMM: mem_entries is empty!\n");
+        return;
+    }
+
+    pmm_zone_count = 0;
+
+    for(size_t i = 0; i < mem_entry_count; i++){
+        if(mem_entries[i]->type != LIMINE_MEMMAP_USABLE) continue;
+
+        uint64_t base = (mem_entries[i]->base + FRAME_SIZE - 1) & ~(uint64_t)(FRAME_SIZE - 1);
+        uint64_t end = (mem_entries[i]->base + mem_entries[i]->length) & ~(uint64_t)(FRAME_SIZE - 1);
+
+        // An entry which spans several NUMA nodes gets a zone on each of them
+        for(uint64_t split; base < end; base = split){
+            split = numa_split(base, end);
+            zone_create(base, split);
+        }
+    }
+
+    // kmalloc has handed out [USABLE_START_PHYS_MEM, phys_mem_head) including the metadata above
+    uint64_t reserved_start = USABLE_START_PHYS_MEM;
+    uint64_t reserved_end = (phys_mem_head + FRAME_SIZE - 1) & ~(uint64_t)(FRAME_SIZE - 1);
+
+    for(int i = 0; i < pmm_zone_count; i++){
+        pmm_zone_t *zone = &pmm_zones[i];
+
+        if(reserved_end <= zone->base || reserved_start >= zone->end){
+            zone_seed(zone, zone->base, zone->end);
+            continue;
+        }
+        if(reserved_start > zone->base) zone_seed(zone, zone->base, reserved_start);
+        if(reserved_end < zone->end) zone_seed(zone, reserved_end, zone->end);
+    }
+
+    printf(" [-] PMM: Buddy allocator with %d zones and %d free frames\n", pmm_zone_count, buddy_free_frames());
+}
+
+
+void test_buddy(){
+    uint64_t free_before = buddy_free_frames();
+
+    uint64_t a = pmm_alloc_pages(0);
+    uint64_t b = pmm_alloc_pages(3);
+    uint64_t c = pmm_alloc_pages(9);    // 2 MB, enough for a huge page
+
+    printf(" Test Buddy Allocator:\n");
+    printf(" order 0: %x, order 3: %x, order 9: %x\n", a, b, c);
+
+    if(b & (PMM_ORDER_SIZE(3) - 1) || c & (PMM_ORDER_SIZE(9) - 1)){
+        printf("[Error] PMM: Buddy blocks are not aligned to their size!\n");
+    }
+
+    if(a) pmm_free_pages(a, 0);
+    if(b) pmm_free_pages(b, 3);
+    if(c) pmm_free_pages(c, 9);
+
+    if(buddy_free_frames() != free_before){
+        printf("[Error] PMM: Buddy lost frames: before %d, after %d\n", free_before, buddy_free_frames());
+    }else{
+        printf(" [-] PMM: Buddy blocks merged back, %d free frames\n", free_before);
+    }
+}
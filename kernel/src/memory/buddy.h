@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "pmm.h"
+
+#define PMM_MAX_ORDER   18                  // 2^18 frames = 1 GB block
+#define PMM_MAX_ZONES   PMM_MAX_REGIONS     // One zone per usable memory map entry
+
+#define PMM_NO_BLOCK    ((uint64_t)-1)      // End of a free list
+
+// Memory below 4 GB is identity mapped by Limine and reachable by 32 bit DMA
+#define PMM_LOW_4G_LIMIT 0x100000000
+
+#define PMM_ORDER_SIZE(order) ((uint64_t)FRAME_SIZE << (order))
+
+// A zone is one usable physical memory range with its own buddy free lists
+typedef struct pmm_zone {
+    uint64_t base;                          // Physical start address, frame aligned
+    uint64_t end;                           // Physical end address, frame aligned
+    uint64_t nframes;                       // Number of frames in this zone
+    uint8_t node;                           // NUMA node of the memory, see numa.c
+    uint64_t free_frames;                   // Frames sitting in the free lists
+    uint8_t *free_order;                    // Per frame: order + 1 if a free block starts here, else 0
+    uint64_t free_list[PMM_MAX_ORDER + 1];  // Physical address of the first free block of each order
+} pmm_zone_t;
+
+extern pmm_zone_t pmm_zones[PMM_MAX_ZONES];
+extern int pmm_zone_count;
+
+uint8_t pmm_size_to_order(uint64_t size);
+
+uint64_t pmm_alloc_pages(uint8_t order);
+uint64_t pmm_alloc_pages_below(uint8_t order, uint64_t limit);
+uint64_t pmm_alloc_pages_node(uint8_t order, uint64_t limit, uint8_t node);
+void pmm_free_pages(uint64_t addr, uint8_t order);
+
+pmm_zone_t *pmm_find_zone(uint64_t addr);
+uint64_t pmm_zone_alloc(pmm_zone_t *zone, uint8_t order);
+void pmm_zone_free(pmm_zone_t *zone, uint64_t addr, uint8_t order);
+
+uint64_t buddy_free_frames();
+
+void init_buddy();
+
+void test_buddy();
@@ -77,6 +77,10 @@ uint64_t USABLE_START_PHYS_MEM;
 uint64_t USABLE_END_PHYS_MEM;
 uint64_t USABLE_LENGTH_PHYS_MEM;
 
+// Sum of all usable entries and of the bootloader reclaimable entries
+uint64_t TOTAL_USABLE_PHYS_MEMORY;
+uint64_t BOOTLOADER_RECLAIMABLE_PHYS_MEMORY;
+
 // Total Physical Memory space found in the device
 uint64_t TOTAL_PHYS_MEMORY;
 
@@ -155,19 +159,29 @@ void get_phys_mem_map(){
     }
 }
 
-// Set usable memory map to use further
+// Set usable memory map to use further. The largest usable entry feeds kmalloc until the
+// PMM is up, the PMM itself takes every usable entry.
 void set_usable_mem(){
     if(mem_entries == NULL){
         printf("[Error] Memory: mem_entries is empty!\n");
         return;
     }
 
+    TOTAL_USABLE_PHYS_MEMORY = 0;
+    BOOTLOADER_RECLAIMABLE_PHYS_MEMORY = 0;
+
     for(size_t i=0; i<mem_entry_count; i++){
         uint64_t base = mem_entries[i]->base;
         uint64_t length = mem_entries[i]->length;
         uint64_t type = mem_entries[i]->type;
 
+        if(type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE){
+            BOOTLOADER_RECLAIMABLE_PHYS_MEMORY += length;
+        }
+
         if(type == LIMINE_MEMMAP_USABLE ){
+            TOTAL_USABLE_PHYS_MEMORY += length;
+
             if(length > USABLE_LENGTH_PHYS_MEM){
                 USABLE_START_PHYS_MEM = base;
                 USABLE_LENGTH_PHYS_MEM = length;
@@ -183,7 +197,9 @@ void set_usable_mem(){
     USABLE_LENGTH_PHYS_MEM = USABLE_END_PHYS_MEM - USABLE_START_PHYS_MEM;
 
     printf(" [-] Memory: Usable Phys. memory => Start: %x, End: %x, Length: %x\n", 
-        USABLE_START_PHYS_MEM, USABLE_END_PHYS_MEM, USABLE_END_PHYS_MEM);
+        USABLE_START_PHYS_MEM, USABLE_END_PHYS_MEM, USABLE_LENGTH_PHYS_MEM);
+    printf(" [-] Memory: All usable entries: %x, Bootloader reclaimable: %x\n",
+        TOTAL_USABLE_PHYS_MEMORY, BOOTLOADER_RECLAIMABLE_PHYS_MEMORY);
 }
 
 // Getting total physical memory space present at the device
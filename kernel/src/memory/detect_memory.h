@@ -36,6 +36,10 @@ extern uint64_t USABLE_START_PHYS_MEM;
 extern uint64_t USABLE_END_PHYS_MEM;
 extern uint64_t USABLE_LENGTH_PHYS_MEM;
 
+// Sum of all usable entries and of the bootloader reclaimable entries
+extern uint64_t TOTAL_USABLE_PHYS_MEMORY;
+extern uint64_t BOOTLOADER_RECLAIMABLE_PHYS_MEMORY;
+
 // Total Physical Memory address present in the device
 extern uint64_t TOTAL_PHYS_MEMORY;
 
@@ -1,38 +1,106 @@
 
+/*
+Kernel Heap
+
+Hands out page aligned ranges of the kernel heap window. The vmem arena keeps track of the
+address space, the pages are only backed on first touch, see vm_region.c.
+
+Every allocation has an unmapped guard page above it, so two allocations are never adjacent
+and running off the end of one, e.g. a thread stack overflow into the one below, faults
+instead of corrupting the neighbour. In heap debug mode (make HEAP_DEBUG=1) there is a guard
+page below every allocation as well, so either end faults next to the allocation itself. A freed range also stays unmapped in a quarantine for the next
+KHEAP_QUARANTINE frees, so a use after free faults as well. Neither costs a frame.
+
+https://www.kernel.org/doc/html/latest/dev-tools/kfence.html
+*/
 
 #include "../lib/stdio.h"
 #include "../bootloader/boot.h"
 #include "../memory/detect_memory.h"
 #include "vmm.h"
+#include "vmem.h"
+#include "vm_region.h"
 
 #include "kheap.h"
 
 #define PAGE_SIZE 0x1000
 
-static uint64_t h_va_head = HIGHER_HALF_START_ADDR;
+// Address space of the heap, freed ranges are reused and merged by the vmem arena
+static vmem_t kheap_arena;
+static bool kheap_ready;
+static spinlock_t kheap_lock;
+
+#ifdef HEAP_DEBUG
+// Freed ranges including their guard pages, the oldest at kheap_quarantine_head
+static struct {
+    uint64_t va;
+    uint64_t size;
+} kheap_quarantine[KHEAP_QUARANTINE];
+static int kheap_quarantine_head;
+static int kheap_quarantine_count;
+
+// Hold a freed range back and return the address space of the oldest one to the arena
+static void kheap_quarantine_push(uint64_t va, uint64_t size){
+    uint64_t rflags = acquire_irqsave(&kheap_lock);
+
+    if(kheap_quarantine_count < KHEAP_QUARANTINE){
+        int slot = (kheap_quarantine_head + kheap_quarantine_count++) % KHEAP_QUARANTINE;
+        kheap_quarantine[slot].va = va;
+        kheap_quarantine[slot].size = size;
+        va = 0;
+    }else{
+        uint64_t oldest = kheap_quarantine[kheap_quarantine_head].va;
+        uint64_t oldest_size = kheap_quarantine[kheap_quarantine_head].size;
+        kheap_quarantine[kheap_quarantine_head].va = va;
+        kheap_quarantine[kheap_quarantine_head].size = size;
+        kheap_quarantine_head = (kheap_quarantine_head + 1) % KHEAP_QUARANTINE;
+        va = oldest;
+        size = oldest_size;
+    }
+
+    release_irqrestore(&kheap_lock, rflags);
+
+    if(va) vmem_free(&kheap_arena, va, size);
+}
+#endif
+
+
+static bool init_kheap(){
+    uint64_t rflags = acquire_irqsave(&kheap_lock);
+    if(!kheap_ready){
+        kheap_ready = vmem_init(&kheap_arena, "kheap", KHEAP_START, KHEAP_END - KHEAP_START, PAGE_SIZE);
+    }
+    release_irqrestore(&kheap_lock, rflags);
+    return kheap_ready;
+}
 
 
-void *kheap_alloc(size_t size) {
+void *kheap_alloc_tagged(size_t size, uint16_t tag) {
     // Align size to page size (4 KiB)
     size = (size + 0xFFF) & ~0xFFF;
+    if (size == 0) return NULL;
+
+    if (!kheap_ready && !init_kheap()) return NULL;
+
+    uint64_t va = vmem_alloc(&kheap_arena, size + KHEAP_GUARDS);
 
     // Check if we have enough space in the heap
-    if ((h_va_head + size) > HIGHER_HALF_END_ADDR) {
+    if (va == 0) {
         printf("Out of memory\n");
         return NULL; // Out of heap space
     }
+    va += KHEAP_GUARD_BELOW;        // The guard pages are never part of a region, so never mapped
 
-    // Allocate virtual pages for the requested size
-    uint64_t va = h_va_head;
-    
-    while (h_va_head < va + size) {
-        vm_alloc(h_va_head);           // allocating by vm_alloc function
-        h_va_head += PAGE_SIZE;        // Increment by page size (size)
+    // Pages get a zeroed frame on first touch, see vm_region.c
+    if (!vm_region_reserve(va, size, VM_REGION_WRITE)) {
+        vmem_free(&kheap_arena, va - KHEAP_GUARD_BELOW, size + KHEAP_GUARDS);
+        return NULL;
     }
 
-    // Add 4KB padding between allocations to prevent overlapping
-    h_va_head += PAGE_SIZE;
-
+    // The region remembers the tag for the free
+    vm_region_t *region = vm_region_find(va);
+    if (region) region->tag = tag;
+    memprof_alloc(tag, size);
 
     return (void *)va; // Return the start of the allocated region
 }
@@ -49,37 +117,81 @@ void kheap_free(void *ptr, size_t size) {
 
     uint64_t va = (uint64_t)ptr;    // Get the virtual address of the pointer
 
-    // Free the pages corresponding to the memory region
-    while (size > 0) {              // If size greater than zero
-        vm_free((uint64_t *)va);    // Free the virtual page
-        va += PAGE_SIZE;            // Increase Virtual Address by 4KB
-        size -= PAGE_SIZE;          // Decrease the size variable by 4KB
+    if (!is_kheap_addr(va)) {
+        printf("[Error] kheap_free: %x is not a kernel heap address\n", va);
+        return;
     }
+
+    vm_region_t *region = vm_region_find(va);
+    if (region) memprof_free(region->tag, size);
+
+    // Free the frames of the touched pages
+    vm_region_release(va);
+
+#ifdef HEAP_DEBUG
+    // The addresses stay unmapped for a while, so a use after free faults
+    kheap_quarantine_push(va - KHEAP_GUARD_BELOW, size + KHEAP_GUARDS);
+#else
+    // The address space can be handed out again
+    vmem_free(&kheap_arena, va, size + KHEAP_GUARDS);
+#endif
 }
 
-void test_kheap(){
 
-    // First Creating a virtual pointer and assigning a value to it
-    uint64_t *vir_ptr = kheap_alloc(0x8000);    // Allocate 32 KB
-    *vir_ptr = 0xDEADBEF;                       // Assign a value to the allocated memory
-    printf("Allocated memory at: %x, Value: %x\n",(uint64_t) vir_ptr, *vir_ptr); // Allocated memory at: 0xFFFF800000001000, Value: 0xDEABEEF
+// Address space of the heap window without a region behind it, for callers which map the
+// pages themselves, e.g. the paging tests. No allocation can be placed on top of it.
+uint64_t kheap_reserve_va(size_t size){
+    size = (size + 0xFFF) & ~0xFFF;
+    if (size == 0) return 0;
+
+    if (!kheap_ready && !init_kheap()) return 0;
+
+    return vmem_alloc(&kheap_arena, size);
+}
+
+
+void kheap_release_va(uint64_t va, size_t size){
+    size = (size + 0xFFF) & ~0xFFF;
+    if (va == 0 || size == 0) return;
+
+    vmem_free(&kheap_arena, va, size);
+}
 
-    // Converting the virtual pointer to a physical pointer and assigning a value to it
-    uint16_t *phy_ptr = (uint16_t *) vir_to_phys((uint64_t)vir_ptr);   // Converting Virtual to physical pointer
-    *phy_ptr = 0xBEEF;                                                 // Assign a value at the physical pointer
-    printf("Allocated memory at: %x, Value: %x\n", (uint64_t)phy_ptr, *phy_ptr);  // Allocated memory at: 0x1000, Value: 0xBEEF
-    
-    // Convert the physical pointer back to a virtual pointer and print the value
-    void *vir_ptr_1 = (void *) phys_to_vir((uint64_t)phy_ptr);          // Convert to virtual address again
-    printf("Converted to virtual address: %x\n", (uint64_t) vir_ptr_1); // Converted to virtual address: 0xFFFF800000001000
 
-    // Free the allocated memory
-    // kheap_free((void *)vir_ptr, 0x8000); // Page fault! ( not present ) at address 0x200210A78
-    kheap_free(vir_ptr_1, 0x8000);       // Page fault! ( not present ) at address 0x200210A78
+bool is_kheap_addr(uint64_t addr){
+    return addr >= KHEAP_START && addr < KHEAP_END;
+}
+
+
+// Called by the page fault handler for a fault on a kernel heap address which no region covers
+void kheap_report_fault(uint64_t addr){
+    uint64_t page = addr & ~(uint64_t)(PAGE_SIZE - 1);
 
+    if (vm_region_find(page + PAGE_SIZE)) {
+        printf("[Error] kheap: Guard page below the allocation at %x hit at %x, e.g. a stack overflow\n", page + PAGE_SIZE, addr);
+    } else if (vm_region_find(page - PAGE_SIZE)) {
+        printf("[Error] kheap: Guard page behind an allocation hit at %x, a buffer overflow\n", addr);
+    } else {
+        printf("[Error] kheap: %x is not allocated, e.g. a use after kheap_free\n", addr);
+    }
 }
 
 
+void test_kheap(){
+
+    // First Creating a virtual pointer and assigning a value to it
+    uint64_t *vir_ptr = kheap_alloc(0x8000);    // Allocate 32 KB
+    *vir_ptr = 0xDEADBEF;                       // Assign a value to the allocated memory
+    printf("Allocated memory at: %x, Value: %x\n",(uint64_t) vir_ptr, *vir_ptr); // Allocated memory at: 0xFFFFC00000000000, Value: 0xDEADBEF
 
+    uint64_t *vir_ptr_1 = kheap_alloc(0x2000);  // Allocate 8 KB behind it
+    kheap_free(vir_ptr, 0x8000);                // Free the first region
 
+    // The freed address space is reused for the next allocation which fits into it
+    uint64_t *vir_ptr_2 = kheap_alloc(0x4000);
+    printf("Reused memory at: %x, %s\n", (uint64_t) vir_ptr_2, (vir_ptr_2 == vir_ptr) ? "recycled" : "not recycled");
 
+    kheap_free(vir_ptr_2, 0x4000);
+    kheap_free(vir_ptr_1, 0x2000);
+    print_vmem_stats(&kheap_arena);
+}
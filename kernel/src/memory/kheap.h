@@ -4,6 +4,31 @@
 #include <stdbool.h>
 #include <stddef.h>
 
-void *kheap_alloc(size_t size);
+#include "memprof.h"
+
+// The kernel heap has its own part of the higher half. It must not overlap the HHDM at
+// 0xFFFF800000000000, which maps all physical memory, nor the kernel image at the top.
+#define KHEAP_START 0xFFFFC00000000000
+#define KHEAP_END   0xFFFFE00000000000      // 32 TB of address space
+
+// Every allocation has an unmapped page above it, so neighbours never touch. Heap debug
+// mode, built by make HEAP_DEBUG=1, adds one below it as well.
+#define KHEAP_GUARD_ABOVE   0x1000
+#ifdef HEAP_DEBUG
+#define KHEAP_GUARD_BELOW   0x1000
+#define KHEAP_QUARANTINE    64          // Freed ranges whose addresses are not handed out again yet
+#else
+#define KHEAP_GUARD_BELOW   0
+#endif
+#define KHEAP_GUARDS        (KHEAP_GUARD_BELOW + KHEAP_GUARD_ABOVE)
+
+void *kheap_alloc_tagged(size_t size, uint16_t tag);
 void kheap_free(void *ptr, size_t size);
+uint64_t kheap_reserve_va(size_t size);
+void kheap_release_va(uint64_t va, size_t size);
+bool is_kheap_addr(uint64_t addr);
+void kheap_report_fault(uint64_t addr);
 void test_kheap();
+
+// Charged to the calling function, see memprof.c
+#define kheap_alloc(size) kheap_alloc_tagged(size, MEMPROF_SITE(MEMPROF_KHEAP))
@@ -1,25 +1,438 @@
 /*
 This file will manage static memory allocation
+
+Before the PMM is up, kmalloc is a placement allocator which only moves phys_mem_head forward.
+Afterwards kmalloc/kfree are a general purpose allocator: requests up to KMALLOC_MAX_SMALL
+bytes are rounded up to one of the size classes below and taken from a slab cache of that
+class, larger requests get whole pages from the kernel heap. Every core keeps a short stack
+of free objects per class, so most kmalloc/kfree pairs take no lock.
+
+In heap debug mode (make HEAP_DEBUG=1) one small allocation in KMALLOC_SAMPLE of every core
+is a guarded object, as in KFENCE: it comes from a separate set of slab caches and sits
+between two canary redzones which kfree() checks. A freed guarded object is poisoned over its
+whole size and held back in a quarantine of its core for a while; a write into it meanwhile
+is reported when it leaves the quarantine. The other objects take the normal path, so the
+checks cost little, and over a long run every allocation site gets guarded objects. Large
+requests get guard pages and a quarantine from the kernel heap, see kheap.c.
+
+https://www.kernel.org/doc/gorman/html/understand/understand011.html
+https://www.usenix.org/legacy/event/usenix01/full_papers/bonwick/bonwick.pdf
 */
 
 #include "../lib/stdio.h"
+#include "../lib/string.h"
+#include "../sys/cpu/cpu.h"
+#include "../sys/timer/tsc.h"
 #include "detect_memory.h"
+#include "pmm.h"
+#include "buddy.h"
+#include "slab.h"
+#include "kheap.h"
 
 #include "kmalloc.h"
 
-#define FRAME_SIZE 4096
-
 extern volatile uint64_t phys_mem_head;
 
+// Size classes: steps of 16 bytes up to 128, then four classes per power of two
+static const uint16_t kmalloc_sizes[KMALLOC_NR_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048
+};
+
+static kmem_cache_t *kmalloc_caches[KMALLOC_NR_CLASSES];
+#ifdef HEAP_DEBUG
+static kmem_cache_t *kmalloc_guarded_caches[KMALLOC_NR_CLASSES];   // Objects with redzones
+#endif
+static uint8_t kmalloc_size_index[KMALLOC_MAX_SMALL / KMALLOC_MIN_ALIGN + 1];   // (size + 15) / 16 -> class
+static bool kmalloc_ready;
+static spinlock_t kmalloc_init_lock;
+
+// Free objects kept by one core, one stack per size class
+typedef struct kmalloc_cpu_cache {
+    void *objs[KMALLOC_NR_CLASSES][KMALLOC_CPU_CACHE_SIZE];
+    uint8_t count[KMALLOC_NR_CLASSES];
+#ifdef HEAP_DEBUG
+    uint32_t sample;                        // Small allocations since the last guarded one, next to count
+#endif
+    uint64_t slab_locks;                    // Refills and drains, each takes a slab lock once
+#ifdef HEAP_DEBUG
+    void *quarantine[KMALLOC_QUARANTINE];   // Freed guarded objects, the oldest at quarantine_head
+    uint8_t quarantine_head;
+    uint8_t quarantine_count;
+#endif
+} kmalloc_cpu_cache_t;
+
+// A page for each core, taken from the PMM when the core first calls kmalloc
+static kmalloc_cpu_cache_t *kmalloc_cpu_caches[MAX_CPUS];
+
+// Allocations larger than KMALLOC_MAX_SMALL, hashed by their address to remember the size
+typedef struct kmalloc_large {
+    uint64_t va;
+    size_t size;
+    struct kmalloc_large *next;
+} kmalloc_large_t;
+
+static kmalloc_large_t *kmalloc_large_table[KMALLOC_LARGE_BUCKETS];
+static kmem_cache_t *kmalloc_large_cache;
+static spinlock_t kmalloc_large_lock;
+
+#ifdef HEAP_DEBUG
+#define KMALLOC_LIVE_MAGIC  0x4B4D4C56  // "KMLV"
+#define KMALLOC_FREED_MAGIC 0x4B4D4652  // "KMFR"
+#define KMALLOC_CANARY      0xA5A5A5A5A5A5A5A5ULL
+#define KMALLOC_POISON      0x6B6B6B6B6B6B6B6BULL
+
+// In front of every guarded object, its canary is the redzone
+typedef struct kmalloc_redzone {
+    uint32_t size;                          // Bytes asked for, the rear redzone follows them
+    uint32_t magic;
+    uint64_t canary;
+} kmalloc_redzone_t;
+
+// The rear redzone starts right behind the bytes asked for, at any alignment
+typedef struct kmalloc_unaligned {
+    uint64_t words[KMALLOC_REDZONE / 8];
+} __attribute__((packed)) kmalloc_unaligned_t;
+
+static uint64_t kmalloc_corruptions;        // Overwritten redzones, double frees, writes after kfree
+#endif
+
+
+// Once the PMM is initialized the placement allocator stops and every request is taken from
+// the buddy allocator instead. Blocks are aligned to their own size, so a block of at least
+// max(sz, alignment) bytes also satisfies the alignment. Callers use the returned physical
+// address as a pointer, so it has to come from the identity mapped first 4 GB. The memory
+// can be given back with pmm_free_pages().
+static uint64_t kmalloc_from_pmm(uint64_t sz, uint64_t alignment){
+    uint64_t size = (sz > alignment) ? sz : alignment;
+    return pmm_alloc_pages_below(pmm_size_to_order(size), PMM_LOW_4G_LIMIT);
+}
+
+
+static inline int kmalloc_class(size_t size){
+    return kmalloc_size_index[(size + KMALLOC_MIN_ALIGN - 1) / KMALLOC_MIN_ALIGN];
+}
+
+
+#ifdef HEAP_DEBUG
+// Words poisoned in a freed object: all of it, the last one may reach into the rear redzone,
+// which is checked already by then
+static inline uint32_t poison_words(uint32_t size){
+    return (size + 7) / 8;
+}
+
+// Put the redzones around the object of a slab object, returns the object
+static void *redzone_arm(void *slab_obj, size_t sz){
+    if(!slab_obj) return NULL;
+
+    kmalloc_redzone_t *head = (kmalloc_redzone_t *) slab_obj;
+    uint8_t *obj = (uint8_t *) slab_obj + KMALLOC_REDZONE;
+    kmalloc_unaligned_t *rear = (kmalloc_unaligned_t *)(obj + sz);
+
+    head->size = sz;
+    head->magic = KMALLOC_LIVE_MAGIC;
+    head->canary = KMALLOC_CANARY;
+    rear->words[0] = KMALLOC_CANARY;
+    rear->words[1] = KMALLOC_CANARY;
+    return obj;
+}
+
+// Check the redzones of an object which is freed and poison it. Returns its slab object, or
+// NULL if the object must not be freed because its header is gone or it was freed already.
+static void *redzone_check(void *ptr){
+    kmalloc_redzone_t *head = (kmalloc_redzone_t *)((uint8_t *) ptr - KMALLOC_REDZONE);
+    kmalloc_unaligned_t *rear = (kmalloc_unaligned_t *)((uint8_t *) ptr + head->size);
+
+    if(head->magic == KMALLOC_FREED_MAGIC){
+        printf("[Error] kfree: %x is freed twice\n", (uint64_t) ptr);
+        kmalloc_corruptions++;
+        return NULL;
+    }
+    if(head->magic != KMALLOC_LIVE_MAGIC || head->canary != KMALLOC_CANARY){
+        printf("[Error] kfree: The redzone in front of %x is overwritten\n", (uint64_t) ptr);
+        kmalloc_corruptions++;
+        return NULL;                    // Leaked, the size can not be trusted
+    }
+    if(rear->words[0] != KMALLOC_CANARY || rear->words[1] != KMALLOC_CANARY){
+        printf("[Error] kfree: The redzone behind %x (%d bytes) is overwritten\n", (uint64_t) ptr, head->size);
+        kmalloc_corruptions++;
+    }
+
+    head->magic = KMALLOC_FREED_MAGIC;
+    uint64_t *words = (uint64_t *) ptr;
+    for(uint32_t i = 0; i < poison_words(head->size); i++) words[i] = KMALLOC_POISON;
+    return head;
+}
+
+// Queue a freed slab object, returns the oldest one once the quarantine is full, else NULL.
+// Must be called with interrupts disabled.
+static void *quarantine_swap(kmalloc_cpu_cache_t *cpu_cache, void *slab_obj){
+    if(cpu_cache->quarantine_count < KMALLOC_QUARANTINE){
+        cpu_cache->quarantine[(cpu_cache->quarantine_head + cpu_cache->quarantine_count) & (KMALLOC_QUARANTINE - 1)] = slab_obj;
+        cpu_cache->quarantine_count++;
+        return NULL;
+    }
+
+    kmalloc_redzone_t *oldest = cpu_cache->quarantine[cpu_cache->quarantine_head];
+    cpu_cache->quarantine[cpu_cache->quarantine_head] = slab_obj;
+    cpu_cache->quarantine_head = (cpu_cache->quarantine_head + 1) & (KMALLOC_QUARANTINE - 1);
+
+    // Word by word, the first word which lost its poison is reported
+    uint64_t *words = (uint64_t *)((uint8_t *) oldest + KMALLOC_REDZONE);
+    for(uint32_t i = 0; i < poison_words(oldest->size); i++){
+        if(words[i] != KMALLOC_POISON){
+            printf("[Error] kmalloc: %x was written after kfree at offset %d\n", (uint64_t) words, i * 8);
+            kmalloc_corruptions++;
+            break;
+        }
+    }
+    return oldest;
+}
+#endif
+
+
+// Create the size class caches and the size lookup table once the PMM is up
+static bool init_kmalloc(){
+    uint64_t rflags = acquire_irqsave(&kmalloc_init_lock);
+
+    if(!kmalloc_ready){
+        bool ok = true;
+
+        for(int i = 0; i < KMALLOC_NR_CLASSES && ok; i++){
+            if(kmalloc_caches[i]) continue;
+
+            char name[KMEM_CACHE_NAME_LEN], size[8];
+            strcpy(name, "kmalloc-");
+            int_to_ascii(kmalloc_sizes[i], size);
+            strcat(name, size);
+
+            kmalloc_caches[i] = kmem_cache_create_order(name, kmalloc_sizes[i], KMALLOC_MIN_ALIGN, KMALLOC_SLAB_ORDER);
+            ok = (kmalloc_caches[i] != NULL);
+        }
+
+#ifdef HEAP_DEBUG
+        for(int i = 0; i < KMALLOC_NR_CLASSES && ok; i++){
+            if(kmalloc_guarded_caches[i]) continue;
+
+            char name[KMEM_CACHE_NAME_LEN], size[8];
+            strcpy(name, "kmalloc-guarded-");
+            int_to_ascii(kmalloc_sizes[i], size);
+            strcat(name, size);
+
+            kmalloc_guarded_caches[i] = kmem_cache_create_order(name, kmalloc_sizes[i], KMALLOC_MIN_ALIGN, KMALLOC_SLAB_ORDER);
+            ok = (kmalloc_guarded_caches[i] != NULL);
+        }
+#endif
+
+        if(ok && !kmalloc_large_cache){
+            kmalloc_large_cache = kmem_cache_create("kmalloc_large", sizeof(kmalloc_large_t), 0);
+            ok = (kmalloc_large_cache != NULL);
+        }
+
+        if(ok){
+            int class = 0;
+            for(size_t i = 0; i <= KMALLOC_MAX_SMALL / KMALLOC_MIN_ALIGN; i++){
+                while(i * KMALLOC_MIN_ALIGN > kmalloc_sizes[class]) class++;
+                kmalloc_size_index[i] = class;
+            }
+            kmalloc_ready = true;
+        }else{
+            printf("[Error] kmalloc: Failed to create the size class caches\n");
+        }
+    }
+
+    release_irqrestore(&kmalloc_init_lock, rflags);
+    return kmalloc_ready;
+}
+
+
+// The object stacks of the running core, or NULL if they could not be allocated.
+// Must be called with interrupts disabled.
+static kmalloc_cpu_cache_t *this_cpu_kmalloc_cache(){
+    uint32_t cpu = this_cpu_id() % MAX_CPUS;
+
+    if(kmalloc_cpu_caches[cpu] == NULL){
+        uint64_t page = pmm_alloc_pages_below(0, PMM_LOW_4G_LIMIT);
+        if(!page) return NULL;
+        memset((void *) page, 0, sizeof(kmalloc_cpu_cache_t));
+        kmalloc_cpu_caches[cpu] = (kmalloc_cpu_cache_t *) page;
+    }
+    return kmalloc_cpu_caches[cpu];
+}
+
+
+#ifdef HEAP_DEBUG
+// A guarded object between redzones, from the guarded caches
+static void *kmalloc_guarded(size_t sz){
+    return redzone_arm(kmem_cache_alloc(kmalloc_guarded_caches[kmalloc_class(sz + 2 * KMALLOC_REDZONE)]), sz);
+}
+
+// The redzones are checked and the poisoned object waits in the quarantine of this core,
+// the oldest object there goes back to its slab in its place
+static void kfree_guarded(void *ptr){
+    kmalloc_redzone_t *head = redzone_check(ptr);
+    if(!head) return;
+
+    uint64_t rflags = irq_save();
+    kmalloc_cpu_cache_t *cpu_cache = this_cpu_kmalloc_cache();
+    if(cpu_cache) head = quarantine_swap(cpu_cache, head);
+    irq_restore(rflags);
+
+    if(head) kmem_cache_free(kmalloc_guarded_caches[kmalloc_class(head->size + 2 * KMALLOC_REDZONE)], head);
+}
+#endif
+
+
+static void *kmalloc_small(size_t sz){
+    int class = kmalloc_class(sz);
+    uint64_t rflags = irq_save();
+    kmalloc_cpu_cache_t *cpu_cache = this_cpu_kmalloc_cache();
+    void *obj = NULL;
 
-// Low level memory allocation by usin base as phys_mem_head
-uint64_t kmalloc(uint64_t sz)       // vanilla (normal).
+    if(cpu_cache){
+#ifdef HEAP_DEBUG
+        // Every KMALLOC_SAMPLE-th small allocation of the core which fits its redzones
+        if(++cpu_cache->sample >= KMALLOC_SAMPLE && sz + 2 * KMALLOC_REDZONE <= KMALLOC_MAX_SMALL){
+            cpu_cache->sample = 0;
+            irq_restore(rflags);
+            return kmalloc_guarded(sz);
+        }
+#endif
+        // Refill an empty stack with a batch from the slab cache, under one slab lock. A stack
+        // which still holds objects hands them out without the slab lock.
+        if(cpu_cache->count[class] == 0){
+            cpu_cache->count[class] = kmem_cache_alloc_bulk(kmalloc_caches[class], cpu_cache->objs[class], KMALLOC_CPU_CACHE_BATCH);
+            cpu_cache->slab_locks++;
+        }
+        if(cpu_cache->count[class] > 0) obj = cpu_cache->objs[class][--cpu_cache->count[class]];
+    }else{
+        obj = kmem_cache_alloc(kmalloc_caches[class]);
+    }
+
+    irq_restore(rflags);
+    return obj;
+}
+
+
+static void kfree_small(kmem_cache_t *cache, int class, void *obj){
+    uint64_t rflags = irq_save();
+    kmalloc_cpu_cache_t *cpu_cache = this_cpu_kmalloc_cache();
+
+    if(cpu_cache){
+        // A full stack gives its oldest objects back to the slab cache
+        if(cpu_cache->count[class] == KMALLOC_CPU_CACHE_SIZE){
+            kmem_cache_free_bulk(cache, cpu_cache->objs[class], KMALLOC_CPU_CACHE_BATCH);
+            cpu_cache->slab_locks++;
+            for(int i = KMALLOC_CPU_CACHE_BATCH; i < KMALLOC_CPU_CACHE_SIZE; i++){
+                cpu_cache->objs[class][i - KMALLOC_CPU_CACHE_BATCH] = cpu_cache->objs[class][i];
+            }
+            cpu_cache->count[class] -= KMALLOC_CPU_CACHE_BATCH;
+        }
+        cpu_cache->objs[class][cpu_cache->count[class]++] = obj;
+    }else{
+        kmem_cache_free(cache, obj);
+    }
+
+    irq_restore(rflags);
+}
+
+
+static inline uint64_t kmalloc_large_hash(uint64_t va){
+    return (va >> 12) % KMALLOC_LARGE_BUCKETS;
+}
+
+static void *kmalloc_large(size_t size){
+    kmalloc_large_t *record = kmem_cache_alloc(kmalloc_large_cache);
+    if(!record) return NULL;
+
+    void *ptr = kheap_alloc(size);
+    if(!ptr){
+        kmem_cache_free(kmalloc_large_cache, record);
+        return NULL;
+    }
+
+    record->va = (uint64_t) ptr;
+    record->size = size;
+
+    uint64_t rflags = acquire_irqsave(&kmalloc_large_lock);
+    record->next = kmalloc_large_table[kmalloc_large_hash(record->va)];
+    kmalloc_large_table[kmalloc_large_hash(record->va)] = record;
+    release_irqrestore(&kmalloc_large_lock, rflags);
+
+    return ptr;
+}
+
+static void kfree_large(void *ptr){
+    kmalloc_large_t *record = NULL;
+
+    uint64_t rflags = acquire_irqsave(&kmalloc_large_lock);
+    for(kmalloc_large_t **link = &kmalloc_large_table[kmalloc_large_hash((uint64_t) ptr)]; *link; link = &(*link)->next){
+        if((*link)->va == (uint64_t) ptr){
+            record = *link;
+            *link = record->next;
+            break;
+        }
+    }
+    release_irqrestore(&kmalloc_large_lock, rflags);
+
+    if(!record){
+        printf("[Error] kfree: %x was not returned by kmalloc\n", (uint64_t) ptr);
+        return;
+    }
+
+    kheap_free(ptr, record->size);
+    kmem_cache_free(kmalloc_large_cache, record);
+}
+
+
+// Low level memory allocation by usin base as phys_mem_head until the PMM is initialized,
+// afterwards from the size class caches. The memory is 16 byte aligned and freed by kfree().
+void *kmalloc(size_t sz)       // vanilla (normal).
 {
-    if(phys_mem_head >= USABLE_END_PHYS_MEM) return 0;
+    if(is_pmm_initialized()){
+        if(sz == 0 || (!kmalloc_ready && !init_kmalloc())) return NULL;
+        if(sz > KMALLOC_MAX_SMALL) return kmalloc_large(sz);
+        return kmalloc_small(sz);
+    }
+
+    if(phys_mem_head >= USABLE_END_PHYS_MEM) return NULL;
     uint64_t ptr = (uint64_t) phys_mem_head;    // memory allocate in current placement address
     phys_mem_head += sz;                        // increase the placement address for next memory allocation
 
-    return ptr;
+    return (void *) ptr;
+}
+
+
+// Free memory from kmalloc. Placement memory from before the PMM was initialized is never freed.
+void kfree(void *ptr){
+    if(ptr == NULL) return;
+
+    if(is_kheap_addr((uint64_t) ptr)){
+        kfree_large(ptr);
+        return;
+    }
+
+    // Small objects live in slabs of 2^KMALLOC_SLAB_ORDER frames aligned to their size
+    if(kmalloc_ready && (uint64_t) ptr < PMM_LOW_4G_LIMIT){
+        kmem_slab_t *slab = (kmem_slab_t *)((uint64_t) ptr & ~(((uint64_t) FRAME_SIZE << KMALLOC_SLAB_ORDER) - 1));
+        for(int class = 0; class < KMALLOC_NR_CLASSES; class++){
+            if(slab->cache == kmalloc_caches[class]){
+                kfree_small(kmalloc_caches[class], class, ptr);
+                return;
+            }
+        }
+#ifdef HEAP_DEBUG
+        for(int class = 0; class < KMALLOC_NR_CLASSES; class++){
+            if(slab->cache == kmalloc_guarded_caches[class]){
+                kfree_guarded(ptr);
+                return;
+            }
+        }
+#endif
+    }
+
+    printf("[Error] kfree: %x was not returned by kmalloc\n", (uint64_t) ptr);
 }
 
 /*
@@ -27,12 +440,19 @@ uint64_t kmalloc(uint64_t sz)       // vanilla (normal).
     multiples of the page size (typically 4 KB for 64-bit systems).
 */
 
-uint64_t kmalloc_a(uint64_t sz, int align)    // page aligned.
+uint64_t kmalloc_a_tagged(uint64_t sz, int align, uint16_t tag)    // page aligned.
 {
     /*
     page directory and page table addresses need to be page-aligned: that is, the bottom 12 
     bits need to be zero (otherwise they would interfere with the read/write/protection/accessed bits).
     */
+    if(is_pmm_initialized()){
+        uint64_t alignment = (align == 1) ? FRAME_SIZE : 1;
+        uint64_t ptr = kmalloc_from_pmm(sz, alignment);
+        if(ptr) memprof_tag_frames(ptr, (uint64_t) FRAME_SIZE << pmm_size_to_order((sz > alignment) ? sz : alignment), tag);
+        return ptr;
+    }
+
     if (phys_mem_head >= USABLE_END_PHYS_MEM) return 0; // Check if the memory allocation exceeds the usable memory range
 
     if(phys_mem_head >= USABLE_END_PHYS_MEM) {
@@ -50,6 +470,7 @@ uint64_t kmalloc_a(uint64_t sz, int align)    // page aligned.
     uint64_t ptr = phys_mem_head;
     phys_mem_head += sz;
 
+    memprof_alloc(tag, sz);     // Placement memory is never freed
     return ptr;
 }
 
@@ -74,6 +495,12 @@ and also ensure page boundary alignment
 */
 uint64_t kmalloc_ap(uint64_t sz, int align, uint64_t *phys)  // page aligned and returns a physical address.
 {
+    if(is_pmm_initialized()){
+        uint64_t ptr = kmalloc_from_pmm(sz, (align == 1) ? FRAME_SIZE : 1);
+        if (phys) *phys = ptr;
+        return ptr;
+    }
+
     if (align == 1 && (phys_mem_head & 0xFFF)) // If the address is not already page-aligned and want to make it page aligned
     {
         // Align it.
@@ -118,6 +545,8 @@ bool check_mem_alloc(void *ptr, uint64_t size){
 }
 
 uint64_t kmalloc_aligned(uint64_t sz, uint64_t alignment) {
+    if(is_pmm_initialized()) return kmalloc_from_pmm(sz, alignment);
+
     if (phys_mem_head >= USABLE_END_PHYS_MEM){
          return 0;
     }
@@ -136,8 +565,8 @@ uint64_t kmalloc_aligned(uint64_t sz, uint64_t alignment) {
 void test_kmalloc(){
     printf("Test of kmalloc\n");
 
-    uint64_t ptr1 = kmalloc(64);
-    printf("ptr1 : %x\n", ptr1);
+    void *ptr1 = kmalloc(64);
+    printf("ptr1 : %x\n", (uint64_t) ptr1);
 
     uint64_t ptr2 = kmalloc_a(43, 1);
     printf("ptr2 : %x\n", ptr2);
@@ -145,7 +574,85 @@ void test_kmalloc(){
     uint64_t ptr3 = kmalloc_p(26,&ptr2);
     printf("ptr3 : %x\n", (uint64_t)ptr3);
 
-    uint64_t ptr4 = kmalloc_ap(23, 1, &ptr1);
+    uint64_t phys;
+    uint64_t ptr4 = kmalloc_ap(23, 1, &phys);
     printf("ptr4 : %x\n", ptr4);
+
+    if(!is_pmm_initialized()) return;
+
+    // A freed object is handed out again by the same core, large requests come from the heap
+    void *small = kmalloc(100);
+    kfree(small);
+    void *again = kmalloc(112);
+    void *large = kmalloc(10000);
+    printf("small : %x, reused : %s, large : %x\n", (uint64_t) small, (again == small) ? "yes" : "no", (uint64_t) large);
+    kfree(again);
+    kfree(large);
 }
 
+
+#define TEST_CPU_CACHE_ALLOCS   1024
+#define TEST_CPU_CACHE_WINDOW   64      // Objects alive at once, more than a core keeps
+
+// A stream of small allocations and frees on one core goes to the slab cache in batches:
+// every refill and every drain moves KMALLOC_CPU_CACHE_BATCH objects under one slab lock
+void test_kmalloc_cpu_cache(){
+    static void *objs[TEST_CPU_CACHE_WINDOW];
+    if(!is_pmm_initialized()) return;
+
+    size_t size = 512;
+    void *warm = kmalloc(size);     // Creates the caches of this core outside of the count
+    kfree(warm);
+
+    uint64_t rflags = irq_save();
+    kmalloc_cpu_cache_t *cpu_cache = this_cpu_kmalloc_cache();
+    irq_restore(rflags);
+    if(!cpu_cache) return;
+
+    uint64_t before = cpu_cache->slab_locks;
+    for(int i = 0; i < TEST_CPU_CACHE_ALLOCS / TEST_CPU_CACHE_WINDOW; i++){
+        for(int j = 0; j < TEST_CPU_CACHE_WINDOW; j++) objs[j] = kmalloc(size);
+        for(int j = 0; j < TEST_CPU_CACHE_WINDOW; j++) kfree(objs[j]);
+    }
+    uint64_t locked = cpu_cache->slab_locks - before;
+
+    // One refill per batch of allocations and one drain per batch of frees at most
+    if(locked > 2 * TEST_CPU_CACHE_ALLOCS / KMALLOC_CPU_CACHE_BATCH + 1){
+        printf("[Error] kmalloc: %d slab lock acquisitions for %d allocations\n", locked, TEST_CPU_CACHE_ALLOCS);
+    }else{
+        printf(" [-] kmalloc: %d slab lock acquisitions for %d allocations\n", locked, TEST_CPU_CACHE_ALLOCS);
+    }
+}
+
+
+#define BENCH_ROUNDS 4096
+
+// Cycles per allocation and free pair, to compare builds with and without HEAP_DEBUG
+void bench_kmalloc(){
+    if(!is_pmm_initialized()) return;
+
+    void *warm = kmalloc(64);       // Creates the caches of this core outside of the timing
+    kfree(warm);
+
+    uint64_t start = read_tsc();
+    for(int i = 0; i < BENCH_ROUNDS; i++){
+        void *obj = kmalloc(64);
+        *(volatile uint64_t *) obj = i;
+        kfree(obj);
+    }
+    uint64_t small = (read_tsc() - start) / BENCH_ROUNDS;
+
+    start = read_tsc();
+    for(int i = 0; i < BENCH_ROUNDS / 16; i++){
+        void *stack = kheap_alloc(0x4000);
+        kheap_free(stack, 0x4000);
+    }
+    uint64_t large = (read_tsc() - start) / (BENCH_ROUNDS / 16);
+
+#ifdef HEAP_DEBUG
+    printf(" [-] kmalloc: %d cycles per 64 byte kmalloc/kfree, %d cycles per 16 KB kheap_alloc/kheap_free (heap debug, %d corruptions)\n",
+        small, large, kmalloc_corruptions);
+#else
+    printf(" [-] kmalloc: %d cycles per 64 byte kmalloc/kfree, %d cycles per 16 KB kheap_alloc/kheap_free\n", small, large);
+#endif
+}
@@ -4,15 +4,36 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#include "memprof.h"
 
+#define KMALLOC_NR_CLASSES      24
+#define KMALLOC_MIN_ALIGN       16
+#define KMALLOC_MAX_SMALL       2048    // Larger requests are served by the kernel heap
+#define KMALLOC_SLAB_ORDER      3       // 32 KB slabs, so kfree finds the slab by masking
+#define KMALLOC_CPU_CACHE_SIZE  16      // Free objects kept per core and size class
+#define KMALLOC_CPU_CACHE_BATCH 8       // Objects moved between a core and its slab cache at once
+#define KMALLOC_LARGE_BUCKETS   64
 
-uint64_t kmalloc(uint64_t sz); // vanilla (normal).
-uint64_t kmalloc_a(uint64_t sz, int align);  // page aligned.
+// Heap debug mode, built by make HEAP_DEBUG=1
+#ifdef HEAP_DEBUG
+#define KMALLOC_SAMPLE          128     // One small allocation in KMALLOC_SAMPLE of a core is guarded
+#define KMALLOC_REDZONE         16      // Canary bytes in front of and behind every guarded object
+#define KMALLOC_QUARANTINE      32      // Freed guarded objects every core holds back, a power of two
+#endif
+
+void *kmalloc(size_t sz); // vanilla (normal).
+void kfree(void *ptr);
+uint64_t kmalloc_a_tagged(uint64_t sz, int align, uint16_t tag);  // page aligned.
 uint64_t kmalloc_p(uint64_t sz, uint64_t *phys); // placed at physical address.
 uint64_t kmalloc_ap(uint64_t sz, int align, uint64_t *phys); // page aligned and returns a physical address.
 uint64_t kmalloc_aligned(uint64_t sz, uint64_t alignment);
 bool check_mem_alloc(void *ptr, uint64_t size);
 
+// Charged to the calling function, see memprof.c
+#define kmalloc_a(sz, align) kmalloc_a_tagged(sz, align, MEMPROF_SITE(MEMPROF_KMALLOC_A))
+
 void test_kmalloc();
+void test_kmalloc_cpu_cache();
+void bench_kmalloc();
 
 
@@ -0,0 +1,194 @@
+/*
+Kernel Memory Accounting
+
+Every call of kmalloc_a(), kheap_alloc(), uheap_alloc() and alloc_frame() is charged to a tag:
+the allocator and the function which called it. MEMPROF_SITE() registers the tag on the first
+call of a site and keeps it in a static, so later calls only add to a few counters.
+
+Frees find their tag without help from the caller. Frames from kmalloc_a() and alloc_frame()
+carry the tag in the PMM beside their reference count, pmm_cache_free_frame() and
+pmm_free_pages() take it back. Heap regions keep their tag in the vm_region.
+
+print_memprof() shows every tag with its allocation rate since the last print, the memprof
+kshell command calls it. memprof_dump_serial() writes the counters to the serial port in a
+sorted, fixed line format, so the dumps of two builds can be compared with diff.
+
+https://www.kernel.org/doc/html/latest/mm/page_owner.html
+https://www.kernel.org/doc/html/latest/dev-tools/kmemleak.html
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/string.h"
+#include "../driver/io/serial.h"
+#include "../sys/timer/tsc.h"
+
+#include "pmm.h"
+#include "memprof.h"
+
+static memprof_tag_t memprof_tags[MEMPROF_MAX_TAGS];
+static uint16_t memprof_tag_count = 1;      // Tag 0 stays unused, it marks untracked memory
+static spinlock_t memprof_lock;
+
+static const char *memprof_allocator_names[MEMPROF_NR_ALLOCATORS] = {
+    "kmalloc_a", "kheap", "uheap", "alloc_frame"
+};
+
+
+// The tag of allocator for func in file, created on the first call. Once the table is full
+// every new site shares MEMPROF_OVERFLOW.
+uint16_t memprof_register(uint8_t allocator, const char *file, const char *func){
+    uint64_t rflags = acquire_irqsave(&memprof_lock);
+
+    uint16_t tag = 0;
+    for(uint16_t i = 1; i < memprof_tag_count && !tag; i++){
+        memprof_tag_t *entry = &memprof_tags[i];
+        if(entry->allocator == allocator && strcmp((char *) entry->func, (char *) func) == 0
+            && strcmp((char *) entry->file, (char *) file) == 0) tag = i;
+    }
+
+    if(!tag && memprof_tag_count < MEMPROF_OVERFLOW){
+        tag = memprof_tag_count++;
+        memprof_tags[tag].allocator = allocator;
+        memprof_tags[tag].file = file;
+        memprof_tags[tag].func = func;
+    }else if(!tag){
+        tag = MEMPROF_OVERFLOW;
+        memprof_tags[tag].allocator = allocator;
+        memprof_tags[tag].file = "?";
+        memprof_tags[tag].func = "overflow";
+    }
+
+    release_irqrestore(&memprof_lock, rflags);
+    return tag;
+}
+
+
+void memprof_alloc(uint16_t tag, uint64_t bytes){
+    if(tag == 0 || tag >= MEMPROF_MAX_TAGS) return;
+    memprof_tag_t *entry = &memprof_tags[tag];
+
+    __atomic_add_fetch(&entry->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&entry->total, bytes, __ATOMIC_RELAXED);
+    uint64_t live = __atomic_add_fetch(&entry->bytes, bytes, __ATOMIC_RELAXED);
+
+    uint64_t peak = __atomic_load_n(&entry->peak, __ATOMIC_RELAXED);
+    while(live > peak && !__atomic_compare_exchange_n(&entry->peak, &peak, live, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+void memprof_free(uint16_t tag, uint64_t bytes){
+    if(tag == 0 || tag >= MEMPROF_MAX_TAGS) return;
+    memprof_tag_t *entry = &memprof_tags[tag];
+
+    __atomic_add_fetch(&entry->frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&entry->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+
+// Charge bytes of frames from addr on to tag, the free of the frames finds it in the PMM
+void memprof_tag_frames(uint64_t addr, uint64_t bytes, uint16_t tag){
+    if(tag == 0) return;
+    memprof_alloc(tag, bytes);
+    pmm_frame_set_tag(addr, tag);
+}
+
+// The frames from addr on are free again
+void memprof_untag_frames(uint64_t addr, uint64_t bytes){
+    uint16_t tag = pmm_frame_take_tag(addr);
+    if(tag != 0) memprof_free(tag, bytes);
+}
+
+
+static void print_size(uint64_t bytes){
+    if(bytes >= 10 * 1024 * 1024){
+        printf("%d MB", bytes / (1024 * 1024));
+    }else if(bytes >= 10 * 1024){
+        printf("%d KB", bytes / 1024);
+    }else{
+        printf("%d B", bytes);
+    }
+}
+
+void print_memprof(){
+    uint64_t now = read_tsc();
+
+    printf(" Memory profile: %d allocation sites\n", memprof_tag_count - 1);
+
+    for(uint8_t allocator = 0; allocator < MEMPROF_NR_ALLOCATORS; allocator++){
+        for(uint16_t i = 1; i < MEMPROF_MAX_TAGS; i++){
+            memprof_tag_t *entry = &memprof_tags[i];
+            if(!entry->func || entry->allocator != allocator) continue;
+
+            uint64_t count = __atomic_load_n(&entry->count, __ATOMIC_RELAXED);
+
+            // Allocations per second since the last print, or since boot for the first one
+            uint64_t cycles = now - entry->last_tsc;
+            uint64_t ms = cpu_frequency_hz ? cycles / (cpu_frequency_hz / 1000) : 0;
+            uint64_t rate = ms ? (count - entry->last_count) * 1000 / ms : 0;
+            entry->last_count = count;
+            entry->last_tsc = now;
+
+            printf("  %s %s: %d allocs, %d frees, ", memprof_allocator_names[allocator], entry->func,
+                count, __atomic_load_n(&entry->frees, __ATOMIC_RELAXED));
+            print_size(__atomic_load_n(&entry->bytes, __ATOMIC_RELAXED));
+            printf(" live, ");
+            print_size(entry->peak);
+            printf(" peak, ");
+            print_size(entry->total);
+            printf(" total, %d/s\n", rate);
+        }
+    }
+}
+
+
+// Sort order of the serial dump: allocator, then file, then function
+static int memprof_compare(memprof_tag_t *a, memprof_tag_t *b){
+    if(a->allocator != b->allocator) return (int) a->allocator - (int) b->allocator;
+    int order = strcmp((char *) a->file, (char *) b->file);
+    return order ? order : strcmp((char *) a->func, (char *) b->func);
+}
+
+static void serial_field(const char *str){
+    serial_print(" ");
+    serial_print(str);
+}
+
+static void serial_number(uint64_t value){
+    serial_print(" ");
+    serial_print_dec((int64_t) value);
+}
+
+// One line per tag: "<allocator> <file> <function> <allocs> <frees> <live> <peak> <total>",
+// between "memprof-begin v1" and "memprof-end". Rates depend on timing, so they are left out.
+void memprof_dump_serial(){
+    uint16_t order[MEMPROF_MAX_TAGS];
+    uint16_t count = 0;
+
+    for(uint16_t i = 1; i < MEMPROF_MAX_TAGS; i++){
+        if(!memprof_tags[i].func) continue;
+
+        uint16_t j = count++;
+        for(; j > 0 && memprof_compare(&memprof_tags[order[j - 1]], &memprof_tags[i]) > 0; j--){
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    serial_print("memprof-begin v1\n");
+    for(uint16_t i = 0; i < count; i++){
+        memprof_tag_t *entry = &memprof_tags[order[i]];
+
+        serial_print(memprof_allocator_names[entry->allocator]);
+        serial_field(entry->file);
+        serial_field(entry->func);
+        serial_number(__atomic_load_n(&entry->count, __ATOMIC_RELAXED));
+        serial_number(__atomic_load_n(&entry->frees, __ATOMIC_RELAXED));
+        serial_number(__atomic_load_n(&entry->bytes, __ATOMIC_RELAXED));
+        serial_number(entry->peak);
+        serial_number(entry->total);
+        serial_print("\n");
+    }
+    serial_print("memprof-end\n");
+
+    printf(" [-] Memory profile: %d sites written to the serial port\n", count);
+}
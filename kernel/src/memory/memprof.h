@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MEMPROF_MAX_TAGS    128     // Allocation sites, tag 0 means untracked
+#define MEMPROF_OVERFLOW    (MEMPROF_MAX_TAGS - 1)  // Shared by the sites which found the table full
+
+// Allocators whose call sites are tagged
+enum memprof_allocator {
+    MEMPROF_KMALLOC_A,
+    MEMPROF_KHEAP,
+    MEMPROF_UHEAP,
+    MEMPROF_ALLOC_FRAME,
+    MEMPROF_NR_ALLOCATORS
+};
+
+// Memory handed out by one allocator to one function
+typedef struct memprof_tag {
+    uint8_t allocator;              // enum memprof_allocator
+    const char *file;
+    const char *func;
+    uint64_t count;                 // Allocations
+    uint64_t frees;
+    uint64_t bytes;                 // Bytes allocated and not freed yet
+    uint64_t peak;                  // Highest value of bytes
+    uint64_t total;                 // Bytes ever allocated
+    uint64_t last_count;            // count at the last print, for the allocation rate
+    uint64_t last_tsc;
+} memprof_tag_t;
+
+// Tag of the calling function, registered on its first allocation. Every call site keeps it
+// in a static, so only the first call looks it up.
+#define MEMPROF_SITE(allocator) ({                                                      \
+    static uint16_t memprof_site_tag;                                                   \
+    if (!memprof_site_tag) memprof_site_tag = memprof_register(allocator, __FILE__, __func__); \
+    memprof_site_tag; })
+
+uint16_t memprof_register(uint8_t allocator, const char *file, const char *func);
+
+void memprof_alloc(uint16_t tag, uint64_t bytes);
+void memprof_free(uint16_t tag, uint64_t bytes);
+void memprof_tag_frames(uint64_t addr, uint64_t bytes, uint16_t tag);
+void memprof_untag_frames(uint64_t addr, uint64_t bytes);
+
+void print_memprof();
+void memprof_dump_serial();
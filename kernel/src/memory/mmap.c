@@ -0,0 +1,59 @@
+/*
+Memory Mapped Files
+
+mmap() maps a part of an open FAT32 file into the user heap, read only. Nothing is read at
+this point: a fault maps the page cache frame of the touched file page, which is read from
+the disk straight into that frame. A file is consumed without a full read into a buffer and
+without a second copy, and pages which are never touched are never read.
+
+https://man7.org/linux/man-pages/man2/mmap.2.html
+*/
+
+#include "../lib/stdio.h"
+
+#include "vm_region.h"
+#include "uheap.h"
+#include "paging.h"
+
+#include "mmap.h"
+
+// Present in fs/fat32.c. Declared here, fat32.h would pull the AHCI driver headers into memory/.
+struct fat32_file;
+extern struct fat32_file *fat32_get_file(int fd);
+extern uint32_t fat32_file_size(struct fat32_file *file);
+extern void fat32_file_put(struct fat32_file *file);
+
+
+// Map len bytes of the file fd from offset (page aligned) on. Returns the address of the
+// mapping, NULL if it can not be mapped. The mapping keeps the file open after close.
+void *mmap(int fd, uint64_t offset, uint64_t len) {
+    struct fat32_file *file = fat32_get_file(fd);
+    if (!file) {
+        printf("[Error] mmap: %d is not an open file\n", fd);
+        return NULL;
+    }
+
+    uint32_t size = fat32_file_size(file);
+    if ((offset & (PAGE_SIZE - 1)) != 0 || offset >= size || len == 0) {
+        printf("[Error] mmap: Can not map %d bytes from offset %d\n", len, offset);
+        fat32_file_put(file);
+        return NULL;
+    }
+
+    if (len > size - offset) len = size - offset;
+
+    // The region owns the reference of fat32_get_file() from now on
+    void *addr = uheap_map_file(file, offset, len);
+    if (!addr) fat32_file_put(file);
+
+    return addr;
+}
+
+
+// Remove a whole mapping of mmap(). len may be the length which was asked for, mmap()
+// shortens a mapping to the end of the file.
+void munmap(void *addr, uint64_t len) {
+    if (!uheap_unmap_file(addr, len)) {
+        printf("[Error] munmap: %x is not the start of a mapped file\n", (uint64_t) addr);
+    }
+}
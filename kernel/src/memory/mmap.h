@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+void *mmap(int fd, uint64_t offset, uint64_t len);
+void munmap(void *addr, uint64_t len);
@@ -0,0 +1,185 @@
+/*
+NUMA Topology
+
+On a machine with several sockets every socket has its own memory, and memory of another
+socket costs an extra hop over the interconnect. The ACPI SRAT tells which proximity domain
+(node) every core and every physical range belongs to, the SLIT tells how far the nodes are
+from each other.
+
+init_numa() reads both before the PMM is built. The PMM then splits its zones at node
+boundaries and serves a core from the zones of its own node first, then from the other nodes
+in the order of their distance. Per CPU stacks, page tables, slabs and the frame caches are
+all allocated by the core which uses them, so they end up local.
+
+Without a SRAT everything is node 0 and nothing changes.
+
+QEMU: -numa node,nodeid=0,cpus=0-1,memdev=m0 -numa node,nodeid=1,cpus=2-3,memdev=m1
+      -numa dist,src=0,dst=1,val=21
+
+https://uefi.org/specs/ACPI/6.5/05_ACPI_Software_Programming_Model.html#system-resource-affinity-table-srat
+https://www.kernel.org/doc/html/latest/mm/numa.html
+*/
+
+#include "../lib/stdio.h"
+#include "../sys/acpi/acpi.h"
+#include "../sys/acpi/descriptor_table/srat.h"
+#include "../sys/acpi/descriptor_table/slit.h"
+#include "../sys/cpu/cpu.h"     // After boot.h, which declares STACK_SIZE as a variable
+
+#include "numa.h"
+
+extern srat_t *srat;    // Defined in srat.c
+extern slit_t *slit;    // Defined in slit.c
+
+int numa_node_count = 1;                        // A single node until init_numa() finds more
+
+static uint32_t numa_domains[NUMA_MAX_NODES];   // Proximity domain of every node
+static int numa_domain_count;
+static uint8_t numa_cpu_nodes[MAX_CPUS];        // Node of every LAPIC id
+static numa_range_t numa_ranges[NUMA_MAX_RANGES];
+static int numa_range_count;
+
+static uint8_t numa_distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static uint8_t numa_fallbacks[NUMA_MAX_NODES][NUMA_MAX_NODES];  // Every node, nearest first
+
+
+// The node of a proximity domain, a new one for a domain not seen before
+static int numa_node_of_domain(uint32_t domain, bool add){
+    for(int node = 0; node < numa_domain_count; node++){
+        if(numa_domains[node] == domain) return node;
+    }
+
+    if(!add) return -1;
+    if(numa_domain_count >= NUMA_MAX_NODES){
+        printf("[Error] NUMA: More than %d nodes, domain %d counts as node 0\n", NUMA_MAX_NODES, domain);
+        return 0;
+    }
+
+    numa_domains[numa_domain_count] = domain;
+    return numa_domain_count++;
+}
+
+
+void numa_add_cpu(uint32_t apic_id, uint32_t domain){
+    int node = numa_node_of_domain(domain, true);
+    if(apic_id < MAX_CPUS) numa_cpu_nodes[apic_id] = node;
+}
+
+void numa_add_memory(uint64_t base, uint64_t length, uint32_t domain){
+    int node = numa_node_of_domain(domain, true);
+
+    if(numa_range_count >= NUMA_MAX_RANGES){
+        printf("[Error] NUMA: More than %d memory ranges, %x counts as node 0\n", NUMA_MAX_RANGES, base);
+        return;
+    }
+
+    numa_ranges[numa_range_count].base = base;
+    numa_ranges[numa_range_count].end = base + length;
+    numa_ranges[numa_range_count].node = node;
+    numa_range_count++;
+}
+
+// Domains which have neither cores nor memory are left out
+void numa_set_distance(uint32_t from_domain, uint32_t to_domain, uint8_t distance){
+    int from = numa_node_of_domain(from_domain, false);
+    int to = numa_node_of_domain(to_domain, false);
+    if(from >= 0 && to >= 0) numa_distances[from][to] = distance;
+}
+
+
+// Memory which no SRAT range covers belongs to node 0
+uint8_t numa_node_of_addr(uint64_t addr){
+    for(int i = 0; i < numa_range_count; i++){
+        if(addr >= numa_ranges[i].base && addr < numa_ranges[i].end) return numa_ranges[i].node;
+    }
+    return 0;
+}
+
+uint8_t numa_node_of_cpu(uint32_t apic_id){
+    return (apic_id < MAX_CPUS) ? numa_cpu_nodes[apic_id] : 0;
+}
+
+uint8_t this_numa_node(){
+    if(numa_node_count <= 1) return 0;
+    return numa_cpu_nodes[this_cpu_id() % MAX_CPUS];
+}
+
+// The n-th nearest node to node, n = 0 is node itself
+uint8_t numa_fallback(uint8_t node, int n){
+    return numa_fallbacks[node % NUMA_MAX_NODES][n];
+}
+
+uint8_t numa_distance(uint8_t from, uint8_t to){
+    return numa_distances[from % NUMA_MAX_NODES][to % NUMA_MAX_NODES];
+}
+
+
+// The end of the part of [base, end) which lies on the same node as base
+uint64_t numa_split(uint64_t base, uint64_t end){
+    for(int i = 0; i < numa_range_count; i++){
+        if(base >= numa_ranges[i].base && base < numa_ranges[i].end){
+            return (numa_ranges[i].end < end) ? numa_ranges[i].end : end;
+        }
+        if(numa_ranges[i].base > base && numa_ranges[i].base < end) end = numa_ranges[i].base;
+    }
+    return end;
+}
+
+
+// Sort the other nodes of every node by their distance, the node itself comes first
+static void numa_build_fallbacks(){
+    for(int node = 0; node < numa_node_count; node++){
+        uint8_t *order = numa_fallbacks[node];
+        order[0] = node;
+
+        int count = 1;
+        for(int other = 0; other < numa_node_count; other++){
+            if(other == node) continue;
+
+            int i = count++;
+            for(; i > 1 && numa_distances[node][order[i - 1]] > numa_distances[node][other]; i--){
+                order[i] = order[i - 1];
+            }
+            order[i] = other;
+        }
+    }
+}
+
+
+// Called by the bootstrap core before init_pmm(), which already splits its zones by node
+void init_numa(){
+    for(int from = 0; from < NUMA_MAX_NODES; from++){
+        for(int to = 0; to < NUMA_MAX_NODES; to++){
+            numa_distances[from][to] = (from == to) ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    // init_acpi() runs later with the other cores and reuses the tables found here
+    if(find_acpi_tables()){
+        parse_srat(srat);
+        parse_slit(slit);
+    }
+
+    numa_node_count = (numa_domain_count > 0) ? numa_domain_count : 1;
+    numa_build_fallbacks();
+
+    printf(" [-] NUMA: %d nodes, %d memory ranges\n", numa_node_count, numa_range_count);
+}
+
+
+void print_numa_info(){
+    printf(" NUMA: %d nodes\n", numa_node_count);
+
+    for(int node = 0; node < numa_node_count; node++){
+        uint64_t memory = 0;
+        for(int i = 0; i < numa_range_count; i++){
+            if(numa_ranges[i].node == node) memory += numa_ranges[i].end - numa_ranges[i].base;
+        }
+
+        printf("  Node %d (domain %d): %d MB, distances", node, numa_domains[node], memory / (1024 * 1024));
+        for(int other = 0; other < numa_node_count; other++){
+            printf(" %d", numa_distances[node][other]);
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define NUMA_MAX_NODES          8
+#define NUMA_MAX_RANGES         32      // Memory affinity ranges of the SRAT
+#define NUMA_LOCAL_DISTANCE     10      // SLIT distance of a node to itself
+#define NUMA_REMOTE_DISTANCE    20      // Assumed for every other node without a SLIT
+
+// Physical memory of one node
+typedef struct numa_range {
+    uint64_t base;
+    uint64_t end;
+    uint8_t node;
+} numa_range_t;
+
+extern int numa_node_count;
+
+void numa_add_cpu(uint32_t apic_id, uint32_t domain);
+void numa_add_memory(uint64_t base, uint64_t length, uint32_t domain);
+void numa_set_distance(uint32_t from_domain, uint32_t to_domain, uint8_t distance);
+
+uint8_t numa_node_of_addr(uint64_t addr);
+uint8_t numa_node_of_cpu(uint32_t apic_id);
+uint8_t this_numa_node();
+uint8_t numa_fallback(uint8_t node, int n);
+uint8_t numa_distance(uint8_t from, uint8_t to);
+uint64_t numa_split(uint64_t base, uint64_t end);
+
+void init_numa();
+void print_numa_info();
@@ -20,8 +20,17 @@ https://stackoverflow.com/questions/18431261/how-does-x86-paging-work
 #include  "../lib/stdio.h"
 #include "../lib/assert.h"
 #include "../sys/timer/tsc.h"
+#include "../sys/cpu/cpuid.h"
+#include "../sys/cpu/cpu.h"
+#include "../arch/interrupt/apic/ipi.h"
 #include "pmm.h"
+#include "buddy.h"
+#include "pmm_cache.h"
+#include "slab.h"
 #include "vmm.h"
+#include "kheap.h"
+#include "address_space.h"
+#include "zero_pool.h"
 
 #include "paging.h"
 
@@ -35,26 +44,28 @@ pml4_t *current_pml4;
 
 uint64_t bsp_cr3;
 
+static pt_cpu_cache_t pt_caches[MAX_CPUS];     // Zeroed page table frames of every core
+static uint64_t pt_owned[PMM_LOW_4G_LIMIT / PAGE_SIZE / 64];  // Frames which are page tables from the PMM
+static uint64_t pt_tables;                      // Page tables in use which came from the PMM
+static bool gb_pages_supported;                // CPUID offers 1 GB pages, read once in init_paging()
+
 // allocate a page with the free physical frame
-void alloc_frame(page_t *page, int is_kernel, int is_writeable) {
+void alloc_frame_tagged(page_t *page, int is_kernel, int is_writeable, uint16_t tag) {
     
-    // idx is now the index of the first free frame.
-    uint64_t bit_no = free_frame_bit_no(); 
+    // frame is a used and zeroed frame, mostly cleared in advance by an idle core
+    uint64_t frame = zero_pool_alloc_frame(); 
 
-    if (bit_no == (uint64_t)-1) {
+    if (frame == PMM_INVALID_FRAME) {
         printf("[Error] Paging: No free frames!");
         halt_kernel();
     }
 
-    set_frame(bit_no); // Mark the frame as used by passing the frame index
+    memprof_tag_frames(frame, FRAME_SIZE, tag);  // Untagged again by pmm_cache_free_frame()
 
     page->present = 1;                      // Mark it as present.
     page->rw = (is_writeable) ? 1 : 0;      // Should the page be writeable?
     page->user = (is_kernel) ? 0 : 1;       // Should the page be user-mode?
-    phys_mem_head &= 0xFFFFFFFFFFFFF000;    // Increment the usable memory pointer
-    page->frame = (uint64_t) (phys_mem_head + (bit_no * FRAME_SIZE)) >> 12;     // Store physical base address
-
-    phys_mem_head += FRAME_SIZE;
+    page->frame = frame >> 12;              // Store physical base address
 }
 
 
@@ -66,9 +77,12 @@ void free_frame(page_t *page)
     {
         uint64_t frame = (uint64_t) page->frame << 12;  // Get the physical address of the frame
 
-        uint64_t bit_no = PHYS_ADDR_TO_BIT_NO(frame);   // Convert the frame address to a bit number
-        
-        clear_frame(bit_no);                            // Frame is now free again from bitmap.
+        // Frames outside of the PMM regions are not managed by the PMM, shared frames stay with
+        // their other mappings
+        if (pmm_find_region(frame) != NULL && pmm_frame_unref(frame))
+        {
+            pmm_cache_free_frame(frame);                    // Frame is now free again in the cache of this core.
+        }
 
         page->frame = 0;                                // Page now doesn't have a frame.
     }
@@ -80,7 +94,7 @@ uint64_t get_cr3_addr() {
     uint64_t cr3;
     asm volatile("mov %%cr3, %0" : "=r"(cr3)); // Read the CR3 register
 
-    return cr3;
+    return cr3 & PTE_ADDR_MASK;                 // Without the PCID in the low 12 bits
 }
 
 void set_cr3_addr(uint64_t cr3) {
@@ -90,6 +104,8 @@ void set_cr3_addr(uint64_t cr3) {
     }
     // Set the CR3 register to the new PML4 address
     asm volatile("mov %0, %%cr3" : : "r"(cr3)); // Write the CR3 register
+    cpu_datas[this_cpu_id()].active_cr3 = cr3;  // TLB shootdowns of this address space must reach this core
+    virt_cache_flush_all();
 }
 
 // Initialising Paging for bootstrap CPU core
@@ -98,6 +114,8 @@ void init_paging()
     assert(phys_mem_head != 0); // Check if physical memory head is initialized
 
     bsp_cr3 = get_cr3_addr(); // Get the current value of CR3 (the base of the PML4 table)
+    cpu_datas[this_cpu_id()].active_cr3 = bsp_cr3;
+    gb_pages_supported = has_1gb_pages();   // CPUID is serializing, so not on every mapping
 
     // Paging is enabled by Limine. Get the pml4 table pointer address that Limine set up
     current_pml4 = (pml4_t *) get_cr3_addr();
@@ -161,23 +179,69 @@ void init_core_paging(int core_id) {
 }
 
 
-static page_t *alloc_page(){
-    page_t *pg = (page_t *) kmalloc_a(sizeof(page_t), 1);
-    if(pg){
-        memset(pg, 0, sizeof(pg));
-    }else{
-        printf("[Error] Paging: Failed to allocate page\n");
-        return NULL; // Allocation failed
+/*
+Page table frames: once the PMM is up every PML4, PDPT, PD and PT is a frame below 4 GB, so
+the identity map reaches it like the early kmalloc_a tables. Each core keeps a stack of
+zeroed table frames. A refill takes PT_CACHE_BATCH frames from the pre-zeroed pool of
+zero_pool.c, and only when it runs dry from the buddy allocator, clearing them with
+non-temporal stores. A freed table is cleared while it is still in the cache and goes back on
+the stack. A full stack returns a batch to the PMM.
+
+pt_owned marks the frames which came from here, only those are ever freed. Limine's tables and
+the ones kmalloc_a made before the PMM stay where they are.
+*/
+
+static inline bool pt_frame_owned(uint64_t frame) {
+    return frame < PMM_LOW_4G_LIMIT && (pt_owned[frame / PAGE_SIZE / 64] & (1ULL << (frame / PAGE_SIZE % 64)));
+}
+
+static inline void pt_set_owned(uint64_t frame, bool owned) {
+    uint64_t bit = 1ULL << (frame / PAGE_SIZE % 64);
+    if (owned) {
+        __atomic_fetch_or(&pt_owned[frame / PAGE_SIZE / 64], bit, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&pt_owned[frame / PAGE_SIZE / 64], ~bit, __ATOMIC_RELAXED);
     }
-    return pg;
+}
+
+// A zeroed 4 KB table. Returns its physical address, which is also its identity mapped
+// address, or NULL.
+static void *alloc_table_page() {
+    if (!is_pmm_initialized()) {
+        void *table = (void *) kmalloc_a(PAGE_SIZE, 1);
+        if (table) memset(table, 0, PAGE_SIZE);
+        return table;
+    }
+
+    uint64_t rflags = irq_save();
+    pt_cpu_cache_t *cache = &pt_caches[this_cpu_id() % MAX_CPUS];
+
+    if (cache->count == 0) {
+        cache->refills++;
+        while (cache->count < PT_CACHE_BATCH) {
+            uint64_t frame = zero_pool_take_below(PMM_LOW_4G_LIMIT);
+            if (frame == PMM_INVALID_FRAME) {
+                frame = pmm_alloc_pages_below(0, PMM_LOW_4G_LIMIT);
+                if (!frame) break;
+                zero_frame_nt(frame);
+            }
+            pt_set_owned(frame, true);
+            cache->frames[cache->count++] = frame;
+        }
+        asm volatile("sfence" ::: "memory");
+    }
+
+    uint64_t frame = (cache->count > 0) ? cache->frames[--cache->count] : 0;
+    if (frame) __atomic_add_fetch(&pt_tables, 1, __ATOMIC_RELAXED);
+
+    irq_restore(rflags);
+    return (void *) frame;
 }
 
 // Function to allocate a new page table
 static pt_t* alloc_pt() {
-    pt_t* pt = (pt_t*)kmalloc_a(sizeof(pt_t), 1);
-    if (pt) {
-        memset(pt, 0, sizeof(pt_t)); // Zero out the page table
-    }else {
+    pt_t* pt = (pt_t*)alloc_table_page();
+    if (!pt) {
         printf("[Error] Paging: Failed to allocate PT\n");
         return NULL; // Allocation failed
     }
@@ -186,10 +250,8 @@ static pt_t* alloc_pt() {
 
 // Function to allocate a new page directory
 static pd_t* alloc_pd() {
-    pd_t* pd = (pd_t*)kmalloc_a(sizeof(pd_t), 1);
-    if (pd) {
-        memset(pd, 0, sizeof(pd_t));    // Zero out the page directory
-    }else{
+    pd_t* pd = (pd_t*)alloc_table_page();
+    if (!pd) {
         printf("[Error] Paging: Failed to allocate PD\n");
         return NULL; // Allocation failed
     }
@@ -198,11 +260,8 @@ static pd_t* alloc_pd() {
 
 // Function to allocate a new page directory pointer table
 static pdpt_t* alloc_pdpt() {
-    pdpt_t* pdpt = (pdpt_t*)kmalloc_a(sizeof(pdpt_t), 1);
-
-    if (pdpt) {
-        memset(pdpt, 0, sizeof(pdpt_t)); // Zero out the PDPT
-    }else{
+    pdpt_t* pdpt = (pdpt_t*)alloc_table_page();
+    if (!pdpt) {
         printf("[Error] Paging: Failed to allocate PDPT\n");
         return NULL; // Allocation failed
     }
@@ -362,12 +421,442 @@ page_t* get_page(uint64_t va, int make, pml4_t* pml4) {
 }
 
 
+// Entry of the next level table for index of a directory. A missing table is created if make
+// is set, otherwise NULL is returned without printing.
+static dir_entry_t *next_table(dir_entry_t *dir, uint64_t index, uint64_t va, int make){
+    dir_entry_t *entry = &dir[index];
+
+    if (entry->present && entry->ps) return NULL;   // A 2 MB or 1 GB page, there is no table below
+
+    if (!entry->present) {
+        if (!make) return NULL;
+
+        void *table = alloc_table_page();
+        if (!table) return NULL;
+
+        entry->base_addr = (uint64_t) table >> 12;
+        entry->rw = 1;
+        entry->present = 1;
+    }
+
+    // Tables which Limine made for the lower half are kernel only, user pages need the bit on every level
+    if (make && va < HIGHER_HALF_START_ADDR) entry->user = 1;
+
+    return (dir_entry_t *) phys_to_vir((uint64_t) entry->base_addr << 12);
+}
+
+// The page table which holds the entries of the 2 MB range around va. Range walks call this
+// once per 512 pages instead of walking all four levels for every page.
+page_t *get_pt(uint64_t va, int make, pml4_t *pml4) {
+    if (!pml4) return NULL;
+
+    dir_entry_t *pdpt = next_table(pml4->entry_t, PML4_INDEX(va), va, make);
+    if (!pdpt) return NULL;
+
+    dir_entry_t *pd = next_table(pdpt, PDPT_INDEX(va), va, make);
+    if (!pd) return NULL;
+
+    return (page_t *) next_table(pd, PD_INDEX(va), va, make);
+}
+
+// Unlike get_page() this returns the page table entry of va without changing it, so the
+// caller can fill the frame before the entry becomes present.
+page_t *get_pte(uint64_t va, int make, pml4_t *pml4) {
+    page_t *pt = get_pt(va, make, pml4);
+    if (!pt) return NULL;
+
+    return &pt[PT_INDEX(va)];
+}
+
+
+/*
+Huge pages: map_range() maps a physically contiguous range with the largest pages which fit,
+1 GB entries in the PDPT, 2 MB entries in the PD and 4 KB entries in a PT for the unaligned
+edges. A huge page which is only partly unmapped or remapped is split into 512 pages of the
+next smaller size first. A PT or PD which ends up mapping 512 contiguous pages with the same
+flags is merged back into one huge entry and the table is freed.
+*/
+
+#define PTE_FLAGS_IGNORED  0x60                // Accessed and dirty differ between merged pages
+#define PTE_PAT_4K         0x80                // PAT bit of a 4 KB entry
+#define PTE_PAT_HUGE       0x1000              // PAT bit of a 2 MB or 1 GB entry
+
+static spinlock_t map_lock;                    // map_range() and unmap_range() change several levels
+
+#define SHARED_LOW_PDPT_ENTRIES 4              // Limine's identity map of the first 4 GB
+
+static inline uint64_t *table_of(uint64_t entry) {
+    return (uint64_t *) phys_to_vir(entry & PTE_ADDR_MASK);
+}
+
+// The 4 KB leaf entry of va, NULL if a table is missing or a huge page maps va
+static uint64_t *find_pte(uint64_t *pml4, uint64_t va) {
+    uint64_t entry = pml4[PML4_INDEX(va)];
+    if (!(entry & PAGE_PRESENT)) return NULL;
+
+    entry = table_of(entry)[PDPT_INDEX(va)];
+    if (!(entry & PAGE_PRESENT) || (entry & PAGE_HUGE)) return NULL;
+
+    entry = table_of(entry)[PD_INDEX(va)];
+    if (!(entry & PAGE_PRESENT) || (entry & PAGE_HUGE)) return NULL;
+
+    return &table_of(entry)[PT_INDEX(va)];
+}
+
+// Only tables from alloc_table_page() go back, Limine's and early kmalloc_a tables stay
+static void free_table_page(uint64_t *table) {
+    uint64_t phys = vir_to_phys((uint64_t) table);
+    if (!pt_frame_owned(phys)) return;
+
+    memset(table, 0, PAGE_SIZE);                // Hot in the cache right now
+    __atomic_sub_fetch(&pt_tables, 1, __ATOMIC_RELAXED);
+
+    uint64_t rflags = irq_save();
+    pt_cpu_cache_t *cache = &pt_caches[this_cpu_id() % MAX_CPUS];
+
+    if (cache->count == PT_CACHE_SIZE) {
+        cache->drains++;
+        for (uint64_t i = 0; i < PT_CACHE_BATCH; i++) {
+            uint64_t frame = cache->frames[--cache->count];
+            pt_set_owned(frame, false);
+            pmm_free_pages(frame, 0);
+        }
+    }
+    cache->frames[cache->count++] = phys;
+
+    irq_restore(rflags);
+}
+
+// Give back a table which tlb_gather_flush() no longer sees in any TLB
+void free_page_table(uint64_t table_phys) {
+    free_table_page((uint64_t *) phys_to_vir(table_phys));
+}
+
+// Page table frames in use and kept in the caches of the cores
+void print_page_table_stats() {
+    uint64_t cached = 0, refills = 0, drains = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cached += pt_caches[i].count;
+        refills += pt_caches[i].refills;
+        drains += pt_caches[i].drains;
+    }
+    printf(" Page tables: %d in use (%d KB), %d cached, %d refills, %d drains\n",
+        pt_tables, pt_tables * PAGE_SIZE / 1024, cached, refills, drains);
+}
+
+// Free a table and every table below it, but not the mapped frames
+static void free_table_tree(uint64_t entry, int level) {
+    uint64_t *table = table_of(entry);
+    if (level > 1) {
+        for (int i = 0; i < 512; i++) {
+            if ((table[i] & PAGE_PRESENT) && !(table[i] & PAGE_HUGE)) free_table_tree(table[i], level - 1);
+        }
+    }
+    free_table_page(table);
+}
+
+// Replace the huge page of entry (2 MB if level is 2, 1 GB if level is 3) by a table of 512
+// pages of the next smaller size with the same flags
+static bool split_huge_page(uint64_t *entry, int level) {
+    uint64_t *table = (uint64_t *) alloc_table_page();
+    if (!table) return false;
+    table = (uint64_t *) phys_to_vir((uint64_t) table);
+
+    uint64_t child_size = (level == 3) ? PAGE_SIZE_2M : PAGE_SIZE;
+    uint64_t base = *entry & PTE_ADDR_MASK & ~(child_size * 512 - 1);
+    uint64_t flags = *entry & ~PTE_ADDR_MASK & ~PAGE_HUGE;
+
+    if (level == 2 && (*entry & PTE_PAT_HUGE)) flags |= PTE_PAT_4K;
+    if (level == 3) flags |= PAGE_HUGE | (*entry & PTE_PAT_HUGE);
+
+    for (int i = 0; i < 512; i++) {
+        table[i] = (base + i * child_size) | flags;
+    }
+
+    // The new table inherits every permission, the leaves restrict it
+    *entry = vir_to_phys((uint64_t) table) | (*entry & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER));
+    return true;
+}
+
+// Merge a table of 512 contiguous pages with the same flags into one huge entry
+static void try_merge(uint64_t *entry, int level) {
+    if (!(*entry & PAGE_PRESENT) || (*entry & PAGE_HUGE)) return;
+    if (level == 3 && !gb_pages_supported) return;
+
+    uint64_t *table = table_of(*entry);
+    uint64_t child_size = (level == 3) ? PAGE_SIZE_2M : PAGE_SIZE;
+    uint64_t base = table[0] & PTE_ADDR_MASK;
+    uint64_t flags = table[0] & ~PTE_ADDR_MASK & ~PTE_FLAGS_IGNORED;
+
+    if (!(flags & PAGE_PRESENT) || (base & (child_size * 512 - 1))) return;
+    if (level == 3 && !(flags & PAGE_HUGE)) return;     // The PD still has tables below it
+
+    for (int i = 1; i < 512; i++) {
+        if ((table[i] & PTE_ADDR_MASK) != base + i * child_size) return;
+        if ((table[i] & ~PTE_ADDR_MASK & ~PTE_FLAGS_IGNORED) != flags) return;
+    }
+
+    if (level == 2) {
+        if (flags & PTE_PAT_4K) flags = (flags & ~PTE_PAT_4K) | PTE_PAT_HUGE;
+        flags |= PAGE_HUGE;
+    }
+
+    *entry = base | flags;
+    free_table_page(table);
+}
+
+// Table below entry for va. A missing table is created and a huge page is split.
+static uint64_t *walk_create(uint64_t *entry, int level, uint64_t va) {
+    if ((*entry & PAGE_PRESENT) && (*entry & PAGE_HUGE)) {
+        if (!split_huge_page(entry, level)) return NULL;
+        flush_tlb(va);
+    }
+
+    if (!(*entry & PAGE_PRESENT)) {
+        void *table = alloc_table_page();
+        if (!table) return NULL;
+        *entry = (uint64_t) table | PAGE_PRESENT | PAGE_WRITE;
+    }
+
+    if (va < HIGHER_HALF_START_ADDR) *entry |= PAGE_USER;  // Same as get_pte(), the leaves decide
+
+    return table_of(*entry);
+}
+
+// Move va to the next multiple of size. False if that wraps around the address space.
+static inline bool skip_to(uint64_t *va, uint64_t size) {
+    uint64_t next = (*va | (size - 1)) + 1;
+    if (next <= *va) return false;
+    *va = next;
+    return true;
+}
+
+static inline bool table_empty(uint64_t *table) {
+    for (int i = 0; i < 512; i++) {
+        if (table[i]) return false;
+    }
+    return true;
+}
+
+// Unhook the PTs of [start, end) which have no mapping left, and the PDs which end up empty
+// as well. Only tables whose whole range lies inside of [start, end) go: demand paging and
+// vmm_map_range() fill entries next to the range without map_lock. The tables wait in tlb
+// until the TLBs are flushed, cores may still walk them until then.
+void reclaim_page_tables(uint64_t start, uint64_t end, tlb_gather_t *tlb) {
+    uint64_t *pml4 = table_of(get_cr3_addr());
+    uint64_t va = (start + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1);
+    if (va < start) return;                     // Wrapped past the top of the address space
+
+    uint64_t rflags = acquire_irqsave(&map_lock);
+
+    while (va < end && end - va >= PAGE_SIZE_2M) {
+        // The shootdown waits for other cores, so a full gather is flushed without the lock
+        if (tlb->nr_tables + 2 > TLB_GATHER_TABLES) {
+            release_irqrestore(&map_lock, rflags);
+            tlb_gather_flush(tlb);
+            rflags = acquire_irqsave(&map_lock);
+        }
+
+        uint64_t *pml4e = &pml4[PML4_INDEX(va)];
+        if (!(*pml4e & PAGE_PRESENT)) {
+            if (!skip_to(&va, 512 * PAGE_SIZE_1G)) break;
+            continue;
+        }
+
+        uint64_t *pdpte = &table_of(*pml4e)[PDPT_INDEX(va)];
+        if (!(*pdpte & PAGE_PRESENT) || (*pdpte & PAGE_HUGE)) {
+            if (!skip_to(&va, PAGE_SIZE_1G)) break;
+            continue;
+        }
+
+        uint64_t *pd = table_of(*pdpte);
+        uint64_t *pde = &pd[PD_INDEX(va)];
+        if ((*pde & PAGE_PRESENT) && !(*pde & PAGE_HUGE) && pt_frame_owned(*pde & PTE_ADDR_MASK)
+                && table_empty(table_of(*pde))) {
+            tlb_gather_table(tlb, *pde & PTE_ADDR_MASK);
+            tlb_gather_page(tlb, va);
+            *pde = 0;
+        }
+
+        // The last PT of a PD which lies inside of the range. The PDs of the identity map are
+        // copied into every address space, they stay.
+        uint64_t pd_va = va & ~(PAGE_SIZE_1G - 1);
+        bool last = !skip_to(&va, PAGE_SIZE_2M);
+        bool shared = pd_va < SHARED_LOW_PDPT_ENTRIES * PAGE_SIZE_1G;
+        if ((last || !(va & (PAGE_SIZE_1G - 1))) && pd_va >= start && !shared
+                && pt_frame_owned(*pdpte & PTE_ADDR_MASK) && table_empty(pd)) {
+            tlb_gather_table(tlb, *pdpte & PTE_ADDR_MASK);
+            tlb_gather_page(tlb, pd_va);
+            *pdpte = 0;
+        }
+        if (last) break;
+    }
+
+    release_irqrestore(&map_lock, rflags);
+}
+
+// Point the entry at a new page and drop whatever was mapped there before
+static void set_leaf(uint64_t *entry, int level, uint64_t value, uint64_t va) {
+    if (level > 1 && (*entry & PAGE_PRESENT) && !(*entry & PAGE_HUGE)) {
+        free_table_tree(*entry, level - 1);
+    }
+    *entry = value;
+    flush_tlb(va);
+}
+
+
+// Map with pages of at most max_page bytes, see map_range()
+static bool map_range_max(uint64_t va, uint64_t pa, uint64_t size, uint64_t flags, uint64_t max_page) {
+    if ((va | pa | size) & (PAGE_SIZE - 1)) {
+        printf("[Error] Paging: map_range(%x, %x, %x) is not page aligned\n", va, pa, size);
+        return false;
+    }
+
+    flags = (flags & (PAGE_WRITE | PAGE_USER | PAGE_NX)) | PAGE_PRESENT;
+    bool gb_pages = gb_pages_supported && max_page >= PAGE_SIZE_1G;
+    bool merge = max_page > PAGE_SIZE;
+    uint64_t *pml4 = table_of(get_cr3_addr());
+    bool ok = true;
+
+    uint64_t rflags = acquire_irqsave(&map_lock);
+
+    uint64_t start = va;
+    uint64_t end = va + size;
+    while (va < end) {
+        uint64_t left = end - va;
+
+        uint64_t *pdpt = walk_create(&pml4[PML4_INDEX(va)], 4, va);
+        if (!pdpt) { ok = false; break; }
+
+        if (gb_pages && !((va | pa) & (PAGE_SIZE_1G - 1)) && left >= PAGE_SIZE_1G) {
+            set_leaf(&pdpt[PDPT_INDEX(va)], 3, pa | flags | PAGE_HUGE, va);
+            va += PAGE_SIZE_1G;
+            pa += PAGE_SIZE_1G;
+            continue;
+        }
+
+        uint64_t *pd = walk_create(&pdpt[PDPT_INDEX(va)], 3, va);
+        if (!pd) { ok = false; break; }
+
+        if (max_page >= PAGE_SIZE_2M && !((va | pa) & (PAGE_SIZE_2M - 1)) && left >= PAGE_SIZE_2M) {
+            set_leaf(&pd[PD_INDEX(va)], 2, pa | flags | PAGE_HUGE, va);
+            va += PAGE_SIZE_2M;
+            pa += PAGE_SIZE_2M;
+        } else {
+            uint64_t *pt = walk_create(&pd[PD_INDEX(va)], 2, va);
+            if (!pt) { ok = false; break; }
+
+            set_leaf(&pt[PT_INDEX(va)], 1, pa | flags, va);
+            va += PAGE_SIZE;
+            pa += PAGE_SIZE;
+
+            // The PT may be complete now
+            if (merge && (!(va & (PAGE_SIZE_2M - 1)) || va == end)) try_merge(&pd[PD_INDEX(va - PAGE_SIZE)], 2);
+        }
+
+        // And so may the PD
+        if (merge && (!(va & (PAGE_SIZE_1G - 1)) || va == end)) try_merge(&pdpt[PDPT_INDEX(va - 1)], 3);
+    }
+
+    release_irqrestore(&map_lock, rflags);
+
+    // Old mappings of the range may still be cached by other cores. Not under map_lock,
+    // a core which waits for the lock with interrupts disabled could not answer.
+    tlb_shootdown((uint64_t) pml4, start, va);
+
+    if (!ok) printf("[Error] Paging: map_range: Out of memory for page tables at %x\n", va);
+    return ok;
+}
+
+
+// Map [va, va + size) to the physical range at pa with flags (PAGE_WRITE, PAGE_USER, PAGE_NX),
+// using 1 GB and 2 MB pages wherever va and pa are aligned for them. va, pa and size must be
+// 4 KB aligned. The range may replace existing mappings.
+bool map_range(uint64_t va, uint64_t pa, uint64_t size, uint64_t flags) {
+    return map_range_max(va, pa, size, flags, PAGE_SIZE_1G);
+}
+
+
+// Remove the mappings of [va, va + size). The frames are not freed, they belong to the caller.
+void unmap_range(uint64_t va, uint64_t size) {
+    uint64_t *pml4 = table_of(get_cr3_addr());
+    uint64_t end = PAGE_ALIGN(va + size);
+    va &= ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t start = va;
+
+    uint64_t rflags = acquire_irqsave(&map_lock);
+
+    while (va < end) {
+        uint64_t left = end - va;
+
+        uint64_t *pml4e = &pml4[PML4_INDEX(va)];
+        if (!(*pml4e & PAGE_PRESENT)) {
+            if (!skip_to(&va, 512 * PAGE_SIZE_1G)) break;
+            continue;
+        }
+
+        uint64_t *pdpte = &table_of(*pml4e)[PDPT_INDEX(va)];
+        if (!(*pdpte & PAGE_PRESENT)) {
+            if (!skip_to(&va, PAGE_SIZE_1G)) break;
+            continue;
+        }
+        if (*pdpte & PAGE_HUGE) {
+            if (!(va & (PAGE_SIZE_1G - 1)) && left >= PAGE_SIZE_1G) {
+                set_leaf(pdpte, 3, 0, va);
+                va += PAGE_SIZE_1G;
+                continue;
+            }
+            if (!split_huge_page(pdpte, 3)) break;      // Only a part goes away
+            flush_tlb(va);
+        }
+
+        uint64_t *pde = &table_of(*pdpte)[PD_INDEX(va)];
+        if (!(*pde & PAGE_PRESENT)) {
+            if (!skip_to(&va, PAGE_SIZE_2M)) break;
+            continue;
+        }
+        if (*pde & PAGE_HUGE) {
+            if (!(va & (PAGE_SIZE_2M - 1)) && left >= PAGE_SIZE_2M) {
+                set_leaf(pde, 2, 0, va);
+                va += PAGE_SIZE_2M;
+                continue;
+            }
+            if (!split_huge_page(pde, 2)) break;
+            flush_tlb(va);
+        }
+
+        set_leaf(&table_of(*pde)[PT_INDEX(va)], 1, 0, va);
+        va += PAGE_SIZE;
+    }
+
+    release_irqrestore(&map_lock, rflags);
+
+    tlb_shootdown((uint64_t) pml4, start, end);
+}
+
+
 // Function to flush TLB for a specific address
 void flush_tlb(uint64_t va) {
     // page_t *page = get_page(va, 0, (pml4_t *)get_cr3_addr());
     // Use the invlpg instruction to invalidate the TLB entry for a specific address
     // if(page->present) asm volatile("invlpg (%0)" : : "r"(va) : "memory");
     asm volatile("invlpg (%0)" : : "r"(va) : "memory");
+    if (va >= HIGHER_HALF_START_ADDR) flush_tlb_other_pcids(va, va + PAGE_SIZE);
+    virt_cache_flush_range(va, va + PAGE_SIZE);
+}
+
+// Flush [start, end) on this core: invlpg for each page of a small range, one CR3 reload
+// for a large one
+void flush_tlb_range(uint64_t start, uint64_t end) {
+    if ((end - start) / PAGE_SIZE > TLB_FLUSH_MAX_PAGES) {
+        flush_tlb_all();
+    } else {
+        for (uint64_t va = start & ~(uint64_t)(PAGE_SIZE - 1); va < end; va += PAGE_SIZE) {
+            asm volatile("invlpg (%0)" : : "r"(va) : "memory");
+        }
+    }
+    if (start >= HIGHER_HALF_START_ADDR) flush_tlb_other_pcids(start, end);
+    virt_cache_flush_range(start, end);
 }
 
 // Function to flush the entire TLB (by writing to cr3)
@@ -378,6 +867,7 @@ void flush_tlb_all() {
 
     // Write the value of CR3 back to itself, which will flush the TLB
     asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    virt_cache_flush_all();
 }
 
 void map_virtual_memory(void *phys_addr, size_t size, uint64_t flags) {
@@ -404,8 +894,7 @@ void map_virtual_memory(void *phys_addr, size_t size, uint64_t flags) {
 
         // Get or create PDPT
         if (!(pml4[pml4_index] & PAGE_PRESENT)) {
-            pdpt = (uint64_t *)kmalloc_a(0x1000, 1);
-            memset(pdpt, 0, 0x1000);
+            pdpt = (uint64_t *)alloc_table_page();
             pml4[pml4_index] = ((uint64_t)pdpt | flags);
         } else {
             pdpt = (uint64_t *)(pml4[pml4_index] & ~0xFFF);
@@ -413,8 +902,7 @@ void map_virtual_memory(void *phys_addr, size_t size, uint64_t flags) {
 
         // Get or create PD
         if (!(pdpt[pdpt_index] & PAGE_PRESENT)) {
-            pd = (uint64_t *)kmalloc_a(0x1000,1);
-            memset(pd, 0, 0x1000);
+            pd = (uint64_t *)alloc_table_page();
             pdpt[pdpt_index] = ((uint64_t)pd | flags);
         } else {
             pd = (uint64_t *)(pdpt[pdpt_index] & ~0xFFF);
@@ -422,8 +910,7 @@ void map_virtual_memory(void *phys_addr, size_t size, uint64_t flags) {
 
         // Get or create PT
         if (!(pd[pd_index] & PAGE_PRESENT)) {
-            pt = (uint64_t *)kmalloc_a(0x1000,1);
-            memset(pt, 0, 0x1000);
+            pt = (uint64_t *)alloc_table_page();
             pd[pd_index] = ((uint64_t)pt | flags);
         } else {
             pt = (uint64_t *)(pd[pd_index] & ~0xFFF);
@@ -461,8 +948,7 @@ void map_virtual_memory_1(void *phys_addr, uint64_t vir_addr, size_t size, uint6
 
         // Get or create PDPT
         if (!(pml4[pml4_index] & PAGE_PRESENT)) {
-            pdpt = (uint64_t *)kmalloc_a(0x1000, 1);
-            memset(pdpt, 0, 0x1000);
+            pdpt = (uint64_t *)alloc_table_page();
             pml4[pml4_index] = ((uint64_t)pdpt | flags);
         } else {
             pdpt = (uint64_t *)(pml4[pml4_index] & ~0xFFF);
@@ -470,8 +956,7 @@ void map_virtual_memory_1(void *phys_addr, uint64_t vir_addr, size_t size, uint6
 
         // Get or create PD
         if (!(pdpt[pdpt_index] & PAGE_PRESENT)) {
-            pd = (uint64_t *)kmalloc_a(0x1000,1);
-            memset(pd, 0, 0x1000);
+            pd = (uint64_t *)alloc_table_page();
             pdpt[pdpt_index] = ((uint64_t)pd | flags);
         } else {
             pd = (uint64_t *)(pdpt[pdpt_index] & ~0xFFF);
@@ -479,8 +964,7 @@ void map_virtual_memory_1(void *phys_addr, uint64_t vir_addr, size_t size, uint6
 
         // Get or create PT
         if (!(pd[pd_index] & PAGE_PRESENT)) {
-            pt = (uint64_t *)kmalloc_a(0x1000,1);
-            memset(pt, 0, 0x1000);
+            pt = (uint64_t *)alloc_table_page();
             pd[pd_index] = ((uint64_t)pt | flags);
         } else {
             pt = (uint64_t *)(pd[pd_index] & ~0xFFF);
@@ -494,13 +978,204 @@ void map_virtual_memory_1(void *phys_addr, uint64_t vir_addr, size_t size, uint6
     flush_tlb(virt);
 }
 
+// A new PML4 for an address space. The kernel half and the identity map of the first 4 GB are
+// shared with bsp_cr3, the rest of the lower half is empty. Returns its physical address or 0.
 uint64_t create_new_pml4() {
-    uint64_t pml4_ptr_phys = (uint64_t) kmalloc_a(sizeof(pml4_t), 1);
-    memset((void*)pml4_ptr_phys, 0, sizeof(pml4_t)); // Clear PML4 table
+    uint64_t *kernel = (uint64_t *) phys_to_vir(bsp_cr3 & PTE_ADDR_MASK);
+
+    uint64_t *pml4 = alloc_table_page();
+    uint64_t *pdpt = alloc_table_page();
+    if (!pml4 || !pdpt) {
+        if (pml4) free_table_page((uint64_t *) phys_to_vir((uint64_t) pml4));
+        if (pdpt) free_table_page((uint64_t *) phys_to_vir((uint64_t) pdpt));
+        return 0;
+    }
+
+    uint64_t rflags = acquire_irqsave(&map_lock);
+
+    // Kernel PDPTs which are made later would only show up in bsp_cr3, so all are made now
+    for (int i = 256; i < 512; i++) {
+        if (!(kernel[i] & PAGE_PRESENT)) {
+            uint64_t *table = alloc_table_page();
+            if (!table) continue;
+            kernel[i] = (uint64_t) table | PAGE_PRESENT | PAGE_WRITE;
+        }
+        pml4[i] = kernel[i];
+    }
+
+    if (kernel[0] & PAGE_PRESENT) {
+        uint64_t *identity = table_of(kernel[0]);
+        for (int i = 0; i < SHARED_LOW_PDPT_ENTRIES; i++) pdpt[i] = identity[i];
+    }
+    pml4[0] = (uint64_t) pdpt | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
 
-    // Map the PML4 into the page tables
-    map_virtual_memory((void*)pml4_ptr_phys, sizeof(pml4_t), PAGE_WRITE | PAGE_PRESENT);
-    return pml4_ptr_phys;
+    release_irqrestore(&map_lock, rflags);
+
+    return (uint64_t) pml4;
+}
+
+// Free a private table, every table below it and the 4 KB frames it maps. A frame which is
+// still shared copy on write with another address space only loses this mapping.
+static void free_user_tree(uint64_t entry, int level) {
+    uint64_t *table = table_of(entry);
+    for (int i = 0; i < 512; i++) {
+        if (!(table[i] & PAGE_PRESENT)) continue;
+
+        if (level > 1 && !(table[i] & PAGE_HUGE)) {
+            free_user_tree(table[i], level - 1);
+        } else if (level == 1) {
+            uint64_t frame = table[i] & PTE_ADDR_MASK;
+            if (pmm_find_region(frame) != NULL && pmm_frame_unref(frame)) pmm_cache_free_frame(frame);
+        }
+    }
+    free_table_page(table);
+}
+
+// Free the lower half of a PML4 from create_new_pml4() with its 4 KB frames, and the PML4
+// itself. The shared entries and huge pages stay.
+void destroy_pml4(uint64_t pml4_phys) {
+    uint64_t *pml4 = table_of(pml4_phys);
+
+    if (pml4[0] & PAGE_PRESENT) {
+        uint64_t *pdpt = table_of(pml4[0]);
+        for (int i = SHARED_LOW_PDPT_ENTRIES; i < 512; i++) {
+            if ((pdpt[i] & PAGE_PRESENT) && !(pdpt[i] & PAGE_HUGE)) free_user_tree(pdpt[i], 2);
+        }
+        free_table_page(pdpt);
+    }
+
+    for (int i = 1; i < 256; i++) {
+        if (pml4[i] & PAGE_PRESENT) free_user_tree(pml4[i], 3);
+    }
+
+    free_table_page(pml4);
+}
+
+
+/*
+Copy on write: fork() does not copy the memory of a process. The child gets its own page
+tables which map the same frames, and every writable page becomes read only and PAGE_COW in
+both trees. The frame counts one more mapping. The first write of either side faults:
+handle_cow_fault() copies the frame for the writer, or just makes it writable again when the
+other side has dropped its mapping already.
+
+Huge pages and frames outside of the PMM (devices) stay shared as they are.
+*/
+
+// Copy the entries of the table src (level 3 is a PDPT, 1 a PT) into the empty table dst
+static bool clone_table(uint64_t *dst, uint64_t *src, int level) {
+    for (int i = 0; i < 512; i++) {
+        uint64_t entry = src[i];
+        if (!(entry & PAGE_PRESENT)) continue;
+
+        if (level > 1 && !(entry & PAGE_HUGE)) {
+            uint64_t *table = alloc_table_page();
+            if (!table) return false;
+            dst[i] = (uint64_t) table | (entry & ~PTE_ADDR_MASK);
+            if (!clone_table(table_of(dst[i]), table_of(entry), level - 1)) return false;
+            continue;
+        }
+
+        if (level == 1 && pmm_find_region(entry & PTE_ADDR_MASK) != NULL) {
+            if (entry & PAGE_WRITE) {
+                entry = (entry & ~PAGE_WRITE) | PAGE_COW;
+                src[i] = entry;
+            }
+            pmm_frame_ref(entry & PTE_ADDR_MASK);
+        }
+        dst[i] = entry;
+    }
+    return true;
+}
+
+// Share the private lower half of src_pml4 copy on write with dst_pml4, a new PML4 from
+// create_new_pml4(). The caller flushes the TLBs of src_pml4, its pages lost the write bit.
+// On failure dst_pml4 holds part of the mappings and goes to destroy_pml4().
+bool clone_user_mappings(uint64_t dst_pml4, uint64_t src_pml4) {
+    uint64_t *dst = table_of(dst_pml4);
+    uint64_t *src = table_of(src_pml4);
+    bool ok = true;
+
+    uint64_t rflags = acquire_irqsave(&map_lock);
+
+    if (src[0] & PAGE_PRESENT) {
+        uint64_t *src_pdpt = table_of(src[0]);
+        uint64_t *dst_pdpt = table_of(dst[0]);
+        for (int i = SHARED_LOW_PDPT_ENTRIES; i < 512 && ok; i++) {
+            if (!(src_pdpt[i] & PAGE_PRESENT)) continue;
+            if (src_pdpt[i] & PAGE_HUGE) {
+                dst_pdpt[i] = src_pdpt[i];
+                continue;
+            }
+            uint64_t *table = alloc_table_page();
+            if (!table) {
+                ok = false;
+                break;
+            }
+            dst_pdpt[i] = (uint64_t) table | (src_pdpt[i] & ~PTE_ADDR_MASK);
+            ok = clone_table(table_of(dst_pdpt[i]), table_of(src_pdpt[i]), 2);
+        }
+    }
+
+    for (int i = 1; i < 256 && ok; i++) {
+        if (!(src[i] & PAGE_PRESENT)) continue;
+        uint64_t *table = alloc_table_page();
+        if (!table) {
+            ok = false;
+            break;
+        }
+        dst[i] = (uint64_t) table | (src[i] & ~PTE_ADDR_MASK);
+        ok = clone_table(table_of(dst[i]), table_of(src[i]), 3);
+    }
+
+    release_irqrestore(&map_lock, rflags);
+    return ok;
+}
+
+// Called by the page fault handler for a write to a present page. Returns true if the page
+// was copy on write and is writable now.
+bool handle_cow_fault(uint64_t va, uint64_t err_code) {
+    if ((err_code & (PAGE_PRESENT | PAGE_WRITE)) != (PAGE_PRESENT | PAGE_WRITE)) return false;
+
+    va &= ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t old_frame = PMM_INVALID_FRAME;
+
+    uint64_t rflags = acquire_irqsave(&map_lock);
+
+    uint64_t *pte = find_pte(table_of(get_cr3_addr()), va);
+    if (!pte || !(*pte & PAGE_PRESENT) || !(*pte & (PAGE_WRITE | PAGE_COW))) {
+        release_irqrestore(&map_lock, rflags);
+        return false;
+    }
+
+    if (*pte & PAGE_COW) {
+        uint64_t frame = *pte & PTE_ADDR_MASK;
+        uint64_t flags = (*pte & ~PTE_ADDR_MASK & ~PAGE_COW) | PAGE_WRITE;
+
+        if (pmm_frame_refs(frame) == 1) {
+            *pte = frame | flags;                   // The other side is gone, the frame is ours
+        } else {
+            uint64_t copy = pmm_cache_alloc_frame();
+            if (copy == PMM_INVALID_FRAME) {
+                release_irqrestore(&map_lock, rflags);
+                return false;
+            }
+            memcpy((void *) phys_to_vir(copy), (void *) phys_to_vir(frame), PAGE_SIZE);
+            *pte = copy | flags;
+            old_frame = frame;
+        }
+    }
+    // else another thread of this address space resolved it first
+
+    flush_tlb(va);
+    release_irqrestore(&map_lock, rflags);
+
+    // Other threads may still read the old frame through their TLB, so it goes back only after them
+    if (old_frame != PMM_INVALID_FRAME) {
+        tlb_shootdown(get_cr3_addr(), va, va + PAGE_SIZE);
+        if (pmm_frame_unref(old_frame)) pmm_cache_free_frame(old_frame);
+    }
+    return true;
 }
 
 bool is_user_page(uint64_t virtual_address) {
@@ -586,7 +1261,69 @@ void test_paging() {
 
     printf("Finish Paging Test\n");
 
-    uint64_t val = *frames;
+    printf("free frames: %d\n", pmm_free_frames());
+}
+
+
+// Sequential reads with one access per 4 KB page miss the TLB on every page once the buffer
+// is larger than the TLB reach of 4 KB pages. The same buffer mapped with 2 MB pages needs
+// only one TLB entry per 512 pages.
+#define BENCH_ORDER     13                    // 32 MB
+#define BENCH_ROUNDS    8
+
+static uint64_t bench_read(uint64_t va, uint64_t size) {
+    volatile uint64_t sum = 0;
+    uint64_t start = read_tsc();
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (uint64_t offset = 0; offset < size; offset += PAGE_SIZE) {
+            sum += *(volatile uint64_t *)(va + offset);
+        }
+    }
+
+    (void) sum;
+    return read_tsc() - start;
+}
+
+void bench_huge_pages() {
+    uint64_t size = PMM_ORDER_SIZE(BENCH_ORDER);
+    uint64_t block = pmm_alloc_pages(BENCH_ORDER);      // Aligned to its size, so 2 MB aligned
+    if (!block) {
+        printf("[Error] Paging: No %d MB block for the huge page benchmark\n", size >> 20);
+        return;
+    }
+
+    // Both mappings side by side in kernel heap addresses, the extra 2 MB aligns them
+    uint64_t window_size = 2 * size + PAGE_SIZE_2M;
+    uint64_t window = kheap_reserve_va(window_size);
+    if (!window) {
+        pmm_free_pages(block, BENCH_ORDER);
+        return;
+    }
+    uint64_t va_4k = (window + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1);
+    uint64_t va_huge = va_4k + size;
+
+    if (!map_range_max(va_4k, block, size, PAGE_WRITE | PAGE_NX, PAGE_SIZE) ||
+        !map_range(va_huge, block, size, PAGE_WRITE | PAGE_NX)) {
+        unmap_range(va_4k, size);
+        unmap_range(va_huge, size);
+        kheap_release_va(window, window_size);
+        pmm_free_pages(block, BENCH_ORDER);
+        return;
+    }
+
+    // First pass of each only warms the caches
+    bench_read(va_4k, size);
+    uint64_t cycles_4k = bench_read(va_4k, size);
+    bench_read(va_huge, size);
+    uint64_t cycles_huge = bench_read(va_huge, size);
+
+    uint64_t accesses = (size / PAGE_SIZE) * BENCH_ROUNDS;
+    printf(" [-] Paging: %d MB strided read, 4 KB pages: %d cycles/page, 2 MB pages: %d cycles/page\n",
+        size >> 20, cycles_4k / accesses, cycles_huge / accesses);
 
-    printf("frames: %x\n", val);
+    unmap_range(va_4k, size);
+    unmap_range(va_huge, size);
+    kheap_release_va(window, window_size);
+    pmm_free_pages(block, BENCH_ORDER);
 }
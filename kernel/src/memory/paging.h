@@ -27,6 +27,7 @@ CR3 |- Page Directory Pointer Table (PDPT)-|-Page Table (PT) => Pages
 #include <stdbool.h>
 
 #include "../util/util.h"
+#include "memprof.h"
 
 
 #define PAGE_SIZE    4096
@@ -34,6 +35,20 @@ CR3 |- Page Directory Pointer Table (PDPT)-|-Page Table (PT) => Pages
 #define PAGE_PRESENT 0x1
 #define PAGE_WRITE   0x2
 #define PAGE_USER    0x4
+#define PAGE_HUGE    0x80                   // PS bit of a PDPT or PD entry
+#define PAGE_COW     0x200                  // Available bit: read only copy of a writable page, see handle_cow_fault()
+#define PAGE_NX      (1ULL << 63)
+
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
+
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// Above this many pages one CR3 reload is cheaper than an invlpg for every page
+#define TLB_FLUSH_MAX_PAGES 32
+
+#define PT_CACHE_SIZE  32           // Zeroed page table frames a core keeps for itself
+#define PT_CACHE_BATCH 16           // Frames moved at once between a core and the PMM
 
 // Function to extract parts of a virtual address
 #define PML4_INDEX(va)   (((va) >> 39) & 0x1FF)  // Bits 39-47
@@ -52,7 +67,9 @@ struct dir_entry { // 64 bit
     uint64_t pwt          : 1;  
     uint64_t pcd          : 1;
     uint64_t accessed     : 1;
-    uint64_t reserved_1   : 3;  // all zeros
+    uint64_t reserved_1   : 1;  // zero, dirty bit of a huge page
+    uint64_t ps           : 1;  // 1 if the entry maps a 2 MB (PD) or 1 GB (PDPT) page instead of a table
+    uint64_t reserved_2   : 1;  // zero, global bit of a huge page
     uint64_t available_1  : 3;  // zero
     uint64_t base_addr    : 40; // Table base address
     uint64_t available_2  : 11; // zero
@@ -98,35 +115,60 @@ typedef struct pml4 {
 } __attribute__((aligned(PAGE_SIZE))) pml4_t;
 
 
+// Per core stack of zeroed page table frames. Only its own core touches it, with interrupts off.
+typedef struct pt_cpu_cache {
+    uint64_t frames[PT_CACHE_SIZE];
+    uint64_t count;
+    uint64_t refills;               // Batches taken from the PMM
+    uint64_t drains;                // Batches given back to the PMM
+} pt_cpu_cache_t;
+
+struct tlb_gather;
+
+
 extern pml4_t *current_pml4;
+extern uint64_t bsp_cr3;
 
 extern uint64_t V_KMEM_UP_BASE;
 extern uint64_t V_KMEM_LOW_BASE;
 
 void debug_page(page_t *page);
-void alloc_frame(page_t *page, int is_kernel, int is_writeable);
+void alloc_frame_tagged(page_t *page, int is_kernel, int is_writeable, uint16_t tag);
 void free_frame(page_t *page);
+
+// Charged to the calling function, see memprof.c
+#define alloc_frame(page, is_kernel, is_writeable) \
+    alloc_frame_tagged(page, is_kernel, is_writeable, MEMPROF_SITE(MEMPROF_ALLOC_FRAME))
 uint64_t get_cr3_addr();
 
 void init_paging();
 void init_core_paging(int core_id);
 
 
-static page_t *alloc_page();
-static pt_t* alloc_pt();
-static pd_t* alloc_pd();
-static pdpt_t* alloc_pdpt();
-
 page_t* get_page(uint64_t va, int make, pml4_t* pml4);
+page_t *get_pt(uint64_t va, int make, pml4_t *pml4);
+page_t *get_pte(uint64_t va, int make, pml4_t *pml4);
+
+bool map_range(uint64_t va, uint64_t pa, uint64_t size, uint64_t flags);
+void unmap_range(uint64_t va, uint64_t size);
+
+void free_page_table(uint64_t table_phys);
+void reclaim_page_tables(uint64_t start, uint64_t end, struct tlb_gather *tlb);
+void print_page_table_stats();
 
 bool is_user_page(uint64_t virtual_address);
 
 void flush_tlb(uint64_t address);
+void flush_tlb_range(uint64_t start, uint64_t end);
 void flush_tlb_all();
 
 void map_virtual_memory(void *phys_addr, size_t size, uint64_t flags);
 void map_virtual_memory_1(void *phys_addr, uint64_t vir_addr, size_t size, uint64_t flags);
 
 uint64_t create_new_pml4();
+void destroy_pml4(uint64_t pml4_phys);
+bool clone_user_mappings(uint64_t dst_pml4, uint64_t src_pml4);
+bool handle_cow_fault(uint64_t va, uint64_t err_code);
 
-void test_paging();
\ No newline at end of file
+void test_paging();
+void bench_huge_pages();
\ No newline at end of file
@@ -10,110 +10,579 @@
 #include "../lib/string.h"
 
 #include "../util/util.h"
+#include "../sys/timer/tsc.h"
 
+#include "buddy.h"
 #include "pmm.h"
+#include "pmm_cache.h"
+#include "numa.h"
 
 
 // This file will set or free a 4KB physical Frame.
-// one row of bitmap can store information(free/use) of 8 * 4 KB = 32 Kb memory page(8 pages)
+// one row of bitmap can store information(free/use) of 64 * 4 KB = 256 KB memory (64 frames)
 // A bitset of frames - used or free.
+//
+// Above the frames bitmap sit summary levels: bit i of level n+1 is set when word i of
+// level n is full. A free frame is found by following clear summary bits downwards with
+// tzcnt/bsf, so the lookup costs one word per level instead of a walk over every word.
+//
+// Every usable memory map entry is a region with its own bitmap, one per NUMA node the entry
+// spans. The bitmap is a pool of single frames in front of the buddy zone of the same region.
+// A clear bit is a frame which alloc_frame() may take; frames still owned by the buddy
+// allocator are set. The pool borrows 2 MB chunks from its zone when it runs dry and gives a
+// chunk back once all of its frames are free again. A core takes frames from the regions of
+// its own node first.
+//
+// The bitmaps and the buddy zones are shared by every core and guarded by pmm_lock. Single
+// frames normally go through the per CPU caches in pmm_cache.c, which take the lock once
+// per batch.
+
+pmm_region_t pmm_regions[PMM_MAX_REGIONS];
+int pmm_region_count;
 
-uint64_t *frames; // start of bitset frames
 uint64_t nframes; // Total numbers of frames
 
+spinlock_t pmm_lock;                            // Guards the regions and the buddy zones
+
+static int pmm_alloc_region;                    // Region which served the last allocation
+static bool pmm_initialized;
+
 extern volatile uint64_t phys_mem_head; // head of physical memory
 
-// set the value of frames array by using bit no
-void set_frame(uint64_t bit_no) {
+// Found from detect_memory.c
+extern size_t mem_entry_count;
+extern struct limine_memmap_entry **mem_entries;
+
 
-    assert(bit_no < nframes); // check either bit_no is less than total nframes i.e. 0 to nframes-1
+// Set a bit in a level and mark the word in the next level once this word is full
+static void pmm_mark_bit(pmm_region_t *region, int level, uint64_t bit_no){
+    while(level < region->level_count){
+        uint64_t idx = INDEX_FROM_BIT_NO(bit_no);
+        region->levels[level][idx] |= (0x1ULL << OFFSET_FROM_BIT_NO(bit_no));
 
-    uint64_t bitmap_idx = INDEX_FROM_BIT_NO(bit_no);
-    uint64_t bitmap_off = OFFSET_FROM_BIT_NO(bit_no);
+        if(region->levels[level][idx] != 0xFFFFFFFFFFFFFFFF) break;
 
-    frames[bitmap_idx] |= (0x1ULL << bitmap_off);       // Set the bit
+        bit_no = idx;   // The whole word is used, so set its bit in the summary above
+        level++;
+    }
 }
 
+// Clear a bit in a level and clear the summary bits of words which were full before
+static void pmm_unmark_bit(pmm_region_t *region, int level, uint64_t bit_no){
+    while(level < region->level_count){
+        uint64_t idx = INDEX_FROM_BIT_NO(bit_no);
+        bool was_full = (region->levels[level][idx] == 0xFFFFFFFFFFFFFFFF);
 
+        region->levels[level][idx] &= ~(0x1ULL << OFFSET_FROM_BIT_NO(bit_no));
 
-// Static function to clear a bit in the frames bitset
-void clear_frame(uint64_t bit_no)
-{
-    assert(bit_no < nframes); // check either bit_no is less than total nframes i.e. 0 to nframes-1
+        if(!was_full) break;
+
+        bit_no = idx;   // The word has a free bit again, so it is not full in the summary above
+        level++;
+    }
+}
+
+// Return the first clear bit at or after start in the given level, or PMM_INVALID_BIT
+static uint64_t pmm_find_clear_bit(pmm_region_t *region, int level, uint64_t start){
+    uint64_t idx = INDEX_FROM_BIT_NO(start);
+    if(idx >= region->level_words[level]) return PMM_INVALID_BIT;
+
+    // Clear bits of the first word which are at or after start
+    uint64_t mask = ~region->levels[level][idx] & (0xFFFFFFFFFFFFFFFF << OFFSET_FROM_BIT_NO(start));
+    if(mask){
+        return CONVERT_BIT_NO(idx, (uint64_t) __builtin_ctzll(mask));
+    }
+
+    // Find the next word which is not full
+    uint64_t next_idx = PMM_INVALID_BIT;
+    if(level + 1 < region->level_count){
+        next_idx = pmm_find_clear_bit(region, level + 1, idx + 1);
+    }else{
+        // The top level has at most BITMAP_SIZE words, scan it directly
+        for(uint64_t i = idx + 1; i < region->level_words[level]; i++){
+            if(region->levels[level][i] != 0xFFFFFFFFFFFFFFFF){
+                next_idx = i;
+                break;
+            }
+        }
+    }
+
+    if(next_idx == PMM_INVALID_BIT || next_idx >= region->level_words[level]) return PMM_INVALID_BIT;
+
+    return CONVERT_BIT_NO(next_idx, (uint64_t) __builtin_ctzll(~region->levels[level][next_idx]));
+}
+
+
+// Check whether count frames starting at bit_no are all clear, one word at a time
+static bool pmm_range_is_clear(pmm_region_t *region, uint64_t bit_no, uint64_t count){
+    while(count){
+        uint64_t off = OFFSET_FROM_BIT_NO(bit_no);
+        uint64_t n = (BITMAP_SIZE - off < count) ? BITMAP_SIZE - off : count;
+        uint64_t mask = (n == BITMAP_SIZE) ? 0xFFFFFFFFFFFFFFFF : (((0x1ULL << n) - 1) << off);
 
-    uint64_t bitmap_idx = INDEX_FROM_BIT_NO(bit_no);
-    uint64_t bitmap_off = OFFSET_FROM_BIT_NO(bit_no);
+        if(region->levels[0][INDEX_FROM_BIT_NO(bit_no)] & mask) return false;
+
+        bit_no += n;
+        count -= n;
+    }
+    return true;
+}
+
+// Borrow a chunk from the buddy zone and make its frames available in the bitmap
+static bool pmm_pool_refill(pmm_region_t *region){
+    if(region->zone == NULL) return false;
+
+    for(int order = PMM_POOL_CHUNK_ORDER; order >= 0; order--){
+        uint64_t addr = pmm_zone_alloc(region->zone, order);
+        if(!addr) continue;
+
+        uint64_t first = PHYS_ADDR_TO_BIT_NO(region, addr);
+        for(uint64_t bit_no = first; bit_no < first + (1ULL << order); bit_no++){
+            pmm_unmark_bit(region, 0, bit_no);
+        }
+        region->free_frames += (1ULL << order);
+        region->next_hint = first;
+        return true;
+    }
+    return false;
+}
+
+// Give the 2 MB chunk around a freed frame back to the buddy zone once it is entirely free.
+// One spare chunk stays in the pool so a single alloc/free pair does not bounce chunks.
+static void pmm_pool_release(pmm_region_t *region, uint64_t bit_no){
+    uint64_t chunk = BIT_NO_TO_ADDR(region, bit_no) & ~(PMM_ORDER_SIZE(PMM_POOL_CHUNK_ORDER) - 1);
+    uint64_t chunk_frames = 1ULL << PMM_POOL_CHUNK_ORDER;
+
+    if(region->free_frames < 2 * chunk_frames) return;
+    if(chunk < region->base || chunk + PMM_ORDER_SIZE(PMM_POOL_CHUNK_ORDER) > region->end) return;
+
+    uint64_t first = PHYS_ADDR_TO_BIT_NO(region, chunk);
+    if(!pmm_range_is_clear(region, first, chunk_frames)) return;
+
+    for(uint64_t bit = first; bit < first + chunk_frames; bit++){
+        pmm_mark_bit(region, 0, bit);
+    }
+    region->free_frames -= chunk_frames;
+
+    pmm_zone_free(region->zone, chunk, PMM_POOL_CHUNK_ORDER);
+}
+
+
+// Find a free frame in the region starting from its rotating hint and wrapping around once
+static uint64_t pmm_region_find(pmm_region_t *region){
+    uint64_t free_bit = pmm_find_clear_bit(region, 0, region->next_hint);
+
+    if(free_bit == PMM_INVALID_BIT && region->next_hint != 0){
+        free_bit = pmm_find_clear_bit(region, 0, 0);    // Wrap around to the start of the bitmap
+    }
 
-    if(frames == NULL){
-        printf("frames is null\n");
+    if(free_bit != PMM_INVALID_BIT){
+        region->next_hint = (free_bit + 1 < region->nframes) ? free_bit + 1 : 0;
+    }
+
+    return free_bit;
+}
+
+
+// Set up the bitmap levels of a region, every frame starts as set (owned by the buddy zone)
+static pmm_region_t *pmm_add_region(uint64_t base, uint64_t end){
+    if(pmm_region_count >= PMM_MAX_REGIONS || end <= base) return NULL;
+
+    pmm_region_t *region = &pmm_regions[pmm_region_count];
+    region->zone = NULL;
+    region->base = base;
+    region->end = end;
+    region->nframes = (end - base) / FRAME_SIZE;
+    region->next_hint = 0;
+    region->free_frames = 0;
+    region->node = numa_node_of_addr(base);
+
+    // Level 0 is the frames bitmap, every next level summarizes 64 words of the previous one
+    uint64_t words = (region->nframes + BITMAP_SIZE - 1) / BITMAP_SIZE;
+    region->level_count = 0;
+    while(region->level_count < PMM_MAX_LEVELS){
+        uint64_t *level = (uint64_t*) kmalloc_a(sizeof(uint64_t) * words, 1); // Allocate memory for the bitmap array
+        if(level == NULL){
+            printf("[Error] PMM: Failed to allocate memory for frames\n");
+            return NULL;
+        }
+
+        // The pool starts empty: every frame, every bit past the end and so every summary is set
+        memset(level, 0xFF, sizeof(uint64_t) * words);
+
+        region->levels[region->level_count] = level;
+        region->level_words[region->level_count] = words;
+        region->level_count++;
+
+        if(words <= BITMAP_SIZE) break;                 // The top level is small enough to scan
+        words = (words + BITMAP_SIZE - 1) / BITMAP_SIZE;
+    }
+
+    // Copy on write sharing counts the mappings of a frame beside its bit
+    region->refcounts = (uint16_t *) kmalloc_a(sizeof(uint16_t) * region->nframes, 1);
+    if(region->refcounts == NULL){
+        printf("[Error] PMM: Failed to allocate memory for frame reference counts\n");
+        return NULL;
+    }
+    memset(region->refcounts, 0, sizeof(uint16_t) * region->nframes);
+
+    region->tags = (uint16_t *) kmalloc_a(sizeof(uint16_t) * region->nframes, 1);
+    if(region->tags == NULL){
+        printf("[Error] PMM: Failed to allocate memory for frame tags\n");
+        return NULL;
+    }
+    memset(region->tags, 0, sizeof(uint16_t) * region->nframes);
+
+    pmm_region_count++;
+    nframes += region->nframes;
+    return region;
+}
+
+
+// Find the region which contains the physical address
+pmm_region_t *pmm_find_region(uint64_t addr){
+    for(int i = 0; i < pmm_region_count; i++){
+        if(addr >= pmm_regions[i].base && addr < pmm_regions[i].end){
+            return &pmm_regions[i];
+        }
+    }
+    return NULL;
+}
+
+
+// One more page table entry maps the frame, e.g. the child of a copy on write fork
+void pmm_frame_ref(uint64_t frame_addr){
+    pmm_region_t *region = pmm_find_region(frame_addr);
+    if(region == NULL) return;
+
+    uint16_t *count = &region->refcounts[PHYS_ADDR_TO_BIT_NO(region, frame_addr)];
+    uint16_t old = __atomic_load_n(count, __ATOMIC_RELAXED);
+    do{
+        if(old == PMM_FRAME_PINNED) return;
+    }while(!__atomic_compare_exchange_n(count, &old, old + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+}
+
+// The frame stays allocated for good, however many mappings come and go
+void pmm_frame_pin(uint64_t frame_addr){
+    pmm_region_t *region = pmm_find_region(frame_addr);
+    if(region == NULL) return;
+
+    __atomic_store_n(&region->refcounts[PHYS_ADDR_TO_BIT_NO(region, frame_addr)], PMM_FRAME_PINNED, __ATOMIC_RELEASE);
+}
+
+// One mapping of the frame is gone. Returns true if it was the last one, then the caller frees the frame.
+bool pmm_frame_unref(uint64_t frame_addr){
+    pmm_region_t *region = pmm_find_region(frame_addr);
+    if(region == NULL) return true;
+
+    uint16_t *count = &region->refcounts[PHYS_ADDR_TO_BIT_NO(region, frame_addr)];
+    uint16_t old = __atomic_load_n(count, __ATOMIC_RELAXED);
+    do{
+        if(old == 0) return true;
+        if(old == PMM_FRAME_PINNED) return false;
+    }while(!__atomic_compare_exchange_n(count, &old, old - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    return false;
+}
+
+// Number of page table entries which map the frame
+uint64_t pmm_frame_refs(uint64_t frame_addr){
+    pmm_region_t *region = pmm_find_region(frame_addr);
+    if(region == NULL) return 1;
+
+    return 1 + __atomic_load_n(&region->refcounts[PHYS_ADDR_TO_BIT_NO(region, frame_addr)], __ATOMIC_ACQUIRE);
+}
+
+
+// Remember the allocation site of the frame until it is freed
+void pmm_frame_set_tag(uint64_t frame_addr, uint16_t tag){
+    pmm_region_t *region = pmm_find_region(frame_addr);
+    if(region == NULL) return;
+
+    __atomic_store_n(&region->tags[PHYS_ADDR_TO_BIT_NO(region, frame_addr)], tag, __ATOMIC_RELAXED);
+}
+
+// The allocation site of a frame which is being freed, 0 if it had none. The tag is cleared.
+uint16_t pmm_frame_take_tag(uint64_t frame_addr){
+    pmm_region_t *region = pmm_find_region(frame_addr);
+    if(region == NULL) return 0;
+
+    uint16_t *tag = &region->tags[PHYS_ADDR_TO_BIT_NO(region, frame_addr)];
+    if(__atomic_load_n(tag, __ATOMIC_RELAXED) == 0) return 0;   // Most frames, no write needed
+    return __atomic_exchange_n(tag, 0, __ATOMIC_RELAXED);
+}
+
+
+// set the frame as used in the bitmap of its region
+void set_frame(uint64_t frame_addr) {
+    pmm_region_t *region = pmm_find_region(frame_addr);
+    assert(region != NULL); // check the frame is inside a region managed by the PMM
+
+    uint64_t bit_no = PHYS_ADDR_TO_BIT_NO(region, frame_addr);
+
+    if(test_frame(frame_addr)) return;  // Already used
+
+    pmm_mark_bit(region, 0, bit_no);    // Set the bit and update the summaries
+    region->free_frames--;
+}
+
+
+
+// Static function to clear a bit in the frames bitset
+void clear_frame(uint64_t frame_addr)
+{
+    pmm_region_t *region = pmm_find_region(frame_addr);
+    if(region == NULL){
+        printf("[Error] PMM: clear_frame: %x is not inside any region\n", frame_addr);
         return;
     }
 
-    frames[bitmap_idx] &= (0 << bitmap_off);         // clears bit of frames
+    uint64_t bit_no = PHYS_ADDR_TO_BIT_NO(region, frame_addr);
+
+    if(!test_frame(frame_addr)) return; // Already free
+
+    pmm_unmark_bit(region, 0, bit_no);  // clears bit of frames and update the summaries
+    region->free_frames++;
+
+    if(region->levels[0][INDEX_FROM_BIT_NO(bit_no)] == 0){
+        pmm_pool_release(region, bit_no);   // The word is free, the whole chunk may be free too
+    }
 }
 
 
-// Static function to test if a bit is set or not.
-uint64_t test_frame(uint64_t bit_no)
+// Static function to test if a bit is set or not. Frames outside of every region count as used.
+uint64_t test_frame(uint64_t frame_addr)
 {
+   pmm_region_t *region = pmm_find_region(frame_addr);
+   if(region == NULL) return 1;
+
+   uint64_t bit_no = PHYS_ADDR_TO_BIT_NO(region, frame_addr);
    uint64_t bitmap_idx = INDEX_FROM_BIT_NO(bit_no);
    uint64_t bitmap_off = OFFSET_FROM_BIT_NO(bit_no);
-   return (frames[bitmap_idx] & (0x1ULL << bitmap_off));  // returns 0 or 1
+   return (region->levels[0][bitmap_idx] & (0x1ULL << bitmap_off));  // returns 0 or 1
 }
 
 
-// Static function to find the first free frame.
-// The below function will return a valid bit number or invalid bit no -1
-uint64_t free_frame_bit_no()
+// The old first-fit search which walks every word, kept as reference for test_pmm
+static uint64_t free_frame_bit_no_linear(pmm_region_t *region)
 {
-    uint64_t free_bit = (uint64_t)-1;
-    bool found = false;
+    uint64_t *frames = region->levels[0];
 
-    for (uint64_t bitmap_idx = 0; (bitmap_idx < INDEX_FROM_BIT_NO(nframes)) && !found; bitmap_idx++)
+    for (uint64_t bitmap_idx = 0; bitmap_idx < region->level_words[0]; bitmap_idx++)
     {
         if (frames[bitmap_idx] != 0xFFFFFFFFFFFFFFFF) // if all bits not set, i.e. there has at least one bit is clear
         {    
             for (uint64_t bitmap_off = 0; bitmap_off < BITMAP_SIZE; bitmap_off++)
             {
-                uint64_t toTest = (uint64_t) 0x1ULL << bitmap_off; // Ensure the shift is handled as a 64-bit value.ULL means Unsigned Long Long 
+                uint64_t toTest = (uint64_t) 0x1ULL << bitmap_off;
 
                 if ( !(frames[bitmap_idx] & toTest) ) // if corresponding bit is zero
                 {
-                    free_bit = CONVERT_BIT_NO(bitmap_idx, bitmap_off); // return corresponding bit number i.e frame index
-                    found = true;
-                    break;
+                    return CONVERT_BIT_NO(bitmap_idx, bitmap_off);
                 }
             }
         }
-   }
-   return free_bit; // Return an invalid frame index to indicate failure.
+    }
+    return PMM_INVALID_BIT;
+}
+
+
+// Find a free frame on the node. The region of the last allocation is tried first, then the
+// bitmaps of the other regions, and only then a region borrows a new chunk from its buddy zone.
+static uint64_t free_frame_addr_node(uint8_t node)
+{
+    for(int n = 0; n < pmm_region_count; n++){
+        int i = (pmm_alloc_region + n) % pmm_region_count;
+        if(pmm_regions[i].node != node || pmm_regions[i].free_frames == 0) continue;
+
+        uint64_t free_bit = pmm_region_find(&pmm_regions[i]);
+        if(free_bit != PMM_INVALID_BIT){
+            pmm_alloc_region = i;
+            return BIT_NO_TO_ADDR(&pmm_regions[i], free_bit);
+        }
+    }
+
+    for(int n = 0; n < pmm_region_count; n++){
+        int i = (pmm_alloc_region + n) % pmm_region_count;
+        if(pmm_regions[i].node != node || !pmm_pool_refill(&pmm_regions[i])) continue;
+
+        uint64_t free_bit = pmm_region_find(&pmm_regions[i]);
+        if(free_bit != PMM_INVALID_BIT){
+            pmm_alloc_region = i;
+            return BIT_NO_TO_ADDR(&pmm_regions[i], free_bit);
+        }
+    }
+
+    return PMM_INVALID_FRAME;
+}
+
+// Find a free frame on the node of the running core, or on the nearest node which has one.
+// The below function will return a valid physical frame address or PMM_INVALID_FRAME
+uint64_t free_frame_addr()
+{
+    if(!pmm_initialized) return PMM_INVALID_FRAME;
+
+    uint8_t node = this_numa_node();
+    for(int n = 0; n < numa_node_count; n++){
+        uint64_t frame = free_frame_addr_node(numa_fallback(node, n));
+        if(frame != PMM_INVALID_FRAME) return frame;
+    }
+
+    return PMM_INVALID_FRAME; // Return an invalid frame address to indicate failure.
+}
+
+
+// Allocate up to count frames for a per CPU cache under one lock. Returns how many were found
+uint64_t pmm_alloc_frame_batch(uint64_t *out, uint64_t count){
+    uint64_t found = 0;
+    uint64_t rflags = acquire_irqsave(&pmm_lock);
+
+    while(found < count){
+        uint64_t frame = free_frame_addr();
+        if(frame == PMM_INVALID_FRAME) break;
+
+        set_frame(frame);
+        out[found++] = frame;
+    }
+
+    release_irqrestore(&pmm_lock, rflags);
+    return found;
+}
+
+
+// Give count frames of a per CPU cache back to their regions under one lock
+void pmm_release_frame_batch(uint64_t *frames, uint64_t count){
+    uint64_t rflags = acquire_irqsave(&pmm_lock);
+
+    for(uint64_t i = 0; i < count; i++){
+        clear_frame(frames[i]);
+    }
+
+    release_irqrestore(&pmm_lock, rflags);
+}
+
+
+bool is_pmm_initialized(){
+    return pmm_initialized;
 }
 
 
+// Frames which can still be allocated from the region, in its bitmap pool and its buddy zone
+uint64_t pmm_region_free_frames(pmm_region_t *region){
+    return region->free_frames + (region->zone ? region->zone->free_frames : 0);
+}
+
+
+// Frames which can still be allocated, from the per CPU caches, the bitmap pools and the buddy zones
+uint64_t pmm_free_frames(){
+    uint64_t free = buddy_free_frames() + pmm_cache_frames();
+    for(int i = 0; i < pmm_region_count; i++){
+        free += pmm_regions[i].free_frames;
+    }
+    return free;
+}
+
 
 void init_pmm(){
 
-    nframes = (uint64_t) (USABLE_LENGTH_PHYS_MEM) / FRAME_SIZE;         // Total number of frames in the memory
+    // The bitmaps are shared by every core, so only the first call builds them
+    if(pmm_initialized) return;
 
-    frames = (uint64_t*) kmalloc_a(sizeof(uint64_t) * (nframes + 1) / BITMAP_SIZE, 1); // Allocate memory for the bitmap array
-    if(frames == NULL){
-        printf("[Error] PMM: Failed to allocate memory for frames\n");
+    if(mem_entries == NULL){
+        printf("[Error] PMM: mem_entries is empty!\n");
         return;
     }
-    // clear the memory of frames array
-    memset(frames, 0, sizeof(uint64_t) * (nframes + 1) / BITMAP_SIZE);                           
 
-    printf(" [-] Successfully initialized PMM!\n");
+    pmm_region_count = 0;
+    nframes = 0;
+
+    // A region for every usable entry; the bitmaps come from kmalloc before the buddy zones exist
+    for(size_t i = 0; i < mem_entry_count; i++){
+        if(mem_entries[i]->type != LIMINE_MEMMAP_USABLE) continue;
+
+        uint64_t base = (mem_entries[i]->base + FRAME_SIZE - 1) & ~(uint64_t)(FRAME_SIZE - 1);
+        uint64_t end = (mem_entries[i]->base + mem_entries[i]->length) & ~(uint64_t)(FRAME_SIZE - 1);
+
+        // Split at NUMA node boundaries the same way as init_buddy() does
+        for(uint64_t split; base < end; base = split){
+            split = numa_split(base, end);
+            pmm_add_region(base, split);
+        }
+    }
+
+    // Every zone gets its free lists; the memory given away by kmalloc so far stays out
+    init_buddy();
+
+    for(int i = 0; i < pmm_region_count; i++){
+        pmm_regions[i].zone = pmm_find_zone(pmm_regions[i].base);
+        if(pmm_regions[i].zone == NULL){
+            printf("[Error] PMM: No buddy zone for region %x!\n", pmm_regions[i].base);
+        }
+    }
+
+    // Start with the region kmalloc used so far, it is the largest one
+    pmm_region_t *start = pmm_find_region(USABLE_START_PHYS_MEM);
+    pmm_alloc_region = start ? (int)(start - pmm_regions) : 0;
+    pmm_initialized = true;
+
+    printf(" [-] Successfully initialized PMM with %d regions and %d frames!\n", pmm_region_count, nframes);
 }
 
 
 void test_pmm(){
     printf(" Test Physical Memory Manager(pmm):\n");
-    printf(" Frames Pointer Address : %x\n", (uint64_t) frames);
-    printf(" Total Frames : %d\n", nframes);
+    printf(" Regions : %d, Total Frames : %d, Free Frames : %d\n", pmm_region_count, nframes, pmm_free_frames());
     printf(" After frames allocation next free address pointer: %x\n", phys_mem_head);
-}
 
+    if(!pmm_initialized || pmm_region_count == 0) return;
+
+    pmm_region_t *region = &pmm_regions[pmm_alloc_region];
+    printf(" Region %x - %x : Frames Pointer Address : %x, Summary Levels : %d\n",
+        region->base, region->end, (uint64_t) region->levels[0], region->level_count);
+
+    if(region->free_frames == 0) pmm_pool_refill(region);
 
+    // Allocate some frames first-fit with both searches and check that they agree
+    static uint64_t taken[256];
+    uint64_t count = 0;
+    uint64_t mismatch = 0;
+    uint64_t saved_hint = region->next_hint;
 
+    for(count = 0; count < 256; count++){
+        uint64_t linear = free_frame_bit_no_linear(region);
+        uint64_t fast = pmm_find_clear_bit(region, 0, 0);
+        if(linear != fast) mismatch++;
+        if(fast == PMM_INVALID_BIT) break;
+        set_frame(BIT_NO_TO_ADDR(region, fast));
+        taken[count] = fast;
+    }
+
+    // Time both searches while the low frames are used
+    uint64_t start = read_tsc();
+    for(int i = 0; i < 64; i++) free_frame_bit_no_linear(region);
+    uint64_t linear_cycles = (read_tsc() - start) / 64;
+
+    start = read_tsc();
+    for(int i = 0; i < 64; i++) pmm_find_clear_bit(region, 0, 0);
+    uint64_t fast_cycles = (read_tsc() - start) / 64;
+
+    // Free every other frame to leave holes and compare again
+    for(uint64_t i = 0; i < count; i += 2){
+        clear_frame(BIT_NO_TO_ADDR(region, taken[i]));
+        if(free_frame_bit_no_linear(region) != pmm_find_clear_bit(region, 0, 0)) mismatch++;
+    }
 
+    for(uint64_t i = 1; i < count; i += 2){
+        clear_frame(BIT_NO_TO_ADDR(region, taken[i]));
+    }
+    region->next_hint = saved_hint;
+
+    if(mismatch){
+        printf("[Error] PMM: %d mismatches between summary bitmap and linear scan!\n", mismatch);
+    }else{
+        printf(" [-] PMM: Summary bitmap matches linear scan for %d frames\n", count);
+    }
+    printf(" [-] PMM: Lookup cost linear scan %d cycles, summary bitmap %d cycles\n", linear_cycles, fast_cycles);
+
+    test_buddy();
+    test_pmm_cache();
+}
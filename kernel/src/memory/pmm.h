@@ -7,6 +7,22 @@
 #define FRAME_SIZE 4096   // 4 KB
 #define BITMAP_SIZE 64 // 64 bits = 8 bytes
 
+// Summary levels above the frames bitmap. Each summary bit covers one 64 bit word of
+// the level below and is set when that word is full, so 4 levels cover 2^30 frames (4 TB).
+#define PMM_MAX_LEVELS 4
+
+#define PMM_INVALID_BIT ((uint64_t)-1)
+#define PMM_INVALID_FRAME ((uint64_t)-1)
+
+// Reference count of a frame which is never freed, e.g. the shared zero page
+#define PMM_FRAME_PINNED 0xFFFF
+
+// The frames bitmap borrows chunks of 2^9 frames (2 MB) from the buddy allocator
+#define PMM_POOL_CHUNK_ORDER 9
+
+// One region for every buddy zone, i.e. every usable memory map entry
+#define PMM_MAX_REGIONS 32
+
 // Finding index and offset from the bit number
 #define INDEX_FROM_BIT_NO(x)(x / BITMAP_SIZE)
 #define OFFSET_FROM_BIT_NO(x)(x % BITMAP_SIZE)
@@ -14,24 +30,60 @@
 // Making bit no from index and offset
 #define CONVERT_BIT_NO(idx, off) (idx * BITMAP_SIZE + off)
 
-// Converting bit number to address
-#define BIT_NO_TO_ADDR(bit_no) (USABLE_START_PHYS_MEM + (bit_no * FRAME_SIZE))
+// Converting bit number of a region to address
+#define BIT_NO_TO_ADDR(region, bit_no) ((region)->base + ((bit_no) * FRAME_SIZE))
 
-// Converting physical address to bit number
-#define PHYS_ADDR_TO_BIT_NO(addr) ((addr - USABLE_START_PHYS_MEM) / FRAME_SIZE)
+// Converting physical address to bit number of a region
+#define PHYS_ADDR_TO_BIT_NO(region, addr) (((addr) - (region)->base) / FRAME_SIZE)
 
 // Finding the maximum frame index from the memory size.
 #define MAX_FRAME_INDEX(memory_size) (memory_size / (BITMAP_SIZE * FRAME_SIZE))
 
-extern uint64_t *frames; // start of bitset frames
-extern uint64_t nframes; // Total frames
+struct pmm_zone;
+
+// A physical memory region with its own frames bitmap in front of its buddy zone
+typedef struct pmm_region {
+    struct pmm_zone *zone;                      // Buddy zone which backs the bitmap
+    uint64_t base;                              // Physical address of bit 0
+    uint64_t end;                               // Physical end address
+    uint64_t nframes;                           // Frames covered by the bitmap
+    uint64_t *levels[PMM_MAX_LEVELS];           // levels[0] is the frames bitmap, the rest are summaries
+    uint64_t level_words[PMM_MAX_LEVELS];       // Number of 64 bit words in each level
+    int level_count;
+    uint64_t next_hint;                         // Rotating cursor: the search starts here
+    uint64_t free_frames;                       // Clear bits in the frames bitmap
+    uint8_t node;                               // NUMA node of the memory, see numa.c
+    uint16_t *refcounts;                        // Extra mappings of every frame, 0 for a single owner
+    uint16_t *tags;                             // Memory profiler tag of every allocated frame, see memprof.c
+} pmm_region_t;
+
+extern pmm_region_t pmm_regions[PMM_MAX_REGIONS];
+extern int pmm_region_count;
+
+extern uint64_t nframes; // Total frames of all regions
 
 void set_frame(uint64_t frame_addr);
 void clear_frame(uint64_t frame_addr);
 uint64_t test_frame(uint64_t frame_addr);
-uint64_t free_frame_bit_no();
+uint64_t free_frame_addr();
+
+uint64_t pmm_alloc_frame_batch(uint64_t *out, uint64_t count);
+void pmm_release_frame_batch(uint64_t *frames, uint64_t count);
+
+pmm_region_t *pmm_find_region(uint64_t addr);
+
+void pmm_frame_ref(uint64_t frame_addr);
+void pmm_frame_pin(uint64_t frame_addr);
+bool pmm_frame_unref(uint64_t frame_addr);
+uint64_t pmm_frame_refs(uint64_t frame_addr);
+
+void pmm_frame_set_tag(uint64_t frame_addr, uint16_t tag);
+uint16_t pmm_frame_take_tag(uint64_t frame_addr);
+
+bool is_pmm_initialized();
+uint64_t pmm_free_frames();
+uint64_t pmm_region_free_frames(pmm_region_t *region);
 
 void init_pmm();
 
 void test_pmm();
-
@@ -0,0 +1,115 @@
+/*
+Per CPU Frame Cache
+
+Every core keeps a small stack of free frames, indexed by its LAPIC id like cpu_datas[].
+alloc_frame() and free_frame() only touch the stack of the running core, so in the common
+case they take no lock at all. An empty stack is refilled and a full stack is drained by
+PMM_CPU_CACHE_BATCH frames at once while holding the global pmm_lock.
+
+https://www.usenix.org/legacy/event/usenix01/full_papers/bonwick/bonwick.pdf
+*/
+
+#include "../lib/stdio.h"
+
+#include "../sys/cpu/cpu.h"
+
+#include "pmm.h"
+#include "pmm_cache.h"
+#include "memprof.h"
+
+
+static pmm_cpu_cache_t pmm_cpu_caches[MAX_CPUS];
+
+
+// The cache of the running core
+static inline pmm_cpu_cache_t *this_cpu_cache(){
+    return &pmm_cpu_caches[this_cpu_id() % MAX_CPUS];
+}
+
+// Take a frame from the running core, refilling its stack from the global pool if empty.
+// Returns the physical address of a used frame or PMM_INVALID_FRAME
+uint64_t pmm_cache_alloc_frame(){
+    uint64_t rflags = irq_save();
+    pmm_cpu_cache_t *cache = this_cpu_cache();
+
+    if(cache->count > 0){
+        cache->hits++;
+    }else{
+        cache->misses++;
+        cache->count = pmm_alloc_frame_batch(cache->frames, PMM_CPU_CACHE_BATCH);
+    }
+
+    uint64_t frame = (cache->count > 0) ? cache->frames[--cache->count] : PMM_INVALID_FRAME;
+
+    irq_restore(rflags);
+    return frame;
+}
+
+
+// Give a frame back to the running core; a full stack first returns a batch to the global pool
+void pmm_cache_free_frame(uint64_t frame_addr){
+    memprof_untag_frames(frame_addr, FRAME_SIZE);
+
+    uint64_t rflags = irq_save();
+    pmm_cpu_cache_t *cache = this_cpu_cache();
+
+    if(cache->count == PMM_CPU_CACHE_SIZE){
+        // Return the oldest frames and keep the recently freed (cache warm) ones
+        pmm_release_frame_batch(cache->frames, PMM_CPU_CACHE_BATCH);
+        for(uint64_t i = PMM_CPU_CACHE_BATCH; i < PMM_CPU_CACHE_SIZE; i++){
+            cache->frames[i - PMM_CPU_CACHE_BATCH] = cache->frames[i];
+        }
+        cache->count -= PMM_CPU_CACHE_BATCH;
+        cache->drains++;
+    }
+
+    cache->frames[cache->count++] = frame_addr;
+
+    irq_restore(rflags);
+}
+
+
+// Free frames which sit in the stacks of all cores
+uint64_t pmm_cache_frames(){
+    uint64_t frames = 0;
+    for(int i = 0; i < MAX_CPUS; i++){
+        frames += pmm_cpu_caches[i].count;
+    }
+    return frames;
+}
+
+
+void print_pmm_cache_stats(){
+    for(int i = 0; i < MAX_CPUS; i++){
+        pmm_cpu_cache_t *cache = &pmm_cpu_caches[i];
+        if(cache->hits == 0 && cache->misses == 0) continue;
+
+        printf(" CPU %d frame cache: %d cached, %d hits, %d misses, %d drains\n",
+            i, cache->count, cache->hits, cache->misses, cache->drains);
+    }
+}
+
+
+void test_pmm_cache(){
+    static uint64_t taken[2 * PMM_CPU_CACHE_SIZE];
+    uint64_t free_before = pmm_free_frames();
+    uint64_t count = 0;
+
+    printf(" Test Per CPU Frame Cache:\n");
+
+    for(count = 0; count < 2 * PMM_CPU_CACHE_SIZE; count++){
+        taken[count] = pmm_cache_alloc_frame();
+        if(taken[count] == PMM_INVALID_FRAME) break;
+    }
+
+    for(uint64_t i = 0; i < count; i++){
+        pmm_cache_free_frame(taken[i]);
+    }
+
+    if(pmm_free_frames() != free_before){
+        printf("[Error] PMM: Frame cache lost frames: before %d, after %d\n", free_before, pmm_free_frames());
+    }else{
+        printf(" [-] PMM: %d frames through the cache, %d free frames\n", count, free_before);
+    }
+    print_pmm_cache_stats();
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define PMM_CPU_CACHE_SIZE  64      // Free frames a core keeps for itself
+#define PMM_CPU_CACHE_BATCH 32      // Frames moved at once between a core and the global pool
+
+// Per core stack (magazine) of free frames. Only its own core touches it, with interrupts off.
+typedef struct pmm_cpu_cache {
+    uint64_t frames[PMM_CPU_CACHE_SIZE];    // Physical addresses of the cached frames
+    uint64_t count;                         // Frames on the stack
+    uint64_t hits;                          // Allocations served from the stack
+    uint64_t misses;                        // Allocations which had to refill from the global pool
+    uint64_t drains;                        // Batches given back to the global pool
+} pmm_cpu_cache_t;
+
+uint64_t pmm_cache_alloc_frame();
+void pmm_cache_free_frame(uint64_t frame_addr);
+
+uint64_t pmm_cache_frames();
+
+void print_pmm_cache_stats();
+
+void test_pmm_cache();
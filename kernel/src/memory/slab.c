@@ -0,0 +1,390 @@
+/*
+Slab Allocator
+
+Kernel objects of a fixed size (process_t, thread_t, page tables, ...) are taken from a
+kmem_cache instead of a whole kheap page each. A cache owns slabs of 2^order contiguous
+frames from the buddy allocator. Every slab starts with a kmem_slab_t header and is cut
+into objects; the free objects of a slab are linked through their first 8 bytes.
+
+Slabs are aligned to their size, so the slab of an object is found by masking its address.
+Like kmalloc, the returned pointers are identity mapped physical addresses below 4 GB, so
+they can be used directly for page tables and DMA.
+
+https://www.usenix.org/legacy/publications/library/proceedings/bos94/full_papers/bonwick.a
+https://www.kernel.org/doc/gorman/html/understand/understand011.html
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/string.h"
+
+#include "buddy.h"
+#include "pmm.h"
+
+#include "slab.h"
+
+
+// The cache of the cache descriptors themselves
+static kmem_cache_t kmem_cache_cache;
+static kmem_cache_t *kmem_caches;         // Every cache, for the statistics
+static spinlock_t kmem_caches_lock;
+
+
+static inline uint64_t slab_size(kmem_cache_t *cache){
+    return (uint64_t) FRAME_SIZE << cache->slab_order;
+}
+
+static inline kmem_slab_t *obj_to_slab(kmem_cache_t *cache, void *obj){
+    return (kmem_slab_t *)((uint64_t) obj & ~(slab_size(cache) - 1));
+}
+
+
+static void slab_list_push(kmem_slab_t **list, kmem_slab_t *slab){
+    slab->prev = NULL;
+    slab->next = *list;
+    if(*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+static void slab_list_remove(kmem_slab_t **list, kmem_slab_t *slab){
+    if(slab->prev){
+        slab->prev->next = slab->next;
+    }else{
+        *list = slab->next;
+    }
+    if(slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+
+// Take a new slab from the PMM and thread all of its objects onto its free list
+static kmem_slab_t *slab_create(kmem_cache_t *cache){
+    uint64_t addr = pmm_alloc_pages_below(cache->slab_order, PMM_LOW_4G_LIMIT);
+    if(!addr) return NULL;
+
+    kmem_slab_t *slab = (kmem_slab_t *) addr;
+    slab->next = slab->prev = NULL;
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free_list = NULL;
+
+    // Link from the last object down, so the list hands out ascending addresses
+    for(int64_t i = cache->objs_per_slab - 1; i >= 0; i--){
+        void **obj = (void **)(addr + cache->first_offset + i * cache->obj_size);
+        *obj = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    cache->nr_slabs++;
+    cache->slab_allocs++;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t *cache, kmem_slab_t *slab){
+    cache->nr_slabs--;
+    cache->slab_frees++;
+    pmm_free_pages((uint64_t) slab, cache->slab_order);
+}
+
+
+// Fill the descriptor and pick the smallest slab which fits enough objects with little waste,
+// unless the caller fixed the slab order
+static void cache_setup(kmem_cache_t *cache, const char *name, size_t size, size_t align, uint8_t order){
+    memset(cache, 0, sizeof(kmem_cache_t));
+    strncpy(cache->name, name, KMEM_CACHE_NAME_LEN - 1);
+    cache->name[KMEM_CACHE_NAME_LEN - 1] = '\0';
+
+    if(align < sizeof(void *)) align = sizeof(void *);
+    if(size < sizeof(void *)) size = sizeof(void *);
+
+    cache->align = align;
+    cache->obj_size = (size + align - 1) & ~(align - 1);
+    cache->first_offset = (sizeof(kmem_slab_t) + align - 1) & ~(align - 1);
+
+    for(cache->slab_order = 0; order == KMEM_SLAB_AUTO_ORDER && cache->slab_order < KMEM_SLAB_MAX_ORDER; cache->slab_order++){
+        uint64_t bytes = slab_size(cache);
+        if(bytes <= cache->first_offset) continue;
+
+        uint64_t objs = (bytes - cache->first_offset) / cache->obj_size;
+        uint64_t waste = bytes - objs * cache->obj_size;
+
+        // At most 1/8 of the slab may be header and tail
+        if(objs >= KMEM_MIN_OBJS_PER_SLAB && waste * 8 <= bytes) break;
+    }
+
+    if(order != KMEM_SLAB_AUTO_ORDER) cache->slab_order = order;
+
+    cache->objs_per_slab = (slab_size(cache) > cache->first_offset) ? (slab_size(cache) - cache->first_offset) / cache->obj_size : 0;
+}
+
+
+// Create a cache for objects of size bytes aligned to align (a power of two, 0 for 8 bytes)
+// with slabs of 2^order frames, or a fitting slab size for KMEM_SLAB_AUTO_ORDER
+kmem_cache_t *kmem_cache_create_order(const char *name, size_t size, size_t align, uint8_t order){
+    if(align & (align - 1)){
+        printf("[Error] Slab: alignment %d of cache %s is not a power of two\n", align, name);
+        return NULL;
+    }
+
+    uint64_t rflags = acquire_irqsave(&kmem_caches_lock);
+    if(kmem_cache_cache.obj_size == 0){
+        cache_setup(&kmem_cache_cache, "kmem_cache", sizeof(kmem_cache_t), 64, KMEM_SLAB_AUTO_ORDER);
+        kmem_cache_cache.next = kmem_caches;
+        kmem_caches = &kmem_cache_cache;
+    }
+    release_irqrestore(&kmem_caches_lock, rflags);
+
+    kmem_cache_t *cache = (kmem_cache_t *) kmem_cache_alloc(&kmem_cache_cache);
+    if(cache == NULL){
+        printf("[Error] Slab: Failed to create cache %s\n", name);
+        return NULL;
+    }
+
+    cache_setup(cache, name, size, align, order);
+
+    if(cache->objs_per_slab == 0){
+        printf("[Error] Slab: Objects of %d bytes are too large for a slab\n", size);
+        kmem_cache_free(&kmem_cache_cache, cache);
+        return NULL;
+    }
+
+    rflags = acquire_irqsave(&kmem_caches_lock);
+    cache->next = kmem_caches;
+    kmem_caches = cache;
+    release_irqrestore(&kmem_caches_lock, rflags);
+
+    return cache;
+}
+
+
+// Create a cache for objects of size bytes aligned to align (a power of two, 0 for 8 bytes)
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align){
+    return kmem_cache_create_order(name, size, align, KMEM_SLAB_AUTO_ORDER);
+}
+
+
+// Give every slab of the cache back to the PMM. All objects must have been freed.
+void kmem_cache_destroy(kmem_cache_t *cache){
+    if(cache == NULL || cache == &kmem_cache_cache) return;
+
+    if(cache->active_objs != 0){
+        printf("[Error] Slab: Destroying cache %s with %d objects in use\n", cache->name, cache->active_objs);
+    }
+
+    uint64_t rflags = acquire_irqsave(&kmem_caches_lock);
+    for(kmem_cache_t **link = &kmem_caches; *link; link = &(*link)->next){
+        if(*link == cache){
+            *link = cache->next;
+            break;
+        }
+    }
+    release_irqrestore(&kmem_caches_lock, rflags);
+
+    kmem_slab_t *lists[3] = {cache->partial, cache->full, cache->empty};
+    for(int i = 0; i < 3; i++){
+        kmem_slab_t *slab = lists[i];
+        while(slab){
+            kmem_slab_t *next = slab->next;
+            slab_destroy(cache, slab);
+            slab = next;
+        }
+    }
+
+    kmem_cache_free(&kmem_cache_cache, cache);
+}
+
+
+// Take an object from a partial slab, then from the spare empty slab, then from a new slab.
+// Called with the lock of the cache held, NULL if no slab could be created.
+static void *cache_take(kmem_cache_t *cache){
+    kmem_slab_t *slab = cache->partial;
+    if(slab == NULL){
+        slab = cache->empty;
+        if(slab){
+            slab_list_remove(&cache->empty, slab);
+        }else{
+            slab = slab_create(cache);
+            if(slab == NULL) return NULL;
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void **obj = (void **) slab->free_list;
+    slab->free_list = *obj;
+    slab->inuse++;
+
+    if(slab->free_list == NULL){
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->allocs++;
+    cache->active_objs++;
+    return obj;
+}
+
+// Return obj to its slab. One empty slab is kept, a further empty slab is returned, which the
+// caller gives to the PMM once it dropped the lock. Called with the lock of the cache held.
+static kmem_slab_t *cache_put(kmem_cache_t *cache, kmem_slab_t *slab, void *obj){
+    if(slab->free_list == NULL){
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    *(void **) obj = slab->free_list;
+    slab->free_list = obj;
+    slab->inuse--;
+
+    cache->frees++;
+    cache->active_objs--;
+
+    if(slab->inuse != 0) return NULL;
+
+    slab_list_remove(&cache->partial, slab);
+    if(cache->empty == NULL){
+        slab_list_push(&cache->empty, slab);
+        return NULL;
+    }
+    return slab;
+}
+
+
+void *kmem_cache_alloc(kmem_cache_t *cache){
+    if(cache == NULL) return NULL;
+
+    uint64_t rflags = acquire_irqsave(&cache->lock);
+    void *obj = cache_take(cache);
+    release_irqrestore(&cache->lock, rflags);
+
+    if(obj == NULL) printf("[Error] Slab: Out of memory for cache %s\n", cache->name);
+    return obj;
+}
+
+// Up to n objects into objs under one acquisition of the lock. Returns how many it took.
+size_t kmem_cache_alloc_bulk(kmem_cache_t *cache, void **objs, size_t n){
+    if(cache == NULL) return 0;
+
+    size_t taken = 0;
+    uint64_t rflags = acquire_irqsave(&cache->lock);
+    while(taken < n){
+        void *obj = cache_take(cache);
+        if(obj == NULL) break;
+        objs[taken++] = obj;
+    }
+    release_irqrestore(&cache->lock, rflags);
+
+    if(taken < n) printf("[Error] Slab: Out of memory for cache %s\n", cache->name);
+    return taken;
+}
+
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj){
+    if(cache == NULL || obj == NULL) return;
+
+    kmem_slab_t *slab = obj_to_slab(cache, obj);
+    if(slab->cache != cache){
+        printf("[Error] Slab: %x does not belong to cache %s\n", (uint64_t) obj, cache->name);
+        return;
+    }
+
+    uint64_t rflags = acquire_irqsave(&cache->lock);
+    kmem_slab_t *release = cache_put(cache, slab, obj);
+    release_irqrestore(&cache->lock, rflags);
+
+    if(release) slab_destroy(cache, release);
+}
+
+// Return n objects under one acquisition of the lock
+void kmem_cache_free_bulk(kmem_cache_t *cache, void **objs, size_t n){
+    if(cache == NULL) return;
+
+    kmem_slab_t *release = NULL;                // Linked through next, they are in no list
+    uint64_t rflags = acquire_irqsave(&cache->lock);
+    for(size_t i = 0; i < n; i++){
+        if(objs[i] == NULL) continue;
+
+        kmem_slab_t *slab = obj_to_slab(cache, objs[i]);
+        if(slab->cache != cache){
+            printf("[Error] Slab: %x does not belong to cache %s\n", (uint64_t) objs[i], cache->name);
+            continue;
+        }
+
+        kmem_slab_t *empty = cache_put(cache, slab, objs[i]);
+        if(empty){
+            empty->next = release;
+            release = empty;
+        }
+    }
+    release_irqrestore(&cache->lock, rflags);
+
+    while(release){
+        kmem_slab_t *next = release->next;
+        slab_destroy(cache, release);
+        release = next;
+    }
+}
+
+
+// True if obj lies in a slab of the cache. obj must be an identity mapped address below 4 GB.
+bool kmem_cache_owns(kmem_cache_t *cache, void *obj){
+    if(cache == NULL || obj == NULL || (uint64_t) obj >= PMM_LOW_4G_LIMIT) return false;
+    if(pmm_find_region((uint64_t) obj) == NULL) return false;
+    return obj_to_slab(cache, obj)->cache == cache;
+}
+
+
+void print_kmem_cache_stats(){
+    printf("Slab caches:\n");
+    printf(" %s : %s, %s, %s, %s, %s\n", "name", "object size", "active/total objects", "slabs(KB each)", "allocs", "frees");
+
+    for(kmem_cache_t *cache = kmem_caches; cache; cache = cache->next){
+        printf(" %s : %d, %d/%d, %d(%d), %d, %d\n",
+            cache->name, cache->obj_size,
+            cache->active_objs, cache->nr_slabs * cache->objs_per_slab,
+            cache->nr_slabs, slab_size(cache) / 1024,
+            cache->allocs, cache->frees);
+    }
+}
+
+
+void test_slab(){
+    static void *objs[200];
+
+    printf(" Test Slab Allocator:\n");
+
+    kmem_cache_t *cache = kmem_cache_create("test_100", 100, 16);
+    if(cache == NULL) return;
+
+    uint64_t free_before = pmm_free_frames();
+
+    bool ok = true;
+    for(int i = 0; i < 200; i++){
+        objs[i] = kmem_cache_alloc(cache);
+        if(objs[i] == NULL || ((uint64_t) objs[i] & 15) || obj_to_slab(cache, objs[i])->cache != cache){
+            ok = false;
+            break;
+        }
+        memset(objs[i], i, 100);
+    }
+
+    // Objects must not overlap: each still holds its own pattern
+    for(int i = 0; ok && i < 200; i++){
+        if(((uint8_t *) objs[i])[99] != (uint8_t) i) ok = false;
+    }
+
+    printf(" [-] Slab: %d objects of %d bytes per %d KB slab, %d slabs for 200 objects\n",
+        cache->objs_per_slab, cache->obj_size, slab_size(cache) / 1024, cache->nr_slabs);
+
+    for(int i = 0; i < 200; i++){
+        if(objs[i]) kmem_cache_free(cache, objs[i]);
+    }
+
+    if(cache->active_objs != 0 || cache->nr_slabs > 1) ok = false;
+
+    kmem_cache_destroy(cache);
+
+    if(!ok || pmm_free_frames() != free_before){
+        printf("[Error] Slab: Test failed, free frames before %d, after %d\n", free_before, pmm_free_frames());
+    }else{
+        printf(" [-] Slab: All objects freed and slabs returned to the PMM\n");
+    }
+}
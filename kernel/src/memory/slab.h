@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "../lib/stdio.h"
+
+#define KMEM_CACHE_NAME_LEN     24
+#define KMEM_SLAB_MAX_ORDER     5       // A slab is at most 2^5 frames (128 KB)
+#define KMEM_MIN_OBJS_PER_SLAB  8       // Larger slabs are used until this many objects fit
+#define KMEM_SLAB_AUTO_ORDER    0xFF    // Let kmem_cache_create_order pick the slab size
+
+// Header at the start of every slab. Free objects are linked through their first 8 bytes.
+typedef struct kmem_slab {
+    struct kmem_slab *next;
+    struct kmem_slab *prev;
+    struct kmem_cache *cache;           // Cache which owns this slab
+    void *free_list;                    // First free object of this slab
+    uint32_t inuse;                     // Objects handed out from this slab
+} kmem_slab_t;
+
+// A cache hands out objects of one size from slabs of 2^slab_order contiguous frames
+typedef struct kmem_cache {
+    char name[KMEM_CACHE_NAME_LEN];
+    size_t obj_size;                    // Object size rounded up to the alignment
+    size_t align;
+    uint8_t slab_order;
+    uint32_t objs_per_slab;
+    size_t first_offset;                // Offset of the first object behind the slab header
+
+    kmem_slab_t *partial;               // Slabs with used and free objects
+    kmem_slab_t *full;                  // Slabs without free objects
+    kmem_slab_t *empty;                 // At most one slab without used objects is kept
+    spinlock_t lock;
+
+    // Statistics
+    uint64_t allocs;                    // kmem_cache_alloc calls which returned an object
+    uint64_t frees;                     // kmem_cache_free calls
+    uint64_t active_objs;               // Objects currently handed out
+    uint64_t nr_slabs;                  // Slabs currently owned by the cache
+    uint64_t slab_allocs;               // Slabs taken from the PMM
+    uint64_t slab_frees;                // Slabs given back to the PMM
+
+    struct kmem_cache *next;            // List of every cache
+} kmem_cache_t;
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align);
+kmem_cache_t *kmem_cache_create_order(const char *name, size_t size, size_t align, uint8_t order);
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+size_t kmem_cache_alloc_bulk(kmem_cache_t *cache, void **objs, size_t n);
+void kmem_cache_free_bulk(kmem_cache_t *cache, void **objs, size_t n);
+bool kmem_cache_owns(kmem_cache_t *cache, void *obj);
+
+void print_kmem_cache_stats();
+
+void test_slab();
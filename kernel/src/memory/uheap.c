@@ -4,39 +4,98 @@
 #include "../bootloader/boot.h"
 #include "../memory/detect_memory.h"
 #include "vmm.h"
+#include "vmem.h"
+#include "vm_region.h"
 
 #include "uheap.h"
 
 #define PAGE_SIZE 0x1000
 
-static volatile uint64_t l_va_head = LOWER_HALF_START_ADDR;
+// Address space of the user heap, freed ranges are reused and merged by the vmem arena
+static vmem_t uheap_arena;
+static bool uheap_ready;
+static spinlock_t uheap_lock;
 
 
-void *uheap_alloc(size_t size) {
+static bool init_uheap(){
+    uint64_t rflags = acquire_irqsave(&uheap_lock);
+    if(!uheap_ready){
+        uheap_ready = vmem_init(&uheap_arena, "uheap", UHEAP_START, UHEAP_END - UHEAP_START, PAGE_SIZE);
+    }
+    release_irqrestore(&uheap_lock, rflags);
+    return uheap_ready;
+}
+
+
+void *uheap_alloc_tagged(size_t size, uint16_t tag) {
     // Align size to page size (4 KiB)
     size = (size + 0xFFF) & ~0xFFF;
 
+    if (size == 0) return NULL;
+
+    if (!uheap_ready && !init_uheap()) return NULL;
+
+    uint64_t va = vmem_alloc(&uheap_arena, size);
+
     // Check if we have enough space in the heap
-    if ((l_va_head + size) > LOWER_HALF_END_ADDR) {
+    if (va == 0) {
         printf("Out of memory\n");
         return NULL;                    // Out of heap space
     }
 
-    // Allocate virtual pages for the requested size
-    uint64_t va = l_va_head;
-    
-    while (l_va_head < va + size) {
-        vm_alloc(l_va_head);            // allocating by vm_alloc function
-        l_va_head+= PAGE_SIZE;          // Increment by page size (size)
+    // Pages get a zeroed frame on first touch, see vm_region.c
+    if (!vm_region_reserve(va, size, VM_REGION_WRITE | VM_REGION_USER)) {
+        vmem_free(&uheap_arena, va, size);
+        return NULL;
     }
 
-    // Add 4KB padding between allocations to prevent overlapping
-    l_va_head += PAGE_SIZE;
+    // The region remembers the tag for the free
+    vm_region_t *region = vm_region_find(va);
+    if (region) region->tag = tag;
+    memprof_alloc(tag, size);
 
     return (void *)va; // Return the start of the allocated region
 }
 
 
+// Reserve user heap addresses for size bytes of file from offset on, see mmap()
+void *uheap_map_file(struct fat32_file *file, uint64_t offset, size_t size) {
+    size = (size + 0xFFF) & ~0xFFF;
+
+    if (size == 0) return NULL;
+
+    if (!uheap_ready && !init_uheap()) return NULL;
+
+    uint64_t va = vmem_alloc(&uheap_arena, size);
+    if (va == 0) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+
+    // Pages get the page cache frame of their file page on first touch
+    if (!vm_region_map_file(va, size, VM_REGION_USER, file, offset)) {
+        vmem_free(&uheap_arena, va, size);
+        return NULL;
+    }
+
+    return (void *)va;
+}
+
+
+// Remove a whole mapping of uheap_map_file(). size may be larger than the mapping. Returns
+// false if no file mapping starts at ptr.
+bool uheap_unmap_file(void *ptr, size_t size) {
+    uint64_t va = (uint64_t)ptr;
+    if (!uheap_ready || !vmem_contains(&uheap_arena, va)) return false;
+
+    uint64_t mapped = vm_region_release_file(va, size);
+    if (mapped == 0) return false;
+
+    vmem_free(&uheap_arena, va, mapped);
+    return true;
+}
+
+
 void uheap_free(void *ptr, size_t size) {
     if (!ptr || size == 0) {
         printf("ptr | size == 0\n");
@@ -48,12 +107,19 @@ void uheap_free(void *ptr, size_t size) {
 
     uint64_t va = (uint64_t)ptr;    // Get the virtual address of the pointer
 
-    // Free the pages corresponding to the memory region
-    while (size > 0) {              // If size greater than zero
-        vm_free((uint64_t *)va);    // Free the virtual page
-        va += PAGE_SIZE;            // Increase Virtual Address by 4KB
-        size -= PAGE_SIZE;          // Decrease the size variable by 4KB
+    if (!uheap_ready || !vmem_contains(&uheap_arena, va)) {
+        printf("[Error] uheap_free: %x is not a user heap address\n", va);
+        return;
     }
+
+    vm_region_t *region = vm_region_find(va);
+    if (region) memprof_free(region->tag, size);
+
+    // Free the frames of the touched pages
+    vm_region_release(va);
+
+    // The address space can be handed out again
+    vmem_free(&uheap_arena, va, size);
 }
 
 
@@ -4,5 +4,18 @@
 #include <stdbool.h>
 #include <stddef.h>
 
-void *uheap_alloc(size_t size);
-void uheap_free(void *ptr, size_t size);
\ No newline at end of file
+#include "memprof.h"
+
+// The user heap starts above the first 4 GB, which Limine identity maps with large pages
+#define UHEAP_START 0x0000000100000000
+#define UHEAP_END   0x00007FFFFFFFF000
+
+void *uheap_alloc_tagged(size_t size, uint16_t tag);
+void uheap_free(void *ptr, size_t size);
+
+struct fat32_file;
+void *uheap_map_file(struct fat32_file *file, uint64_t offset, size_t size);
+bool uheap_unmap_file(void *ptr, size_t size);
+
+// Charged to the calling function, see memprof.c
+#define uheap_alloc(size) uheap_alloc_tagged(size, MEMPROF_SITE(MEMPROF_UHEAP))
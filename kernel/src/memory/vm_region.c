@@ -0,0 +1,359 @@
+/*
+Demand Paging
+
+kheap_alloc() and uheap_alloc() only reserve a region of virtual addresses. None of its pages
+is mapped until it is touched for the first time: the page fault handler then finds the
+region, takes a frame, zeroes it and maps it with the protection of the region. A large
+buffer which is never used costs no memory at all.
+
+A read of an untouched page maps the shared zero page read only, so memory which is only read
+costs nothing either. The first write gives the page a zeroed frame of its own.
+
+A region which maps a file (see mmap()) is read only. A fault maps the frame of the file page
+from the page cache, which reads it from the disk if nobody has touched it yet.
+
+A fault outside of every region, a write to a read only region or a user access to a kernel
+region is a real fault and still halts the kernel.
+
+https://wiki.osdev.org/Exceptions#Page_Fault
+https://github.com/dreamportdev/Osdev-Notes/blob/master/04_Memory_Management/04_Virtual_Memory_Manager.md
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/string.h"
+
+#include "pmm.h"
+#include "pmm_cache.h"
+#include "slab.h"
+#include "vmm.h"
+#include "paging.h"
+#include "kheap.h"
+#include "zero_pool.h"
+#include "../fs/page_cache.h"
+
+#include "vm_region.h"
+
+// Present in fs/fat32.c. Declared here, fat32.h would pull the AHCI driver headers into memory/.
+extern void fat32_file_hold(struct fat32_file *file);
+extern void fat32_file_put(struct fat32_file *file);
+
+// Page fault error code bits
+#define PF_PRESENT  0x1     // The page was present, i.e. a protection violation
+#define PF_WRITE    0x2
+#define PF_USER     0x4
+
+static vm_region_t *vm_regions;     // Sorted by start address
+static kmem_cache_t *vm_region_cache;
+static spinlock_t vm_region_lock;
+
+
+static vm_region_t *find_region(uint64_t addr){
+    for(vm_region_t *region = vm_regions; region && region->start <= addr; region = region->next){
+        if(addr < region->end) return region;
+    }
+    return NULL;
+}
+
+
+static inline bool maps_zero_page(page_t *page){
+    return page->present && ((uint64_t) page->frame << 12) == zero_page_frame;
+}
+
+// Give a zeroed frame to the page at va, in place of the zero page if it has that.
+// Called with vm_region_lock held.
+static bool map_zeroed_page(vm_region_t *region, uint64_t va){
+    pml4_t *pml4 = (pml4_t *) get_cr3_addr();
+
+    page_t *page = get_pte(va, 1, pml4);
+    if(!page) return false;
+    if(page->present && !maps_zero_page(page)) return true;  // Another core was faster
+
+    uint64_t frame = zero_pool_alloc_frame();
+    if(frame == PMM_INVALID_FRAME) return false;
+
+    bool upgrade = page->present;
+
+    page->frame = frame >> 12;
+    page->rw = (region->flags & VM_REGION_WRITE) ? 1 : 0;
+    page->user = (region->flags & VM_REGION_USER) ? 1 : 0;
+    page->present = 1;                  // Last, so no core sees the entry half filled
+
+    // Other cores which still see the zero page fault on their write and find this frame
+    if(upgrade){
+        flush_tlb(va);
+    }else{
+        region->resident++;
+    }
+    return true;
+}
+
+// Map the zero page read only at va for a read of an untouched page
+static bool map_zero_page(vm_region_t *region, uint64_t va){
+    if(zero_page_frame == PMM_INVALID_FRAME) return map_zeroed_page(region, va);
+
+    page_t *page = get_pte(va, 1, (pml4_t *) get_cr3_addr());
+    if(!page) return false;
+    if(page->present) return true;
+
+    page->frame = zero_page_frame >> 12;
+    page->rw = 0;
+    page->user = (region->flags & VM_REGION_USER) ? 1 : 0;
+    page->present = 1;
+
+    region->resident++;
+    return true;
+}
+
+
+// Map the page cache frame of the file page at va, read only. The page is read without
+// vm_region_lock, which is held on entry and on return, so the region is looked up again.
+static bool map_file_page(vm_region_t *region, uint64_t va, uint64_t *rflags){
+    struct fat32_file *file = region->file;
+    uint64_t index = region->file_page + (va - region->start) / PAGE_SIZE;
+
+    fat32_file_hold(file);      // Keeps the file open even if the region is released meanwhile
+    release_irqrestore(&vm_region_lock, *rflags);
+
+    uint64_t frame = page_cache_get(file, index);   // With a reference for this mapping
+
+    *rflags = acquire_irqsave(&vm_region_lock);
+
+    bool mapped = false;
+    region = find_region(va);
+    if(frame != PMM_INVALID_FRAME && region && region->file == file){
+        page_t *page = get_pte(va, 1, (pml4_t *) get_cr3_addr());
+        if(page && page->present){
+            mapped = true;          // Another core was faster
+        }else if(page){
+            page->frame = frame >> 12;
+            page->rw = 0;
+            page->user = (region->flags & VM_REGION_USER) ? 1 : 0;
+            page->present = 1;
+
+            region->resident++;
+            frame = PMM_INVALID_FRAME;
+            mapped = true;
+        }
+    }
+
+    // The reference of a frame which was not mapped
+    if(frame != PMM_INVALID_FRAME && pmm_frame_unref(frame)) pmm_cache_free_frame(frame);
+
+    fat32_file_put(file);
+    return mapped;
+}
+
+
+static vm_region_t *new_region(uint64_t start, uint64_t size, uint32_t flags){
+    uint64_t rflags = acquire_irqsave(&vm_region_lock);
+    if(!vm_region_cache){
+        vm_region_cache = kmem_cache_create("vm_region", sizeof(vm_region_t), 0);
+    }
+    release_irqrestore(&vm_region_lock, rflags);
+
+    vm_region_t *region = kmem_cache_alloc(vm_region_cache);
+    if(!region) return NULL;
+
+    region->start = start & ~(uint64_t)(PAGE_SIZE - 1);
+    region->end = PAGE_ALIGN(start + size);
+    region->flags = flags;
+    region->resident = 0;
+    region->file = NULL;
+    region->file_page = 0;
+    region->tag = 0;
+    return region;
+}
+
+// Link region into the sorted list, unless it overlaps another region
+static bool insert_region(vm_region_t *region){
+    uint64_t rflags = acquire_irqsave(&vm_region_lock);
+
+    vm_region_t **link = &vm_regions;
+    while(*link && (*link)->start < region->start) link = &(*link)->next;
+
+    if((*link && (*link)->start < region->end) || find_region(region->start)){
+        release_irqrestore(&vm_region_lock, rflags);
+        printf("[Error] VMM: Region %x - %x overlaps another region\n", region->start, region->end);
+        kmem_cache_free(vm_region_cache, region);
+        return false;
+    }
+
+    region->next = *link;
+    *link = region;
+
+    release_irqrestore(&vm_region_lock, rflags);
+    return true;
+}
+
+
+// Reserve [start, start + size) for demand paging. Nothing is mapped yet.
+bool vm_region_reserve(uint64_t start, uint64_t size, uint32_t flags){
+    vm_region_t *region = new_region(start, size, flags);
+    return region && insert_region(region);
+}
+
+
+// Reserve [start, start + size) for the file pages from offset (page aligned) on. Mapped
+// read only whatever flags asks for. On success the region owns the file reference of the caller.
+bool vm_region_map_file(uint64_t start, uint64_t size, uint32_t flags, struct fat32_file *file, uint64_t offset){
+    vm_region_t *region = new_region(start, size, flags & ~VM_REGION_WRITE);
+    if(!region) return false;
+
+    region->file = file;
+    region->file_page = offset / PAGE_SIZE;
+    return insert_region(region);
+}
+
+
+// The region which contains addr, NULL if there is none
+vm_region_t *vm_region_find(uint64_t addr){
+    uint64_t rflags = acquire_irqsave(&vm_region_lock);
+    vm_region_t *region = find_region(addr);
+    release_irqrestore(&vm_region_lock, rflags);
+    return region;
+}
+
+
+// Take the region which starts at start out of the list. Called with vm_region_lock held.
+static vm_region_t *unlink_region(uint64_t start){
+    for(vm_region_t **link = &vm_regions; *link; link = &(*link)->next){
+        if((*link)->start == start){
+            vm_region_t *region = *link;
+            *link = region->next;
+            return region;
+        }
+    }
+    return NULL;
+}
+
+// Free the frames of the touched pages of an unlinked region, and the region itself. No fault
+// maps its pages any more. Called without the lock because the TLB shootdown waits for other
+// cores, which may be spinning on it.
+static void destroy_region(vm_region_t *region){
+    if(region->resident > 0){
+        region->resident -= vmm_unmap_range(region->start, region->end - region->start);
+    }
+
+    if(region->file) fat32_file_put(region->file);
+    kmem_cache_free(vm_region_cache, region);
+}
+
+
+// Drop the region which starts at start and free the frames of its touched pages
+void vm_region_release(uint64_t start){
+    uint64_t rflags = acquire_irqsave(&vm_region_lock);
+    vm_region_t *region = unlink_region(start);
+    release_irqrestore(&vm_region_lock, rflags);
+
+    if(!region){
+        printf("[Error] VMM: No region starts at %x\n", start);
+        return;
+    }
+
+    destroy_region(region);
+}
+
+
+// Drop the file mapping which starts at start if len covers all of it. Checked and unlinked
+// under one lock, so two munmap() calls of the same mapping can not both free it. Returns the
+// size of the region, 0 if no file mapping starts at start.
+uint64_t vm_region_release_file(uint64_t start, uint64_t len){
+    uint64_t rflags = acquire_irqsave(&vm_region_lock);
+
+    vm_region_t *region = find_region(start);
+    if(!region || !region->file || region->start != start || PAGE_ALIGN(len) < region->end - region->start){
+        release_irqrestore(&vm_region_lock, rflags);
+        return 0;
+    }
+    unlink_region(start);
+
+    release_irqrestore(&vm_region_lock, rflags);
+
+    uint64_t size = region->end - region->start;
+    destroy_region(region);
+    return size;
+}
+
+
+// Map every page of [start, start + size) now, e.g. for stacks which must not fault
+void vm_region_populate(uint64_t start, uint64_t size){
+    uint64_t rflags = acquire_irqsave(&vm_region_lock);
+
+    for(uint64_t va = start & ~(uint64_t)(PAGE_SIZE - 1); va < start + size; va += PAGE_SIZE){
+        vm_region_t *region = find_region(va);
+        if(!region || region->file || !map_zeroed_page(region, va)){
+            printf("[Error] VMM: Can not populate %x\n", va);
+            break;
+        }
+    }
+
+    release_irqrestore(&vm_region_lock, rflags);
+}
+
+
+// Called by the page fault handler. Returns true if the fault was resolved by mapping a page.
+bool vm_region_handle_fault(uint64_t addr, uint64_t err_code){
+    // A present page only faults here on a write to the zero page
+    if((err_code & PF_PRESENT) && !(err_code & PF_WRITE)) return false;
+
+    uint64_t va = addr & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t rflags = acquire_irqsave(&vm_region_lock);
+
+    vm_region_t *region = find_region(addr);
+    bool handled = region
+        && !((err_code & PF_WRITE) && !(region->flags & VM_REGION_WRITE))
+        && !((err_code & PF_USER) && !(region->flags & VM_REGION_USER));
+
+    if(handled && region->file){
+        handled = !(err_code & PF_PRESENT) && map_file_page(region, va, &rflags);
+    }else if(handled && (err_code & PF_PRESENT)){
+        page_t *page = get_pte(va, 0, (pml4_t *) get_cr3_addr());
+        handled = page && (maps_zero_page(page) || page->rw) && map_zeroed_page(region, va);
+    }else if(handled){
+        handled = (err_code & PF_WRITE) ? map_zeroed_page(region, va) : map_zero_page(region, va);
+    }
+
+    release_irqrestore(&vm_region_lock, rflags);
+    return handled;
+}
+
+
+void test_vm_region(){
+    printf(" Test Demand Paging:\n");
+
+    uint64_t size = 64 * PAGE_SIZE;
+    uint64_t start = kheap_reserve_va(size);  // Kernel heap addresses no allocation can get meanwhile
+    if(start == 0) return;
+
+    if(!vm_region_reserve(start, size, VM_REGION_WRITE)){
+        kheap_release_va(start, size);
+        return;
+    }
+
+    // Two touches fault in two zeroed pages, the rest of the region stays unbacked. The first
+    // page is read before it is written, so it maps the zero page until the write.
+    volatile uint64_t *first = (uint64_t *) start;
+    volatile uint64_t *last = (uint64_t *)(start + size - 8);
+    bool zeroed = (*first == 0);
+    bool shared = zero_page_frame == PMM_INVALID_FRAME || maps_zero_page(get_pte(start, 0, (pml4_t *) get_cr3_addr()));
+    *first = 1;
+    bool copied = !maps_zero_page(get_pte(start, 0, (pml4_t *) get_cr3_addr()));
+    *last = 0xDEADBEEF;
+
+    uint64_t rflags = acquire_irqsave(&vm_region_lock);
+    vm_region_t *region = find_region(start);
+    uint64_t resident = region ? region->resident : 0;
+    release_irqrestore(&vm_region_lock, rflags);
+
+    vm_region_release(start);
+
+    page_t *page = get_pte(start, 0, (pml4_t *) get_cr3_addr());
+    bool unmapped = !page || !page->present;
+    kheap_release_va(start, size);
+
+    if(zeroed && shared && copied && resident == 2 && unmapped){
+        printf(" [-] Demand Paging: 2 of 64 pages were backed on touch and unmapped on release\n");
+    }else{
+        printf("[Error] Demand Paging: Test failed with %d resident pages\n", resident);
+    }
+}
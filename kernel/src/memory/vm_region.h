@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Protection of the pages of a region, the same bits as in a page table entry
+#define VM_REGION_WRITE 0x2
+#define VM_REGION_USER  0x4
+
+struct fat32_file;
+
+// A reserved range of virtual addresses. Its pages get a zeroed frame on first touch, or
+// the page cache frame of their file page if the region maps a file.
+typedef struct vm_region {
+    uint64_t start;
+    uint64_t end;
+    uint32_t flags;                 // VM_REGION_*
+    uint64_t resident;              // Pages which have a frame
+    struct fat32_file *file;        // Backing file, NULL for anonymous memory
+    uint64_t file_page;             // Page of the file which start maps
+    uint16_t tag;                   // Memory profiler tag of the heap allocation, see memprof.c
+    struct vm_region *next;         // Regions sorted by address
+} vm_region_t;
+
+bool vm_region_reserve(uint64_t start, uint64_t size, uint32_t flags);
+bool vm_region_map_file(uint64_t start, uint64_t size, uint32_t flags, struct fat32_file *file, uint64_t offset);
+void vm_region_release(uint64_t start);
+uint64_t vm_region_release_file(uint64_t start, uint64_t len);
+void vm_region_populate(uint64_t start, uint64_t size);
+vm_region_t *vm_region_find(uint64_t addr);
+
+bool vm_region_handle_fault(uint64_t addr, uint64_t err_code);
+
+void test_vm_region();
@@ -0,0 +1,296 @@
+/*
+Virtual Address Range Allocator
+
+A vmem arena manages a range of virtual addresses, e.g. the kernel heap or the user heap.
+The arena is cut into segments, each described by a boundary tag. The tags are kept in
+address order, so a freed segment finds its neighbours at once and merges with the free ones.
+
+Free segments sit on power of two free lists: list i holds segments of [2^i, 2^(i+1)) bytes.
+For a request of n bytes every segment on the lists from the next power of two >= n upwards is
+large enough, so the first non empty list (one bit scan of the freemap) gives a fit in
+constant time (instant fit). Only if those lists are empty is the list of n itself searched.
+
+Allocated segments are hashed by their start address, so vmem_free() finds its tag.
+
+https://www.usenix.org/legacy/event/usenix01/full_papers/bonwick/bonwick.pdf
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/string.h"
+
+#include "slab.h"
+
+#include "vmem.h"
+
+
+static kmem_cache_t *vmem_seg_cache;    // Boundary tags of every arena
+static spinlock_t vmem_seg_cache_lock;
+
+
+static inline int highbit(uint64_t x){
+    return 63 - __builtin_clzll(x);
+}
+
+static inline uint64_t hash_index(vmem_t *vm, uint64_t addr){
+    return (addr / vm->quantum) % VMEM_HASH_SIZE;
+}
+
+
+static void freelist_insert(vmem_t *vm, vmem_seg_t *seg){
+    int i = highbit(seg->size);
+
+    seg->free = true;
+    seg->list_prev = NULL;
+    seg->list_next = vm->freelist[i];
+    if(seg->list_next) seg->list_next->list_prev = seg;
+    vm->freelist[i] = seg;
+    vm->freemap |= (1ULL << i);
+}
+
+static void freelist_remove(vmem_t *vm, vmem_seg_t *seg){
+    int i = highbit(seg->size);
+
+    if(seg->list_prev){
+        seg->list_prev->list_next = seg->list_next;
+    }else{
+        vm->freelist[i] = seg->list_next;
+    }
+    if(seg->list_next) seg->list_next->list_prev = seg->list_prev;
+    if(vm->freelist[i] == NULL) vm->freemap &= ~(1ULL << i);
+
+    seg->free = false;
+    seg->list_next = seg->list_prev = NULL;
+}
+
+static void hash_insert(vmem_t *vm, vmem_seg_t *seg){
+    uint64_t i = hash_index(vm, seg->start);
+    seg->list_prev = NULL;
+    seg->list_next = vm->hash[i];
+    vm->hash[i] = seg;
+}
+
+// Unlink the allocated segment starting at addr from the hash table
+static vmem_seg_t *hash_remove(vmem_t *vm, uint64_t addr){
+    for(vmem_seg_t **link = &vm->hash[hash_index(vm, addr)]; *link; link = &(*link)->list_next){
+        vmem_seg_t *seg = *link;
+        if(seg->start == addr){
+            *link = seg->list_next;
+            seg->list_next = NULL;
+            return seg;
+        }
+    }
+    return NULL;
+}
+
+
+// Put a new tag for [start, start + size) into the address list behind prev
+static vmem_seg_t *seg_create(vmem_t *vm, vmem_seg_t *prev, uint64_t start, uint64_t size){
+    vmem_seg_t *seg = kmem_cache_alloc(vmem_seg_cache);
+    if(seg == NULL) return NULL;
+
+    memset(seg, 0, sizeof(vmem_seg_t));
+    seg->start = start;
+    seg->size = size;
+
+    seg->addr_prev = prev;
+    seg->addr_next = prev ? prev->addr_next : vm->segs;
+    if(seg->addr_next) seg->addr_next->addr_prev = seg;
+    if(prev){
+        prev->addr_next = seg;
+    }else{
+        vm->segs = seg;
+    }
+
+    vm->nr_segs++;
+    return seg;
+}
+
+// Drop the tag of a segment which was merged into its neighbour
+static void seg_destroy(vmem_t *vm, vmem_seg_t *seg){
+    if(seg->addr_prev){
+        seg->addr_prev->addr_next = seg->addr_next;
+    }else{
+        vm->segs = seg->addr_next;
+    }
+    if(seg->addr_next) seg->addr_next->addr_prev = seg->addr_prev;
+
+    vm->nr_segs--;
+    kmem_cache_free(vmem_seg_cache, seg);
+}
+
+
+// A free segment of at least size bytes, or NULL
+static vmem_seg_t *find_free(vmem_t *vm, uint64_t size){
+    int i = highbit(size);
+
+    // Instant fit: any segment on a list of the next power of two or above is large enough
+    int first = (size & (size - 1)) ? i + 1 : i;
+    if(first < VMEM_FREELISTS){
+        uint64_t lists = vm->freemap & (~0ULL << first);
+        if(lists) return vm->freelist[__builtin_ctzll(lists)];
+    }
+
+    // The list of size itself mixes smaller and larger segments
+    for(vmem_seg_t *seg = vm->freelist[i]; seg; seg = seg->list_next){
+        if(seg->size >= size) return seg;
+    }
+    return NULL;
+}
+
+
+// Set up an arena for [base, base + size). base and size must be multiples of the quantum.
+bool vmem_init(vmem_t *vm, const char *name, uint64_t base, uint64_t size, uint64_t quantum){
+    uint64_t rflags = acquire_irqsave(&vmem_seg_cache_lock);
+    if(vmem_seg_cache == NULL){
+        vmem_seg_cache = kmem_cache_create("vmem_seg", sizeof(vmem_seg_t), 0);
+    }
+    release_irqrestore(&vmem_seg_cache_lock, rflags);
+
+    if(vmem_seg_cache == NULL || quantum == 0 || (quantum & (quantum - 1)) || (base | size) & (quantum - 1) || size == 0){
+        printf("[Error] vmem: Can not create arena %s\n", name);
+        return false;
+    }
+
+    memset(vm, 0, sizeof(vmem_t));
+    strncpy(vm->name, name, VMEM_NAME_LEN - 1);
+    vm->base = base;
+    vm->size = size;
+    vm->quantum = quantum;
+
+    vmem_seg_t *seg = seg_create(vm, NULL, base, size);
+    if(seg == NULL) return false;
+    freelist_insert(vm, seg);
+
+    return true;
+}
+
+
+// Drop every tag of the arena. The ranges handed out by it must not be used any more.
+void vmem_destroy(vmem_t *vm){
+    while(vm->segs) seg_destroy(vm, vm->segs);
+    memset(vm->freelist, 0, sizeof(vm->freelist));
+    memset(vm->hash, 0, sizeof(vm->hash));
+    vm->freemap = 0;
+    vm->in_use = 0;
+}
+
+
+// Allocate size bytes (rounded up to the quantum) of the arena. Returns the start address or 0
+uint64_t vmem_alloc(vmem_t *vm, uint64_t size){
+    if(size == 0) return 0;
+    size = (size + vm->quantum - 1) & ~(vm->quantum - 1);
+
+    uint64_t rflags = acquire_irqsave(&vm->lock);
+
+    vmem_seg_t *seg = find_free(vm, size);
+    if(seg == NULL){
+        release_irqrestore(&vm->lock, rflags);
+        return 0;
+    }
+
+    // The rest of a larger segment stays free behind the allocated part
+    if(seg->size > size){
+        vmem_seg_t *rest = seg_create(vm, seg, seg->start + size, seg->size - size);
+        if(rest == NULL){
+            release_irqrestore(&vm->lock, rflags);
+            return 0;
+        }
+        freelist_remove(vm, seg);
+        seg->size = size;
+        freelist_insert(vm, rest);
+    }else{
+        freelist_remove(vm, seg);
+    }
+
+    hash_insert(vm, seg);
+    vm->in_use += size;
+    vm->allocs++;
+
+    release_irqrestore(&vm->lock, rflags);
+    return seg->start;
+}
+
+
+// Give back a range from vmem_alloc and merge it with its free neighbours
+void vmem_free(vmem_t *vm, uint64_t addr, uint64_t size){
+    size = (size + vm->quantum - 1) & ~(vm->quantum - 1);
+
+    uint64_t rflags = acquire_irqsave(&vm->lock);
+
+    vmem_seg_t *seg = hash_remove(vm, addr);
+    if(seg == NULL || seg->size != size){
+        if(seg) hash_insert(vm, seg);
+        release_irqrestore(&vm->lock, rflags);
+        printf("[Error] vmem: %x with size %x is not allocated from %s\n", addr, size, vm->name);
+        return;
+    }
+
+    vm->in_use -= seg->size;
+    vm->frees++;
+
+    vmem_seg_t *next = seg->addr_next;
+    if(next && next->free && seg->start + seg->size == next->start){
+        freelist_remove(vm, next);
+        seg->size += next->size;
+        seg_destroy(vm, next);
+    }
+
+    vmem_seg_t *prev = seg->addr_prev;
+    if(prev && prev->free && prev->start + prev->size == seg->start){
+        freelist_remove(vm, prev);
+        prev->size += seg->size;
+        seg_destroy(vm, seg);
+        seg = prev;
+    }
+
+    freelist_insert(vm, seg);
+
+    release_irqrestore(&vm->lock, rflags);
+}
+
+
+bool vmem_contains(vmem_t *vm, uint64_t addr){
+    return addr >= vm->base && addr - vm->base < vm->size;
+}
+
+
+void print_vmem_stats(vmem_t *vm){
+    printf(" %s : %x - %x, in use %d KB, %d segments, %d allocs, %d frees\n",
+        vm->name, vm->base, vm->base + vm->size, vm->in_use / 1024, vm->nr_segs, vm->allocs, vm->frees);
+}
+
+
+void test_vmem(){
+    static vmem_t arena;
+    static uint64_t addrs[64];
+
+    printf(" Test vmem:\n");
+
+    // Only address space is handed out, nothing is mapped
+    if(!vmem_init(&arena, "test_vmem", 0x100000, 0x1000000, 0x1000)) return;
+
+    bool ok = true;
+    for(int i = 0; i < 64; i++){
+        addrs[i] = vmem_alloc(&arena, (i % 7 + 1) * 0x1000);
+        if(addrs[i] == 0) ok = false;
+    }
+
+    // Free every second range: the holes are reused by allocations which fit into them
+    for(int i = 0; i < 64; i += 2) vmem_free(&arena, addrs[i], (i % 7 + 1) * 0x1000);
+    uint64_t reused = vmem_alloc(&arena, 0x1000);
+    if(reused >= addrs[63]) ok = false;
+    vmem_free(&arena, reused, 0x1000);
+
+    for(int i = 1; i < 64; i += 2) vmem_free(&arena, addrs[i], (i % 7 + 1) * 0x1000);
+
+    // Everything merged back into one segment
+    if(arena.nr_segs != 1 || arena.in_use != 0 || vmem_alloc(&arena, 0x1000000) != 0x100000) ok = false;
+
+    if(ok){
+        printf(" [-] vmem: Freed ranges are reused and coalesce back into one segment\n");
+    }else{
+        printf("[Error] vmem: Test failed with %d segments and %d bytes in use\n", arena.nr_segs, arena.in_use);
+    }
+
+    vmem_destroy(&arena);
+}
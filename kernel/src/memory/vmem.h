@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "../lib/stdio.h"
+
+#define VMEM_FREELISTS  64          // Free list i holds free segments of [2^i, 2^(i+1)) bytes
+#define VMEM_HASH_SIZE  64          // Buckets of the allocated segment hash
+#define VMEM_NAME_LEN   24
+
+// Boundary tag of one segment. All segments of an arena are kept in address order, a free
+// segment is also on the free list of its size, an allocated one in the hash table.
+typedef struct vmem_seg {
+    uint64_t start;
+    uint64_t size;
+    bool free;
+    struct vmem_seg *addr_next;     // Segments in address order
+    struct vmem_seg *addr_prev;
+    struct vmem_seg *list_next;     // Free list or hash chain
+    struct vmem_seg *list_prev;
+} vmem_seg_t;
+
+// An arena hands out ranges of [base, base + size) in multiples of its quantum
+typedef struct vmem {
+    char name[VMEM_NAME_LEN];
+    uint64_t base;
+    uint64_t size;
+    uint64_t quantum;
+
+    vmem_seg_t *segs;                           // Lowest segment
+    vmem_seg_t *freelist[VMEM_FREELISTS];
+    uint64_t freemap;                           // Bit i is set when freelist[i] is not empty
+    vmem_seg_t *hash[VMEM_HASH_SIZE];
+    spinlock_t lock;
+
+    // Statistics
+    uint64_t in_use;                            // Bytes handed out
+    uint64_t nr_segs;
+    uint64_t allocs;
+    uint64_t frees;
+} vmem_t;
+
+bool vmem_init(vmem_t *vm, const char *name, uint64_t base, uint64_t size, uint64_t quantum);
+void vmem_destroy(vmem_t *vm);
+uint64_t vmem_alloc(vmem_t *vm, uint64_t size);
+void vmem_free(vmem_t *vm, uint64_t addr, uint64_t size);
+bool vmem_contains(vmem_t *vm, uint64_t addr);
+
+void print_vmem_stats(vmem_t *vm);
+
+void test_vmem();
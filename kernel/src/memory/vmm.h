@@ -8,14 +8,61 @@ https://chatgpt.com/share/675fa60d-c044-8001-aef6-d23b3d62ab62
 #include <stdbool.h>
 
 
+// Frames of removed mappings wait in a gather until the TLB is flushed
+#define TLB_GATHER_FRAMES 64
+#define TLB_GATHER_TABLES 16        // Page tables which became empty
+
+// Invalidations and freed frames of a range operation. The TLB is flushed once for the whole
+// batch, and only after that do the frames go back to the PMM.
+typedef struct tlb_gather {
+    uint64_t start;                         // Lowest changed address
+    uint64_t end;                           // End of the highest changed page
+    uint64_t frames[TLB_GATHER_FRAMES];
+    uint64_t nr_frames;
+    uint64_t tables[TLB_GATHER_TABLES];
+    uint64_t nr_tables;
+} tlb_gather_t;
+
+// Translations of kernel heap and user addresses which virt_to_phys() keeps on every core
+#define VIRT_CACHE_SIZE 64              // Entries, a power of two
+#define VIRT_INVALID_ADDR ((uint64_t)-1)
+
+// A small software TLB. It caches the frames of single 4 KB pages, and the page table of
+// the last walk, so a buffer which crosses many pages walks the upper levels once per 2 MB.
+typedef struct virt_cache {
+    uint64_t tags[VIRT_CACHE_SIZE];     // Virtual page number + 1, 0 for an empty entry
+    uint64_t frames[VIRT_CACHE_SIZE];
+    uint64_t pt_base;                   // 2 MB which the cached page table maps
+    uint64_t *pt;                       // HHDM pointer of that page table, NULL for none
+    uint64_t hits;                      // Served from an entry
+    uint64_t pt_hits;                   // Walked from the cached page table
+    uint64_t walks;                     // Walked from the PML4
+} virt_cache_t;
+
+void tlb_gather_init(tlb_gather_t *tlb);
+void tlb_gather_page(tlb_gather_t *tlb, uint64_t va);
+void tlb_gather_frame(tlb_gather_t *tlb, uint64_t frame);
+void tlb_gather_table(tlb_gather_t *tlb, uint64_t table);
+void tlb_gather_flush(tlb_gather_t *tlb);
+
+bool vmm_map_range(uint64_t va, uint64_t size, uint64_t flags);
+uint64_t vmm_unmap_range(uint64_t va, uint64_t size);
+
 void vm_alloc(uint64_t va);
 void vm_free(uint64_t *ptr);
 
 uint64_t phys_to_vir(uint64_t pa);
 uint64_t vir_to_phys(uint64_t va);
 
+uint64_t virt_to_phys(uint64_t va);
+uint64_t virt_to_phys_run(uint64_t va, uint64_t size, uint64_t *pa);
+void virt_cache_flush_range(uint64_t start, uint64_t end);
+void virt_cache_flush_all();
+void print_virt_cache_stats();
+
 bool is_phys_addr(uint64_t addr);
 bool is_virt_addr(uint64_t addr);
 
 void test_vmm();
+void test_virt_to_phys();
 
@@ -0,0 +1,216 @@
+/*
+Pre-zeroed Frames and the Zero Page
+
+Page tables and anonymous pages must start out zeroed. Clearing 4 KB on the allocation path
+costs a full pass over the frame and evicts useful cache lines. Idle cores fill a pool of
+frames which are zeroed already, with non-temporal stores (movnti) which go around the cache
+to memory. zero_pool_alloc_frame() pops one of them and only clears a frame itself when the
+pool is empty. Every NUMA node has a pool of its own, a core fills and takes from the pool of
+its node only.
+
+A read fault on an anonymous page needs no frame at all: the page maps the shared zero page
+read only. The first write replaces it with a zeroed frame of its own. The zero page is pinned
+in the PMM, so unmapping or copy on write never frees it.
+
+https://wiki.osdev.org/Page_Frame_Allocation
+https://www.felixcloutier.com/x86/movnti
+https://lwn.net/Articles/517465/
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/string.h"
+#include "../sys/timer/tsc.h"
+
+#include "pmm.h"
+#include "pmm_cache.h"
+#include "vmm.h"
+#include "paging.h"
+
+#include "numa.h"
+#include "zero_pool.h"
+
+
+uint64_t zero_page_frame = PMM_INVALID_FRAME;
+
+static uint64_t zero_pool[NUMA_MAX_NODES][ZERO_POOL_SIZE];  // Physical addresses of zeroed frames
+static uint64_t zero_pool_count[NUMA_MAX_NODES];
+static spinlock_t zero_pool_lock;
+
+static uint64_t zero_pool_hits;                 // Allocations served zeroed from the pool
+static uint64_t zero_pool_misses;               // Allocations which had to clear the frame
+
+
+// Clear a frame without pulling it into the cache. The caller runs an sfence before the frame
+// is handed out, it orders the weakly ordered stores.
+void zero_frame_nt(uint64_t frame){
+    uint64_t *page = (uint64_t *) phys_to_vir(frame);
+
+    for(uint64_t i = 0; i < FRAME_SIZE / sizeof(uint64_t); i += 8){
+        asm volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)\n\t"
+            "movnti %1, 32(%0)\n\t"
+            "movnti %1, 40(%0)\n\t"
+            "movnti %1, 48(%0)\n\t"
+            "movnti %1, 56(%0)\n\t"
+            :: "r"(page + i), "r"(0ULL) : "memory");
+    }
+}
+
+
+// Called by the bootstrap core once paging is up
+void init_zero_pool(){
+    zero_page_frame = pmm_cache_alloc_frame();
+    if(zero_page_frame == PMM_INVALID_FRAME){
+        printf("[Error] Zero Pool: No frame for the zero page\n");
+        return;
+    }
+
+    memset((void *) phys_to_vir(zero_page_frame), 0, FRAME_SIZE);
+    pmm_frame_pin(zero_page_frame);
+
+    printf(" [-] Zero Pool: Zero page at %x, up to %d pre-zeroed frames\n", zero_page_frame, ZERO_POOL_SIZE);
+}
+
+
+// A zeroed frame, from the pool of this node if it has one. Returns PMM_INVALID_FRAME if memory is out.
+uint64_t zero_pool_alloc_frame(){
+    uint64_t frame = PMM_INVALID_FRAME;
+    uint8_t node = this_numa_node();
+
+    uint64_t rflags = acquire_irqsave(&zero_pool_lock);
+    if(zero_pool_count[node] > 0){
+        frame = zero_pool[node][--zero_pool_count[node]];
+        zero_pool_hits++;
+    }else{
+        zero_pool_misses++;
+    }
+    release_irqrestore(&zero_pool_lock, rflags);
+
+    if(frame != PMM_INVALID_FRAME) return frame;
+
+    frame = pmm_cache_alloc_frame();
+    if(frame != PMM_INVALID_FRAME) memset((void *) phys_to_vir(frame), 0, FRAME_SIZE);
+    return frame;
+}
+
+
+// A zeroed frame below limit from the pool of this node, e.g. for page tables which the identity
+// map must reach. Unlike zero_pool_alloc_frame() it does not clear one itself, it returns
+// PMM_INVALID_FRAME if the pool has none.
+uint64_t zero_pool_take_below(uint64_t limit){
+    uint64_t frame = PMM_INVALID_FRAME;
+    uint8_t node = this_numa_node();
+
+    uint64_t rflags = acquire_irqsave(&zero_pool_lock);
+    for(uint64_t i = zero_pool_count[node]; i > 0; i--){
+        if(zero_pool[node][i - 1] >= limit) continue;
+
+        frame = zero_pool[node][i - 1];
+        zero_pool[node][i - 1] = zero_pool[node][--zero_pool_count[node]];
+        zero_pool_hits++;
+        break;
+    }
+    release_irqrestore(&zero_pool_lock, rflags);
+
+    return frame;
+}
+
+
+// Zero up to ZERO_POOL_BATCH frames for the pool of this node. Called from the idle loop of a
+// core, returns the number of frames added, 0 once the pool is full or memory is short.
+uint64_t zero_pool_fill(){
+    uint64_t added = 0;
+    uint8_t node = this_numa_node();
+
+    for(; added < ZERO_POOL_BATCH; added++){
+        if(__atomic_load_n(&zero_pool_count[node], __ATOMIC_RELAXED) >= ZERO_POOL_SIZE) break;
+
+        // Idle memory only: the last free frames stay with the allocators
+        if(pmm_free_frames() < ZERO_POOL_MIN_FREE) break;
+
+        uint64_t frame = pmm_cache_alloc_frame();
+        if(frame == PMM_INVALID_FRAME) break;
+
+        zero_frame_nt(frame);
+        asm volatile("sfence" ::: "memory");
+
+        uint64_t rflags = acquire_irqsave(&zero_pool_lock);
+        bool full = zero_pool_count[node] >= ZERO_POOL_SIZE;
+        if(!full) zero_pool[node][zero_pool_count[node]++] = frame;
+        release_irqrestore(&zero_pool_lock, rflags);
+
+        if(full){               // Another core filled the last slot meanwhile
+            pmm_cache_free_frame(frame);
+            break;
+        }
+    }
+
+    return added;
+}
+
+
+// The loop of a core which has nothing else to do: zero frames, sleep once the pool is full
+void zero_pool_idle(){
+    for(;;){
+        if(zero_pool_fill() == 0) asm volatile("hlt");
+    }
+}
+
+
+// Zeroed frames in the pool of this node
+uint64_t zero_pool_frames(){
+    return __atomic_load_n(&zero_pool_count[this_numa_node()], __ATOMIC_RELAXED);
+}
+
+
+void print_zero_pool_stats(){
+    uint64_t frames = 0;
+    for(int node = 0; node < NUMA_MAX_NODES; node++) frames += zero_pool_count[node];
+
+    printf(" Zero pool: %d zeroed frames, %d hits, %d misses\n", frames, zero_pool_hits, zero_pool_misses);
+}
+
+
+#define BENCH_FRAMES 64
+
+// Compare a frame from the pool with a frame cleared on the allocation path
+void bench_zero_pool(){
+    static uint64_t frames[BENCH_FRAMES];
+
+    while(zero_pool_frames() < BENCH_FRAMES && zero_pool_fill() > 0);
+    if(zero_pool_frames() < BENCH_FRAMES){
+        printf("[Error] Zero Pool: Can not fill the pool for the benchmark\n");
+        return;
+    }
+
+    uint64_t start = read_tsc();
+    for(int i = 0; i < BENCH_FRAMES; i++) frames[i] = zero_pool_alloc_frame();
+    uint64_t pooled = (read_tsc() - start) / BENCH_FRAMES;
+
+    bool zeroed = true;
+    for(int i = 0; i < BENCH_FRAMES; i++){
+        uint64_t *page = (uint64_t *) phys_to_vir(frames[i]);
+        for(uint64_t j = 0; j < FRAME_SIZE / sizeof(uint64_t); j++){
+            if(page[j] != 0) zeroed = false;
+        }
+        pmm_cache_free_frame(frames[i]);
+    }
+
+    start = read_tsc();
+    for(int i = 0; i < BENCH_FRAMES; i++){
+        frames[i] = pmm_cache_alloc_frame();
+        memset((void *) phys_to_vir(frames[i]), 0, FRAME_SIZE);
+    }
+    uint64_t cleared = (read_tsc() - start) / BENCH_FRAMES;
+
+    for(int i = 0; i < BENCH_FRAMES; i++) pmm_cache_free_frame(frames[i]);
+
+    if(zeroed){
+        printf(" [-] Zero Pool: %d cycles per pre-zeroed frame, %d cycles with memset\n", pooled, cleared);
+    }else{
+        printf("[Error] Zero Pool: A frame from the pool was not zeroed\n");
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define ZERO_POOL_SIZE      512     // Zeroed frames kept ready per NUMA node (2 MB)
+#define ZERO_POOL_BATCH     16      // Frames an idle core zeroes before it checks for work again
+#define ZERO_POOL_MIN_FREE  4096    // Free frames (16 MB) below which nothing is taken for the pool
+
+extern uint64_t zero_page_frame;    // Mapped read only by every untouched anonymous page
+
+void init_zero_pool();
+
+void zero_frame_nt(uint64_t frame);
+
+uint64_t zero_pool_alloc_frame();
+uint64_t zero_pool_take_below(uint64_t limit);
+uint64_t zero_pool_fill();
+void zero_pool_idle();
+uint64_t zero_pool_frames();
+
+void print_zero_pool_stats();
+void bench_zero_pool();
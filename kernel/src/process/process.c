@@ -18,18 +18,28 @@ https://wiki.osdev.org/Brendan%27s_Multi-tasking_Tutorial
 #include "../lib/stdio.h"
 #include "../lib/string.h"
 #include "../memory/kheap.h"
+#include "../memory/slab.h"
 #include "../util/util.h"
 #include "thread.h"
 #include "types.h"
+#include "scheduler.h"
 #include "process.h"
 
 
 extern void restore_cpu_state(registers_t* registers);
 
 size_t next_free_pid = 0;           // Available free process id
-process_t *current_process;         // Current running process
 process_t *processes_list = NULL;   // List of all processes
 
+static kmem_cache_t *process_cache; // Slab cache of process_t objects
+
+
+// Called once by the bootstrap core before the application cores start and create processes
+void init_process_cache() {
+    process_cache = kmem_cache_create("process_t", sizeof(process_t), 0);
+    if (!process_cache) printf("[Error] Process: No slab cache for process_t\n");
+}
+
 // Adding Process into process_list
 void add_process(process_t* proc) {
     if (!proc) return;
@@ -41,22 +51,23 @@ void add_process(process_t* proc) {
 
 // Creating a new process with a null thread
 process_t* create_process(const char* name) {
-    
-    process_t* proc = (process_t*) kheap_alloc(sizeof(process_t)); // Allocate memory for the process
+    process_t* proc = (process_t*) kmem_cache_alloc(process_cache); // Allocate memory for the process
     if (!proc){
         printf("Process Memory allocation Failed!\n");
         return NULL; // Return NULL if memory allocation fails
     } 
     
     // Assign the next available PID
-    proc->pid = next_free_pid++;    // pick and assigne process id
+    proc->pid = __atomic_fetch_add(&next_free_pid, 1, __ATOMIC_RELAXED);    // pick and assigne process id
     proc->status = READY;           // Changed the status into READY
     strncpy(proc->name, name, NAME_MAX_LEN - 1); // Copy name
     proc->name[NAME_MAX_LEN - 1] = '\0'; // Ensure null-termination
     proc->next = NULL;      // The next process of this is Null
     proc->threads = NULL;   // Currents threads are null
     proc->current_thread = proc->threads;
+    proc->threads_lock.locked = false;
     proc->cpu_time = 0;
+    proc->as = &kernel_address_space;   // Kernel processes share the kernel page tables
 
     // Add the process to the global process list
     add_process(proc);
@@ -98,58 +109,46 @@ void delete_process(process_t* proc) {
     // Remove the process from the global process list
     remove_process(proc);
 
-    // Free the process and its threads
+    // Free the process and its threads, delete_thread() unlinks each one under threads_lock
     while (true)
     {
         thread_t* thread = proc->threads; // First Thread of the thread linked list
         if (!thread) break; // No more threads to delete
-        proc->threads = thread->next;
         delete_thread(thread);
     }
 
     printf("Deleting Process: %s (PID: %d)\n", proc->name, proc->pid);
-    kheap_free(proc, sizeof(process_t));
+    if (proc->as != &kernel_address_space) address_space_destroy(proc->as);
+    kmem_cache_free(process_cache, proc);
 }
 
 
-registers_t* schedule(registers_t* registers) {
-    void *prev_registers = (void *)(uintptr_t)registers;
-    if (!current_process || !current_process->current_thread) return NULL;
-
-    __asm__ volatile("cli");   // Clearing Interrupt
-    // printf("Starting mem copy\n");
-    memcpy((void *)&current_process->current_thread->registers, (void *)prev_registers, sizeof(registers_t)); // Save current thread state
-    // printf("mem copy Ended\n");
-    // __asm__ volatile("sti");   // Starting Interrupt
-    
-
-    current_process->current_thread->status = READY;
-
-    thread_t* current_thread = current_process->current_thread;
-    thread_t* next_thread = current_thread->next;
+// fork(): a child of parent with a copy on write copy of its address space and of the calling
+// thread, which continues from registers. Only user threads fork, a kernel thread's stack
+// lives in the shared kernel half. Returns the child or NULL.
+process_t* fork_process(process_t* parent, registers_t* registers) {
+    thread_t* self = get_current_thread();
+    if (!parent || !self || self->parent != parent || (registers->iret_cs & 3) != 3) return NULL;
 
-    if(!next_thread) next_thread = current_process->threads;
+    address_space_t *as = address_space_clone(parent->as);
+    if (!as) return NULL;
 
-    // Round-robin search for next READY thread
-    // while (next_thread != current_thread) {
-    //     if (next_thread->status == READY){
-    //         break;
-    //     }
-    //     next_thread = next_thread->next;
-    // }
-  
-    // printf("Next:%s\n", next_thread->name);
+    process_t* child = create_process(parent->name);
+    if (!child) {
+        address_space_destroy(as);
+        return NULL;
+    }
+    child->as = as;
 
-    // Update current thread and set status
-    next_thread->status = RUNNING;
-    current_process->current_thread = next_thread;
+    if (!clone_thread(child, self, registers)) {
+        delete_process(child);
+        return NULL;
+    }
 
-    // __asm__ volatile("sti");   // Starting Interrupt
-    return (registers_t *)(uintptr_t) &current_process->current_thread->registers;
+    return child;
 }
 
 
-
 void print_process_list() {
     process_t* current = processes_list;
     printf("Current Running Process:\n");
@@ -171,8 +170,10 @@ process_t* get_process_by_pid(size_t pid) {
     return NULL; // Not found
 }
 
+// Process of the thread which runs on this core
 process_t * get_current_process() {
-    return processes_list; // Return the current process
+    thread_t* thread = get_current_thread();
+    return thread ? thread->parent : NULL;
 }
 
 
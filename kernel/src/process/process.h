@@ -7,6 +7,8 @@
 
 #include "types.h"          // for process_t and thread_t structures
 #include "../util/util.h"   // for registers_t
+#include "../lib/stdio.h"   // for spinlock_t
+#include "../memory/address_space.h"
 
 #define NAME_MAX_LEN 64
 
@@ -19,7 +21,7 @@ typedef enum { // 4 bytes
 } status_t;
 
 
-typedef struct process {        // 112 byte
+typedef struct process {        // 128 byte
     size_t pid;                 // Process ID
     status_t status;            // Process status
     char name[NAME_MAX_LEN];    // Process name
@@ -27,6 +29,8 @@ typedef struct process {        // 112 byte
 
     thread_t* threads;          // List of threads in the process
     thread_t* current_thread;   // Current running thread
+    spinlock_t threads_lock;    // Guards threads and current_thread
+    address_space_t *as;        // Page tables of the process
     
     uint64_t cpu_time;          // Track CPU time per process
 } process_t;
@@ -34,13 +38,12 @@ typedef struct process {        // 112 byte
 
 
 extern size_t next_free_pid;        //Available free process id
-extern process_t *current_process;  // Current running process
 extern process_t *processes_list;   // List of all processes
 
+void init_process_cache();
 process_t* create_process(const char* name);
 void delete_process(process_t* proc);
-
-registers_t* schedule(registers_t* registers);
+process_t* fork_process(process_t* parent, registers_t* registers);
 
 process_t* get_process_by_pid(size_t pid);
 process_t * get_current_process();
@@ -0,0 +1,773 @@
+/*
+Preemptive Scheduler
+
+The scheduler is tickless. Every switch arms the one shot APIC timer for the end of the time
+slice of the next thread or the next timer event of the core, see timer_wheel.c. An idle core
+only wakes for its timer events, interrupts and IPIs. When the timer fires irq_handler() hands
+the saved registers to schedule(), which copies them into the thread, queues the thread if it
+can still run and returns the registers of the next thread. The stub in irq.asm loads its
+stack pointer from them, so its iretq resumes the other thread. thread_yield() gives up the
+rest of the time slice with a software interrupt on SCHED_YIELD_VECTOR, which takes the same
+path.
+
+Only READY threads are in a run queue. A SLEEPING thread waits for thread_wake(), a DEAD one
+for thread_join() and delete_thread(). init_scheduler() turns the context which runs on the
+core into its idle thread, which runs whenever the run queue is empty: kmain() continues as the
+idle thread of the bootstrap core, target_cpu_task() as the one of an application core.
+
+A run queue has SCHED_PRIO_LEVELS levels in each of two arrays, as in the O(1) scheduler of
+Linux 2.6. The first set bit of the bitmap of the active array is the level to run next, so
+picking a thread costs the same for any number of threads. The nice value of a thread sets its
+base level and the length of its time slice: nice -20 gets 800 ms, 0 gets 100 ms and 19 gets
+5 ms. A thread which uses up its slice drops a level, up to SCHED_MAX_PENALTY, and waits in the
+expired array until every thread of the active array has had its slice, then the arrays swap.
+A woken thread returns to its base level, an interactive one SCHED_WAKE_BOOST levels above it,
+and preempts a thread of a lower level at once. So the shell answers a key while CPU hogs run.
+
+Every core has a run queue of its own in cpu_data_t, with its own lock, which also guards the
+status of the threads of the core. thread->cpu names the core, a woken thread goes back to it
+while its cache may still be warm. A new thread goes to the core with the least work. A core
+which would go idle steals half of the run queue of the busiest core. When a core gets work
+which an idle core could take, or a thread which should preempt the running one, it sends that
+core a reschedule IPI over the IPI vector, so it does not wait for its next tick.
+
+The timer, the yield and the IPI run on the interrupt stack (IST1), not on the stack of the
+interrupted thread. Once its registers are saved nothing runs on the stack of the old thread
+any more, so another core can resume it at once. The x87 and SSE registers are not part of
+the interrupt frame, schedule() saves them with fxsave into the old thread and loads those of
+the next thread with fxrstor.
+
+https://wiki.osdev.org/Scheduling_Algorithms
+https://wiki.osdev.org/Context_Switching
+https://github.com/dreamportdev/Osdev-Notes/blob/master/05_Scheduling/README.md
+https://www.kernel.org/doc/html/latest/scheduler/sched-domains.html
+https://www.kernel.org/doc/html/latest/scheduler/sched-nice-design.html
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/string.h"
+#include "../memory/address_space.h"
+#include "../sys/timer/tsc.h"
+#include "../sys/timer/timer_wheel.h"
+#include "../arch/interrupt/apic/ipi.h"
+#include "../sys/cpu/cpu.h"
+
+#include "process.h"
+#include "thread.h"
+#include "scheduler.h"
+
+
+static uint32_t sched_cpus[MAX_CPUS];   // Cores which run the scheduler, in start order
+static uint32_t sched_cpu_count;
+static uint32_t next_placement;         // Rotates where the search for the least busy core starts
+
+static process_t *idle_process;         // Owns the idle thread of every core
+static spinlock_t sched_init_lock;
+
+
+// Level of a thread which is neither penalized nor boosted
+static inline uint8_t base_priority(thread_t *thread){
+    return (uint8_t)(thread->nice - SCHED_NICE_MIN);
+}
+
+// Time slice in TSC cycles: 800 ms for nice -20, 100 ms for 0 and 5 ms for 19
+static uint64_t slice_cycles(thread_t *thread){
+    int32_t nice = thread->nice;
+    uint64_t ms = (uint64_t)(20 - nice) * (nice < 0 ? 20 : 5);
+    return ms * (cpu_frequency_hz / 1000);
+}
+
+
+static void prio_array_push(prio_array_t *array, thread_t *thread){
+    uint8_t level = thread->priority;
+    thread->run_next = NULL;
+    if(array->tail[level]){
+        array->tail[level]->run_next = thread;
+    }else{
+        array->head[level] = thread;
+    }
+    array->tail[level] = thread;
+    array->bitmap |= 1ULL << level;
+}
+
+// Unlink thread, whose predecessor at its level is prev (NULL at the head)
+static void prio_array_unlink_after(prio_array_t *array, thread_t *prev, thread_t *thread){
+    uint8_t level = thread->priority;
+    if(prev){
+        prev->run_next = thread->run_next;
+    }else{
+        array->head[level] = thread->run_next;
+    }
+    if(array->tail[level] == thread) array->tail[level] = prev;
+    if(!array->head[level]) array->bitmap &= ~(1ULL << level);
+    thread->run_next = NULL;
+}
+
+static bool prio_array_unlink(prio_array_t *array, thread_t *thread){
+    thread_t *prev = NULL;
+    for(thread_t *t = array->head[thread->priority]; t; prev = t, t = t->run_next){
+        if(t == thread){
+            prio_array_unlink_after(array, prev, t);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Queue thread at its level, in the expired array if it used up its slice
+static void run_queue_push(cpu_data_t *cpu, thread_t *thread, bool expired){
+    prio_array_push(&cpu->prio_arrays[cpu->active_array ^ expired], thread);
+    cpu->run_queue_length++;
+}
+
+// The first thread of the highest level of the active array
+static thread_t *run_queue_pop(cpu_data_t *cpu){
+    prio_array_t *active = &cpu->prio_arrays[cpu->active_array];
+    if(!active->bitmap){
+        cpu->active_array ^= 1;                 // Every thread had its slice, the expired ones run again
+        active = &cpu->prio_arrays[cpu->active_array];
+        if(!active->bitmap) return NULL;
+    }
+
+    thread_t *thread = active->head[__builtin_ctzll(active->bitmap)];
+    prio_array_unlink_after(active, NULL, thread);
+    cpu->run_queue_length--;
+    return thread;
+}
+
+static void run_queue_unlink(cpu_data_t *cpu, thread_t *thread){
+    if(prio_array_unlink(&cpu->prio_arrays[0], thread) || prio_array_unlink(&cpu->prio_arrays[1], thread)){
+        cpu->run_queue_length--;
+    }
+}
+
+// A thread of the active array runs before a thread at level priority
+static inline bool run_queue_has_higher(cpu_data_t *cpu, uint8_t priority){
+    return (cpu->prio_arrays[cpu->active_array].bitmap & ((1ULL << priority) - 1)) != 0;
+}
+
+
+static inline bool is_idle_thread(thread_t *thread){
+    return thread->parent == idle_process;
+}
+
+static inline bool is_idle_cpu(cpu_data_t *cpu){
+    return cpu->current_thread == cpu->idle_thread
+        && __atomic_load_n(&cpu->run_queue_length, __ATOMIC_RELAXED) == 0;
+}
+
+
+// Fire the timer when the slice of next ends. An idle core only wakes for its timer events.
+static void arm_slice_timer(thread_t *next, uint64_t now){
+    timer_set_slice_deadline(is_idle_thread(next) ? TIMER_NO_DEADLINE : now + next->slice_left);
+}
+
+
+// Lock the run queue which owns thread. A thread only moves to another core under the lock
+// of its old one, so thread->cpu is checked again once the lock is held.
+static cpu_data_t *lock_thread_cpu(thread_t *thread, uint64_t *rflags){
+    for(;;){
+        uint32_t id = __atomic_load_n(&thread->cpu, __ATOMIC_ACQUIRE);
+        cpu_data_t *cpu = &cpu_datas[id];
+
+        *rflags = acquire_irqsave(&cpu->run_queue_lock);
+        if(thread->cpu == id) return cpu;
+        release_irqrestore(&cpu->run_queue_lock, *rflags);
+    }
+}
+
+
+// thread was queued on core id: make the core switch to it if it idles or runs a thread of a
+// lower level, else wake an idle core which can steal it
+static void kick_for_work(uint32_t id, thread_t *thread){
+    uint32_t self = this_cpu_id();
+    cpu_data_t *cpu = &cpu_datas[id];
+
+    // Only a hint, the core may switch meanwhile, schedule() decides under the lock
+    thread_t *running = __atomic_load_n(&cpu->current_thread, __ATOMIC_RELAXED);
+    if(running == cpu->idle_thread || thread->priority < running->priority){
+        send_resched_ipi(id);                   // Also to this core, it switches once interrupts are on
+        return;
+    }
+
+    uint32_t count = __atomic_load_n(&sched_cpu_count, __ATOMIC_ACQUIRE);
+    for(uint32_t i = 0; i < count; i++){
+        uint32_t other = sched_cpus[i];
+        if(other == id || other == self || !is_idle_cpu(&cpu_datas[other])) continue;
+        send_resched_ipi(other);
+        return;
+    }
+}
+
+
+// Called with the lock of the core of thread held. Returns true if the thread was queued.
+// A thread which still runs on a core is queued by schedule() when it switches out, idle
+// threads are never queued.
+static bool wake_locked(cpu_data_t *cpu, thread_t *thread){
+    if(thread->status == SLEEPING){
+        thread->status = READY;
+
+        // A sleeper is no CPU hog, its penalty goes. An interactive one runs before the hogs.
+        uint8_t priority = base_priority(thread);
+        if(thread->interactive) priority = (priority > SCHED_WAKE_BOOST) ? priority - SCHED_WAKE_BOOST : 0;
+        thread->priority = priority;
+
+        if(!thread->on_cpu && !is_idle_thread(thread)){
+            run_queue_push(cpu, thread, false);
+            return true;
+        }
+    }else if(thread->status != DEAD){
+        thread->wakeup = true;
+    }
+    return false;
+}
+
+
+// Move up to take threads which are not pinned from the levels of array, lowest level first,
+// to the same array of core self. Returns how many are left to take.
+static uint32_t steal_from_array(uint32_t self, bool expired, cpu_data_t *busy, prio_array_t *array, uint32_t take){
+    cpu_data_t *cpu = &cpu_datas[self];
+    uint64_t levels = array->bitmap;
+    while(levels && take > 0){
+        uint8_t level = 63 - __builtin_clzll(levels);
+        levels &= ~(1ULL << level);
+
+        thread_t *prev = NULL;
+        thread_t *thread = array->head[level];
+        while(thread && take > 0){
+            thread_t *next = thread->run_next;
+            if(thread->pinned){
+                prev = thread;
+            }else{
+                prio_array_unlink_after(array, prev, thread);
+                busy->run_queue_length--;
+                __atomic_store_n(&thread->cpu, self, __ATOMIC_RELEASE);
+                run_queue_push(cpu, thread, expired);
+                cpu->threads_stolen++;
+                take--;
+            }
+            thread = next;
+        }
+    }
+    return take;
+}
+
+// Move half of the run queue of the busiest core to self, which would go idle otherwise.
+// Called with interrupts off.
+static void steal_threads(uint32_t self){
+    uint32_t victim = self;
+    uint32_t most = 0;
+
+    uint32_t count = __atomic_load_n(&sched_cpu_count, __ATOMIC_ACQUIRE);
+    for(uint32_t i = 0; i < count; i++){
+        uint32_t id = sched_cpus[i];
+        uint32_t length = __atomic_load_n(&cpu_datas[id].run_queue_length, __ATOMIC_RELAXED);
+        if(id != self && length > most){
+            most = length;
+            victim = id;
+        }
+    }
+    if(victim == self) return;
+
+    cpu_data_t *cpu = &cpu_datas[self];
+    cpu_data_t *busy = &cpu_datas[victim];
+
+    // Two run queue locks are always taken in the order of the core ids
+    acquire(self < victim ? &cpu->run_queue_lock : &busy->run_queue_lock);
+    acquire(self < victim ? &busy->run_queue_lock : &cpu->run_queue_lock);
+
+    // The threads which would wait longest on the busy core: the expired ones, then the lowest levels
+    uint32_t take = (busy->run_queue_length + 1) / 2;
+    take = steal_from_array(self, true, busy, &busy->prio_arrays[busy->active_array ^ 1], take);
+    steal_from_array(self, false, busy, &busy->prio_arrays[busy->active_array], take);
+
+    release(&busy->run_queue_lock);
+    release(&cpu->run_queue_lock);
+}
+
+
+// Called by irq_handler() with interrupts off, on the interrupt stack. Returns the registers
+// to resume: registers if the thread keeps the core, else those of the next thread.
+registers_t* schedule(registers_t* registers) {
+    uint32_t self = this_cpu_id();
+    cpu_data_t *cpu = &cpu_datas[self];
+    thread_t *prev = cpu->current_thread;
+    if (!prev) return registers;                // The scheduler does not run on this core
+
+    // An IPI only switches when it was sent to reschedule, not for a TLB shootdown
+    bool resched = __atomic_exchange_n(&cpu->need_resched, false, __ATOMIC_ACQ_REL);
+    if (registers->int_no == IPI_VECTOR && !resched) return registers;
+
+    // Only a core which has nothing else to run steals, busy cores keep their threads
+    bool prev_runnable = !is_idle_thread(prev) && (prev->status == RUNNING || prev->status == READY);
+    if (cpu->run_queue_length == 0 && !prev_runnable) steal_threads(self);
+
+    acquire(&cpu->run_queue_lock);
+
+    uint64_t now = read_tsc();
+    uint64_t used = now - cpu->switch_tsc;
+    prev->cpu_time += used;
+    prev->parent->cpu_time += used;
+    cpu->switch_tsc = now;
+
+    // READY if it was woken before it could switch out
+    if (!is_idle_thread(prev) && (prev->status == RUNNING || prev->status == READY)) {
+        prev->slice_left = (used < prev->slice_left) ? prev->slice_left - used : 0;
+
+        // The one shot timer may fire a little early, what is left then counts as used
+        bool expired = prev->slice_left < SCHED_SLICE_SLACK_US * (cpu_frequency_hz / 1000000);
+
+        if (expired) {
+            // Used up its slice: a new one, one level lower, after every thread of the active array
+            uint8_t lowest = base_priority(prev) + SCHED_MAX_PENALTY;
+            if (lowest > SCHED_PRIO_LEVELS - 1) lowest = SCHED_PRIO_LEVELS - 1;
+            if (prev->priority < lowest) prev->priority++;
+            prev->slice_left = slice_cycles(prev);
+        } else if (registers->int_no == SCHED_TIMER_VECTOR && !run_queue_has_higher(cpu, prev->priority)) {
+            // Woke early, e.g. for a deadline too far for the APIC count: keeps the rest of its slice
+            prev->status = RUNNING;
+            arm_slice_timer(prev, now);
+            release(&cpu->run_queue_lock);
+            return registers;
+        }
+
+        prev->status = READY;
+        run_queue_push(cpu, prev, expired);
+    }
+
+    thread_t *next = run_queue_pop(cpu);
+    if (!next) next = cpu->idle_thread;
+    next->status = RUNNING;
+    arm_slice_timer(next, now);
+
+    if (next == prev) {
+        release(&cpu->run_queue_lock);
+        return registers;
+    }
+
+    memcpy((void *)&prev->registers, (void *)registers, sizeof(registers_t));   // Save current thread state
+    fpu_save(&prev->fpu);
+    prev->on_cpu = false;
+    thread_t *joiner = (prev->status == DEAD) ? prev->joiner : NULL;
+
+    next->on_cpu = true;
+    fpu_restore(&next->fpu);
+    cpu->current_thread = next;
+    cpu->context_switches++;
+
+    release(&cpu->run_queue_lock);
+
+    if (joiner) thread_wake(joiner);            // Its core may be another one, so without our lock
+
+    address_space_switch(next->parent->as);     // Keeps the TLB if the process did not change
+    return &next->registers;
+}
+
+
+// The thread which runs on this core, NULL before init_scheduler()
+thread_t* get_current_thread() {
+    uint64_t rflags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(rflags) :: "memory");
+
+    thread_t *thread = cpu_datas[this_cpu_id()].current_thread;
+
+    if (rflags & 0x200) asm volatile("sti" ::: "memory");
+    return thread;
+}
+
+
+// The core with the least work, counting its running thread. The search starts at another
+// core every time, so equally busy cores take turns.
+static uint32_t place_thread() {
+    uint32_t count = __atomic_load_n(&sched_cpu_count, __ATOMIC_ACQUIRE);
+    if (count == 0) return this_cpu_id();       // Nobody schedules yet, the first core takes it
+
+    uint32_t start = __atomic_fetch_add(&next_placement, 1, __ATOMIC_RELAXED) % count;
+    uint32_t best = sched_cpus[start];
+    uint32_t least = (uint32_t) -1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t id = sched_cpus[(start + i) % count];
+        cpu_data_t *cpu = &cpu_datas[id];
+        uint32_t load = __atomic_load_n(&cpu->run_queue_length, __ATOMIC_RELAXED)
+            + (cpu->current_thread != cpu->idle_thread);
+        if (load < least) {
+            least = load;
+            best = id;
+        }
+    }
+    return best;
+}
+
+
+// Queue a new thread on cpu, which keeps it, or on the least busy core for SCHED_ANY_CPU
+void sched_add_thread(thread_t* thread, int32_t cpu) {
+    uint32_t id = (cpu == SCHED_ANY_CPU) ? place_thread() : (uint32_t) cpu;
+    cpu_data_t *target = &cpu_datas[id];
+
+    uint64_t rflags = acquire_irqsave(&target->run_queue_lock);
+    thread->cpu = id;
+    thread->pinned = (cpu != SCHED_ANY_CPU);
+    thread->priority = base_priority(thread);
+    thread->slice_left = slice_cycles(thread);
+    thread->status = READY;
+    if (!thread->on_cpu) run_queue_push(target, thread, false);
+    release_irqrestore(&target->run_queue_lock, rflags);
+
+    kick_for_work(id, thread);
+}
+
+// Take a thread which is deleted out of its run queue. It must not run on any core.
+void sched_remove_thread(thread_t* thread) {
+    uint64_t rflags;
+    cpu_data_t *cpu = lock_thread_cpu(thread, &rflags);
+
+    if (thread->on_cpu) {
+        printf("[Error] Scheduler: Thread %s is deleted while it runs\n", thread->name);
+    }
+    if (thread->status == READY) run_queue_unlink(cpu, thread);
+    thread->status = DEAD;
+
+    release_irqrestore(&cpu->run_queue_lock, rflags);
+}
+
+
+// Change the nice value of thread, which sets its level and the length of its time slices
+void thread_set_nice(thread_t* thread, int32_t nice) {
+    if (nice < SCHED_NICE_MIN) nice = SCHED_NICE_MIN;
+    if (nice > SCHED_NICE_MAX) nice = SCHED_NICE_MAX;
+
+    uint64_t rflags;
+    cpu_data_t *cpu = lock_thread_cpu(thread, &rflags);
+
+    // A queued thread moves to its new level
+    bool queued = thread->status == READY && !thread->on_cpu && !is_idle_thread(thread);
+    if (queued) run_queue_unlink(cpu, thread);
+
+    thread->nice = (int8_t) nice;
+    thread->priority = base_priority(thread);
+    thread->slice_left = slice_cycles(thread);
+
+    if (queued) run_queue_push(cpu, thread, false);
+    release_irqrestore(&cpu->run_queue_lock, rflags);
+}
+
+// An interactive thread, e.g. one which waits for keys, is boosted when it is woken
+void thread_set_interactive(thread_t* thread, bool interactive) {
+    __atomic_store_n(&thread->interactive, interactive, __ATOMIC_RELAXED);
+}
+
+
+// Give the core to the next ready thread. Returns when this thread is scheduled again.
+void thread_yield() {
+    asm volatile("int %0" :: "i"(SCHED_YIELD_VECTOR) : "memory");
+}
+
+
+// Sleep until thread_wake(). A wakeup which came first is not lost, the thread returns at
+// once, so callers check their condition in a loop.
+void thread_block() {
+    thread_t *self = get_current_thread();
+    if (!self) {
+        asm volatile("hlt");                    // No scheduler on this core: wait for an interrupt
+        return;
+    }
+
+    uint64_t rflags;
+    cpu_data_t *cpu = lock_thread_cpu(self, &rflags);
+    bool sleep = !self->wakeup && !is_idle_thread(self);   // The idle thread only yields
+    self->wakeup = false;
+    if (sleep) self->status = SLEEPING;
+    release_irqrestore(&cpu->run_queue_lock, rflags);
+
+    thread_yield();
+}
+
+
+void thread_wake(thread_t* thread) {
+    uint64_t rflags;
+    cpu_data_t *cpu = lock_thread_cpu(thread, &rflags);
+    uint32_t id = thread->cpu;
+    bool queued = wake_locked(cpu, thread);
+    release_irqrestore(&cpu->run_queue_lock, rflags);
+
+    if (queued) kick_for_work(id, thread);
+}
+
+
+// End the running thread. create_thread() makes it the return address of the thread function.
+void thread_exit() {
+    thread_t *self = get_current_thread();
+
+    uint64_t rflags;
+    cpu_data_t *cpu = lock_thread_cpu(self, &rflags);
+    self->status = DEAD;
+    release_irqrestore(&cpu->run_queue_lock, rflags);
+
+    thread_yield();                             // schedule() wakes the joiner once we are off the core
+
+    for (;;) asm volatile("hlt");               // Never scheduled again
+}
+
+
+// Wait until thread is DEAD and no core runs on its stack, so it can be deleted
+void thread_join(thread_t* thread) {
+    uint64_t rflags;
+    cpu_data_t *cpu = lock_thread_cpu(thread, &rflags);
+    thread->joiner = get_current_thread();
+    release_irqrestore(&cpu->run_queue_lock, rflags);
+
+    while (__atomic_load_n(&thread->status, __ATOMIC_ACQUIRE) != DEAD
+        || __atomic_load_n(&thread->on_cpu, __ATOMIC_ACQUIRE)) {
+        thread_block();
+    }
+}
+
+
+// Called on every core once its interrupts are up: the running context becomes its idle
+// thread and the timer starts to switch threads.
+void init_scheduler() {
+    uint32_t self = this_cpu_id();
+
+    uint64_t rflags = acquire_irqsave(&sched_init_lock);
+    if (!idle_process) idle_process = create_process("Idle Process");
+    release_irqrestore(&sched_init_lock, rflags);
+
+    thread_t *idle = create_boot_thread(idle_process, "Idle Thread");
+    if (!idle) {
+        printf("[Error] Scheduler: No idle thread for CPU %d\n", self);
+        return;
+    }
+    idle->cpu = self;
+    idle->pinned = true;
+
+    cpu_data_t *cpu = &cpu_datas[self];
+    cpu->idle_thread = idle;
+    cpu->switch_tsc = read_tsc();
+    cpu->current_thread = idle;                 // From here on the timer switches threads
+
+    // Last, from here on other cores place threads here and steal from here
+    rflags = acquire_irqsave(&sched_init_lock);
+    sched_cpus[sched_cpu_count] = self;
+    __atomic_store_n(&sched_cpu_count, sched_cpu_count + 1, __ATOMIC_RELEASE);
+    release_irqrestore(&sched_init_lock, rflags);
+
+    printf(" [-] Scheduler: %d priority levels, tickless, on CPU %d\n", SCHED_PRIO_LEVELS, self);
+}
+
+
+#define BENCH_SWITCHES 10000
+
+static uint64_t bench_start_tsc, bench_end_tsc;
+static uint64_t bench_start_switches, bench_end_switches;
+
+// Two of these take turns on the core, every yield switches to the other one
+static void bench_yield_thread(void *arg) {
+    bool first = (arg != NULL);
+    cpu_data_t *cpu = &cpu_datas[this_cpu_id()];
+
+    if (first) {
+        bench_start_switches = cpu->context_switches;
+        bench_start_tsc = read_tsc();
+    }
+
+    for (int i = 0; i < BENCH_SWITCHES / 2; i++) thread_yield();
+
+    if (!first) {
+        bench_end_tsc = read_tsc();
+        bench_end_switches = cpu->context_switches;
+    }
+}
+
+// Time the switch between two kernel threads which yield to each other on this core
+void bench_context_switch() {
+    if (!get_current_thread() || cpu_frequency_hz == 0) {
+        printf("[Error] Scheduler: No scheduler or TSC frequency for the benchmark\n");
+        return;
+    }
+
+    process_t *process = create_process("Switch Bench");
+    if (!process) return;
+
+    // Both on this core, and no tick may start the first one before the second one is queued
+    int32_t self = this_cpu_id();
+    asm volatile("cli");
+    thread_t *a = create_thread_on(process, "Bench Thread A", &bench_yield_thread, (void *) 1, self);
+    thread_t *b = create_thread_on(process, "Bench Thread B", &bench_yield_thread, NULL, self);
+    asm volatile("sti");
+
+    if (a) thread_join(a);
+    if (b) thread_join(b);
+
+    uint64_t switches = bench_end_switches - bench_start_switches;
+    bool ok = a && b && switches > 0;
+
+    delete_process(process);
+
+    if (!ok) {
+        printf("[Error] Scheduler: Context switch benchmark failed\n");
+        return;
+    }
+
+    uint64_t cycles = (bench_end_tsc - bench_start_tsc) / switches;
+    uint64_t ns = cycles * 1000 / (cpu_frequency_hz / 1000000);
+    printf(" [-] Scheduler: %d ns (%d cycles) per context switch on CPU %d\n", ns, cycles, self);
+}
+
+
+#define SCALE_WORK (1ULL << 25)         // Iterations of the CPU bound loop of one thread
+
+static uint64_t scale_first_tsc, scale_last_tsc;
+
+static void scale_thread(void *arg) {
+    uint64_t start = read_tsc();
+
+    uint64_t x = (uint64_t) arg;
+    for (uint64_t i = 0; i < SCALE_WORK; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        asm volatile("" : "+r"(x));
+    }
+
+    uint64_t end = read_tsc();
+
+    uint64_t seen = __atomic_load_n(&scale_first_tsc, __ATOMIC_RELAXED);
+    while (start < seen && !__atomic_compare_exchange_n(&scale_first_tsc, &seen, start, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    seen = __atomic_load_n(&scale_last_tsc, __ATOMIC_RELAXED);
+    while (end > seen && !__atomic_compare_exchange_n(&scale_last_tsc, &seen, end, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// TSC cycles from the start of the first to the end of the last of count CPU bound threads
+static uint64_t run_scale_round(uint32_t count) {
+    static thread_t *threads[MAX_CPUS];
+
+    process_t *process = create_process("Scale Bench");
+    if (!process) return 0;
+
+    scale_first_tsc = (uint64_t) -1;
+    scale_last_tsc = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        threads[i] = create_thread(process, "Scale Thread", &scale_thread, (void *)(uint64_t)(i + 1));
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (threads[i]) thread_join(threads[i]);
+    }
+    delete_process(process);
+
+    return (scale_last_tsc > scale_first_tsc) ? scale_last_tsc - scale_first_tsc : 0;
+}
+
+// The same CPU bound work on 1, 2, 4, ... threads. With one thread per core the time stays
+// the same and the throughput grows with the number of threads.
+void bench_sched_scaling() {
+    uint32_t cores = __atomic_load_n(&sched_cpu_count, __ATOMIC_ACQUIRE);
+    if (cores == 0 || cpu_frequency_hz == 0) {
+        printf("[Error] Scheduler: No scheduler or TSC frequency for the scaling test\n");
+        return;
+    }
+
+    uint64_t single = run_scale_round(1);
+    if (single == 0) return;
+    printf(" [-] Scheduler: 1 CPU bound thread on %d cores: %d us\n",
+        cores, single / (cpu_frequency_hz / 1000000));
+
+    for (uint32_t count = 2; ; count *= 2) {
+        if (count > cores) count = cores;
+
+        uint64_t cycles = run_scale_round(count);
+        if (cycles == 0) return;
+
+        uint64_t speedup = (uint64_t) count * single * 100 / cycles;   // In hundredths
+        printf(" [-] Scheduler: %d CPU bound threads on %d cores: %d.%d times the throughput of one\n",
+            count, cores, speedup / 100, (speedup % 100) / 10);
+
+        if (count == cores) break;
+    }
+}
+
+
+#define LATENCY_HOGS    2
+#define LATENCY_ROUNDS  16
+#define LATENCY_GAP_US  2000            // Between the wakeups
+
+static thread_t *latency_sleeper;
+static volatile bool latency_armed;     // The sleeper waits for a wakeup
+static volatile bool latency_done;
+static volatile uint64_t latency_wake_tsc;
+static uint64_t latency_total;
+
+// A CPU hog which also wakes the sleeper every LATENCY_GAP_US
+static void latency_hog(void *arg) {
+    (void) arg;
+    uint64_t gap = cpu_frequency_hz / 1000000 * LATENCY_GAP_US;
+    uint64_t due = read_tsc() + gap;
+
+    while (!latency_done) {
+        uint64_t now = read_tsc();
+        if (now >= due && __atomic_exchange_n(&latency_armed, false, __ATOMIC_ACQ_REL)) {
+            latency_wake_tsc = read_tsc();
+            thread_wake(latency_sleeper);
+            due = now + gap;
+        }
+    }
+}
+
+static void latency_sleeper_thread(void *arg) {
+    (void) arg;
+    for (int i = 0; i < LATENCY_ROUNDS; i++) {
+        __atomic_store_n(&latency_armed, true, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&latency_armed, __ATOMIC_ACQUIRE)) thread_block();
+        latency_total += read_tsc() - latency_wake_tsc;
+    }
+    latency_done = true;
+}
+
+// Average microseconds from thread_wake() until the sleeper runs, with LATENCY_HOGS hogs on its core
+static uint64_t run_latency_round(bool interactive) {
+    static thread_t *hogs[LATENCY_HOGS];
+
+    process_t *process = create_process("Latency Bench");
+    if (!process) return 0;
+
+    latency_armed = false;
+    latency_done = false;
+    latency_total = 0;
+
+    // All on this core, and none may run before the others are set up
+    int32_t self = this_cpu_id();
+    asm volatile("cli");
+    latency_sleeper = create_thread_on(process, "Latency Sleeper", &latency_sleeper_thread, NULL, self);
+    if (latency_sleeper) thread_set_interactive(latency_sleeper, interactive);
+    for (int i = 0; i < LATENCY_HOGS; i++) {
+        hogs[i] = latency_sleeper ? create_thread_on(process, "Latency Hog", &latency_hog, NULL, self) : NULL;
+    }
+    asm volatile("sti");
+
+    if (latency_sleeper) thread_join(latency_sleeper);
+    latency_done = true;                        // Also if the sleeper could not be created
+    for (int i = 0; i < LATENCY_HOGS; i++) {
+        if (hogs[i]) thread_join(hogs[i]);
+    }
+    bool ok = latency_sleeper != NULL;
+    for (int i = 0; i < LATENCY_HOGS; i++) ok = ok && hogs[i];
+
+    delete_process(process);
+
+    if (!ok) return 0;
+    return latency_total / LATENCY_ROUNDS / (cpu_frequency_hz / 1000000);
+}
+
+// How soon a woken thread runs while CPU hogs keep its core busy, with and without the boost
+void bench_wakeup_latency() {
+    if (!get_current_thread() || cpu_frequency_hz == 0) {
+        printf("[Error] Scheduler: No scheduler or TSC frequency for the benchmark\n");
+        return;
+    }
+
+    uint64_t boosted = run_latency_round(true);
+    uint64_t plain = run_latency_round(false);
+
+    printf(" [-] Scheduler: Wakeup latency next to %d CPU hogs: %d us interactive, %d us otherwise\n",
+        LATENCY_HOGS, boosted, plain);
+}
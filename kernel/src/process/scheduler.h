@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "types.h"
+#include "../util/util.h"   // for registers_t
+
+#define SCHED_YIELD_VECTOR  51      // int $51 gives up the rest of the time slice
+#define SCHED_YIELD_IRQ     19      // 51 - 32
+#define SCHED_TIMER_VECTOR  48      // The one shot APIC timer, it fires when a time slice ends
+#define SCHED_SLICE_SLACK_US 20     // Less left of a slice than this counts as used up
+#define SCHED_ANY_CPU       (-1)    // sched_add_thread() picks the least busy core
+
+#define SCHED_NICE_MIN      (-20)   // Most CPU time
+#define SCHED_NICE_MAX      19      // Least CPU time
+#define SCHED_PRIO_LEVELS   40      // Run queue levels, 0 runs first, nice n starts at n + 20
+#define SCHED_MAX_PENALTY   5       // Levels a thread drops for slices it uses up
+#define SCHED_WAKE_BOOST    5       // Levels an interactive thread rises when it is woken
+
+// The READY threads of a core at one priority level each, the bitmap has bit n set when
+// level n is not empty
+typedef struct prio_array {
+    thread_t *head[SCHED_PRIO_LEVELS];
+    thread_t *tail[SCHED_PRIO_LEVELS];
+    uint64_t bitmap;
+} prio_array_t;
+
+registers_t* schedule(registers_t* registers);
+
+void init_scheduler();
+
+void sched_add_thread(thread_t* thread, int32_t cpu);
+void sched_remove_thread(thread_t* thread);
+
+void thread_set_nice(thread_t* thread, int32_t nice);
+void thread_set_interactive(thread_t* thread, bool interactive);
+
+thread_t* get_current_thread();
+
+void thread_yield();
+void thread_block();
+void thread_wake(thread_t* thread);
+void thread_exit();
+void thread_join(thread_t* thread);
+
+void bench_context_switch();
+void bench_sched_scaling();
+void bench_wakeup_latency();
@@ -158,42 +158,30 @@ void init_processes() {
 
     // Create a thread with an argument
     thread_t* thread2 = create_thread(process, "Thread2", (void *) &thread2_func, NULL);
-    if (!thread1) {
+    if (!thread2) {
         printf("Failed to create Thread3\n");
         return;
     }
 
     thread_t* thread10 = create_thread(process1, "Thread10", (void *) &thread10_func, NULL);
-    if (!thread0) {
+    if (!thread10) {
         printf("Failed to get init thread\n");
         return;
     }
 
     // Create a thread with an argument
     thread_t* thread11 = create_thread(process1, "Thread11", (void *) &thread11_func, NULL);
-    if (!thread1) {
+    if (!thread11) {
         printf("Failed to create Thread1\n");
         return;
     }
 
     // Create a thread with an argument
     thread_t* thread12 = create_thread(process1, "Thread12", (void *) &thread12_func, NULL);
-    if (!thread1) {
+    if (!thread12) {
         printf("Failed to create Thread3\n");
         return;
     }
 
-    // Set the current process
-    current_process = process;
-    processes_list = process;
-
-    current_process->next = process1;
-    processes_list = process1;
-
-    thread0->next = thread1;
-    thread1->next = thread2;
-
-    thread10->next = thread11;
-    thread11->next = thread12;
-    thread12->next = thread10;
+    // Every thread is queued by create_thread(), the timer switches between them
 }
\ No newline at end of file
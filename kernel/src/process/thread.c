@@ -2,8 +2,11 @@
 #include "../lib/string.h"
 #include "../lib/stdio.h"
 #include "../memory/kheap.h"
+#include "../memory/vm_region.h"
+#include "../memory/slab.h"
 #include "process.h"
 #include "types.h"
+#include "scheduler.h"
 #include "../sys/timer/apic_timer.h"
 
 #include "thread.h"
@@ -24,12 +27,22 @@
 
 size_t next_free_tid = 0;
 
+static kmem_cache_t *thread_cache;  // Slab cache of thread_t objects, 16 byte aligned for fpu
+
+
+// Called once by the bootstrap core before the application cores start and create threads
+void init_thread_cache() {
+    thread_cache = kmem_cache_create("thread_t", sizeof(thread_t), 16);
+    if (!thread_cache) printf("[Error] Thread: No slab cache for thread_t\n");
+}
+
 
 // Adding the thread in threads
 void add_thread(thread_t* thread) {
     if (!thread || !thread->parent) return; // If the given thread is null then return from here 
 
     process_t* parent = thread->parent;
+    uint64_t rflags = acquire_irqsave(&parent->threads_lock);  // Cores add idle threads at once
 
     if (parent->threads == NULL) {          // If threads is null
         parent->threads = thread;           // Set threads with given thread
@@ -46,19 +59,24 @@ void add_thread(thread_t* thread) {
         last->next = thread;                // Found last thread and set last thread's next with given thread
     }
     parent->current_thread = thread;        // Set parent's current thread with given last thread
+    release_irqrestore(&parent->threads_lock, rflags);
 }
 
 
-// Creating a new thread and add into parent process
+// Creating a new thread and add into parent process, it runs on the least busy core
 thread_t* create_thread(process_t* parent, const char* name, void (*function)(void*), void* arg) {
+    return create_thread_on(parent, name, function, arg, SCHED_ANY_CPU);
+}
+
 
-    thread_t* thread = (thread_t*) kheap_alloc(sizeof(thread_t)); // Allocate memory for the thread
+// Like create_thread(), but the thread stays on core cpu unless cpu is SCHED_ANY_CPU
+thread_t* create_thread_on(process_t* parent, const char* name, void (*function)(void*), void* arg, int32_t cpu) {
+
+    thread_t* thread = (thread_t*) kmem_cache_alloc(thread_cache); // Allocate memory for the thread
 
     if (!thread) return NULL;
     memset((void*)thread, 0, sizeof(thread_t)); // Initialize the thread to 0
 
-    // Assign the next available TID
-    thread->tid = next_free_tid++;
     thread->status = READY;
     strncpy(thread->name, name, THREAD_NAME_MAX_LEN - 1);
     thread->name[THREAD_NAME_MAX_LEN - 1] = '\0'; // Ensure null-termination
@@ -71,21 +89,35 @@ thread_t* create_thread(process_t* parent, const char* name, void (*function)(vo
     void* stack = kheap_alloc(THREAD_STACK_SIZE);
 
     if (!stack) {           // If stack allocation fails, free the thread
-        kheap_free((void*)thread, sizeof(thread_t));
-        next_free_tid--;    // Revert the TID counter if stack allocation fails
+        kmem_cache_free(thread_cache, thread);
         return NULL;
     }
 
+    // Assign the next available TID, only once the thread can be created
+    thread->tid = __atomic_fetch_add(&next_free_tid, 1, __ATOMIC_RELAXED);
+
+    // A fault on the stack could not push its own frame, so the stack is mapped up front
+    vm_region_populate((uint64_t) stack, THREAD_STACK_SIZE);
+
+    thread->stack = stack;
+
+    // A thread which returns from its function exits
+    uint64_t *stack_top = (uint64_t *)((uint64_t)stack + THREAD_STACK_SIZE);
+    stack_top[-1] = (uint64_t) &thread_exit;
+
     // Set up the thread's stack and registers to execute the provided function
     thread->registers.iret_ss = KERNEL_SS;
-    thread->registers.iret_rsp = ((uint64_t)stack + THREAD_STACK_SIZE); // Align stack , Stack grows downward
+    thread->registers.iret_rsp = (uint64_t) &stack_top[-1];   // Stack grows downward, the return address on top
     thread->registers.iret_rflags = FLAGS;              // Enable interrupts (default flags)
     thread->registers.iret_cs = KERNEL_CS;              // Assume a default code segment selector
     thread->registers.iret_rip = (uint64_t) function;   // Instruction pointer = function address
     thread->registers.rdi = (uint64_t) arg;             // First argument (rdi) = arg
     thread->registers.rbp = 0;                          // Base pointer = 0
+    thread->fpu.fcw = FPU_DEFAULT_FCW;                  // A clean FPU, the rest of fpu is 0
+    thread->fpu.mxcsr = FPU_DEFAULT_MXCSR;
 
     add_thread(thread);                                 // Add the thread to the parent process's thread list
+    sched_add_thread(thread, cpu);                      // Runs from the next switch on
 
     printf("Created Thread: %s (TID: %d) at %x | rip : %x | rsp : %x\n", 
         thread->name, 
@@ -99,6 +131,65 @@ thread_t* create_thread(process_t* parent, const char* name, void (*function)(vo
 
 
 
+// Copy of the user thread src for a forked process. It continues from the saved registers,
+// on the same user stack in the copy on write address space of parent, and sees 0 as the
+// return value of fork.
+thread_t* clone_thread(process_t* parent, thread_t* src, registers_t* registers) {
+
+    thread_t* thread = (thread_t*) kmem_cache_alloc(thread_cache);
+
+    if (!thread) return NULL;
+    memset((void*)thread, 0, sizeof(thread_t));
+
+    thread->tid = __atomic_fetch_add(&next_free_tid, 1, __ATOMIC_RELAXED);
+    thread->status = READY;
+    strncpy(thread->name, src->name, THREAD_NAME_MAX_LEN - 1);
+    thread->name[THREAD_NAME_MAX_LEN - 1] = '\0';
+
+    thread->parent = parent;
+    thread->next = 0;
+    thread->cpu_time = 0;
+    thread->stack = NULL;                               // The user stack belongs to the address space
+    thread->nice = src->nice;
+    thread->interactive = src->interactive;
+
+    memcpy((void*)&thread->registers, (void*)registers, sizeof(registers_t));
+    thread->registers.rax = 0;                          // fork() returns 0 in the child
+    fpu_save(&thread->fpu);                             // src runs, its FPU state is in the registers
+
+    add_thread(thread);
+    sched_add_thread(thread, SCHED_ANY_CPU);
+
+    return thread;
+}
+
+
+
+// A thread for the context which runs already, e.g. kmain() as the idle thread of a core.
+// It has no stack of its own, its registers are saved when it is switched out the first time.
+thread_t* create_boot_thread(process_t* parent, const char* name) {
+
+    thread_t* thread = (thread_t*) kmem_cache_alloc(thread_cache);
+
+    if (!thread) return NULL;
+    memset((void*)thread, 0, sizeof(thread_t));
+
+    thread->tid = __atomic_fetch_add(&next_free_tid, 1, __ATOMIC_RELAXED);
+    thread->status = RUNNING;
+    strncpy(thread->name, name, THREAD_NAME_MAX_LEN - 1);
+    thread->name[THREAD_NAME_MAX_LEN - 1] = '\0';
+
+    thread->parent = parent;
+    thread->on_cpu = true;
+    thread->stack = NULL;
+
+    add_thread(thread);
+
+    return thread;
+}
+
+
+
 // Remove the thread from the process's thread list
 void remove_thread(thread_t* thread) {
     if (!thread){
@@ -110,6 +201,7 @@ void remove_thread(thread_t* thread) {
         return;;
     }
 
+    uint64_t rflags = acquire_irqsave(&parent->threads_lock);
     while (true) {
         if (parent->threads == thread) {            // If thread is equal to first thread
             parent->threads = thread->next;         // Remove the given thread from linked list of threads
@@ -126,6 +218,8 @@ void remove_thread(thread_t* thread) {
         }
         break;
     }
+    release_irqrestore(&parent->threads_lock, rflags);
+
     thread->next = NULL;                            // Clear the next pointer of the removed thread
     thread->parent = NULL;                          // Clear the parent pointer   
 }
@@ -135,17 +229,18 @@ void remove_thread(thread_t* thread) {
 void delete_thread(thread_t* thread) {
     if (!thread) return;
     printf("Start Deleting Thread: %s (TID: %d)\n", thread->name, thread->tid);
+    sched_remove_thread(thread); // Out of the run queue
     remove_thread(thread); // Remove the thread from the process's thread list
 
     // Storing following datta before clearing stack memory
-    char * name;
+    char name[THREAD_NAME_MAX_LEN];
     memcpy((void*)name, (void*)thread->name, THREAD_NAME_MAX_LEN);
     size_t tid = thread->tid;
 
     // Free the thread's stack memory
-    kheap_free((void*)(thread->registers.iret_rsp - THREAD_STACK_SIZE), THREAD_STACK_SIZE ); 
+    if (thread->stack) kheap_free(thread->stack, THREAD_STACK_SIZE);
     // Free the thread memory
-    kheap_free((void*)thread, sizeof(thread_t));                                                  
+    kmem_cache_free(thread_cache, thread);
     
     printf("Thread Deleted: %s (TID: %d)\n", name, tid);                        
 }
@@ -12,21 +12,62 @@
 
 #define THREAD_NAME_MAX_LEN 64
 
-struct thread {                     // Allocated size 312 byte
+#define FPU_DEFAULT_FCW     0x037F  // All x87 exceptions masked, 64 bit precision, as after fninit
+#define FPU_DEFAULT_MXCSR   0x1F80  // All SSE exceptions masked, round to nearest
+
+// x87 and SSE registers as fxsave stores them, fxsave and fxrstor need 16 byte alignment
+typedef struct fpu_state {
+    uint16_t fcw;                   // x87 control word
+    uint16_t fsw;
+    uint8_t ftw;
+    uint8_t reserved;
+    uint16_t fop;
+    uint64_t fip;
+    uint64_t fdp;
+    uint32_t mxcsr;                 // SSE control and status
+    uint32_t mxcsr_mask;
+    uint8_t regs[480];              // st0-st7, xmm0-xmm15 and reserved space
+} __attribute__((packed, aligned(16))) fpu_state_t;
+
+struct thread {                     // Allocated size 880 byte, 16 byte aligned for fpu
     size_t tid;                     // Thread ID
     status_t status;                // Thread status
     char name[THREAD_NAME_MAX_LEN]; // Thread name
     process_t* parent;              // Reference to parent process
     struct thread* next;            // Linked list for threads
     uint64_t cpu_time;              // Track CPU time per thread
+    void *stack;                    // Kernel stack from kheap_alloc(), NULL for a forked user thread
+    struct thread* run_next;        // Link in the run queue, see scheduler.c
+    uint32_t cpu;                   // Core whose run queue owns the thread
+    bool pinned;                    // Stays on cpu, other cores do not steal it
+    int8_t nice;                    // SCHED_NICE_MIN to SCHED_NICE_MAX, see thread_set_nice()
+    uint8_t priority;               // Run queue level, changes with penalty and boost
+    uint64_t slice_left;            // TSC cycles left of the time slice
+    bool interactive;               // Boosted when woken, e.g. the reader of the keyboard
+    bool on_cpu;                    // Runs on a core, its registers are not saved yet
+    bool wakeup;                    // thread_wake() came before thread_block()
+    struct thread* joiner;          // Thread waiting in thread_join() for this one
     registers_t registers;          // Thread registers
+    fpu_state_t fpu;                // x87 and SSE registers, saved while the thread does not run
 };
 
+static inline void fpu_save(fpu_state_t *fpu){
+    asm volatile("fxsave64 (%0)" :: "r"(fpu) : "memory");
+}
+
+static inline void fpu_restore(fpu_state_t *fpu){
+    asm volatile("fxrstor64 (%0)" :: "r"(fpu) : "memory");
+}
+
 
 
 extern size_t next_free_tid;
 
+void init_thread_cache();
 thread_t* create_thread(process_t* parent, const char* name, void (*function)(void*), void* arg);
+thread_t* create_thread_on(process_t* parent, const char* name, void (*function)(void*), void* arg, int32_t cpu);
+thread_t* clone_thread(process_t* parent, thread_t* src, registers_t* registers);
+thread_t* create_boot_thread(process_t* parent, const char* name);
 void delete_thread(thread_t* thread);
 
 
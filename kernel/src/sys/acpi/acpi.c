@@ -63,6 +63,18 @@ void find_acpi_table_pointer(){
     }
 }
 
+// Find the RSDP and the tables of the RSDT or XSDT, once. init_numa() needs the SRAT and the SLIT
+// before init_acpi() runs. Returns false if ACPI is not available.
+bool find_acpi_tables(){
+    static bool found;
+    if(found) return rsdp != NULL;
+    found = true;
+
+    find_acpi_table_pointer();
+    if(rsdp) parse_rsdt_table(rsdp);
+    return rsdp != NULL;
+}
+
 void validate_rsdp_table(rsdp_t *rsdp){
     if(rsdp){
         uint64_t acpi_version = (rsdp->revision >= 2) ? 2 : 1;
@@ -137,9 +149,8 @@ void acpi_enable() {
 
 void init_acpi(){
     
-    find_acpi_table_pointer();
+    find_acpi_tables();
     validate_rsdp_table(rsdp);
-    parse_rsdt_table(rsdp);
 
     if(!is_acpi_enabled())
         acpi_enable();
@@ -66,6 +66,7 @@ typedef struct GenericAddressStructure GenericAddressStructure_t;
 
 
 void find_acpi_table_pointer();
+bool find_acpi_tables();
 void validate_rsdp_table(rsdp_t *rsdp);
 
 int is_acpi_enabled();
@@ -7,6 +7,8 @@
 #include "hpet.h"
 #include "madt.h"
 #include "mcfg.h"
+#include "srat.h"
+#include "slit.h"
 
 #include "rsdt.h"
 
@@ -21,8 +23,10 @@ extern fadt_t *fadt;   // Defined in fadt.c
 extern madt_t *madt;   // Defined in madt.c
 extern mcfg_t *mcfg;   // Defined in mcfg.c
 extern hpet_t *hpet;   // Defined in hpet.c
+extern srat_t *srat;   // Defined in srat.c
+extern slit_t *slit;   // Defined in slit.c
 
-// parsing RSDT and XSDT tables to get MADT, MCFG, FADT and HPET tables
+// parsing RSDT and XSDT tables to get MADT, MCFG, FADT, HPET, SRAT and SLIT tables
 void parse_rsdt_table(rsdp_t *rsdp){
     if(rsdp->revision >= 2){
         rsdp_ext_t *rsdp_ext = (rsdp_ext_t *) rsdp;
@@ -46,6 +50,10 @@ void parse_rsdt_table(rsdp_t *rsdp){
                 fadt = (fadt_t *)(uintptr_t) entry;
             }else if(memcmp(entry->signature, "HPET", 4) == 0){
                 hpet = (hpet_t *)(uintptr_t) entry;
+            }else if(memcmp(entry->signature, "SRAT", 4) == 0){
+                srat = (srat_t *)(uintptr_t) entry;
+            }else if(memcmp(entry->signature, "SLIT", 4) == 0){
+                slit = (slit_t *)(uintptr_t) entry;
             }else{
                 continue;
             }
@@ -70,6 +78,10 @@ void parse_rsdt_table(rsdp_t *rsdp){
                 fadt = (fadt_t *)(uintptr_t) entry;
             }else if(memcmp(entry->signature, "HPET", 4) == 0){
                 hpet = (hpet_t *)(uintptr_t) entry;
+            }else if(memcmp(entry->signature, "SRAT", 4) == 0){
+                srat = (srat_t *)(uintptr_t) entry;
+            }else if(memcmp(entry->signature, "SLIT", 4) == 0){
+                slit = (slit_t *)(uintptr_t) entry;
             }else{
                 continue;
             }
@@ -0,0 +1,34 @@
+/*
+System Locality Information Table (SLIT)
+
+The relative memory latency between every pair of proximity domains, 10 for a domain to
+itself. The PMM falls back to the nearest nodes in this order once the local node is empty.
+
+Reference:
+    https://uefi.org/specs/ACPI/6.5/05_ACPI_Software_Programming_Model.html#system-locality-information-table-slit
+*/
+
+#include "../../../lib/stdio.h"
+#include "../../../memory/numa.h"
+
+#include "slit.h"
+
+slit_t *slit;       // Found by parse_rsdt_table, NULL if the firmware gives no distances
+
+
+void parse_slit(slit_t *slit) {
+
+    if(slit == NULL) return;    // Every remote node counts as equally far
+
+    uint64_t count = slit->locality_count;
+    if(sizeof(slit_t) + count * count > slit->header.length){
+        printf("[Error] SLIT: %d localities do not fit into the table\n", count);
+        return;
+    }
+
+    for(uint64_t from = 0; from < count; from++){
+        for(uint64_t to = 0; to < count; to++){
+            numa_set_distance(from, to, slit->entries[from * count + to]);
+        }
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "../acpi.h"   // For acpi_header_t
+
+// System Locality Information Table (SLIT)
+struct slit{
+    acpi_header_t header;       // ACPI standard header
+    uint64_t locality_count;    // Number of proximity domains
+    uint8_t entries[];          // locality_count * locality_count relative distances, 10 is local
+} __attribute__((packed));
+typedef struct slit slit_t;
+
+void parse_slit(slit_t *slit);
@@ -0,0 +1,66 @@
+/*
+System Resource Affinity Table (SRAT)
+
+Assigns every core and every physical memory range to a proximity domain, i.e. a NUMA node.
+The PMM splits its zones at node boundaries with this, see memory/numa.c.
+
+Reference:
+    https://uefi.org/specs/ACPI/6.5/05_ACPI_Software_Programming_Model.html#system-resource-affinity-table-srat
+    https://wiki.osdev.org/SRAT
+*/
+
+#include "../../../lib/stdio.h"
+#include "../../../memory/numa.h"
+
+#include "srat.h"
+
+srat_t *srat;       // Found by parse_rsdt_table, NULL without NUMA
+
+
+void parse_srat(srat_t *srat) {
+
+    if(srat == NULL) return;    // Not a NUMA machine, everything is node 0
+
+    uint8_t *ptr = (uint8_t *)(srat + 1);  // Start after SRAT header
+    uint8_t *end = (uint8_t *)srat + srat->header.length;
+
+    while (ptr + sizeof(srat_entry_t) <= end) {
+        srat_entry_t *entry = (srat_entry_t *)ptr;
+        if(entry->length == 0) break;  // A broken table would loop forever
+
+        switch (entry->type) {
+            case 0x00: {  // Processor Local APIC Affinity
+                srat_lapic_t *lapic = (srat_lapic_t *)ptr;
+                if(!(lapic->flags & SRAT_ENABLED)) break;
+
+                uint32_t domain = lapic->proximity_domain_low
+                    | ((uint32_t) lapic->proximity_domain_high[0] << 8)
+                    | ((uint32_t) lapic->proximity_domain_high[1] << 16)
+                    | ((uint32_t) lapic->proximity_domain_high[2] << 24);
+                numa_add_cpu(lapic->apic_id, domain);
+                break;
+            }
+
+            case 0x01: {  // Memory Affinity
+                srat_memory_t *memory = (srat_memory_t *)ptr;
+                if(!(memory->flags & SRAT_ENABLED) || memory->length_bytes == 0) break;
+
+                numa_add_memory(memory->base_address, memory->length_bytes, memory->proximity_domain);
+                break;
+            }
+
+            case 0x02: {  // Processor Local x2APIC Affinity
+                srat_x2apic_t *x2apic = (srat_x2apic_t *)ptr;
+                if(!(x2apic->flags & SRAT_ENABLED)) break;
+
+                numa_add_cpu(x2apic->x2apic_id, x2apic->proximity_domain);
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        ptr += entry->length;  // Move to next entry
+    }
+}
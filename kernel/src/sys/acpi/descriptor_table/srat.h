@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "../acpi.h"   // For acpi_header_t
+
+// System Resource Affinity Table (SRAT)
+struct srat{
+    acpi_header_t header;   // ACPI standard header
+    uint32_t reserved1;     // Must be 1
+    uint64_t reserved2;
+} __attribute__((packed));
+typedef struct srat srat_t;
+
+// SRAT entry header
+struct srat_entry {
+    uint8_t type;   // Type of entry
+    uint8_t length; // Length of this entry
+} __attribute__((packed));
+typedef struct srat_entry srat_entry_t;
+
+#define SRAT_ENABLED    0x1     // Flag of every entry type, disabled entries are ignored
+
+// Processor Local APIC Affinity entry
+typedef struct srat_lapic {
+    uint8_t type;                   // 0
+    uint8_t length;                 // 16
+    uint8_t proximity_domain_low;   // Bits 0 - 7 of the proximity domain
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_domain_high[3];   // Bits 8 - 31 of the proximity domain
+    uint32_t clock_domain;
+} __attribute__((packed)) srat_lapic_t;
+
+// Memory Affinity entry
+typedef struct srat_memory {
+    uint8_t type;                   // 1
+    uint8_t length;                 // 40
+    uint32_t proximity_domain;
+    uint16_t reserved1;
+    uint64_t base_address;
+    uint64_t length_bytes;
+    uint32_t reserved2;
+    uint32_t flags;                 // Bit 0 enabled, bit 1 hot pluggable, bit 2 non volatile
+    uint64_t reserved3;
+} __attribute__((packed)) srat_memory_t;
+
+// Processor Local x2APIC Affinity entry
+typedef struct srat_x2apic {
+    uint8_t type;                   // 2
+    uint8_t length;                 // 24
+    uint16_t reserved1;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed)) srat_x2apic_t;
+
+void parse_srat(srat_t *srat);
@@ -39,9 +39,14 @@ References:
 #include "../../memory/kmalloc.h"
 #include "../../memory/kheap.h"
 #include "../../memory/vmm.h"
+#include "../../memory/buddy.h"
 
 #include "ahci.h"
 
+#define AHCI_PORT_MEM_ORDER 2   // 2^2 frames = 16 KB per port
+#define AHCI_PRDT_ENTRIES   8   // A 256 byte command table has room for 8 PRDT entries
+#define AHCI_PRDT_MAX_BYTES 0x400000    // 4 MB per PRDT entry
+
 
 
 // Checks if a port has a valid, active device attached.
@@ -150,36 +155,42 @@ void portRebase(HBA_MEM_T *abar, int port_no)
 
 	stopCMD(port);	// Stop command engine
 
-	uint32_t AHCI_BASE = (uint32_t) kmalloc(0x1000); // although 0x400 i.e. 1KB memory need
+	// Command list (1K), FIS (256 bytes) and 32 command tables (8K) of this port in one
+	// contiguous 16K block below 4 GB, because clbu, fbu and ctbau are kept zero
+	uint32_t AHCI_BASE = (uint32_t) pmm_alloc_pages_below(AHCI_PORT_MEM_ORDER, PMM_LOW_4G_LIMIT);
+	if(AHCI_BASE == 0){
+		printf("[AHCI] Failed to allocate port memory\n");
+		return;
+	}
 
-	// Command list offset: 1K * port_no
+	// Command list offset: 0
 	// Command list entry size = 32
 	// Command list entry maximum count = 32
 	// Command list maximum size = 32 * 32 = 1K per port
-	port->clb = AHCI_BASE + (port_no << 10);
+	port->clb = AHCI_BASE;
 	port->clbu = 0;
 	uint64_t vir_clb = phys_to_vir(port->clb); // convert phys to virt
 	memset((void*) (uint64_t) (vir_clb), 0, 0x400);
 
 
-	// FIS offset: 32K + 256 * port_no
+	// FIS offset: 1K
 	// FIS entry size = 256 bytes per port
-	port->fb = AHCI_BASE + (32 << 10) + (port_no << 8);
+	port->fb = AHCI_BASE + (1 << 10);
 
 	port->fbu = 0;
 	uint64_t vir_fb = phys_to_vir(port->fb);
 	memset((void*) (uint64_t) (vir_fb), 0, 0x100);
  
-	// Command table offset: 40K + 8K * port_no
+	// Command table offset: 4K
 	// Command table size = 256 * 32 = 8K per port
 	HBA_CMD_HEADER_T* cmd_header = (HBA_CMD_HEADER_T*) vir_clb;
 
 	for (size_t i = 0; i < 32; i++)
 	{
-		cmd_header[i].prdtl = 8;
+		cmd_header[i].prdtl = AHCI_PRDT_ENTRIES;
 
 		// Calculate the physical address of the command table
-		uint64_t phys_ctba = AHCI_BASE + (40 << 10) + (port_no << 13) + (i << 8);
+		uint64_t phys_ctba = AHCI_BASE + (4 << 10) + (i << 8);
 		uint64_t virt_ctba = phys_to_vir(phys_ctba);  // Map to virtual
 
 		// Set physical address in the command header (hardware uses physical)
@@ -230,32 +241,43 @@ static bool runCommand(FIS_TYPE type, uint8_t write, HBA_PORT_T *port, uint32_t
 	cmd_header->cfl = sizeof(FIS_REG_H2D_T) / sizeof(uint32_t);	
 	// Read or write from device
     cmd_header->w = write;
-    // PRDT entries count
-	cmd_header->prdtl = (uint16_t) ((count - 1) >> 4) + 1;	
  
 	HBA_CMD_TBL_T* cmd_tbl = (HBA_CMD_TBL_T*) (uint64_t) (cmd_header->ctba);
-	memset((void *)cmd_tbl, 0, sizeof(HBA_CMD_TBL_T) + (cmd_header->prdtl - 1) * sizeof(HBA_PRDT_ENTRY_T));
- 
-	// 8K bytes (16 sectors) per PRDT
-    uint16_t i;
-	for (i = 0; i < cmd_header->prdtl - 1; i++)
+	memset((void *)cmd_tbl, 0, sizeof(HBA_CMD_TBL_T) + (AHCI_PRDT_ENTRIES - 1) * sizeof(HBA_PRDT_ENTRY_T));
+
+	// One PRDT entry for every physically contiguous run of buf. A kernel heap buffer is
+	// contiguous only in virtual memory, so the device gets the frames behind it.
+	uint64_t va = (uint64_t) buf;
+	uint64_t left = (uint64_t) count << 9;	// 512 bytes per sector
+	uint16_t i = 0;
+	while (left > 0)
 	{
-		cmd_tbl->prdt_entry[i].dba = (uint32_t)((uint64_t)buf);
-        // 8K bytes (this value should always be set to 1 less than the actual value)
-		cmd_tbl->prdt_entry[i].dbc = 8 * 1024 - 1;	
-		cmd_tbl->prdt_entry[i].i = 1;
-        // 4K words
-		buf += 4 * 1024;	// Move buffer pointer by 8K bytes (4K uint16_t elements)
-        // 16 sectors
-		count -= 16;	
-	}
+		if (i == AHCI_PRDT_ENTRIES)
+		{
+			printf(" [-] AHCI: Buffer %x has too many physical runs for one command\n", (uint64_t) buf);
+			return false;
+		}
+
+		uint64_t pa;
+		uint64_t len = virt_to_phys_run(va, left < AHCI_PRDT_MAX_BYTES ? left : AHCI_PRDT_MAX_BYTES, &pa);
+		if (len == 0)
+		{
+			printf(" [-] AHCI: Buffer %x is not mapped\n", va);
+			return false;
+		}
 
+		cmd_tbl->prdt_entry[i].dba = (uint32_t) pa;
+		cmd_tbl->prdt_entry[i].dbau = (uint32_t) (pa >> 32);
+        // This value should always be set to 1 less than the actual value
+		cmd_tbl->prdt_entry[i].dbc = len - 1;
+		cmd_tbl->prdt_entry[i].i = 1;
 
-	// Last entry
-	cmd_tbl->prdt_entry[i].dba = (uint32_t) buf;
-    // 512 bytes per sector
-	cmd_tbl->prdt_entry[i].dbc = (count << 9) - 1;	
-	cmd_tbl->prdt_entry[i].i = 1;
+		va += len;
+		left -= len;
+		i++;
+	}
+    // PRDT entries count
+	cmd_header->prdtl = i;
  
 	// Setup command
 	FIS_REG_H2D_T* cmd_fis = (FIS_REG_H2D_T*) (&cmd_tbl->cfis);
@@ -407,7 +429,8 @@ void test_ahci(HBA_MEM_T* abar)
 
 
 	// Create a buffer for the command list
-    uint16_t* buf_1 = (uint16_t*)vir_to_phys((uint64_t)kheap_alloc(0x8000)); // 32 KB buffer (overkill but fine for test)
+    // runCommand() translates the kmalloc buffer to the frames behind it for DMA
+    uint16_t* buf_1 = (uint16_t*)kmalloc(512); // One sector
     if (buf_1 == NULL) {
         printf(" [-] AHCI: Buffer_1 Memory allocation failed!\n");
         return;
@@ -427,7 +450,7 @@ void test_ahci(HBA_MEM_T* abar)
     }
 
 
-	uint16_t* buf_2 = (uint16_t*)vir_to_phys((uint64_t)kheap_alloc(0x8000)); // 32 KB buffer (overkill but fine for test)
+	uint16_t* buf_2 = (uint16_t*)kmalloc(512); // One sector
     if (buf_2 == NULL) {
         printf(" [-] AHCI: Buffer_2 Memory allocation failed!\n");
         return;
@@ -441,8 +464,8 @@ void test_ahci(HBA_MEM_T* abar)
         printf(" [-] AHCI: Read failed from disk!\n");
     }
 
-    kheap_free((void *)phys_to_vir((uint64_t) buf_1), 0x8000); 	// Free memory
-	kheap_free((void *)phys_to_vir((uint64_t) buf_2), 0x8000);	// Free memory
+    kfree(buf_1); 	// Free memory
+	kfree(buf_2);	// Free memory
 
 	printf("[Info] AHCI test completed successfully.\n");
 	return;
@@ -26,17 +26,21 @@
 #include "../../sys/timer/tsc.h"
 #include "../../sys/timer/pit_timer.h"
 #include "../../sys/timer/apic_timer.h"
+#include "../../sys/timer/timer_wheel.h"
 
 #include "../../memory/detect_memory.h"
 #include "../../memory/kmalloc.h"
 #include "../../memory/paging.h"
 #include "../../memory/pmm.h"
+#include "../../memory/buddy.h"
+#include "../../memory/zero_pool.h"
 
 #include "../../util/util.h"
 #include "../acpi/acpi.h"
 #include "../acpi/descriptor_table/madt.h"
 
 #include "../../kshell/kshell.h"
+#include "../../process/scheduler.h"    // init_scheduler
 #include "cpuid.h"
 
 #include "../../arch/interrupt/apic/ipi.h"
@@ -48,12 +52,31 @@
 
 cpu_data_t cpu_datas[MAX_CPUS];  // Array indexed by CPU ID (APIC ID)
 
+#define IA32_TSC_AUX_MSR 0xC0000103
+
+bool cpu_id_in_tsc_aux;          // Every core keeps its LAPIC ID in IA32_TSC_AUX
+
 extern struct limine_smp_response *smp_response;
 
 extern madt_t *madt;
 
 
 
+// Store the LAPIC ID of the running core in IA32_TSC_AUX for this_cpu_id().
+// Must be the first thing a core does, before it touches any per CPU data.
+void init_cpu_id() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001), "c"(0));
+
+    if (!(edx & (1 << 27))) return;     // No RDTSCP, this_cpu_id() falls back to CPUID
+
+    uint32_t lapic_id = get_lapic_id_by_cpuid();
+    asm volatile("wrmsr" :: "c"(IA32_TSC_AUX_MSR), "a"(lapic_id), "d"(0));
+
+    cpu_id_in_tsc_aux = true;
+}
+
+
 void start_bootstrap_cpu_core() {
 
     if (smp_response == NULL) {
@@ -91,7 +114,8 @@ void start_bootstrap_cpu_core() {
 
     enable_fpu_and_sse();       // Enable FPU and SSE for the bootstrap core
 
-    init_apic_timer(100);       // Initialize the APIC timer for the bootstrap core
+    init_apic_timer();          // Initialize the APIC timer for the bootstrap core, the scheduler arms it
+    init_timer_wheel();         // Timer events of the bootstrap core
     initKeyboard();             // Initialize the keyboard driver
 
     // Setting up the CPU data structure for the bootstrap core
@@ -113,6 +137,8 @@ void target_cpu_task(struct limine_smp_info *smp_info) {
         return;
     }
 
+    init_cpu_id();              // Before any per CPU cache is used on this core
+
     uint32_t core_id = smp_info->lapic_id;
 
     cpu_datas[core_id].lapic_id = core_id;
@@ -125,7 +151,8 @@ void target_cpu_task(struct limine_smp_info *smp_info) {
     init_core_paging(core_id);
 
     // Initialize the stack for this core
-    uint64_t cpu_stack = (uint64_t)kmalloc_a(STACK_SIZE, 1); // Allocate stack for this core
+    // Allocate stack for this core, from its own NUMA node since this core allocates it
+    uint64_t cpu_stack = pmm_alloc_pages_below(pmm_size_to_order(STACK_SIZE), PMM_LOW_4G_LIMIT);
     if(cpu_stack == 0) {
         printf("[Error] Failed to allocate stack for CPU %d\n", core_id);
         return;
@@ -136,6 +163,7 @@ void target_cpu_task(struct limine_smp_info *smp_info) {
 
     // setting cr3 for this core
     init_core_paging(core_id);
+    init_pcid();                // This core starts in the kernel address space
 
     // Initialize GDT and TSS for this core
     init_gdt_tss_in_cpu(core_id);
@@ -149,6 +177,10 @@ void target_cpu_task(struct limine_smp_info *smp_info) {
         enable_fpu_and_sse();
     }
 
+    init_apic_timer();              // Tickless, the calibration of the bootstrap core is reused
+    init_timer_wheel();             // Timer events of this core
+    init_scheduler();               // This context becomes the idle thread, other cores can send threads here
+
     cpu_datas[core_id].is_online = 1; // Mark this core as online
     printf(" [-] CPU %d (LAPIC ID: %x) is online\n", core_id, core_id);
 
@@ -167,10 +199,8 @@ void target_cpu_task(struct limine_smp_info *smp_info) {
     //     }
     // }
 
-    // Halt the AP as we have nothing else to do currently
-    for (;;) {
-        asm volatile("hlt");
-    }
+    // Nothing else to do currently: zero frames for the pool, halt once it is full
+    zero_pool_idle();
 }
 
 
@@ -7,6 +7,11 @@
 #include "../../../../limine-8.6.0/limine.h"
 #include "../../arch/gdt/gdt.h"
 #include "../../arch/gdt/tss.h"
+#include "cpuid.h"
+#include "../../memory/address_space.h"
+#include "../../process/types.h"
+#include "../../process/scheduler.h"  // prio_array_t
+#include "../../lib/stdio.h"         // spinlock_t
 
 #define MAX_CPUS   256            // Maximum number of CPUs supported
 #define STACK_SIZE 4096 * 4       // 16 KB per core
@@ -19,12 +24,44 @@ typedef struct {
     gdtr_t gdtr;                            // Core's GDT Register
     tss_t tss;                              // Core's Task State Segment
     uint64_t tss_stack;                     // The stack pointer for the TSS
+    uint64_t ist_stack;                     // Interrupt stack (IST1) of the interrupts which switch threads
     uint8_t is_online;                      // Flag to indicate if the core is online
     struct limine_smp_info *smp_info;       // Pointer to the SMP info structure
     uint64_t cpu_stack;                     // Pointer to the CPU stack
+    volatile uint64_t active_cr3;           // Address space loaded on the core, for TLB shootdowns
+    address_space_t *active_as;             // The same as set by address_space_switch()
+    pcid_slot_t pcid_slots[PCID_SLOTS];     // Address spaces which own a PCID on this core
+    uint8_t pcid_current;                   // Slot of active_as
+    uint8_t pcid_next;                      // Next slot to recycle
+    thread_t *current_thread;               // Thread running on the core, see scheduler.c
+    thread_t *idle_thread;                  // Runs when no other thread is ready
+    spinlock_t run_queue_lock;              // The run queue and the status of the threads on it
+    prio_array_t prio_arrays[2];            // READY threads of this core: active and expired
+    uint8_t active_array;                   // Index of the active one, the other has used its slices
+    uint32_t run_queue_length;              // Threads in both arrays
+    volatile bool need_resched;             // Set with the IPI which asks the core to reschedule
+    uint64_t switch_tsc;                    // TSC when current_thread was switched in
+    uint64_t context_switches;
+    uint64_t threads_stolen;                // Taken from the run queues of busier cores
 } cpu_data_t;
 
 
+extern cpu_data_t cpu_datas[MAX_CPUS];
+extern bool cpu_id_in_tsc_aux;
+
+// LAPIC id of the running core. init_cpu_id() stores it in IA32_TSC_AUX on every core,
+// where RDTSCP reads it back for far less than a (serializing) CPUID.
+static inline uint32_t this_cpu_id(){
+    if(cpu_id_in_tsc_aux){
+        uint32_t low, high, aux;
+        asm volatile("rdtscp" : "=a"(low), "=d"(high), "=c"(aux));
+        return aux;
+    }
+    return get_lapic_id_by_cpuid();
+}
+
+void init_cpu_id();
+
 void switch_to_core(uint32_t target_lapic_id);
 
 void start_bootstrap_cpu_core();
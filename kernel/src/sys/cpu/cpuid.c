@@ -227,6 +227,37 @@ bool has_avs() {
     return (ecx & (1 << 28));  // AVX is bit 28 of ECX
 }
 
+// Check if the local APIC timer can fire at a TSC value (IA32_TSC_DEADLINE)
+bool has_tsc_deadline() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (ecx & (1 << 24));  // TSC-Deadline is bit 24 of ECX
+}
+
+// Check if the CPU can map 1 GB pages in the PDPT
+bool has_1gb_pages() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+    return (edx & (1 << 26));  // Page1GB is bit 26 of EDX
+}
+
+// Check if the CPU can tag TLB entries with a process context identifier (CR4.PCIDE)
+bool has_pcid() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (ecx & (1 << 17));  // PCID is bit 17 of ECX
+}
+
+// Check if the CPU has the INVPCID instruction
+bool has_invpcid() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 7) return false;
+
+    asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+    return (ebx & (1 << 10));  // INVPCID is bit 10 of EBX in leaf 7, subleaf 0
+}
+
 // Check if the CPU has an FPU
 bool has_fpu() {
     uint32_t eax, ebx, ecx, edx;
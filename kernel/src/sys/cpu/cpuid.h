@@ -15,6 +15,10 @@ bool has_apic();
 bool has_sse();
 bool has_sse2();
 bool has_avx();
+bool has_1gb_pages();
+bool has_pcid();
+bool has_invpcid();
+bool has_tsc_deadline();
 
 bool has_fpu();
 void enable_fpu_and_sse();
@@ -1,6 +1,12 @@
 /*
 APIC TIMER:
 
+The timer runs tickless: it fires once, at the deadline apic_timer_arm() sets, and not at all
+while it is disarmed. The scheduler arms it for the end of the time slice of the running
+thread and disarms it on an idle core, which then sleeps until a real event. If CPUID offers
+the TSC deadline mode the deadline is a TSC value in IA32_TSC_DEADLINE, else the TSC cycles
+to go are converted into a one shot count of the calibrated APIC timer.
+
 https://wiki.osdev.org/APIC_Timer
 https://github.com/dreamportdev/Osdev-Notes/blob/master/02_Architecture/08_Timers.md
 
@@ -11,6 +17,7 @@ https://github.com/dreamportdev/Osdev-Notes/blob/master/02_Architecture/08_Timer
 #include "../../process/types.h"
 #include "../../process/thread.h"
 #include "../../process/process.h"
+#include "../../process/scheduler.h"            // SCHED_TIMER_VECTOR
 
 #include "../../arch/interrupt/pic/pic.h"
 #include "../../arch/interrupt/apic/apic.h"
@@ -22,12 +29,16 @@ https://github.com/dreamportdev/Osdev-Notes/blob/master/02_Architecture/08_Timer
 
 #include "../../util/util.h"
 
+#include "../cpu/cpuid.h"                      // has_tsc_deadline
+#include "../cpu/cpu.h"                        // cpu_datas
+
 #include "tsc.h"
+#include "timer_wheel.h"
 
 #include "apic_timer.h"
 
 
-#define APIC_TIMER_VECTOR  48                   // APIC Timer Interrupt Vector 0x30
+#define APIC_TIMER_VECTOR  SCHED_TIMER_VECTOR   // APIC Timer Interrupt Vector 0x30, the scheduler switches on it
 #define APIC_IRQ           16                   // APIC Timer Interrupt Request 48 - 32 = 16 (0x10)
 
 #define MAX_APIC_TICKS 0xFFFFFFFFFFFFFFFF       // Maximum ticks for APIC timer
@@ -40,6 +51,9 @@ https://github.com/dreamportdev/Osdev-Notes/blob/master/02_Architecture/08_Timer
 
 #define APIC_LVT_TIMER_MODE_PERIODIC (1 << 17)  // Periodic mode bit
 #define APIC_LVT_TIMER_MODE_ONESHOT  (0 << 0 )  // One shot mode bit
+#define APIC_LVT_TIMER_MODE_TSC_DEADLINE (2 << 17)  // Fires when the TSC reaches IA32_TSC_DEADLINE
+
+#define IA32_TSC_DEADLINE_MSR        0x6E0      // Writing 0 disarms the timer
 #define APIC_LVT_INT_MASKED          (1 << 16)  // Mask interrupt
 
 // Divider values
@@ -52,12 +66,20 @@ https://github.com/dreamportdev/Osdev-Notes/blob/master/02_Architecture/08_Timer
 #define DIV_BY_128  0b110
 #define DIV_BY_1    0b111
  
-#define MAX_CPUS 256
-volatile uint64_t apic_ticks[MAX_CPUS] = {0};
+volatile uint64_t apic_ticks[MAX_CPUS] = {0};   // Timer interrupts of every core
 
 
 volatile bool apic_calibrated = false;
 volatile uint64_t apic_timer_ticks_per_ms = 0;
+static bool apic_tsc_deadline;                  // The timer runs in TSC deadline mode
+
+
+// write 32 bit msr address with value
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    uint32_t low = value & 0xFFFFFFFF;
+    uint32_t high = value >> 32;
+    asm volatile ("wrmsr" : : "c"(msr), "a"(low), "d"(high));
+}
 
 
 uint64_t get_core_id() { return get_lapic_id(); }
@@ -101,7 +123,7 @@ void apic_start_oneshot_timer(uint32_t initial_count) {
     // Set APIC timer to use divider 16
     apic_write(APIC_TIMER_DIV_REGISTER, DIV_BY_16);
     
-    // Set APIC initial count to max
+    // Counts down from initial_count, 0 stops the timer
     apic_write(APIC_TIMER_INITCNT_REGISTER, initial_count);
 
     // Set APIC Timer Mode (Periodic Mode = 0x20000, One-shot = 0x0)
@@ -118,16 +140,46 @@ void apic_timer_handler(registers_t *regs) {
 
     apic_ticks[cpu_id]++;
 
-    apic_send_eoi();
+    timer_wheel_run();          // Due timers, then the next event is armed
+
+    // irq_handler() sends the EOI and then calls schedule(), which may end the time slice
+}
+
+
+
+// Fire the timer interrupt of this core once, when the TSC reaches deadline. Replaces the
+// deadline armed before. Called with interrupts off.
+void apic_timer_arm(uint64_t deadline) {
+    if(apic_tsc_deadline) {
+        wrmsr(IA32_TSC_DEADLINE_MSR, deadline ? deadline : 1);     // A deadline in the past fires at once
+        return;
+    }
+
+    uint64_t now = read_tsc();
+    uint64_t cycles = (deadline > now) ? deadline - now : 0;
+    uint64_t count = cycles * apic_timer_ticks_per_ms / (cpu_frequency_hz / 1000);
 
-    if(apic_ticks[cpu_id] % 100 == 0){
-        // printf("apic ticks: %d in CPU %d\n", apic_ticks[cpu_id], cpu_id);
+    // A deadline too far for the 32 bit counter fires early, the handler arms it again
+    if(count == 0) count = 1;
+    if(count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+
+    // init_apic_timer() left the timer in one shot mode, so a new count is all it takes
+    apic_write(APIC_TIMER_INITCNT_REGISTER, (uint32_t) count);
+}
+
+
+// No timer interrupt on this core until the next apic_timer_arm()
+void apic_timer_disarm() {
+    if(apic_tsc_deadline) {
+        wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+    } else {
+        apic_write(APIC_TIMER_INITCNT_REGISTER, 0);
     }
 }
 
 
 
-void init_apic_timer(uint32_t interval_ms) {// Start APIC timer with a large count
+void init_apic_timer() {                // Calibrate and leave the timer disarmed
 
     if(is_apic_enabled() == false) {
         printf(" [-] APIC is not enabled. Cannot initialize APIC timer.\n");
@@ -149,39 +201,53 @@ void init_apic_timer(uint32_t interval_ms) {// Start APIC timer with a large cou
     
         while (!apic_calibrated);           // Wait for calibration to complete
         printf(" [-] APIC Timer calibrated with %d ticks/ms\n", apic_timer_ticks_per_ms);
+
+        apic_tsc_deadline = has_tsc_deadline();     // The same on every core
     } 
 
-    uint32_t apic_count = apic_timer_ticks_per_ms * interval_ms;
-    
-    // Set APIC Timer for periodic interrupts
-    apic_write(APIC_LVT_TIMER_REGISTER, APIC_TIMER_VECTOR | APIC_LVT_TIMER_MODE_PERIODIC);  // Vector 48, Periodic Mode
-    apic_write(APIC_TIMER_DIV_REGISTER , DIV_BY_16);                                        // Set divisor by 16
-    apic_write(APIC_TIMER_INITCNT_REGISTER, apic_count);                                    // Set initial count for timer
+    if(apic_tsc_deadline) {
+        apic_write(APIC_LVT_TIMER_REGISTER, APIC_TIMER_VECTOR | APIC_LVT_TIMER_MODE_TSC_DEADLINE);
+        asm volatile("mfence" ::: "memory");        // The mode switch must land before the MSR write
+        wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+    } else {
+        apic_start_oneshot_timer(0);        // One shot mode with the calibrated divider, stopped
+    }
 
     asm volatile("sti");
 
-    printf(" [-] APIC Timer initialized with %d ms interval in CPU: %d.\n", interval_ms, get_lapic_id());
+    printf(" [-] APIC Timer initialized with one shot deadlines (%s) in CPU: %d.\n",
+        apic_tsc_deadline ? "TSC deadline mode" : "APIC count", get_lapic_id());
 }
 
 
 
+// Blocks the calling thread, see sleep() in timer_wheel.c
 void apic_delay(uint32_t milliseconds) {  
-    uint32_t cpu_id = get_core_id();  
-    uint64_t start_ticks = *apic_ticks;
-    uint64_t target_ticks = start_ticks + ((uint64_t) milliseconds * apic_timer_ticks_per_ms) / 1000; 
-
-    while (*apic_ticks < target_ticks) {
-        asm volatile ("hlt");
-    }
+    sleep((uint64_t) milliseconds * 1000);
 }
 
 
 
+#define BENCH_IDLE_SECONDS  1
+#define BENCH_PERIODIC_MS   10      // The tick the timer had before it went tickless
 
+// Timer interrupts which wake the idle application cores while this core waits
+void bench_idle_wakeups() {
+    static uint64_t before[MAX_CPUS];
+    uint32_t self = get_core_id();
+    uint32_t cores = 0;
 
+    for(uint32_t i = 0; i < MAX_CPUS; i++) before[i] = apic_ticks[i];
 
+    apic_delay(BENCH_IDLE_SECONDS * 1000);
 
+    uint64_t wakeups = 0;
+    for(uint32_t i = 0; i < MAX_CPUS; i++) {
+        if(i == self || !cpu_datas[i].is_online) continue;
+        wakeups += apic_ticks[i] - before[i];
+        cores++;
+    }
 
-
-
-
+    printf(" [-] APIC Timer: %d timer interrupts on %d idle cores in %d s, a %d ms tick takes %d\n",
+        wakeups, cores, BENCH_IDLE_SECONDS, BENCH_PERIODIC_MS, cores * BENCH_IDLE_SECONDS * 1000 / BENCH_PERIODIC_MS);
+}
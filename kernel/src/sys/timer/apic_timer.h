@@ -5,6 +5,10 @@
 #include <stdbool.h>
 
 
-void init_apic_timer(uint32_t interval_ms);
+void init_apic_timer();
+void apic_timer_arm(uint64_t deadline);
+void apic_timer_disarm();
 void apic_delay(uint32_t milliseconds);
 
+void bench_idle_wakeups();
+
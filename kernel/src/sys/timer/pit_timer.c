@@ -30,7 +30,6 @@
 static uint32_t PIT_FREQUENCY = 1193182;   // 1.193182 MHz = 1193182 Hz
 
 extern void restore_cpu_state(registers_t* registers);
-extern process_t *current_process;
 
 volatile uint64_t pit_ticks = 0;
 
@@ -0,0 +1,444 @@
+/*
+Timer Wheel
+
+Every core keeps its timers in a hierarchical wheel of TIMER_WHEEL_LEVELS levels with 64 slots
+each. The wheel counts in microseconds of the TSC. A slot of level n spans 64^n us, so level 0
+holds the timers of the next 64 us to the microsecond, level 1 those of the next 4 ms and so on.
+Adding and cancelling a timer is a list operation on one slot. A bitmap per level marks the
+slots which hold timers, so the next event is found with a bit scan, not a walk over timers.
+
+There is no tick. The one shot APIC timer is armed for the earlier of the next event and the
+end of the time slice of the running thread, see timer_set_slice_deadline(). When the clock
+passes a slot, its timers are taken out: due ones run, the others cascade into a lower level
+with a finer slot. A slot of a higher level only gives a lower bound for its timers, the wheel
+wakes at its start to cascade them.
+
+sleep() blocks the calling thread on a timer of its core instead of spinning on the clock.
+
+https://www.kernel.org/doc/html/latest/timers/highres.html
+https://lwn.net/Articles/646950/
+*/
+
+#include "../../lib/stdio.h"
+#include "../../lib/string.h"
+#include "../../memory/kmalloc.h"
+#include "../../process/process.h"
+#include "../../process/thread.h"
+#include "../../process/scheduler.h"
+#include "../cpu/cpu.h"
+
+#include "tsc.h"
+#include "apic_timer.h"
+
+#include "timer_wheel.h"
+
+
+#define TIMER_LEVEL_BITS    6                   // log2(TIMER_WHEEL_SLOTS)
+#define TIMER_DUE           TIMER_WHEEL_LEVELS  // Level of a timer which waits for its callback
+
+typedef struct timer_wheel {
+    spinlock_t lock;
+    ktimer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t bitmap[TIMER_WHEEL_LEVELS];        // Bit n set when slot n of the level holds timers
+    ktimer_t *due;                              // Taken out of the wheel, their callbacks run next
+    uint64_t clock;                             // Microseconds up to which the wheel has run
+    uint64_t slice_deadline;                    // End of the time slice of the running thread
+    uint64_t armed;                             // Deadline the APIC timer is armed for
+    uint64_t fired;                             // Callbacks run
+    uint64_t cascaded;                          // Timers moved into a lower level
+} timer_wheel_t;
+
+static timer_wheel_t *timer_wheels[MAX_CPUS];
+static uint64_t cycles_per_us;
+
+
+static inline uint64_t tsc_to_us(uint64_t tsc){
+    return tsc / cycles_per_us;
+}
+
+static inline uint64_t rotate_right(uint64_t bits, uint32_t n){
+    return n ? (bits >> n) | (bits << (64 - n)) : bits;
+}
+
+
+static void slot_push(ktimer_t **head, ktimer_t *timer){
+    timer->prev = NULL;
+    timer->next = *head;
+    if(*head) (*head)->prev = timer;
+    *head = timer;
+}
+
+static void wheel_unlink(timer_wheel_t *wheel, ktimer_t *timer){
+    ktimer_t **head = (timer->level == TIMER_DUE) ? &wheel->due : &wheel->slots[timer->level][timer->slot];
+
+    if(timer->prev){
+        timer->prev->next = timer->next;
+    }else{
+        *head = timer->next;
+    }
+    if(timer->next) timer->next->prev = timer->prev;
+
+    if(timer->level != TIMER_DUE && !*head) wheel->bitmap[timer->level] &= ~(1ULL << timer->slot);
+    timer->next = timer->prev = NULL;
+}
+
+// The level is the one whose slots still tell the deadline apart from the clock: a timer
+// 64^n to 64^(n+1) us away goes into level n
+static void wheel_insert(timer_wheel_t *wheel, ktimer_t *timer){
+    uint64_t expires = tsc_to_us(timer->deadline);
+    if(expires <= wheel->clock) expires = wheel->clock + 1;         // Due already, the next run takes it
+
+    // Further than the wheel reaches: parked in the last slot, from where it cascades again
+    uint64_t reach = 1ULL << (TIMER_LEVEL_BITS * TIMER_WHEEL_LEVELS);
+    if(expires - wheel->clock >= reach) expires = wheel->clock + reach - 1;
+
+    uint64_t delta = expires - wheel->clock;
+    uint8_t level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1 && delta >= 1ULL << (TIMER_LEVEL_BITS * (level + 1))) level++;
+
+    timer->level = level;
+    timer->slot = (expires >> (TIMER_LEVEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    slot_push(&wheel->slots[level][timer->slot], timer);
+    wheel->bitmap[level] |= 1ULL << timer->slot;
+}
+
+
+// Move the clock to now. The timers of every slot it passed are taken out: the due ones go
+// to the due list, the others back into the wheel, now at a lower level.
+static void wheel_advance(timer_wheel_t *wheel, uint64_t now_tsc){
+    uint64_t now = tsc_to_us(now_tsc);
+    if(now <= wheel->clock) return;
+
+    uint64_t old = wheel->clock;
+    wheel->clock = now;
+
+    ktimer_t *taken = NULL;
+    for(uint8_t level = 0; level < TIMER_WHEEL_LEVELS; level++){
+        uint32_t shift = TIMER_LEVEL_BITS * level;
+        uint64_t from = (old >> shift) + 1;                         // First slot the clock passed
+        uint64_t to = now >> shift;
+        if(to < from) break;                                        // Higher levels passed no slot either
+
+        uint64_t passed = ~0ULL;
+        if(to - from < TIMER_WHEEL_SLOTS - 1){
+            uint64_t span = (1ULL << (to - from + 1)) - 1;
+            passed = rotate_right(span, (64 - (from & (TIMER_WHEEL_SLOTS - 1))) & 63);
+        }
+
+        uint64_t hit = wheel->bitmap[level] & passed;
+        while(hit){
+            uint8_t slot = __builtin_ctzll(hit);
+            hit &= hit - 1;
+
+            while(wheel->slots[level][slot]){
+                ktimer_t *timer = wheel->slots[level][slot];
+                wheel_unlink(wheel, timer);
+                timer->next = taken;
+                taken = timer;
+            }
+        }
+    }
+
+    while(taken){
+        ktimer_t *timer = taken;
+        taken = timer->next;
+
+        if(timer->deadline <= now_tsc){
+            timer->level = TIMER_DUE;
+            slot_push(&wheel->due, timer);
+        }else{
+            wheel_insert(wheel, timer);
+            wheel->cascaded++;
+        }
+    }
+}
+
+
+// The TSC value of the next event: exact for level 0, the start of the slot for the levels
+// above, where the timers cascade
+static uint64_t wheel_next_deadline(timer_wheel_t *wheel){
+    if(wheel->due) return 0;                                        // At once
+
+    uint64_t next = TIMER_NO_DEADLINE;
+    for(uint8_t level = 0; level < TIMER_WHEEL_LEVELS; level++){
+        if(!wheel->bitmap[level]) continue;
+
+        uint32_t shift = TIMER_LEVEL_BITS * level;
+        uint64_t first = (wheel->clock >> shift) + 1;
+        uint32_t offset = __builtin_ctzll(rotate_right(wheel->bitmap[level], first & (TIMER_WHEEL_SLOTS - 1)));
+        uint64_t at = ((first + offset) << shift) * cycles_per_us;
+
+        if(level == 0){
+            // The first deadline, but not before the slot starts: the clock must pass it
+            uint8_t slot = (first + offset) & (TIMER_WHEEL_SLOTS - 1);
+            uint64_t earliest = TIMER_NO_DEADLINE;
+            for(ktimer_t *timer = wheel->slots[0][slot]; timer; timer = timer->next){
+                if(timer->deadline < earliest) earliest = timer->deadline;
+            }
+            if(earliest > at) at = earliest;
+        }
+        if(at < next) next = at;
+    }
+    return next;
+}
+
+// Arm the APIC timer of this core for the next event or the end of the time slice
+static void wheel_program(timer_wheel_t *wheel){
+    uint64_t deadline = wheel_next_deadline(wheel);
+    if(wheel->slice_deadline < deadline) deadline = wheel->slice_deadline;
+    if(deadline == wheel->armed) return;
+
+    wheel->armed = deadline;
+    if(deadline == TIMER_NO_DEADLINE){
+        apic_timer_disarm();
+    }else{
+        apic_timer_arm(deadline);
+    }
+}
+
+
+// Called on every core after init_apic_timer()
+void init_timer_wheel(){
+    uint32_t self = this_cpu_id();
+
+    if(cpu_frequency_hz < 1000000){
+        printf("[Error] Timer Wheel: No TSC frequency on CPU %d\n", self);
+        return;
+    }
+    cycles_per_us = cpu_frequency_hz / 1000000;
+
+    timer_wheel_t *wheel = (timer_wheel_t *) kmalloc(sizeof(timer_wheel_t));
+    if(!wheel){
+        printf("[Error] Timer Wheel: Out of memory on CPU %d\n", self);
+        return;
+    }
+    memset((void *) wheel, 0, sizeof(timer_wheel_t));
+    wheel->clock = tsc_to_us(read_tsc());
+    wheel->slice_deadline = TIMER_NO_DEADLINE;
+    wheel->armed = TIMER_NO_DEADLINE;
+
+    __atomic_store_n(&timer_wheels[self], wheel, __ATOMIC_RELEASE);
+
+    printf(" [-] Timer Wheel: %d levels of %d slots from 1 us on CPU %d\n", TIMER_WHEEL_LEVELS, TIMER_WHEEL_SLOTS, self);
+}
+
+
+// Run callback(arg) once the TSC reaches deadline, in the timer interrupt of this core
+void timer_add(ktimer_t *timer, uint64_t deadline, timer_callback_t callback, void *arg){
+    uint64_t rflags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(rflags) :: "memory");
+
+    uint32_t self = this_cpu_id();
+    timer_wheel_t *wheel = timer_wheels[self];
+
+    if(wheel){
+        acquire(&wheel->lock);
+
+        timer->deadline = deadline;
+        timer->callback = callback;
+        timer->arg = arg;
+        timer->cpu = self;
+        timer->pending = true;
+        timer->running = false;
+        if(deadline <= read_tsc()){
+            timer->level = TIMER_DUE;                               // Runs at the next timer interrupt
+            slot_push(&wheel->due, timer);
+        }else{
+            wheel_insert(wheel, timer);
+        }
+        wheel_program(wheel);
+
+        release(&wheel->lock);
+    }else{
+        printf("[Error] Timer Wheel: No wheel on CPU %d\n", self);
+    }
+
+    if(rflags & 0x200) asm volatile("sti" ::: "memory");
+}
+
+
+// Take an added timer out of its wheel. Returns false if its callback has started already,
+// then it waits until the callback has returned, so the timer and its arg can go away after.
+// Must not be called from the callback of the timer. The APIC timer stays armed, at worst
+// it fires once for nothing.
+bool timer_cancel(ktimer_t *timer){
+    bool cancelled = false;
+
+    if(__atomic_load_n(&timer->pending, __ATOMIC_ACQUIRE)){
+        timer_wheel_t *wheel = timer_wheels[timer->cpu];
+
+        uint64_t rflags = acquire_irqsave(&wheel->lock);
+        if(timer->pending){
+            wheel_unlink(wheel, timer);
+            timer->pending = false;
+            cancelled = true;
+        }
+        release_irqrestore(&wheel->lock, rflags);
+    }
+
+    // The callback may still run in the timer interrupt of another core
+    while(__atomic_load_n(&timer->running, __ATOMIC_ACQUIRE)) asm volatile("pause");
+
+    return cancelled;
+}
+
+
+// Called by the APIC timer interrupt: run the due callbacks and arm the next event
+void timer_wheel_run(){
+    timer_wheel_t *wheel = timer_wheels[this_cpu_id()];
+    if(!wheel) return;
+
+    acquire(&wheel->lock);
+    wheel->armed = TIMER_NO_DEADLINE;                               // It fired, nothing is armed
+    wheel_advance(wheel, read_tsc());
+
+    // The lock is dropped for every callback, which may add timers itself
+    while(wheel->due){
+        ktimer_t *timer = wheel->due;
+        wheel_unlink(wheel, timer);
+
+        timer_callback_t callback = timer->callback;
+        void *arg = timer->arg;
+        timer->running = true;
+        __atomic_store_n(&timer->pending, false, __ATOMIC_RELEASE);
+        wheel->fired++;
+
+        release(&wheel->lock);
+        callback(arg);
+        __atomic_store_n(&timer->running, false, __ATOMIC_RELEASE); // The owner may reuse it from here on
+        acquire(&wheel->lock);
+    }
+
+    wheel_program(wheel);
+    release(&wheel->lock);
+}
+
+
+// The scheduler hands over the end of the time slice of the thread it switches to,
+// TIMER_NO_DEADLINE for the idle thread. Called with interrupts off.
+void timer_set_slice_deadline(uint64_t deadline){
+    timer_wheel_t *wheel = timer_wheels[this_cpu_id()];
+
+    if(!wheel){                                                     // No wheel yet: the slice alone
+        if(deadline == TIMER_NO_DEADLINE){
+            apic_timer_disarm();
+        }else{
+            apic_timer_arm(deadline);
+        }
+        return;
+    }
+
+    acquire(&wheel->lock);
+    wheel->slice_deadline = deadline;
+    wheel_program(wheel);
+    release(&wheel->lock);
+}
+
+
+static void wake_sleeper(void *arg){
+    thread_wake((thread_t *) arg);
+}
+
+// Block the calling thread for microseconds. The idle thread of a core must not block, it
+// halts until the timer interrupt instead. Without a scheduler it waits on the TSC.
+void sleep(uint64_t microseconds){
+    uint32_t self_cpu = this_cpu_id();
+    thread_t *self = get_current_thread();
+    uint64_t deadline = read_tsc() + microseconds * (cpu_frequency_hz / 1000000);
+
+    if(!self || !timer_wheels[self_cpu]){
+        while(read_tsc() < deadline) asm volatile("pause");
+        return;
+    }
+
+    bool idle = (self == cpu_datas[self_cpu].idle_thread);          // Idle threads never change the core
+
+    ktimer_t timer;
+    timer_add(&timer, deadline, &wake_sleeper, self);
+
+    while(read_tsc() < deadline){
+        if(idle){
+            // sti takes effect after hlt starts, so the timer interrupt can not slip in between
+            asm volatile("cli" ::: "memory");
+            if(read_tsc() < deadline){
+                asm volatile("sti; hlt" ::: "memory");
+            }else{
+                asm volatile("sti" ::: "memory");
+            }
+        }else{
+            thread_block();                                         // Woken early too, e.g. by thread_wake()
+        }
+    }
+
+    // In case something else woke us. It also waits for a wake_sleeper() which has started,
+    // so the thread can not exit and be deleted under it.
+    timer_cancel(&timer);
+}
+
+
+#define BENCH_TIMERS        1024
+#define BENCH_SLEEPS        32
+
+static const uint64_t bench_sleep_us[] = {10, 100, 1000};
+
+static void bench_sleep_thread(void *arg){
+    (void) arg;
+
+    for(size_t i = 0; i < sizeof(bench_sleep_us) / sizeof(bench_sleep_us[0]); i++){
+        uint64_t late = 0;
+        for(int j = 0; j < BENCH_SLEEPS; j++){
+            uint64_t start = read_tsc();
+            sleep(bench_sleep_us[i]);
+            late += (read_tsc() - start) - bench_sleep_us[i] * cycles_per_us;
+        }
+        printf(" [-] Timer Wheel: sleep(%d us) returns %d ns late on average\n",
+            bench_sleep_us[i], late * 1000 / cycles_per_us / BENCH_SLEEPS);
+    }
+}
+
+static void bench_nop_callback(void *arg){
+    (void) arg;
+}
+
+// Cost of adding and cancelling among many timers, and how precise a blocking sleep is
+void bench_timer_wheel(){
+    static ktimer_t timers[BENCH_TIMERS];
+
+    if(!timer_wheels[this_cpu_id()]){
+        printf("[Error] Timer Wheel: No wheel for the benchmark\n");
+        return;
+    }
+
+    // Deadlines spread from 1 us to about 16 s, over every level. No timer interrupt may run
+    // them before they are cancelled.
+    asm volatile("cli" ::: "memory");
+
+    uint64_t seed = read_tsc();
+    uint64_t now = read_tsc();
+    uint64_t start = read_tsc();
+    for(int i = 0; i < BENCH_TIMERS; i++){
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t us = 1 + ((seed >> 33) & ((1ULL << ((i % 24) + 1)) - 1));
+        timer_add(&timers[i], now + us * cycles_per_us, &bench_nop_callback, NULL);
+    }
+    uint64_t added = (read_tsc() - start) / BENCH_TIMERS;
+
+    start = read_tsc();
+    uint32_t cancelled = 0;
+    for(int i = 0; i < BENCH_TIMERS; i++) cancelled += timer_cancel(&timers[i]);
+    uint64_t removed = (read_tsc() - start) / BENCH_TIMERS;
+
+    asm volatile("sti" ::: "memory");
+
+    if(cancelled != BENCH_TIMERS){
+        printf("[Error] Timer Wheel: %d of %d timers could be cancelled\n", cancelled, BENCH_TIMERS);
+    }
+    printf(" [-] Timer Wheel: %d cycles per timer_add, %d per timer_cancel with %d timers\n", added, removed, BENCH_TIMERS);
+
+    // A thread blocks in sleep(), the idle thread would only halt
+    process_t *process = create_process("Timer Bench");
+    if(!process) return;
+    thread_t *thread = create_thread(process, "Sleep Bench", &bench_sleep_thread, NULL);
+    if(thread) thread_join(thread);
+    delete_process(process);
+}
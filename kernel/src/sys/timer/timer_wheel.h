@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define TIMER_WHEEL_LEVELS  6                   // Slots of level n span 64^n us, all levels about 19 hours
+#define TIMER_WHEEL_SLOTS   64
+#define TIMER_NO_DEADLINE   ((uint64_t) -1)
+
+typedef void (*timer_callback_t)(void *arg);
+
+// A timer which belongs to the caller, e.g. on the stack of a sleeping thread
+typedef struct ktimer {
+    struct ktimer *next;                        // In its slot of the wheel
+    struct ktimer *prev;
+    uint64_t deadline;                          // TSC value at which it fires
+    timer_callback_t callback;                  // Runs in the timer interrupt, with interrupts off
+    void *arg;
+    uint32_t cpu;                               // Core whose wheel holds the timer
+    uint8_t level;                              // Position in the wheel, TIMER_WHEEL_LEVELS when due
+    uint8_t slot;
+    bool pending;                               // In the wheel, the callback has not started
+    bool running;                               // The callback runs, timer_cancel() waits for it
+} ktimer_t;
+
+void init_timer_wheel();
+
+void timer_add(ktimer_t *timer, uint64_t deadline, timer_callback_t callback, void *arg);
+bool timer_cancel(ktimer_t *timer);
+
+void timer_wheel_run();
+void timer_set_slice_deadline(uint64_t deadline);
+
+void sleep(uint64_t microseconds);
+
+void bench_timer_wheel();
@@ -9,11 +9,17 @@ References:
 #include "../arch/interrupt/irq_manage.h"
 #include "../util/util.h"
 #include "../kshell/ring_buffer.h"
+#include "../process/process.h"
+#include "../memory/mmap.h"
 
 #include "int_syscall_manager.h"
 
 extern ring_buffer_t* keyboard_buffer;
 
+// Present in fs/fat32.c. Declared here, fat32.h would pull the AHCI driver headers in.
+extern int fat32_open(const char* filename);
+extern void fat32_close(int fd);
+
 registers_t *int_systemcall_handler(registers_t *regs) {
     switch (regs->int_no) { // syscall number
         case INT_SYSCALL_READ: {
@@ -46,6 +52,36 @@ registers_t *int_systemcall_handler(registers_t *regs) {
             break;
         }
 
+        case INT_SYSCALL_FORK: {
+            process_t *child = fork_process(get_current_process(), regs);
+            regs->rax = child ? child->pid : (uint64_t) -1;  // The child returns 0 from its copy of regs
+            break;
+        }
+
+        case INT_SYSCALL_OPEN: {
+            const char *filename = (const char *)regs->rbx;  // 8.3 name, space padded
+            regs->rax = (uint64_t) (int64_t) fat32_open(filename);
+            break;
+        }
+
+        case INT_SYSCALL_CLOSE: {
+            fat32_close((int) regs->rbx);
+            regs->rax = 0;
+            break;
+        }
+
+        case INT_SYSCALL_MMAP: {
+            void *addr = mmap((int) regs->rbx, regs->rcx, regs->rdx);   // fd, offset, length
+            regs->rax = addr ? (uint64_t) addr : (uint64_t) -1;
+            break;
+        }
+
+        case INT_SYSCALL_MUNMAP: {
+            munmap((void *) regs->rbx, regs->rcx);
+            regs->rax = 0;
+            break;
+        }
+
         default: {
             printf("Unknown System Call!\n");
             regs->rax = -1; // unknown syscall
@@ -62,6 +98,11 @@ void int_syscall_init(){
     irq_install(140, (void *)&int_systemcall_handler);
     irq_install(141, (void *)&int_systemcall_handler);
     irq_install(142, (void *)&int_systemcall_handler);
+    irq_install(143, (void *)&int_systemcall_handler);
+    irq_install(144, (void *)&int_systemcall_handler);
+    irq_install(145, (void *)&int_systemcall_handler);
+    irq_install(146, (void *)&int_systemcall_handler);
+    irq_install(147, (void *)&int_systemcall_handler);
 
     printf(" [-] Interrupt Based System Call initialized!\n");
 }
@@ -8,6 +8,11 @@ enum int_syscall_number{
     INT_SYSCALL_READ =  172,    // 0xAC - Read System Call
     INT_SYSCALL_PRINT = 173,    // 0xAD - Print System Call
     INT_SYSCALL_EXIT =  174,    // 0XAE - Exit System Call
+    INT_SYSCALL_FORK =  175,    // 0xAF - Fork System Call
+    INT_SYSCALL_OPEN =  176,    // 0xB0 - Open System Call
+    INT_SYSCALL_CLOSE = 177,    // 0xB1 - Close System Call
+    INT_SYSCALL_MMAP =  178,    // 0xB2 - Mmap System Call
+    INT_SYSCALL_MUNMAP = 179,   // 0xB3 - Munmap System Call
 };
 
 
@@ -11,6 +11,7 @@ References:
 
 #include "../memory/paging.h"
 #include "../memory/uheap.h"
+#include "../memory/vm_region.h"
 
 #include "../util/util.h"
 #include  "../lib/stdio.h"
@@ -64,6 +65,7 @@ void init_user_mode(){
     code_page->user = 1;        // Making User accessible
 
     uint64_t stack_base_addr = ((uint64_t) uheap_alloc(STACK_SIZE));
+    vm_region_populate(stack_base_addr, STACK_SIZE);    // get_page() below needs mapped pages
     for(uint64_t addr = stack_base_addr; addr < stack_base_addr + STACK_SIZE; addr += 0x1000){
         page_t *stack_page = get_page(addr, 0,  (pml4_t *)get_cr3_addr());
         stack_page->rw = 1;     // Making it read-writable